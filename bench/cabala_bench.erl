@@ -0,0 +1,356 @@
+-module(cabala_bench).
+
+%% Benchmarks over generated corpora, run by `make bench`. Every case is
+%% timed call by call for a fixed time budget in a fresh process, and the
+%% results are written as JSON:
+%%
+%% {"suite": "cabala", "otp_release": ..., "schedulers": ...,
+%%  "time_ms": ..., "timestamp": ..., "results": [Case]}
+%%
+%% where each Case holds name, group, op, corpus, opts, bytes (input or
+%% output bytes per call), iterations, ops_per_sec, bytes_per_sec,
+%% mean_ns, p50_ns, p99_ns and result_bytes, the size of the returned
+%% term: its heap words plus the data of the refc binaries it holds. This
+%% is not what the call allocated, scratch buffers and garbage are not
+%% counted. Compression cases also carry ratio, compressed / plain size.
+
+-export([main/0,
+         main/2,
+         run/1,
+         corpora/0]).
+
+-define(WARMUP, 20).
+-define(MAX_SAMPLES, 1000000).
+-define(BATCH_DOCS, 10000).
+
+main() ->
+	main("bench/results.json", 1000).
+
+main(Out, TimeMs) when is_list(Out), is_integer(TimeMs), TimeMs > 0 ->
+	Results = run(TimeMs),
+	Report = #{suite => <<"cabala">>,
+			   otp_release => list_to_binary(erlang:system_info(otp_release)),
+			   system_architecture =>
+				   list_to_binary(erlang:system_info(system_architecture)),
+			   schedulers => erlang:system_info(schedulers_online),
+			   time_ms => TimeMs,
+			   timestamp => list_to_binary(calendar:system_time_to_rfc3339(
+											 erlang:system_time(second))),
+			   results => Results},
+	ok = file:write_file(Out, [json(Report), $\n]),
+	io:format("~b cases written to ~s~n", [length(Results), Out]).
+
+%% Run every case for about TimeMs each.
+run(TimeMs) ->
+	rand:seed(exsss, {16#cab, 16#a1a, 16#b5e}),
+	Corpora = corpora(),
+	Cases = core_cases(Corpora) ++ record_cases() ++ utf8_cases() ++
+		batch_cases() ++ op_msg_cases() ++ json_cases(Corpora),
+	[run_case(Case, TimeMs) || Case <- Cases].
+
+%%% -------------------------------------------------
+%%% Corpora
+%%% -------------------------------------------------
+
+%% [{Name, Doc}], all documents as maps.
+corpora() ->
+	[{<<"flat">>, flat_doc(1)},
+	 {<<"wide">>, wide_doc(500)},
+	 {<<"nested">>, nested_doc(90)},
+	 {<<"large_string">>, #{<<"_id">> => oid(),
+							<<"body">> => text(1 bsl 20)}},
+	 {<<"large_binary">>, #{<<"_id">> => oid(),
+							<<"data">> => {'$type$', 0, '$binary$',
+										   random_bytes(1 bsl 20)}}},
+	 {<<"numeric_array">>, #{<<"_id">> => oid(),
+							 <<"doubles">> => [rand:uniform() * 1000.0
+											   || _ <- lists:seq(1, 10000)],
+							 <<"ints">> => [rand:uniform(1 bsl 30)
+											|| _ <- lists:seq(1, 10000)]}},
+	 {<<"cursor_batch">>, cursor_reply(101)}].
+
+%% A small user record of the kind most collections hold.
+flat_doc(N) ->
+	#{<<"_id">> => oid(),
+	  <<"name">> => word(12),
+	  <<"email">> => <<(word(8))/binary, "@example.com">>,
+	  <<"age">> => 18 + rand:uniform(60),
+	  <<"score">> => rand:uniform() * 100.0,
+	  <<"active">> => rand:uniform(2) =:= 1,
+	  <<"created">> => {'$date$', 1700000000000 + N * 1000},
+	  <<"tags">> => [word(5) || _ <- lists:seq(1, 3)],
+	  <<"city">> => word(10),
+	  <<"zip">> => rand:uniform(99999),
+	  <<"balance">> => rand:uniform() * 1.0e6,
+	  <<"visits">> => rand:uniform(1 bsl 40)}.
+
+wide_doc(Fields) ->
+	maps:from_list([{<<"f", (integer_to_binary(I))/binary>>, wide_value(I)}
+					|| I <- lists:seq(0, Fields - 1)]).
+
+wide_value(I) ->
+	case I rem 4 of
+		0 -> rand:uniform(1 bsl 20);
+		1 -> rand:uniform();
+		2 -> word(8);
+		3 -> I rem 3 =:= 0
+	end.
+
+nested_doc(0) ->
+	#{<<"leaf">> => true};
+nested_doc(Depth) ->
+	#{<<"level">> => Depth,
+	  <<"name">> => word(6),
+	  <<"child">> => nested_doc(Depth - 1)}.
+
+%% A find reply as a server sends it, {cursor: {firstBatch, id, ns}, ok}.
+cursor_reply(Docs) ->
+	#{<<"cursor">> => #{<<"firstBatch">> => [flat_doc(I)
+											 || I <- lists:seq(1, Docs)],
+						<<"id">> => 1 bsl 40 + 7,
+						<<"ns">> => <<"bench.users">>},
+	  <<"ok">> => 1.0}.
+
+oid() ->
+	{'$oid$', random_bytes(12)}.
+
+word(Len) ->
+	<< <<($a + rand:uniform(26) - 1)>> || _ <- lists:seq(1, Len) >>.
+
+random_bytes(Len) ->
+	<< <<(rand:uniform(256) - 1)>> || _ <- lists:seq(1, Len) >>.
+
+%% ASCII text of Len bytes.
+text(Len) ->
+	Line = <<"The quick brown fox jumps over the lazy dog. ">>,
+	binary:part(binary:copy(Line, Len div byte_size(Line) + 1), 0, Len).
+
+%% Text of about Len bytes mixing ASCII with 2, 3 and 4 byte sequences.
+mixed_text(Len) ->
+	Line = unicode:characters_to_binary(
+			 [<<"plain ascii words, ">>, "caf\x{e9} na\x{ef}ve, ",
+			  "\x{65e5}\x{672c}\x{8a9e}, ", "\x{1f600} "]),
+	binary:copy(Line, Len div byte_size(Line) + 1).
+
+%%% -------------------------------------------------
+%%% Cases
+%%% -------------------------------------------------
+
+%% encode/1 and decode/2, with and without return_maps, per corpus.
+core_cases(Corpora) ->
+	lists:append(
+	  [begin
+		   Bin = ok(cabala:encode(Doc)),
+		   Size = byte_size(Bin),
+		   [case_(<<"core">>, <<"encode/1">>, Name, [], Size,
+				  fun() -> cabala:encode(Doc) end),
+			case_(<<"core">>, <<"decode/2">>, Name, [], Size,
+				  fun() -> cabala:decode(Bin, []) end),
+			case_(<<"core">>, <<"decode/2">>, Name, [return_maps], Size,
+				  fun() -> cabala:decode(Bin, [return_maps]) end)]
+	   end || {Name, Doc} <- Corpora]).
+
+%% Schema based record encoding and decoding next to encode/decode of
+%% the same document.
+record_cases() ->
+	Fields = [name, email, age, score, active, created, city, zip, balance],
+	Types = [string, string, int32, double, bool, date, string, int32,
+			 double],
+	Schema = ok(cabala:compile_schema(Fields, Types, [{record, user}])),
+	Doc = maps:without([<<"_id">>, <<"tags">>, <<"visits">>], flat_doc(1)),
+	Record = list_to_tuple(
+			   [user | [maps:get(atom_to_binary(F, utf8), Doc)
+						|| F <- Fields]]),
+	Bin = ok(cabala:encode_record(Schema, Record)),
+	Size = byte_size(Bin),
+	[case_(<<"record">>, <<"encode/1">>, <<"user">>, [], Size,
+		   fun() -> cabala:encode(Doc) end),
+	 case_(<<"record">>, <<"encode_record/2">>, <<"user">>, [], Size,
+		   fun() -> cabala:encode_record(Schema, Record) end),
+	 case_(<<"record">>, <<"decode/2">>, <<"user">>, [], Size,
+		   fun() -> cabala:decode(Bin, []) end),
+	 case_(<<"record">>, <<"decode_record/3">>, <<"user">>, [], Size,
+		   fun() -> cabala:decode_record(Schema, Bin, []) end)].
+
+%% The cost of {validate_utf8, true} on ASCII and on mixed text.
+utf8_cases() ->
+	Corpora = [{<<"ascii_64k">>, text(1 bsl 16)},
+			   {<<"mixed_64k">>, mixed_text(1 bsl 16)},
+			   {<<"flat">>, flat_doc(1)}],
+	lists:append(
+	  [begin
+		   Doc = case Text of
+					 _ when is_map(Text) -> Text;
+					 _ -> #{<<"text">> => Text}
+				 end,
+		   Bin = ok(cabala:encode(Doc)),
+		   Size = byte_size(Bin),
+		   lists:append(
+			 [[case_(<<"utf8">>, <<"encode/2">>, Name, Opts, Size,
+					 fun() -> cabala:encode(Doc, Opts) end),
+			   case_(<<"utf8">>, <<"decode/2">>, Name, Opts, Size,
+					 fun() -> cabala:decode(Bin, Opts) end)]
+			  || Opts <- [[], [{validate_utf8, true}]]])
+	   end || {Name, Text} <- Corpora]).
+
+%% encode_batch/2 and decode_all_parallel/2 on one thread and on all of
+%% them.
+batch_cases() ->
+	Docs = [flat_doc(I) || I <- lists:seq(1, ?BATCH_DOCS)],
+	Bin = ok(cabala:encode_batch(Docs, [])),
+	Size = byte_size(Bin),
+	Corpus = <<"flat_x", (integer_to_binary(?BATCH_DOCS))/binary>>,
+	lists:append(
+	  [[case_(<<"batch">>, <<"encode_batch/2">>, Corpus, Opts, Size,
+			  fun() -> cabala:encode_batch(Docs, Opts) end),
+		case_(<<"batch">>, <<"decode_all_parallel/2">>, Corpus, Opts, Size,
+			  fun() -> cabala:decode_all_parallel(Bin, Opts) end)]
+	   || Opts <- [[{threads, 1}], []]]).
+
+%% A cursor reply framed as OP_MSG, plain and compressed, and parsed back.
+op_msg_cases() ->
+	Body = cursor_reply(1000),
+	Plain = byte_size(ok(cabala:encode_op_msg(1, 0, Body, []))),
+	lists:append(
+	  [begin
+		   Frame = ok(cabala:encode_op_msg(1, 0, Body, [], Opts)),
+		   Ratio = byte_size(Frame) / Plain,
+		   [(case_(<<"op_msg">>, <<"encode_op_msg/5">>, <<"cursor_x1000">>,
+				   Opts, Plain,
+				   fun() -> cabala:encode_op_msg(1, 0, Body, [], Opts) end))
+				#{ratio => Ratio},
+			(case_(<<"op_msg">>, <<"decode_op_msg/2">>, <<"cursor_x1000">>,
+				   Opts, Plain,
+				   fun() -> cabala:decode_op_msg(Frame, []) end))
+				#{ratio => Ratio}]
+	   end || Opts <- [[], [{compressor, zlib}], [{compressor, zstd}]]]).
+
+%% Extended JSON out of and back into bson.
+json_cases(Corpora) ->
+	lists:append(
+	  [begin
+		   Bin = ok(cabala:encode(proplists:get_value(Name, Corpora))),
+		   Json = ok(cabala:to_json(Bin, [])),
+		   [case_(<<"json">>, <<"to_json/2">>, Name, [], byte_size(Bin),
+				  fun() -> cabala:to_json(Bin, []) end),
+			case_(<<"json">>, <<"from_json/2">>, Name, [], byte_size(Json),
+				  fun() -> cabala:from_json(Json, []) end)]
+	   end || Name <- [<<"flat">>, <<"wide">>, <<"cursor_batch">>]]).
+
+case_(Group, Op, Corpus, Opts, Bytes, Fun) ->
+	#{group => Group,
+	  op => Op,
+	  corpus => Corpus,
+	  opts => list_to_binary(io_lib:format("~w", [Opts])),
+	  bytes => Bytes,
+	  'fun' => Fun}.
+
+%% The result of a setup call, which must not have failed.
+ok({error, _} = Error) ->
+	erlang:error({setup_failed, Error});
+ok(Result) ->
+	Result.
+
+%%% -------------------------------------------------
+%%% Measuring
+%%% -------------------------------------------------
+
+%% Each case runs in its own process so the heap left by one does not
+%% slow down the garbage collection of the next.
+run_case(#{'fun' := Fun} = Case, TimeMs) ->
+	Name = iolist_to_binary([maps:get(group, Case), $/,
+							 maps:get(op, Case), $/,
+							 maps:get(corpus, Case), $/,
+							 maps:get(opts, Case)]),
+	{Pid, Ref} = spawn_monitor(fun() -> exit({done, measure(Fun, TimeMs)}) end),
+	receive
+		{'DOWN', Ref, process, Pid, {done, Stats}} ->
+			Result = maps:merge(maps:remove('fun', Case#{name => Name}),
+								Stats),
+			BytesPerSec = maps:get(ops_per_sec, Stats) * maps:get(bytes, Case),
+			io:format("~-64s ~12.1f ops/s  p50 ~b ns~n",
+					  [Name, maps:get(ops_per_sec, Result),
+					   maps:get(p50_ns, Result)]),
+			Result#{bytes_per_sec => BytesPerSec};
+		{'DOWN', Ref, process, Pid, Reason} ->
+			erlang:error({case_failed, Name, Reason})
+	end.
+
+measure(Fun, TimeMs) ->
+	ResultBytes = term_bytes(ok(Fun())),
+	_ = [Fun() || _ <- lists:seq(1, ?WARMUP)],
+	erlang:garbage_collect(),
+	Start = erlang:monotonic_time(nanosecond),
+	Samples = sample(Fun, Start + TimeMs * 1000000, 0, []),
+	Total = erlang:monotonic_time(nanosecond) - Start,
+	Sorted = lists:sort(Samples),
+	N = length(Sorted),
+	#{iterations => N,
+	  mean_ns => lists:sum(Sorted) div N,
+	  p50_ns => percentile(Sorted, N, 50),
+	  p99_ns => percentile(Sorted, N, 99),
+	  ops_per_sec => N * 1.0e9 / Total,
+	  result_bytes => ResultBytes}.
+
+sample(_Fun, _Deadline, N, Acc) when N >= ?MAX_SAMPLES ->
+	Acc;
+sample(Fun, Deadline, N, Acc) ->
+	T0 = erlang:monotonic_time(nanosecond),
+	_ = Fun(),
+	T1 = erlang:monotonic_time(nanosecond),
+	case T1 >= Deadline of
+		true -> [T1 - T0 | Acc];
+		false -> sample(Fun, Deadline, N + 1, [T1 - T0 | Acc])
+	end.
+
+percentile(Sorted, N, P) ->
+	lists:nth(max(1, (N * P + 99) div 100), Sorted).
+
+%% Heap bytes of a term plus the data of the refc (over 64 byte)
+%% binaries in it.
+term_bytes(Term) ->
+	erts_debug:flat_size(Term) * erlang:system_info(wordsize) +
+		refc_bytes(Term).
+
+refc_bytes(B) when is_binary(B), byte_size(B) > 64 ->
+	byte_size(B);
+refc_bytes(T) when is_tuple(T) ->
+	refc_bytes(tuple_to_list(T));
+refc_bytes(M) when is_map(M) ->
+	refc_bytes(maps:to_list(M));
+refc_bytes([H | T]) ->
+	refc_bytes(H) + refc_bytes(T);
+refc_bytes(_) ->
+	0.
+
+%%% -------------------------------------------------
+%%% JSON output
+%%% -------------------------------------------------
+
+json(M) when is_map(M) ->
+	[${, join([[json(K), $:, json(V)]
+			   || {K, V} <- lists:sort(maps:to_list(M))]), $}];
+json(L) when is_list(L) ->
+	[$[, join([json(V) || V <- L]), $]];
+json(true) ->
+	<<"true">>;
+json(false) ->
+	<<"false">>;
+json(A) when is_atom(A) ->
+	json(atom_to_binary(A, utf8));
+json(B) when is_binary(B) ->
+	[$", [escape(C) || <<C>> <= B], $"];
+json(I) when is_integer(I) ->
+	integer_to_binary(I);
+json(F) when is_float(F) ->
+	float_to_binary(F, [{decimals, 4}, compact]).
+
+join([]) ->
+	[];
+join([H | T]) ->
+	[H | [[$,, X] || X <- T]].
+
+escape($") -> <<"\\\"">>;
+escape($\\) -> <<"\\\\">>;
+escape(C) when C < 16#20 -> io_lib:format("\\u~4.16.0b", [C]);
+escape(C) -> C.
@@ -0,0 +1,241 @@
+#include "cabala.h"
+
+typedef enum {
+    ASYNC_ENCODE,
+    ASYNC_DECODE
+} async_kind;
+
+/*
+ * An async job is a resource: the term handed back to the caller is the
+ * reference the result is tagged with, and the pool holds a reference
+ * of its own while the job is queued or running.
+ */
+typedef struct {
+    pool_job_t   job;
+    cabala_st   *st;
+    async_kind   kind;
+    ErlNifEnv   *env;       // input copy and result
+    ERL_NIF_TERM input;
+    decode_state opts;          // decode options, env unset
+    bool         ensure_id;     // encode options, as for encode/2
+    bool         validate_utf8;
+    ErlNifPid    caller;
+} async_job;
+
+void
+async_dtor(ErlNifEnv *env, void *obj)
+{
+    async_job *job = obj;
+
+    if(job->env) {
+        enif_free_env(job->env);
+    }
+}
+
+static ERL_NIF_TERM
+run_encode(async_job *job)
+{
+    encode_state *es;
+    ERL_NIF_TERM  out, id;
+    bson_oid_t    oid;
+
+    es = es_new(job->env, job->st);
+    if(!es) {
+        return make_error(job->st, job->env, "internal_error");
+    }
+    es->validate_utf8 = job->validate_utf8;
+    if(job->ensure_id && !doc_id(job->env, job->st, job->input, &id)) {
+        oid_new(&oid);
+        es->id = &oid;
+        id = make_oid(job->env, job->st, &oid);
+    }
+    if(!encode_doc(job->input, es) || !encode_result(&out, es)) {
+        out = make_error(job->st, job->env, es->utf8_error ?
+                         "invalid_utf8" : "internal_error");
+    } else if(job->ensure_id) {
+        out = enif_make_tuple2(job->env, out, id);
+    }
+    es_destroy(es);
+    return out;
+}
+
+static ERL_NIF_TERM
+run_decode(async_job *job)
+{
+    ErlNifBinary bin;
+    decode_state ds;
+    bson_t       bson;
+    ERL_NIF_TERM out;
+
+    ds = job->opts;
+    ds.env = job->env;
+    if(!enif_inspect_binary(job->env, job->input, &bin) ||
+            !bson_init_static(&bson, bin.data, bin.size) ||
+            !iter_bson(&bson, &out, &ds)) {
+        out = make_error(job->st, job->env, ds.utf8_error ?
+                         "invalid_utf8" : "badbson");
+    }
+    return out;
+}
+
+static void
+run_async(pool_job_t *pjob)
+{
+    async_job   *job = (async_job*)pjob;
+    ERL_NIF_TERM result, msg;
+
+    if(job->kind == ASYNC_ENCODE) {
+        result = run_encode(job);
+    } else {
+        result = run_decode(job);
+    }
+    msg = enif_make_tuple3(job->env, job->st->atom_cabala,
+                           enif_make_resource(job->env, job), result);
+    enif_send(NULL, &job->caller, job->env, msg);
+    enif_clear_env(job->env);
+
+    /* the reference taken by submit_async */
+    enif_release_resource(job);
+}
+
+static async_job *
+new_async(cabala_st *st, async_kind kind)
+{
+    async_job *job;
+
+    job = enif_alloc_resource(st->res_async, sizeof(async_job));
+    if(job) {
+        memset(job, 0, sizeof(async_job));
+        job->job.run = run_async;
+        job->st = st;
+        job->kind = kind;
+    }
+    return job;
+}
+
+/* takes over the caller's reference to job */
+static ERL_NIF_TERM
+submit_async(ErlNifEnv *env, cabala_st *st, async_job *job,
+             ERL_NIF_TERM input)
+{
+    ERL_NIF_TERM ref;
+
+    if(!job) {
+        return make_error(st, env, "internal_error");
+    }
+    job->env = enif_alloc_env();
+    if(!job->env || !enif_self(env, &job->caller)) {
+        enif_release_resource(job);
+        return make_error(st, env, "internal_error");
+    }
+    job->input = enif_make_copy(job->env, input);
+
+    ref = enif_make_resource(env, job);
+    enif_keep_resource(job);
+    if(!pool_submit(st->pool, &job->job, true)) {
+        enif_release_resource(job);
+        enif_release_resource(job);
+        return make_error(st, env, "busy");
+    }
+    enif_release_resource(job);
+    return ref;
+}
+
+ERL_NIF_TERM
+encode_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    async_job   *job;
+    ERL_NIF_TERM opts, item;
+    const ERL_NIF_TERM *tuple;
+    bool         ensure_id = false, validate_utf8 = false;
+    int          arity;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_is_tuple(env, argv[0]) && !enif_is_map(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+
+    /* as in encode/2, unknown options are ignored */
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            continue;
+        }
+        if(enif_is_identical(tuple[0], st->atom_ensure_id)) {
+            ensure_id = enif_is_identical(tuple[1], st->atom_true);
+        } else if(enif_is_identical(tuple[0], st->atom_validate_utf8)) {
+            validate_utf8 = enif_is_identical(tuple[1], st->atom_true);
+        }
+    }
+
+    job = new_async(st, ASYNC_ENCODE);
+    if(job) {
+        job->ensure_id = ensure_id;
+        job->validate_utf8 = validate_utf8;
+    }
+    return submit_async(env, st, job, argv[0]);
+}
+
+ERL_NIF_TERM
+decode_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    async_job   *job;
+    decode_state ds;
+    ERL_NIF_TERM opts, item;
+
+    if(argc != 2 || !enif_is_binary(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+    opts = argv[1];
+    init_state(&ds, env, st);
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!decode_option(&ds, item)) {
+            return enif_make_badarg(env);
+        }
+    }
+    job = new_async(st, ASYNC_DECODE);
+    if(job) {
+        job->opts = ds;
+        job->opts.env = NULL;
+    }
+    return submit_async(env, st, job, argv[0]);
+}
+
+/* true if the job was still queued, no reply will be sent for it */
+ERL_NIF_TERM
+async_cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st *st = (cabala_st*)enif_priv_data(env);
+    async_job *job;
+
+    if(argc != 1) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_async, (void **)&job)) {
+        return enif_make_badarg(env);
+    }
+    if(!pool_cancel(st->pool, &job->job)) {
+        return st->atom_false;
+    }
+    enif_release_resource(job);
+    return st->atom_true;
+}
+
+ERL_NIF_TERM
+async_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ERL_NIF_TERM items[3];
+
+    items[0] = enif_make_tuple2(env, st->atom_threads,
+                                enif_make_int(env, pool_size(st->pool)));
+    items[1] = enif_make_tuple2(env, make_atom(env, "queued"),
+                                enif_make_int(env, pool_queued(st->pool)));
+    items[2] = enif_make_tuple2(env, make_atom(env, "max_queued"),
+                                enif_make_int(env, ASYNC_MAX_QUEUED));
+    return enif_make_list_from_array(env, items, 3);
+}
@@ -0,0 +1,360 @@
+#include "cabala.h"
+
+/* MongoDB's own limits for a time-series bucket */
+#define BUCKET_MAX_COUNT    1000
+#define BUCKET_MAX_SIZE     (125 * 1024)
+
+typedef struct {
+    char   *name;
+    bson_t  data;       // {"0": v, "1": v, ...}, rows without the field skipped
+    bson_t  min;        // a single element, the smallest value so far
+    bson_t  max;
+} bucket_col_t;
+
+typedef struct {
+    ErlNifEnv     *env;
+    cabala_st     *st;
+    char           time_field[MAX_PATH_LEN];
+    char           meta_field[MAX_PATH_LEN];
+    int            has_meta;
+    uint32_t       max_count;
+    size_t         max_size;
+
+    /* the bucket being filled */
+    bucket_col_t **cols;
+    size_t         ncols;
+    size_t         cap;
+    uint32_t       count;
+    size_t         size;
+    bson_t         meta;    // a single element, or empty without a meta value
+} bucket_t;
+
+static void
+free_cols(bucket_t *b)
+{
+    size_t i;
+
+    for(i = 0; i < b->ncols; i++) {
+        enif_free(b->cols[i]->name);
+        bson_destroy(&b->cols[i]->data);
+        bson_destroy(&b->cols[i]->min);
+        bson_destroy(&b->cols[i]->max);
+        enif_free(b->cols[i]);
+    }
+    b->ncols = 0;
+    b->count = 0;
+    b->size = 0;
+    bson_reinit(&b->meta);
+}
+
+static bucket_col_t *
+find_col(bucket_t *b, const char *name, size_t hint)
+{
+    bucket_col_t *col;
+    size_t i, len;
+
+    /* rows of a batch mostly share their field order */
+    if(hint < b->ncols && strcmp(b->cols[hint]->name, name) == 0) {
+        return b->cols[hint];
+    }
+    for(i = 0; i < b->ncols; i++) {
+        if(strcmp(b->cols[i]->name, name) == 0) {
+            return b->cols[i];
+        }
+    }
+
+    if(b->ncols == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 16;
+        bucket_col_t **cols = enif_realloc(b->cols, sizeof(bucket_col_t*) * cap);
+        if(cols == NULL) {
+            return NULL;
+        }
+        b->cols = cols;
+        b->cap = cap;
+    }
+    col = enif_alloc(sizeof(bucket_col_t));
+    if(col == NULL) {
+        return NULL;
+    }
+    len = strlen(name);
+    col->name = enif_alloc(len + 1);
+    if(col->name == NULL) {
+        enif_free(col);
+        return NULL;
+    }
+    memcpy(col->name, name, len + 1);
+    bson_init(&col->data);
+    bson_init(&col->min);
+    bson_init(&col->max);
+    b->cols[b->ncols++] = col;
+    return col;
+}
+
+/* keep the smaller (sign 1) or larger (sign -1) of bound and iter in bound */
+static int
+update_bound(bson_t *bound, const bson_iter_t *iter, int sign)
+{
+    bson_iter_t cur;
+
+    if(bson_iter_init(&cur, bound) && bson_iter_next(&cur) &&
+            compare_iter(iter, &cur) * sign >= 0) {
+        return 1;
+    }
+    bson_reinit(bound);
+    return bson_append_iter(bound, "", 0, iter);
+}
+
+/* add the already encoded row as row number b->count */
+static int
+add_row(bucket_t *b, const bson_t *row)
+{
+    bucket_col_t *col;
+    bson_iter_t   iter;
+    char          buf[16];
+    const char   *idx;
+    size_t        idx_len, n = 0;
+
+    idx_len = bson_uint32_to_string(b->count, &idx, buf, sizeof buf);
+    if(!bson_iter_init(&iter, row)) {
+        return 0;
+    }
+    while(bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+
+        if(b->has_meta && strcmp(key, b->meta_field) == 0) {
+            if(b->count == 0 && !bson_append_iter(&b->meta, "", 0, &iter)) {
+                return 0;
+            }
+            continue;
+        }
+        col = find_col(b, key, n++);
+        if(col == NULL) {
+            return 0;
+        }
+        b->size -= col->data.len;
+        if(!bson_append_iter(&col->data, idx, idx_len, &iter)) {
+            return 0;
+        }
+        b->size += col->data.len;
+        if(!update_bound(&col->min, &iter, 1) ||
+                !update_bound(&col->max, &iter, -1)) {
+            return 0;
+        }
+    }
+    b->count++;
+    return 1;
+}
+
+/* a row with another meta value than the bucket's starts a new bucket */
+static int
+same_meta(bucket_t *b, const bson_t *row)
+{
+    bson_iter_t a, m;
+    int has_a, has_m;
+
+    if(!b->has_meta) {
+        return 1;
+    }
+    has_a = bson_iter_init_find(&a, row, b->meta_field);
+    has_m = bson_iter_init(&m, &b->meta) && bson_iter_next(&m);
+    if(has_a != has_m) {
+        return 0;
+    }
+    return !has_a || (bson_iter_type(&a) == bson_iter_type(&m) &&
+                      compare_iter(&a, &m) == 0);
+}
+
+static int
+append_bounds(bucket_t *b, bson_t *control, const char *key, int max)
+{
+    bson_t      child;
+    bson_iter_t iter;
+    size_t      i;
+
+    if(!bson_append_document_begin(control, key, -1, &child)) {
+        return 0;
+    }
+    for(i = 0; i < b->ncols; i++) {
+        bson_t *bound = max ? &b->cols[i]->max : &b->cols[i]->min;
+
+        if(!bson_iter_init(&iter, bound) || !bson_iter_next(&iter) ||
+                !bson_append_iter(&child, b->cols[i]->name, -1, &iter)) {
+            return 0;
+        }
+    }
+    return bson_append_document_end(control, &child);
+}
+
+/* {control: {version: 1, min, max}, meta, data: {Field: Column}} */
+static int
+flush_bucket(bucket_t *b, vec_term_t *out)
+{
+    bson_t       doc, child;
+    bson_iter_t  iter;
+    ERL_NIF_TERM bin;
+    size_t       i;
+    int          ret = 0;
+
+    if(b->count == 0) {
+        return 1;
+    }
+    bson_init(&doc);
+    if(!bson_append_document_begin(&doc, "control", 7, &child) ||
+            !bson_append_int32(&child, "version", 7, 1) ||
+            !append_bounds(b, &child, "min", 0) ||
+            !append_bounds(b, &child, "max", 1) ||
+            !bson_append_document_end(&doc, &child)) {
+        goto done;
+    }
+    if(bson_iter_init(&iter, &b->meta) && bson_iter_next(&iter) &&
+            !bson_append_iter(&doc, "meta", 4, &iter)) {
+        goto done;
+    }
+    if(!bson_append_document_begin(&doc, "data", 4, &child)) {
+        goto done;
+    }
+    for(i = 0; i < b->ncols; i++) {
+        if(!bson_append_document(&child, b->cols[i]->name, -1,
+                                 &b->cols[i]->data)) {
+            goto done;
+        }
+    }
+    if(!bson_append_document_end(&doc, &child) ||
+            !make_binary(b->env, &bin, bson_get_data(&doc), doc.len) ||
+            vec_push(out, bin) != 0) {
+        goto done;
+    }
+    ret = 1;
+
+done:
+    bson_destroy(&doc);
+    free_cols(b);
+    return ret;
+}
+
+static int
+get_field(ErlNifEnv *env, ERL_NIF_TERM term, char *field, size_t size)
+{
+    ErlNifBinary bin;
+
+    if(enif_is_atom(env, term)) {
+        return enif_get_atom(env, term, field, size, ERL_NIF_LATIN1) > 1;
+    }
+    if(!enif_inspect_binary(env, term, &bin) || bin.size == 0 ||
+            bin.size >= size || memchr(bin.data, '\0', bin.size)) {
+        return 0;
+    }
+    memcpy(field, bin.data, bin.size);
+    field[bin.size] = '\0';
+    return 1;
+}
+
+static int
+parse_spec(bucket_t *b, ERL_NIF_TERM spec)
+{
+    cabala_st   *st = b->st;
+    ErlNifEnv   *env = b->env;
+    ERL_NIF_TERM item;
+    const ERL_NIF_TERM *tuple;
+    int          arity, has_time = 0;
+    unsigned     n;
+
+    while(enif_get_list_cell(env, spec, &item, &spec)) {
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            return 0;
+        }
+        if(enif_compare(tuple[0], st->atom_time_field) == 0) {
+            has_time = get_field(env, tuple[1], b->time_field, MAX_PATH_LEN);
+            if(!has_time) {
+                return 0;
+            }
+        } else if(enif_compare(tuple[0], st->atom_meta_field) == 0) {
+            b->has_meta = get_field(env, tuple[1], b->meta_field, MAX_PATH_LEN);
+            if(!b->has_meta) {
+                return 0;
+            }
+        } else if(enif_compare(tuple[0], st->atom_max_count) == 0 &&
+                enif_get_uint(env, tuple[1], &n) && n > 0) {
+            b->max_count = n;
+        } else if(enif_compare(tuple[0], st->atom_max_size) == 0 &&
+                enif_get_uint(env, tuple[1], &n) && n > 0) {
+            b->max_size = n;
+        } else {
+            return 0;
+        }
+    }
+    return has_time;
+}
+
+ERL_NIF_TERM
+encode_buckets(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    encode_state *es;
+    bucket_t      b;
+    bson_iter_t   iter;
+    vec_term_t    buckets;
+    ERL_NIF_TERM  rows, row, out;
+
+    if(argc != 2 || !enif_is_list(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+
+    memset(&b, 0, sizeof b);
+    b.env = env;
+    b.st = st;
+    b.max_count = BUCKET_MAX_COUNT;
+    b.max_size = BUCKET_MAX_SIZE;
+    if(!parse_spec(&b, argv[1])) {
+        return enif_make_badarg(env);
+    }
+
+    es = es_new(env, st);
+    if(!es) {
+        return make_error(st, env, "internal_error");
+    }
+    bson_init(&b.meta);
+    vec_init(&buckets);
+
+    rows = argv[0];
+    while(enif_get_list_cell(env, rows, &row, &rows)) {
+        bson_reinit(&es->bson);
+        if(!encode_doc(row, es) ||
+                !bson_iter_init_find(&iter, &es->bson, b.time_field) ||
+                bson_iter_type(&iter) != BSON_TYPE_DATE_TIME) {
+            out = make_obj_error(st, env, "baddoc", row);
+            goto done;
+        }
+        /* close the bucket before the row that does not fit */
+        if(b.count > 0 && (!same_meta(&b, &es->bson) ||
+                           b.size + es->bson.len > b.max_size)) {
+            if(!flush_bucket(&b, &buckets)) {
+                goto failure;
+            }
+        }
+        if(!add_row(&b, &es->bson)) {
+            goto failure;
+        }
+        if(b.count >= b.max_count && !flush_bucket(&b, &buckets)) {
+            goto failure;
+        }
+    }
+    if(!flush_bucket(&b, &buckets)) {
+        goto failure;
+    }
+    out = enif_make_list_from_array(env, buckets.data, buckets.length);
+    goto done;
+
+failure:
+    out = make_error(st, env, "internal_error");
+
+done:
+    free_cols(&b);
+    if(b.cols) {
+        enif_free(b.cols);
+    }
+    bson_destroy(&b.meta);
+    vec_deinit(&buckets);
+    es_destroy(es);
+    return out;
+}
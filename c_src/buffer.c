@@ -0,0 +1,73 @@
+#include "cabala.h"
+
+/*
+ * Growable byte buffer backed by an erlang binary, so the finished
+ * buffer becomes a term without another copy.
+ */
+int
+buffer_init(buffer_t *buf, size_t size)
+{
+    buf->len = 0;
+    if(size == 0) {
+        size = 256;
+    }
+    return enif_alloc_binary(size, &buf->bin);
+}
+
+int
+buffer_reserve(buffer_t *buf, size_t size)
+{
+    size_t need = buf->len + size;
+    size_t cap = buf->bin.size;
+
+    if(need <= cap) {
+        return 1;
+    }
+    while(cap < need) {
+        cap <<= 1;
+    }
+    return enif_realloc_binary(&buf->bin, cap);
+}
+
+int
+buffer_append(buffer_t *buf, const void *data, size_t size)
+{
+    if(!buffer_reserve(buf, size)) {
+        return 0;
+    }
+    memcpy(buf->bin.data + buf->len, data, size);
+    buf->len += size;
+    return 1;
+}
+
+int
+buffer_append_int32(buffer_t *buf, int32_t v)
+{
+    uint32_t le = BSON_UINT32_TO_LE((uint32_t)v);
+    return buffer_append(buf, &le, sizeof le);
+}
+
+void
+buffer_set_int32(buffer_t *buf, size_t offset, int32_t v)
+{
+    uint32_t le = BSON_UINT32_TO_LE((uint32_t)v);
+    memcpy(buf->bin.data + offset, &le, sizeof le);
+}
+
+/* hand the buffer over to the term, buf must not be used afterwards */
+int
+buffer_make_binary(ErlNifEnv *env, buffer_t *buf, ERL_NIF_TERM *out)
+{
+    if(buf->len != buf->bin.size &&
+            !enif_realloc_binary(&buf->bin, buf->len)) {
+        return 0;
+    }
+    *out = enif_make_binary(env, &buf->bin);
+    return 1;
+}
+
+void
+buffer_destroy(buffer_t *buf)
+{
+    enif_release_binary(&buf->bin);
+}
@@ -50,14 +50,116 @@ load(ErlNifEnv *env, void **priv, ERL_NIF_TERM info)
 	st->atom_s_options = make_atom(env, "$options$");
 	st->atom_s_timestamp = make_atom(env, "$timestamp$");
 	st->atom_s_increment = make_atom(env, "$increment$");
+	st->atom_s_f64 = make_atom(env, "$f64$");
+	st->atom_s_i32 = make_atom(env, "$i32$");
+	st->atom_s_i64 = make_atom(env, "$i64$");
 	
 	st->atom_return_maps = make_atom(env, "return_maps");
+	st->atom_canonical = make_atom(env, "canonical");
+	st->atom_bits = make_atom(env, "bits");
+	st->atom_seed = make_atom(env, "seed");
+	st->atom_terms = make_atom(env, "terms");
+	st->atom_checksum = make_atom(env, "checksum");
+	st->atom_response_to = make_atom(env, "response_to");
+	st->atom_raw = make_atom(env, "raw");
+	st->atom_compressor = make_atom(env, "compressor");
+	st->atom_compression_level = make_atom(env, "compression_level");
+	st->atom_zlib = make_atom(env, "zlib");
+	st->atom_zstd = make_atom(env, "zstd");
+	st->atom_eof = make_atom(env, "eof");
+	st->atom_append = make_atom(env, "append");
+	st->atom_fsync = make_atom(env, "fsync");
+	st->atom_buffer_size = make_atom(env, "buffer_size");
+	st->atom_never = make_atom(env, "never");
+	st->atom_on_close = make_atom(env, "on_close");
+	st->atom_always = make_atom(env, "always");
+	st->atom_file = make_atom(env, "file");
+	st->atom_sidecar = make_atom(env, "sidecar");
+	st->atom_threads = make_atom(env, "threads");
+	st->atom_cabala = make_atom(env, "cabala");
+	st->atom_threshold = make_atom(env, "threshold");
+	st->atom_packed_arrays = make_atom(env, "packed_arrays");
+	st->atom_time_field = make_atom(env, "time_field");
+	st->atom_meta_field = make_atom(env, "meta_field");
+	st->atom_max_count = make_atom(env, "max_count");
+	st->atom_max_size = make_atom(env, "max_size");
+	st->atom_int32 = make_atom(env, "int32");
+	st->atom_int64 = make_atom(env, "int64");
+	st->atom_double = make_atom(env, "double");
+	st->atom_string = make_atom(env, "string");
+	st->atom_binary = make_atom(env, "binary");
+	st->atom_bool = make_atom(env, "bool");
+	st->atom_date = make_atom(env, "date");
+	st->atom_any = make_atom(env, "any");
+	st->atom_defaults = make_atom(env, "defaults");
+	st->atom_record = make_atom(env, "record");
+	st->atom_unknown = make_atom(env, "unknown");
+	st->atom_ignore = make_atom(env, "ignore");
+	st->atom_collect = make_atom(env, "collect");
+	st->atom_ensure_id = make_atom(env, "ensure_id");
+	st->atom_id = make_atom(env, "_id");
+	st->atom_oid_format = make_atom(env, "oid_format");
+	st->atom_uuid_format = make_atom(env, "uuid_format");
+	st->atom_hex = make_atom(env, "hex");
+	st->atom_relaxed = make_atom(env, "relaxed");
+	st->atom_validate_utf8 = make_atom(env, "validate_utf8");
+
+	st->res_filter = enif_open_resource_type(env, NULL, "cabala_filter",
+			filter_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_filter == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->res_reader = enif_open_resource_type(env, NULL, "cabala_reader",
+			reader_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_reader == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->res_writer = enif_open_resource_type(env, NULL, "cabala_writer",
+			writer_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_writer == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->res_index = enif_open_resource_type(env, NULL, "cabala_index",
+			index_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_index == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->res_async = enif_open_resource_type(env, NULL, "cabala_async",
+			async_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_async == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->res_schema = enif_open_resource_type(env, NULL, "cabala_schema",
+			schema_dtor, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+	if(st->res_schema == NULL) {
+		enif_free(st);
+		return 1;
+	}
+
+	st->pool = pool_new(0, ASYNC_MAX_QUEUED);
+	if(st->pool == NULL) {
+		enif_free(st);
+		return 1;
+	}
 
 	*priv = (void*)st;
 
 	/* init bson memory control */
 	bson_mem_set_vtable(&erl_bson_vtable);
 
+	crc32c_init();
+	utf8_init();
+
 	return 0;
 }
 
@@ -76,6 +178,9 @@ upgrade(ErlNifEnv *env, void **priv, void **old_priv, ERL_NIF_TERM info)
 static void 
 unload(ErlNifEnv *env, void *priv)
 {
+	cabala_st *st = (cabala_st*)priv;
+
+	pool_destroy(st->pool);
 	enif_free(priv);
 	return;
 }
@@ -83,7 +188,43 @@ unload(ErlNifEnv *env, void *priv)
 static ErlNifFunc funcs[] = 
 {
 	{"nif_decode", 2, decode},
-	{"nif_encode", 2, encode}
+	{"nif_encode", 2, encode},
+	{"nif_compile_filter", 1, compile_filter},
+	{"nif_match", 2, match},
+	{"nif_filter", 2, filter, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_compare", 3, compare},
+	{"nif_sort", 2, sort, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_hash", 2, hash},
+	{"nif_hash_term", 2, hash_term},
+	{"nif_diff", 3, diff},
+	{"nif_encode_op_msg", 5, encode_op_msg, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_decode_op_msg", 2, decode_op_msg, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_file_open", 1, file_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_file_next_batch", 3, file_next_batch, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_file_close", 1, file_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_writer_open", 2, writer_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_writer_write", 2, writer_write, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_writer_flush", 1, writer_flush, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_decode_all_parallel", 2, decode_all_parallel, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_encode_batch", 2, encode_batch, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_encode_async", 2, encode_async},
+	{"nif_decode_async", 2, decode_async},
+	{"nif_async_cancel", 1, async_cancel},
+	{"nif_async_info", 0, async_info},
+	{"nif_index", 2, index_new, ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"nif_index_count", 1, index_count},
+	{"nif_index_nth", 2, index_nth},
+	{"nif_index_slice", 3, index_slice, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_index_ranges", 2, index_ranges},
+	{"nif_decode_columns", 3, decode_columns, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_encode_buckets", 2, encode_buckets, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_compile_schema", 3, compile_schema},
+	{"nif_encode_record", 2, encode_record},
+	{"nif_decode_record", 3, decode_record},
+	{"nif_new_oid", 0, new_oid},
+	{"nif_to_json", 2, to_json},
+	{"nif_from_json", 2, from_json},
+	{"nif_from_ndjson", 2, from_ndjson}
 };
 
 ERL_NIF_INIT(cabala, funcs, &load, &reload, &upgrade, &unload);
\ No newline at end of file
@@ -8,12 +8,31 @@
 
 // #define CABALA_DEBUG 1
 
+#define MAX_PATH_LEN    4096
+
 #ifdef CABALA_DEBUG
     #define LOG(fmt, ...) fprintf(stdout, fmt, __VA_ARGS__)
 #else
     #define LOG(fmt, ...)
 #endif
 
+#define POOL_MAX_THREADS    64
+#define ASYNC_MAX_QUEUED    1024
+
+typedef struct pool_s pool_t;
+
+/* a unit of work for the pool, embedded first in the caller's job */
+typedef struct pool_job_s {
+    void              (*run)(struct pool_job_s *job);
+    struct pool_job_s  *next;
+} pool_job_t;
+
+typedef struct {
+    ErlNifMutex *lock;
+    ErlNifCond  *cond;
+    int          count;
+} latch_t;
+
 typedef struct {
 	ERL_NIF_TERM 	atom_ok;			// 'ok'
     ERL_NIF_TERM    atom_error;			// 'error'
@@ -35,15 +54,261 @@ typedef struct {
     ERL_NIF_TERM    atom_s_options;     // '$options$'
     ERL_NIF_TERM    atom_s_timestamp;   // '$timestamp$'
     ERL_NIF_TERM    atom_s_increment;   // '$increment$'
+    ERL_NIF_TERM    atom_s_f64;         // '$f64$'
+    ERL_NIF_TERM    atom_s_i32;         // '$i32$'
+    ERL_NIF_TERM    atom_s_i64;         // '$i64$'
 
     ERL_NIF_TERM    atom_return_maps;	// 'return_maps'
+    ERL_NIF_TERM    atom_canonical;     // 'canonical'
+    ERL_NIF_TERM    atom_bits;          // 'bits'
+    ERL_NIF_TERM    atom_seed;          // 'seed'
+    ERL_NIF_TERM    atom_terms;         // 'terms'
+    ERL_NIF_TERM    atom_checksum;      // 'checksum'
+    ERL_NIF_TERM    atom_response_to;   // 'response_to'
+    ERL_NIF_TERM    atom_raw;           // 'raw'
+    ERL_NIF_TERM    atom_compressor;    // 'compressor'
+    ERL_NIF_TERM    atom_compression_level; // 'compression_level'
+    ERL_NIF_TERM    atom_zlib;          // 'zlib'
+    ERL_NIF_TERM    atom_zstd;          // 'zstd'
+    ERL_NIF_TERM    atom_eof;           // 'eof'
+    ERL_NIF_TERM    atom_append;        // 'append'
+    ERL_NIF_TERM    atom_fsync;         // 'fsync'
+    ERL_NIF_TERM    atom_buffer_size;   // 'buffer_size'
+    ERL_NIF_TERM    atom_never;         // 'never'
+    ERL_NIF_TERM    atom_on_close;      // 'on_close'
+    ERL_NIF_TERM    atom_always;        // 'always'
+    ERL_NIF_TERM    atom_file;          // 'file'
+    ERL_NIF_TERM    atom_sidecar;       // 'sidecar'
+    ERL_NIF_TERM    atom_threads;       // 'threads'
+    ERL_NIF_TERM    atom_cabala;        // 'cabala'
+    ERL_NIF_TERM    atom_threshold;     // 'threshold'
+    ERL_NIF_TERM    atom_packed_arrays; // 'packed_arrays'
+    ERL_NIF_TERM    atom_time_field;    // 'time_field'
+    ERL_NIF_TERM    atom_meta_field;    // 'meta_field'
+    ERL_NIF_TERM    atom_max_count;     // 'max_count'
+    ERL_NIF_TERM    atom_max_size;      // 'max_size'
+    ERL_NIF_TERM    atom_int32;         // 'int32'
+    ERL_NIF_TERM    atom_int64;         // 'int64'
+    ERL_NIF_TERM    atom_double;        // 'double'
+    ERL_NIF_TERM    atom_string;        // 'string'
+    ERL_NIF_TERM    atom_binary;        // 'binary'
+    ERL_NIF_TERM    atom_bool;          // 'bool'
+    ERL_NIF_TERM    atom_date;          // 'date'
+    ERL_NIF_TERM    atom_any;           // 'any'
+    ERL_NIF_TERM    atom_defaults;      // 'defaults'
+    ERL_NIF_TERM    atom_record;        // 'record'
+    ERL_NIF_TERM    atom_unknown;       // 'unknown'
+    ERL_NIF_TERM    atom_ignore;        // 'ignore'
+    ERL_NIF_TERM    atom_collect;       // 'collect'
+    ERL_NIF_TERM    atom_ensure_id;     // 'ensure_id'
+    ERL_NIF_TERM    atom_id;            // '_id'
+    ERL_NIF_TERM    atom_oid_format;    // 'oid_format'
+    ERL_NIF_TERM    atom_uuid_format;   // 'uuid_format'
+    ERL_NIF_TERM    atom_hex;           // 'hex'
+    ERL_NIF_TERM    atom_relaxed;       // 'relaxed'
+    ERL_NIF_TERM    atom_validate_utf8; // 'validate_utf8'
+
+    ErlNifResourceType *res_filter;     // compiled match filter
+    ErlNifResourceType *res_reader;     // mmapped .bson file
+    ErlNifResourceType *res_writer;     // buffered .bson file writer
+    ErlNifResourceType *res_index;      // document offsets of a stream
+    ErlNifResourceType *res_async;      // pending encode_async/decode_async
+    ErlNifResourceType *res_schema;     // compiled record schema
+
+    pool_t             *pool;           // native worker threads
 } cabala_st;
 
 typedef vec_t(ERL_NIF_TERM) vec_term_t;
+typedef vec_t(uint64_t) vec_u64_t;
+
+/* OP_COMPRESSED compressor ids */
+#define COMPRESSOR_NOOP     0
+#define COMPRESSOR_ZLIB     2
+#define COMPRESSOR_ZSTD     3
+
+/* nesting limit of to_json and from_json */
+#define JSON_MAX_DEPTH      100
+
+/* inputs larger than this are converted on a dirty scheduler */
+#define JSON_DIRTY_BYTES    (64 * 1024)
+
+typedef struct {
+    ErlNifBinary bin;
+    size_t       len;
+} buffer_t;
+
+typedef struct {
+    ErlNifEnv *env;
+    cabala_st *st;
+
+    vec_term_t *vec;
+    int depth;
+
+    int  return_maps;
+    int  packed_arrays;
+    int  oid_hex;       // ObjectIds as 24 hex digits
+    int  uuid_string;   // subtype 4 binaries as 8-4-4-4-12 text
+    int  validate_utf8; // strings are checked while they are copied
+    int  utf8_error;    // set when one of them was not well formed
+    bool keys;
+} decode_state;
+
+/* field types of a compiled schema, FIELD_ANY goes through encode_elem */
+typedef enum {
+    FIELD_ANY = 0,
+    FIELD_INT32,
+    FIELD_INT64,
+    FIELD_DOUBLE,
+    FIELD_STRING,
+    FIELD_BINARY,
+    FIELD_BOOL,
+    FIELD_DATE
+} field_type;
+
+typedef struct {
+    const char *key;        // NUL terminated, in schema_res.keys
+    int         key_len;
+    field_type  type;
+} schema_field;
+
+typedef struct {
+    schema_field *fields;
+    size_t        count;
+    char         *keys;
+    uint32_t     *table;    // key hash -> field index + 1, 0 when free
+    uint32_t      mask;
+    ErlNifEnv    *env;      // defaults and record name
+    ERL_NIF_TERM *defaults; // NULL when missing fields are undefined
+    ERL_NIF_TERM  record;   // record name, when has_record
+    int           has_record;
+} schema_res;
+
+typedef bool (*path_fn)(const bson_iter_t *value, void *data);
+
+typedef struct {
+	ErlNifEnv 	 *env;
+	cabala_st 	 *st;
+
+	bson_t 		  bson;
+	const bson_oid_t *id;	// prepended as _id by encode_doc when set
+	bool		  validate_utf8;	// strings must be well formed UTF-8
+	bool		  utf8_error;		// set when one was not
+} encode_state;
 
 /* nif functions */
 ERL_NIF_TERM decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 ERL_NIF_TERM encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM compile_filter(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM match(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM filter(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM compare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM sort(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM hash(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM hash_term(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM diff(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM encode_op_msg(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM decode_op_msg(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM file_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM file_next_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM file_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM writer_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM writer_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM writer_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM decode_all_parallel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM encode_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM encode_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM decode_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM async_cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM async_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM index_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM index_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM index_nth(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM index_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM index_ranges(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM decode_columns(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM encode_buckets(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM compile_schema(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM encode_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM decode_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM new_oid(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM to_json(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM from_json(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM from_ndjson(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/* decode functions */
+void init_state(decode_state *ds, ErlNifEnv *env, cabala_st *st);
+int decode_option(decode_state *ds, ERL_NIF_TERM opt);
+int iter_bson(const bson_t *bson, ERL_NIF_TERM *out, decode_state *ds);
+int decode_value(decode_state *ds, const bson_iter_t *iter, ERL_NIF_TERM *out);
+int make_document(ErlNifEnv *env, vec_term_t *vec, ERL_NIF_TERM *out,
+                  int return_maps);
+
+/* encode functions */
+encode_state *es_new(ErlNifEnv *env, cabala_st *st);
+void es_destroy(encode_state *es);
+int encode_doc(ERL_NIF_TERM term, encode_state *es);
+int encode_elem(ERL_NIF_TERM key, ERL_NIF_TERM term, encode_state *es);
+int doc_id(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM doc, ERL_NIF_TERM *id);
+int encode_result(ERL_NIF_TERM *out, encode_state *es);
+
+/* compare functions */
+int canonical_type(bson_type_t type);
+int compare_iter(const bson_iter_t *a, const bson_iter_t *b);
+int compare_document(bson_iter_t *a, bson_iter_t *b);
+bool walk_path(bson_iter_t iter, const char *path, path_fn fn, void *data,
+               bool *found, bool *error);
+
+/* match functions */
+void filter_dtor(ErlNifEnv *env, void *obj);
+
+/* file functions */
+void reader_dtor(ErlNifEnv *env, void *obj);
+void writer_dtor(ErlNifEnv *env, void *obj);
+int get_path(ErlNifEnv *env, ERL_NIF_TERM term, char *path, size_t size);
+int map_file(const char *path, uint8_t **map, size_t *size);
+
+/* index functions */
+void index_dtor(ErlNifEnv *env, void *obj);
+int64_t scan_offsets(const uint8_t *data, size_t size, vec_u64_t *offsets);
+
+/* schema functions */
+void schema_dtor(ErlNifEnv *env, void *obj);
+int schema_lookup(const schema_res *res, const char *key, size_t len);
+
+/* hex functions */
+void hex_encode(const uint8_t *src, size_t len, char *dst);
+int hex_decode(const char *src, size_t len, uint8_t *dst);
+void oid_to_hex(const uint8_t *oid, char *dst);
+int oid_from_hex(const char *src, uint8_t *oid);
+void uuid_to_string(const uint8_t *uuid, char *dst);
+int uuid_from_string(const char *src, uint8_t *uuid);
+
+/* json functions */
+size_t json_safe_run(const uint8_t *p, size_t len);
+
+/* utf8 functions */
+void utf8_init(void);
+int utf8_copy(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* oid functions */
+void oid_new(bson_oid_t *oid);
+ERL_NIF_TERM make_oid(ErlNifEnv *env, cabala_st *st, const bson_oid_t *oid);
+
+/* pool functions */
+pool_t *pool_new(int nthreads, int max_queued);
+void pool_destroy(pool_t *pool);
+int pool_size(pool_t *pool);
+int pool_submit(pool_t *pool, pool_job_t *job, bool bounded);
+int pool_cancel(pool_t *pool, pool_job_t *job);
+int pool_queued(pool_t *pool);
+
+/* async functions */
+void async_dtor(ErlNifEnv *env, void *obj);
+
+int latch_init(latch_t *latch, int count);
+void latch_count_down(latch_t *latch);
+void latch_wait(latch_t *latch);
+void latch_destroy(latch_t *latch);
 
 /* util functions */
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *name);
@@ -51,7 +316,27 @@ ERL_NIF_TERM make_ok(cabala_st *st, ErlNifEnv *env, ERL_NIF_TERM value);
 ERL_NIF_TERM make_error(cabala_st *st, ErlNifEnv *env, const char *error);
 ERL_NIF_TERM make_obj_error(cabala_st *st, ErlNifEnv *env, 
 		const char *error, ERL_NIF_TERM obj);
+ERL_NIF_TERM make_errno_error(cabala_st *st, ErlNifEnv *env, int err);
 
 int make_binary(ErlNifEnv *env, ERL_NIF_TERM *out, const void* str, size_t len);
 
+/* buffer functions */
+int buffer_init(buffer_t *buf, size_t size);
+int buffer_reserve(buffer_t *buf, size_t size);
+int buffer_append(buffer_t *buf, const void *data, size_t size);
+int buffer_append_int32(buffer_t *buf, int32_t v);
+void buffer_set_int32(buffer_t *buf, size_t offset, int32_t v);
+int buffer_make_binary(ErlNifEnv *env, buffer_t *buf, ERL_NIF_TERM *out);
+void buffer_destroy(buffer_t *buf);
+
+/* crc32c functions */
+void crc32c_init(void);
+uint32_t crc32c(const void *data, size_t len);
+
+/* compress functions */
+int compress_frame(const uint8_t *frame, size_t len, int compressor, int level,
+                   buffer_t *out);
+const char *decompress_frame(const uint8_t *frame, size_t len,
+                             ErlNifBinary *out);
+
 #endif
\ No newline at end of file
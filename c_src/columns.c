@@ -0,0 +1,342 @@
+#include "cabala.h"
+
+/* what a column holds so far, numeric kinds only ever widen */
+#define COL_EMPTY   0
+#define COL_I32     1
+#define COL_I64     2
+#define COL_F64     3
+#define COL_TERMS   4
+
+/* per row state of a column */
+#define ROW_MISSING 0
+#define ROW_NULL    1
+#define ROW_VALUE   2
+
+typedef struct {
+    char          *path;
+    ERL_NIF_TERM   name;
+    int            kind;
+    uint64_t      *slots;   // int64_t or double, by kind
+    uint8_t       *rows;    // ROW_* per document
+    ERL_NIF_TERM  *terms;   // once kind is COL_TERMS
+} column_t;
+
+static void
+free_columns(column_t *cols, size_t ncols)
+{
+    size_t i;
+
+    for(i = 0; i < ncols; i++) {
+        if(cols[i].path) {
+            enif_free(cols[i].path);
+        }
+        if(cols[i].slots) {
+            enif_free(cols[i].slots);
+        }
+        if(cols[i].rows) {
+            enif_free(cols[i].rows);
+        }
+        if(cols[i].terms) {
+            enif_free(cols[i].terms);
+        }
+    }
+    enif_free(cols);
+}
+
+static ERL_NIF_TERM
+slot_term(ErlNifEnv *env, const column_t *col, size_t row)
+{
+    double d;
+
+    if(col->kind == COL_F64) {
+        memcpy(&d, &col->slots[row], sizeof d);
+        return enif_make_double(env, d);
+    }
+    return enif_make_int64(env, (int64_t)col->slots[row]);
+}
+
+/*
+ * The first value that is not a number turns the column into a list,
+ * rows decoded so far become terms: undefined, null or the number.
+ */
+static int
+to_terms(decode_state *ds, column_t *col, size_t row, size_t count)
+{
+    size_t i;
+
+    col->terms = enif_alloc(sizeof(ERL_NIF_TERM) * (count > 0 ? count : 1));
+    if(col->terms == NULL) {
+        return 0;
+    }
+    for(i = 0; i < row; i++) {
+        switch(col->rows[i]) {
+            case ROW_MISSING:
+                col->terms[i] = ds->st->atom_undefined;
+                break;
+            case ROW_NULL:
+                col->terms[i] = ds->st->atom_null;
+                break;
+            default:
+                col->terms[i] = slot_term(ds->env, col, i);
+                break;
+        }
+    }
+    col->kind = COL_TERMS;
+    return 1;
+}
+
+/* integers already stored become doubles */
+static void
+to_f64(column_t *col, size_t row)
+{
+    double d;
+    size_t i;
+
+    for(i = 0; i < row; i++) {
+        if(col->rows[i] == ROW_VALUE) {
+            d = (double)(int64_t)col->slots[i];
+            memcpy(&col->slots[i], &d, sizeof d);
+        }
+    }
+    col->kind = COL_F64;
+}
+
+static int
+put_value(decode_state *ds, column_t *col, size_t row, size_t count,
+          const bson_iter_t *iter)
+{
+    bson_type_t type = bson_iter_type(iter);
+    int64_t     i;
+    double      d;
+
+    if(col->kind != COL_TERMS) {
+        switch(type) {
+            case BSON_TYPE_NULL:
+                col->rows[row] = ROW_NULL;
+                col->slots[row] = 0;
+                return 1;
+            case BSON_TYPE_INT32:
+            case BSON_TYPE_INT64:
+                if(type == BSON_TYPE_INT32) {
+                    i = bson_iter_int32(iter);
+                    if(col->kind == COL_EMPTY) {
+                        col->kind = COL_I32;
+                    }
+                } else {
+                    i = bson_iter_int64(iter);
+                    if(col->kind < COL_I64) {
+                        col->kind = COL_I64;
+                    }
+                }
+                col->rows[row] = ROW_VALUE;
+                if(col->kind == COL_F64) {
+                    d = (double)i;
+                    memcpy(&col->slots[row], &d, sizeof d);
+                } else {
+                    col->slots[row] = (uint64_t)i;
+                }
+                return 1;
+            case BSON_TYPE_DOUBLE:
+                if(col->kind != COL_F64) {
+                    to_f64(col, row);
+                }
+                d = bson_iter_double(iter);
+                col->rows[row] = ROW_VALUE;
+                memcpy(&col->slots[row], &d, sizeof d);
+                return 1;
+            default:
+                if(!to_terms(ds, col, row, count)) {
+                    return 0;
+                }
+                break;
+        }
+    }
+    col->rows[row] = ROW_VALUE;
+    return decode_value(ds, iter, &col->terms[row]);
+}
+
+/*
+ * {'$i32$' | '$i64$' | '$f64$', Values, Valid} with the values in native
+ * byte order, bit N of Valid (LSB first) is set when row N has a value.
+ */
+static int
+make_numeric(decode_state *ds, const column_t *col, size_t count,
+             ERL_NIF_TERM *out)
+{
+    ErlNifBinary values, valid;
+    ERL_NIF_TERM tag;
+    size_t       width = col->kind == COL_I32 ? 4 : 8;
+    size_t       i;
+    int32_t      v;
+
+    if(!enif_alloc_binary(count * width, &values)) {
+        return 0;
+    }
+    if(!enif_alloc_binary((count + 7) / 8, &valid)) {
+        enif_release_binary(&values);
+        return 0;
+    }
+    memset(valid.data, 0, valid.size);
+
+    if(width == 4) {
+        for(i = 0; i < count; i++) {
+            v = (int32_t)col->slots[i];
+            memcpy(values.data + i * 4, &v, 4);
+        }
+    } else if(count > 0) {
+        memcpy(values.data, col->slots, count * 8);
+    }
+    for(i = 0; i < count; i++) {
+        if(col->rows[i] == ROW_VALUE) {
+            valid.data[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    switch(col->kind) {
+        case COL_I32: tag = ds->st->atom_s_i32; break;
+        case COL_I64: tag = ds->st->atom_s_i64; break;
+        default:      tag = ds->st->atom_s_f64; break;
+    }
+    *out = enif_make_tuple3(ds->env, tag, enif_make_binary(ds->env, &values),
+                            enif_make_binary(ds->env, &valid));
+    return 1;
+}
+
+static int
+make_column(decode_state *ds, column_t *col, size_t count, ERL_NIF_TERM *out)
+{
+    if(col->kind == COL_EMPTY) {
+        /* only nulls and missing fields, the same as a list of them */
+        if(!to_terms(ds, col, count, count)) {
+            return 0;
+        }
+    }
+    if(col->kind == COL_TERMS) {
+        *out = enif_make_list_from_array(ds->env, col->terms, count);
+        return 1;
+    }
+    return make_numeric(ds, col, count, out);
+}
+
+static int
+get_columns(ErlNifEnv *env, ERL_NIF_TERM fields, size_t count,
+            column_t **out, size_t *nout)
+{
+    column_t    *cols;
+    ERL_NIF_TERM item;
+    ErlNifBinary bin;
+    unsigned     len, n = 0;
+
+    if(!enif_get_list_length(env, fields, &len)) {
+        return 0;
+    }
+    cols = enif_alloc(sizeof(column_t) * (len > 0 ? len : 1));
+    if(cols == NULL) {
+        return 0;
+    }
+    memset(cols, 0, sizeof(column_t) * (len > 0 ? len : 1));
+    while(enif_get_list_cell(env, fields, &item, &fields)) {
+        column_t *col = &cols[n++];
+
+        if(!enif_inspect_binary(env, item, &bin) || bin.size == 0 ||
+                bin.size >= MAX_PATH_LEN || memchr(bin.data, '\0', bin.size)) {
+            goto error;
+        }
+        col->name = item;
+        col->path = enif_alloc(bin.size + 1);
+        col->slots = enif_alloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+        col->rows = enif_alloc(count > 0 ? count : 1);
+        if(!col->path || !col->slots || !col->rows) {
+            goto error;
+        }
+        memcpy(col->path, bin.data, bin.size);
+        col->path[bin.size] = '\0';
+        memset(col->rows, ROW_MISSING, count);
+        memset(col->slots, 0, sizeof(uint64_t) * count);
+    }
+    *out = cols;
+    *nout = n;
+    return 1;
+
+error:
+    free_columns(cols, n);
+    return 0;
+}
+
+ERL_NIF_TERM
+decode_columns(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    decode_state ds;
+    ErlNifBinary bin;
+    ERL_NIF_TERM opts, item, out, column;
+    vec_u64_t    offsets;
+    column_t    *cols = NULL;
+    bson_t       bson;
+    bson_iter_t  iter, child;
+    size_t       count, ncols = 0, row, c;
+
+    if(argc != 3 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&ds, env, st);
+    opts = argv[2];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!decode_option(&ds, item)) {
+            return enif_make_badarg(env);
+        }
+    }
+
+    vec_init(&offsets);
+    if(scan_offsets(bin.data, bin.size, &offsets) >= 0 ||
+            vec_push(&offsets, bin.size) != 0) {
+        vec_deinit(&offsets);
+        return make_error(st, env, "badbson");
+    }
+    count = offsets.length - 1;
+
+    if(!get_columns(env, argv[1], count, &cols, &ncols)) {
+        vec_deinit(&offsets);
+        return enif_make_badarg(env);
+    }
+
+    /* one pass over the documents, every field looked up in place */
+    for(row = 0; row < count; row++) {
+        if(!bson_init_static(&bson, bin.data + offsets.data[row],
+                             offsets.data[row + 1] - offsets.data[row])) {
+            out = make_error(st, env, "badbson");
+            goto done;
+        }
+        for(c = 0; c < ncols; c++) {
+            column_t *col = &cols[c];
+
+            if(!bson_iter_init(&iter, &bson) ||
+                    !bson_iter_find_descendant(&iter, col->path, &child)) {
+                if(col->kind == COL_TERMS) {
+                    col->terms[row] = st->atom_undefined;
+                }
+                continue;
+            }
+            if(!put_value(&ds, col, row, count, &child)) {
+                out = make_error(st, env, ds.utf8_error ?
+                                 "invalid_utf8" : "badbson");
+                goto done;
+            }
+        }
+    }
+
+    out = enif_make_new_map(env);
+    for(c = 0; c < ncols; c++) {
+        if(!make_column(&ds, &cols[c], count, &column) ||
+                !enif_make_map_put(env, out, cols[c].name, column, &out)) {
+            out = make_error(st, env, "enomem");
+            break;
+        }
+    }
+
+done:
+    free_columns(cols, ncols);
+    vec_deinit(&offsets);
+    return out;
+}
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+
+#include "cabala.h"
+
+/*
+ * MongoDB canonical type ordering, values of different canonical
+ * types never compare equal:
+ *
+ * MinKey < Undefined < Null < Numbers < String, Symbol < Object < Array
+ *        < BinData < ObjectId < Boolean < Date < Timestamp < Regex
+ *        < DBPointer < Code < CodeWScope < MaxKey
+ *
+ * Numbers are int32, int64, double and Decimal128.
+ */
+int
+canonical_type(bson_type_t type)
+{
+    switch(type) {
+    case BSON_TYPE_MINKEY:
+        return -1;
+    case BSON_TYPE_EOD:
+    case BSON_TYPE_UNDEFINED:
+        return 0;
+    case BSON_TYPE_NULL:
+        return 5;
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128:
+        return 10;
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL:
+        return 15;
+    case BSON_TYPE_DOCUMENT:
+        return 20;
+    case BSON_TYPE_ARRAY:
+        return 25;
+    case BSON_TYPE_BINARY:
+        return 30;
+    case BSON_TYPE_OID:
+        return 35;
+    case BSON_TYPE_BOOL:
+        return 40;
+    case BSON_TYPE_DATE_TIME:
+        return 45;
+    case BSON_TYPE_TIMESTAMP:
+        return 47;
+    case BSON_TYPE_REGEX:
+        return 50;
+    case BSON_TYPE_DBPOINTER:
+        return 55;
+    case BSON_TYPE_CODE:
+        return 60;
+    case BSON_TYPE_CODEWSCOPE:
+        return 65;
+    case BSON_TYPE_MAXKEY:
+        return 127;
+    default:
+        return 0;
+    }
+}
+
+#define CMP(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
+
+static inline int
+compare_bytes(const void *a, size_t alen, const void *b, size_t blen)
+{
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+    if(ret != 0) {
+        return ret < 0 ? -1 : 1;
+    }
+    return CMP(alen, blen);
+}
+
+/*
+ * Compare an integer with a double without losing precision on
+ * either side; NaN sorts before every other number.
+ */
+static int
+compare_int_double(int64_t i, double d)
+{
+    int64_t trunc;
+    double  frac;
+
+    if(d != d) {
+        return 1;
+    }
+    if(d >= 9223372036854775808.0) {
+        return -1;
+    }
+    if(d < -9223372036854775808.0) {
+        return 1;
+    }
+    trunc = (int64_t)d;
+    if(i != trunc) {
+        return CMP(i, trunc);
+    }
+    frac = d - (double)trunc;
+    return frac > 0 ? -1 : (frac < 0 ? 1 : 0);
+}
+
+static inline bool
+is_float(bson_type_t type)
+{
+    return type == BSON_TYPE_DOUBLE || type == BSON_TYPE_DECIMAL128;
+}
+
+static inline int64_t
+int_value(const bson_iter_t *iter)
+{
+    return bson_iter_type(iter) == BSON_TYPE_INT32 ? bson_iter_int32(iter)
+                                                   : bson_iter_int64(iter);
+}
+
+/*
+ * A Decimal128 is compared through the nearest double, so decimals that
+ * only differ past 17 significant digits compare equal, to each other
+ * and to that double. NaN, Infinity and -Infinity keep their meaning.
+ */
+static double
+float_value(const bson_iter_t *iter)
+{
+    bson_decimal128_t dec;
+    char str[BSON_DECIMAL128_STRING];
+
+    if(bson_iter_type(iter) == BSON_TYPE_DOUBLE) {
+        return bson_iter_double(iter);
+    }
+    if(!bson_iter_decimal128(iter, &dec)) {
+        return 0.0;
+    }
+    bson_decimal128_to_string(&dec, str);
+    return strtod(str, NULL);
+}
+
+static int
+compare_numbers(const bson_iter_t *a, const bson_iter_t *b)
+{
+    bool fa = is_float(bson_iter_type(a));
+    bool fb = is_float(bson_iter_type(b));
+
+    if(!fa && !fb) {
+        return CMP(int_value(a), int_value(b));
+    }
+    if(fa && fb) {
+        double da = float_value(a);
+        double db = float_value(b);
+        if(da != da || db != db) {
+            return CMP(db != db, da != da);
+        }
+        return CMP(da, db);
+    }
+    if(fa) {
+        return -compare_int_double(int_value(b), float_value(a));
+    }
+    return compare_int_double(int_value(a), float_value(b));
+}
+
+static const char *
+iter_string(const bson_iter_t *iter, uint32_t *len)
+{
+    if(bson_iter_type(iter) == BSON_TYPE_SYMBOL) {
+        return bson_iter_symbol(iter, len);
+    }
+    return bson_iter_utf8(iter, len);
+}
+
+/*
+ * Compare two documents (or arrays) element by element: canonical
+ * type first, then field name, then value. Both iterators must be
+ * positioned before the first element.
+ */
+int
+compare_document(bson_iter_t *a, bson_iter_t *b)
+{
+    int ret;
+
+    for(;;) {
+        bool na = bson_iter_next(a);
+        bool nb = bson_iter_next(b);
+
+        if(!na || !nb) {
+            return CMP(na, nb);
+        }
+        ret = CMP(canonical_type(bson_iter_type(a)),
+                  canonical_type(bson_iter_type(b)));
+        if(ret != 0) {
+            return ret;
+        }
+        ret = strcmp(bson_iter_key(a), bson_iter_key(b));
+        if(ret != 0) {
+            return ret < 0 ? -1 : 1;
+        }
+        ret = compare_iter(a, b);
+        if(ret != 0) {
+            return ret;
+        }
+    }
+}
+
+int
+compare_iter(const bson_iter_t *a, const bson_iter_t *b)
+{
+    int ret = CMP(canonical_type(bson_iter_type(a)),
+                  canonical_type(bson_iter_type(b)));
+    if(ret != 0) {
+        return ret;
+    }
+
+    switch(bson_iter_type(a)) {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128:
+        return compare_numbers(a, b);
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL: {
+        uint32_t alen, blen;
+        const char *as = iter_string(a, &alen);
+        const char *bs = iter_string(b, &blen);
+        return compare_bytes(as, alen, bs, blen);
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY: {
+        bson_iter_t ca, cb;
+        if(!bson_iter_recurse(a, &ca) || !bson_iter_recurse(b, &cb)) {
+            return 0;
+        }
+        return compare_document(&ca, &cb);
+    }
+    case BSON_TYPE_BINARY: {
+        bson_subtype_t asub, bsub;
+        uint32_t alen, blen;
+        const uint8_t *adata, *bdata;
+
+        bson_iter_binary(a, &asub, &alen, &adata);
+        bson_iter_binary(b, &bsub, &blen, &bdata);
+        if(alen != blen) {
+            return CMP(alen, blen);
+        }
+        if(asub != bsub) {
+            return CMP(asub, bsub);
+        }
+        return compare_bytes(adata, alen, bdata, blen);
+    }
+    case BSON_TYPE_OID:
+        return compare_bytes(bson_iter_oid(a)->bytes, 12,
+                             bson_iter_oid(b)->bytes, 12);
+    case BSON_TYPE_BOOL:
+        return CMP(bson_iter_bool(a), bson_iter_bool(b));
+    case BSON_TYPE_DATE_TIME:
+        return CMP(bson_iter_date_time(a), bson_iter_date_time(b));
+    case BSON_TYPE_TIMESTAMP: {
+        uint32_t at, ai, bt, bi;
+        bson_iter_timestamp(a, &at, &ai);
+        bson_iter_timestamp(b, &bt, &bi);
+        return at != bt ? CMP(at, bt) : CMP(ai, bi);
+    }
+    case BSON_TYPE_REGEX: {
+        const char *aopts, *bopts;
+        const char *are = bson_iter_regex(a, &aopts);
+        const char *bre = bson_iter_regex(b, &bopts);
+        ret = strcmp(are, bre);
+        if(ret == 0) {
+            ret = strcmp(aopts, bopts);
+        }
+        return CMP(ret, 0);
+    }
+    case BSON_TYPE_DBPOINTER: {
+        uint32_t alen, blen;
+        const char *acol, *bcol;
+        const bson_oid_t *aoid, *boid;
+
+        bson_iter_dbpointer(a, &alen, &acol, &aoid);
+        bson_iter_dbpointer(b, &blen, &bcol, &boid);
+        ret = compare_bytes(acol, alen, bcol, blen);
+        if(ret == 0) {
+            ret = compare_bytes(aoid->bytes, 12, boid->bytes, 12);
+        }
+        return ret;
+    }
+    case BSON_TYPE_CODE: {
+        uint32_t alen, blen;
+        const char *acode = bson_iter_code(a, &alen);
+        const char *bcode = bson_iter_code(b, &blen);
+        return compare_bytes(acode, alen, bcode, blen);
+    }
+    case BSON_TYPE_CODEWSCOPE: {
+        uint32_t alen, blen, ascope_len, bscope_len;
+        const uint8_t *ascope, *bscope;
+        const char *acode = bson_iter_codewscope(a, &alen, &ascope_len, &ascope);
+        const char *bcode = bson_iter_codewscope(b, &blen, &bscope_len, &bscope);
+        bson_t as, bs;
+        bson_iter_t ca, cb;
+
+        ret = compare_bytes(acode, alen, bcode, blen);
+        if(ret != 0) {
+            return ret;
+        }
+        if(!bson_init_static(&as, ascope, ascope_len) ||
+                !bson_init_static(&bs, bscope, bscope_len) ||
+                !bson_iter_init(&ca, &as) ||
+                !bson_iter_init(&cb, &bs)) {
+            return 0;
+        }
+        return compare_document(&ca, &cb);
+    }
+    default:
+        /* MinKey, MaxKey, Null and Undefined carry no value */
+        return 0;
+    }
+}
+
+/*
+ * Visit every value reachable through a dotted path, descending into
+ * arrays the way MongoDB does: the array itself and each of its
+ * elements are candidates, and a path component is applied to every
+ * sub-document of an array. Returns true as soon as `fn` does. A
+ * corrupt document met on the way sets *error, when error is not NULL.
+ */
+bool
+walk_path(bson_iter_t iter, const char *path, path_fn fn, void *data,
+          bool *found, bool *error)
+{
+    const char *rest = strchr(path, '.');
+    size_t len = rest ? (size_t)(rest - path) : strlen(path);
+    bson_iter_t child, sub;
+
+    while(bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+
+        if(strncmp(key, path, len) != 0 || key[len] != '\0') {
+            continue;
+        }
+
+        if(!rest) {
+            *found = true;
+            if(fn(&iter, data)) {
+                return true;
+            }
+            if(BSON_ITER_HOLDS_ARRAY(&iter) && bson_iter_recurse(&iter, &child)) {
+                while(bson_iter_next(&child)) {
+                    if(fn(&child, data)) {
+                        return true;
+                    }
+                }
+                if(child.err_off && error) {
+                    *error = true;
+                }
+            }
+            return false;
+        }
+
+        if(BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+            return bson_iter_recurse(&iter, &child) &&
+                walk_path(child, rest + 1, fn, data, found, error);
+        }
+        if(BSON_ITER_HOLDS_ARRAY(&iter) && bson_iter_recurse(&iter, &child)) {
+            /* numeric components address array elements by key */
+            if(rest[1] >= '0' && rest[1] <= '9' &&
+                    walk_path(child, rest + 1, fn, data, found, error)) {
+                return true;
+            }
+            while(bson_iter_next(&child)) {
+                if(BSON_ITER_HOLDS_DOCUMENT(&child) &&
+                        bson_iter_recurse(&child, &sub) &&
+                        walk_path(sub, rest + 1, fn, data, found, error)) {
+                    return true;
+                }
+            }
+            if(child.err_off && error) {
+                *error = true;
+            }
+        }
+        return false;
+    }
+    if(iter.err_off && error) {
+        *error = true;
+    }
+    return false;
+}
@@ -0,0 +1,174 @@
+#include <zlib.h>
+#include <zstd.h>
+
+#include "cabala.h"
+
+#define MSG_HEADER_LEN      16
+#define OP_COMPRESSED       2012
+
+/* OP_COMPRESSED prefix: originalOpcode, uncompressedSize, compressorId */
+#define COMPRESSED_HEADER_LEN   (MSG_HEADER_LEN + 9)
+
+/* the server's maxMessageSizeBytes, caps what a reply may inflate to */
+#define MAX_MESSAGE_SIZE    48000000
+
+static inline int32_t
+read_int32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return (int32_t)BSON_UINT32_FROM_LE(v);
+}
+
+static inline void
+write_int32(uint8_t *p, int32_t v)
+{
+    uint32_t le = BSON_UINT32_TO_LE((uint32_t)v);
+    memcpy(p, &le, sizeof le);
+}
+
+static int
+deflate_into(buffer_t *out, const uint8_t *src, size_t len, int level)
+{
+    uLongf dst_len = compressBound(len);
+
+    if(!buffer_reserve(out, dst_len)) {
+        return 0;
+    }
+    if(level < 0) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    if(compress2(out->bin.data + out->len, &dst_len, src, len, level) != Z_OK) {
+        return 0;
+    }
+    out->len += dst_len;
+    return 1;
+}
+
+static int
+zstd_into(buffer_t *out, const uint8_t *src, size_t len, int level)
+{
+    size_t dst_len = ZSTD_compressBound(len);
+
+    if(!buffer_reserve(out, dst_len)) {
+        return 0;
+    }
+    if(level < 0) {
+        level = 0;      // library default
+    }
+    dst_len = ZSTD_compress(out->bin.data + out->len, dst_len, src, len, level);
+    if(ZSTD_isError(dst_len)) {
+        return 0;
+    }
+    out->len += dst_len;
+    return 1;
+}
+
+/*
+ * Wrap a complete message in OP_COMPRESSED. The header keeps the
+ * request and response ids of the original, everything after the
+ * header is compressed straight into the output buffer.
+ */
+int
+compress_frame(const uint8_t *frame, size_t len, int compressor, int level,
+               buffer_t *out)
+{
+    const uint8_t *body = frame + MSG_HEADER_LEN;
+    size_t body_len = len - MSG_HEADER_LEN;
+    uint8_t prefix[COMPRESSED_HEADER_LEN];
+    int ret;
+
+    if(len < MSG_HEADER_LEN) {
+        return 0;
+    }
+
+    memcpy(prefix, frame, MSG_HEADER_LEN);
+    write_int32(prefix + 12, OP_COMPRESSED);
+    memcpy(prefix + 16, frame + 12, 4);
+    write_int32(prefix + 20, (int32_t)body_len);
+    prefix[24] = (uint8_t)compressor;
+
+    if(!buffer_append(out, prefix, sizeof prefix)) {
+        return 0;
+    }
+    switch(compressor) {
+        case COMPRESSOR_ZLIB:
+            ret = deflate_into(out, body, body_len, level);
+            break;
+        case COMPRESSOR_ZSTD:
+            ret = zstd_into(out, body, body_len, level);
+            break;
+        default:
+            ret = 0;
+            break;
+    }
+    if(!ret) {
+        return 0;
+    }
+    buffer_set_int32(out, 0, (int32_t)out->len);
+    return 1;
+}
+
+/*
+ * Unwrap an OP_COMPRESSED message into `out`, a fresh binary holding
+ * the original header (with its own opcode) followed by the inflated
+ * body. Returns NULL on success or the error reason.
+ */
+const char *
+decompress_frame(const uint8_t *frame, size_t len, ErlNifBinary *out)
+{
+    const uint8_t *src = frame + COMPRESSED_HEADER_LEN;
+    size_t src_len = len - COMPRESSED_HEADER_LEN;
+    int32_t size;
+    size_t got;
+    uLongf dst_len;
+
+    if(len < COMPRESSED_HEADER_LEN || (size_t)read_int32(frame) != len) {
+        return "badframe";
+    }
+    size = read_int32(frame + 20);
+    if(size < 0 || size > MAX_MESSAGE_SIZE) {
+        return "badframe";
+    }
+    if(!enif_alloc_binary(MSG_HEADER_LEN + size, out)) {
+        return "internal_error";
+    }
+    memcpy(out->data, frame, 12);
+    memcpy(out->data + 12, frame + 16, 4);
+    write_int32(out->data, MSG_HEADER_LEN + size);
+
+    switch(frame[24]) {
+        case COMPRESSOR_NOOP:
+            got = src_len;
+            if(got == (size_t)size) {
+                memcpy(out->data + MSG_HEADER_LEN, src, got);
+            }
+            break;
+        case COMPRESSOR_ZLIB:
+            dst_len = size;
+            if(uncompress(out->data + MSG_HEADER_LEN, &dst_len,
+                          src, src_len) != Z_OK) {
+                goto failure;
+            }
+            got = dst_len;
+            break;
+        case COMPRESSOR_ZSTD:
+            got = ZSTD_decompress(out->data + MSG_HEADER_LEN, size,
+                                  src, src_len);
+            if(ZSTD_isError(got)) {
+                goto failure;
+            }
+            break;
+        default:
+            enif_release_binary(out);
+            return "badcompressor";
+    }
+    if(got != (size_t)size) {
+        goto failure;
+    }
+    return NULL;
+
+failure:
+    enif_release_binary(out);
+    return "baddata";
+}
@@ -0,0 +1,110 @@
+#include "cabala.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+#ifdef CRC32C_HW
+static int      crc32c_hw = 0;
+#endif
+
+/* slice-by-8 tables for the portable path */
+void
+crc32c_init(void)
+{
+    uint32_t crc;
+    int n, k;
+
+    for(n = 0; n < 256; n++) {
+        crc = n;
+        for(k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for(n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for(k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+#ifdef CRC32C_HW
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while(len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while(len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        v = BSON_UINT64_FROM_LE(v) ^ crc;
+        crc = crc32c_table[7][v & 0xff] ^
+              crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^
+              crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^
+              crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^
+              crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while(len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+        len--;
+    }
+    while(len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while(len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+uint32_t
+crc32c(const void *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+#ifdef CRC32C_HW
+    if(crc32c_hw) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
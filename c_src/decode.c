@@ -3,17 +3,6 @@
 
 #define MAX_DEPTHS 100
 
-typedef struct {
-    ErlNifEnv *env;
-    cabala_st *st;
-
-    vec_term_t *vec;
-    int depth;
-
-    int  return_maps;
-    bool keys;
-} decode_state;
-
 static bool decode_visit_document(const bson_iter_t *iter,
                                   const char        *key,
                                   const bson_t      *v_document,
@@ -38,16 +27,80 @@ init_state(decode_state *ds, ErlNifEnv *env, cabala_st *st)
     ds->env = env;
     ds->st = st;
     ds->return_maps = 0;
+    ds->packed_arrays = 0;
+    ds->oid_hex = 0;
+    ds->uuid_string = 0;
+    ds->validate_utf8 = 0;
+    ds->utf8_error = 0;
     ds->keys = true;
     ds->depth = 0;
 }
 
+/*
+ * Options shared by the decoders: return_maps, packed_arrays or
+ * {packed_arrays, Bool}, {oid_format, hex | binary} and
+ * {uuid_format, string | binary}. Returns 0 for anything else.
+ */
+int
+decode_option(decode_state *ds, ERL_NIF_TERM opt)
+{
+    cabala_st *st = ds->st;
+    const ERL_NIF_TERM *tuple;
+    int arity;
+
+    if(enif_compare(opt, st->atom_return_maps) == 0) {
+        ds->return_maps = 1;
+        return 1;
+    }
+    if(enif_compare(opt, st->atom_packed_arrays) == 0) {
+        ds->packed_arrays = 1;
+        return 1;
+    }
+    if(!enif_get_tuple(ds->env, opt, &arity, &tuple) || arity != 2) {
+        return 0;
+    }
+    if(enif_compare(tuple[0], st->atom_packed_arrays) == 0) {
+        ds->packed_arrays = enif_compare(tuple[1], st->atom_true) == 0;
+        return 1;
+    }
+    if(enif_compare(tuple[0], st->atom_validate_utf8) == 0) {
+        ds->validate_utf8 = enif_compare(tuple[1], st->atom_true) == 0;
+        return 1;
+    }
+    if(enif_compare(tuple[0], st->atom_oid_format) == 0) {
+        if(enif_compare(tuple[1], st->atom_hex) == 0) {
+            ds->oid_hex = 1;
+        } else if(enif_compare(tuple[1], st->atom_binary) == 0) {
+            ds->oid_hex = 0;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    if(enif_compare(tuple[0], st->atom_uuid_format) == 0) {
+        if(enif_compare(tuple[1], st->atom_string) == 0) {
+            ds->uuid_string = 1;
+        } else if(enif_compare(tuple[1], st->atom_binary) == 0) {
+            ds->uuid_string = 0;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
 void
 init_child_state(decode_state *ds, decode_state *child)
 {
     child->env = ds->env;
     child->st = ds->st;
     child->return_maps = ds->return_maps;
+    child->packed_arrays = ds->packed_arrays;
+    child->oid_hex = ds->oid_hex;
+    child->uuid_string = ds->uuid_string;
+    child->validate_utf8 = ds->validate_utf8;
+    child->utf8_error = 0;
 }
 
 ERL_NIF_TERM
@@ -100,9 +153,23 @@ decode_visit_utf8(const bson_iter_t *iter,
 {
     decode_state *ds = data;
     ERL_NIF_TERM  out;
+    ErlNifBinary  bin;
 
     LOG("decode visit utf8, key: %s\r\n", key);
 
+    /* checked in the same pass that copies the bytes into the binary */
+    if(ds->validate_utf8) {
+        if(!enif_alloc_binary(v_utf8_len, &bin)) {
+            return true;
+        }
+        if(!utf8_copy(bin.data, (const uint8_t *)v_utf8, v_utf8_len)) {
+            enif_release_binary(&bin);
+            ds->utf8_error = 1;
+            return true;
+        }
+        vec_push(ds->vec, enif_make_binary(ds->env, &bin));
+        return false;
+    }
     if(!make_binary(ds->env, &out, v_utf8, v_utf8_len)) {
         LOG("decode visit vtf8, make binary error: %d \r\n", (int)v_utf8_len);
         return true;
@@ -179,7 +246,13 @@ decode_visit_oid(const bson_iter_t *iter,
 
     bson_return_val_if_fail(v_oid, true);
 
-    if(!make_binary(ds->env, &out, v_oid->bytes, 12)) {
+    if(ds->oid_hex) {
+        char *hex = (char *)enif_make_new_binary(ds->env, 24, &out);
+        if(!hex) {
+            return true;
+        }
+        oid_to_hex(v_oid->bytes, hex);
+    } else if(!make_binary(ds->env, &out, v_oid->bytes, 12)) {
         return true;
     }
     out = enif_make_tuple2(ds->env, ds->st->atom_s_oid, out);
@@ -200,7 +273,14 @@ decode_visit_binary(const bson_iter_t  *iter,
     ERL_NIF_TERM type, binary, out;
 
     type = enif_make_int(ds->env, v_subtype);
-    if(!make_binary(ds->env, &binary, v_binary, v_binary_len)) {
+    if(ds->uuid_string && v_subtype == BSON_SUBTYPE_UUID &&
+            v_binary_len == 16) {
+        char *str = (char *)enif_make_new_binary(ds->env, 36, &binary);
+        if(!str) {
+            return true;
+        }
+        uuid_to_string(v_binary, str);
+    } else if(!make_binary(ds->env, &binary, v_binary, v_binary_len)) {
         return true;
     }
     out = enif_make_tuple4(ds->env, 
@@ -468,6 +548,7 @@ decode_visit_codewscope(const bson_iter_t *iter,
     cs.depth = ds->depth;
     cs.keys = true;
     if(!iter_bson(v_scope, &scope, &cs)) {
+        ds->utf8_error = cs.utf8_error;
         return true;
     }
 
@@ -503,12 +584,102 @@ decode_visit_document(const bson_iter_t *iter,
     cs.depth = ds->depth + 1;
 
     if(!iter_bson(v_document, &out, &cs)) {
+        ds->utf8_error = cs.utf8_error;
         return true;
     }
     vec_push(ds->vec, out);
     return false;
 }
 
+/*
+ * Copy the values of an array whose elements all have the same numeric
+ * type into a native endian binary, stepping over each element's type
+ * byte and index key. Returns 0 when the array is empty or mixed.
+ */
+static int
+pack_array(decode_state *ds, const bson_t *v_array, ERL_NIF_TERM *out)
+{
+    const uint8_t *data = bson_get_data(v_array);
+    const uint8_t *p = data + 4;
+    const uint8_t *end = data + v_array->len - 1;
+    ErlNifBinary   bin;
+    ERL_NIF_TERM   tag;
+    uint8_t        type = *p;
+    size_t         width, count = 0;
+
+    switch(type) {
+        case BSON_TYPE_DOUBLE:
+            tag = ds->st->atom_s_f64;
+            width = 8;
+            break;
+        case BSON_TYPE_INT32:
+            tag = ds->st->atom_s_i32;
+            width = 4;
+            break;
+        case BSON_TYPE_INT64:
+            tag = ds->st->atom_s_i64;
+            width = 8;
+            break;
+        default:
+            return 0;
+    }
+
+    /* the shortest element is a type byte, a one digit key and NUL */
+    if(!enif_alloc_binary((v_array->len - 5) / (2 + width) * width, &bin)) {
+        return 0;
+    }
+    while(p < end) {
+        const uint8_t *key = p + 1;
+
+        if(*p != type) {
+            goto fallback;
+        }
+        while(key < end && *key) {
+            key++;
+        }
+        if((size_t)(end - key) < 1 + width) {
+            goto fallback;
+        }
+        memcpy(bin.data + count * width, key + 1, width);
+        p = key + 1 + width;
+        count++;
+    }
+    if(p != end) {
+        goto fallback;
+    }
+
+#if BSON_BYTE_ORDER == BSON_BIG_ENDIAN
+    {
+        size_t i;
+        for(i = 0; i < count; i++) {
+            uint8_t *v = bin.data + i * width;
+            if(width == 8) {
+                uint64_t x;
+                memcpy(&x, v, 8);
+                x = BSON_UINT64_FROM_LE(x);
+                memcpy(v, &x, 8);
+            } else {
+                uint32_t x;
+                memcpy(&x, v, 4);
+                x = BSON_UINT32_FROM_LE(x);
+                memcpy(v, &x, 4);
+            }
+        }
+    }
+#endif
+
+    if(count * width != bin.size &&
+            !enif_realloc_binary(&bin, count * width)) {
+        goto fallback;
+    }
+    *out = enif_make_tuple2(ds->env, tag, enif_make_binary(ds->env, &bin));
+    return 1;
+
+fallback:
+    enif_release_binary(&bin);
+    return 0;
+}
+
 static bool
 decode_visit_array(const bson_iter_t *iter,
                    const char        *key,
@@ -527,6 +698,11 @@ decode_visit_array(const bson_iter_t *iter,
         return true;
     }
 
+    if(ds->packed_arrays && pack_array(ds, v_array, &out)) {
+        vec_push(ds->vec, out);
+        return false;
+    }
+
     init_child_state(ds, &cs);
     cs.keys  = false;
     cs.depth = ds->depth + 1; 
@@ -538,6 +714,7 @@ decode_visit_array(const bson_iter_t *iter,
 
     if(bson_iter_visit_all(&child, &decode_visitors, &cs) ||
             child.err_off) {
+        ds->utf8_error = cs.utf8_error;
         vec_deinit(&vec);
         return true;
     }
@@ -548,6 +725,115 @@ decode_visit_array(const bson_iter_t *iter,
     return false;
 }
 
+/*
+ * Decode the single value under iter with the same visitors that
+ * iter_bson uses for whole documents.
+ */
+int
+decode_value(decode_state *ds, const bson_iter_t *iter, ERL_NIF_TERM *out)
+{
+    const char   *key = bson_iter_key(iter);
+    vec_term_t    vec;
+    bson_t        doc;
+    const uint8_t *data;
+    const char   *str, *opts;
+    const bson_oid_t *oid;
+    bson_subtype_t subtype;
+    uint32_t      len, scope_len, ts, inc;
+    bool          err;
+
+    vec_init(&vec);
+    ds->vec = &vec;
+
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_DOUBLE:
+        err = decode_visit_double(iter, key, bson_iter_double(iter), ds);
+        break;
+    case BSON_TYPE_UTF8:
+        str = bson_iter_utf8(iter, &len);
+        err = decode_visit_utf8(iter, key, len, str, ds);
+        break;
+    case BSON_TYPE_DOCUMENT:
+        bson_iter_document(iter, &len, &data);
+        err = !bson_init_static(&doc, data, len) ||
+              decode_visit_document(iter, key, &doc, ds);
+        break;
+    case BSON_TYPE_ARRAY:
+        bson_iter_array(iter, &len, &data);
+        err = !bson_init_static(&doc, data, len) ||
+              decode_visit_array(iter, key, &doc, ds);
+        break;
+    case BSON_TYPE_BINARY:
+        bson_iter_binary(iter, &subtype, &len, &data);
+        err = decode_visit_binary(iter, key, subtype, len, data, ds);
+        break;
+    case BSON_TYPE_UNDEFINED:
+        err = decode_visit_undefined(iter, key, ds);
+        break;
+    case BSON_TYPE_OID:
+        err = decode_visit_oid(iter, key, bson_iter_oid(iter), ds);
+        break;
+    case BSON_TYPE_BOOL:
+        err = decode_visit_bool(iter, key, bson_iter_bool(iter), ds);
+        break;
+    case BSON_TYPE_DATE_TIME:
+        err = decode_visit_date_time(iter, key, bson_iter_date_time(iter), ds);
+        break;
+    case BSON_TYPE_NULL:
+        err = decode_visit_null(iter, key, ds);
+        break;
+    case BSON_TYPE_REGEX:
+        str = bson_iter_regex(iter, &opts);
+        err = decode_visit_regex(iter, key, str, opts, ds);
+        break;
+    case BSON_TYPE_DBPOINTER:
+        bson_iter_dbpointer(iter, &len, &str, &oid);
+        err = decode_visit_dbpointer(iter, key, len, str, oid, ds);
+        break;
+    case BSON_TYPE_CODE:
+        str = bson_iter_code(iter, &len);
+        err = decode_visit_code(iter, key, len, str, ds);
+        break;
+    case BSON_TYPE_SYMBOL:
+        str = bson_iter_symbol(iter, &len);
+        err = decode_visit_symbol(iter, key, len, str, ds);
+        break;
+    case BSON_TYPE_CODEWSCOPE:
+        str = bson_iter_codewscope(iter, &len, &scope_len, &data);
+        err = !bson_init_static(&doc, data, scope_len) ||
+              decode_visit_codewscope(iter, key, len, str, &doc, ds);
+        break;
+    case BSON_TYPE_INT32:
+        err = decode_visit_int32(iter, key, bson_iter_int32(iter), ds);
+        break;
+    case BSON_TYPE_TIMESTAMP:
+        bson_iter_timestamp(iter, &ts, &inc);
+        err = decode_visit_timestamp(iter, key, ts, inc, ds);
+        break;
+    case BSON_TYPE_INT64:
+        err = decode_visit_int64(iter, key, bson_iter_int64(iter), ds);
+        break;
+    case BSON_TYPE_MAXKEY:
+        err = decode_visit_maxkey(iter, key, ds);
+        break;
+    case BSON_TYPE_MINKEY:
+        err = decode_visit_minkey(iter, key, ds);
+        break;
+    default:
+        err = true;
+        break;
+    }
+
+    if(!err && vec.length == 1) {
+        *out = vec.data[0];
+    } else {
+        err = true;
+    }
+    vec_deinit(&vec);
+    ds->vec = NULL;
+    return !err;
+}
+
 ERL_NIF_TERM 
 decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
@@ -568,9 +854,7 @@ decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     /* parse decode options */
     while(enif_get_list_cell(env, opts, &out, &opts)) {
-        if(enif_compare(out, st->atom_return_maps) == 0) {
-            ds.return_maps = 1;
-        } else {
+        if(!decode_option(&ds, out)) {
             return enif_make_badarg(env);
         }
     }
@@ -591,8 +875,122 @@ decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     LOG("decode begin, return_maps: %d\r\n", ds.return_maps);
 
     if(!iter_bson(bson, &out, &ds)) {
-        out = make_error(st, env, "internal_error");
+        out = make_error(st, env, ds.utf8_error ?
+                         "invalid_utf8" : "internal_error");
     }
     bson_destroy(bson);
     return out;
+}
+
+/*
+ * Decode a document into a tuple with one element per schema field, in
+ * schema order, prefixed with the record name when the schema has one.
+ * Each key is looked up in the schema's hash, so no key terms are made
+ * for known fields. Options: return_maps for nested documents and
+ * {unknown, ignore | collect}; collect returns {Record, Unknown} with
+ * the other fields as a document.
+ */
+ERL_NIF_TERM
+decode_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    schema_res   *res;
+    decode_state  ds;
+    ErlNifBinary  bin;
+    bson_t        bson;
+    bson_iter_t   iter;
+    vec_term_t    unknown;
+    ERL_NIF_TERM  opts, item, key, value, extra, out, *slots;
+    uint8_t      *seen;
+    const ERL_NIF_TERM *tuple;
+    size_t        i, skip;
+    int           arity, slot, collect = 0;
+
+    if(argc != 3 ||
+            !enif_get_resource(env, argv[0], st->res_schema, (void **)&res) ||
+            !enif_inspect_binary(env, argv[1], &bin)) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&ds, env, st);
+    opts = argv[2];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(decode_option(&ds, item)) {
+            continue;
+        } else if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_unknown) == 0 &&
+                (enif_compare(tuple[1], st->atom_ignore) == 0 ||
+                 enif_compare(tuple[1], st->atom_collect) == 0)) {
+            collect = enif_compare(tuple[1], st->atom_collect) == 0;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    if(!bson_init_static(&bson, bin.data, bin.size) ||
+            !bson_iter_init(&iter, &bson)) {
+        return make_error(st, env, "badbson");
+    }
+
+    skip = res->has_record ? 1 : 0;
+    slots = enif_alloc((sizeof(ERL_NIF_TERM) + 1) * (res->count + 1));
+    if(slots == NULL) {
+        return make_error(st, env, "internal_error");
+    }
+    seen = (uint8_t *)(slots + res->count + 1);
+    memset(seen, 0, res->count + 1);
+    vec_init(&unknown);
+
+    while(bson_iter_next(&iter)) {
+        const char *k = bson_iter_key(&iter);
+        size_t      len = strlen(k);
+
+        slot = schema_lookup(res, k, len);
+        if(slot >= 0) {
+            if(!decode_value(&ds, &iter, &slots[slot + skip])) {
+                out = make_error(st, env, ds.utf8_error ?
+                                 "invalid_utf8" : "badbson");
+                goto done;
+            }
+            seen[slot] = 1;
+        } else if(collect) {
+            if(!make_binary(env, &key, k, len) ||
+                    !decode_value(&ds, &iter, &value) ||
+                    vec_push(&unknown, key) != 0 ||
+                    vec_push(&unknown, value) != 0) {
+                out = make_error(st, env, ds.utf8_error ?
+                                 "invalid_utf8" : "badbson");
+                goto done;
+            }
+        }
+    }
+    if(iter.err_off) {
+        out = make_error(st, env, "badbson");
+        goto done;
+    }
+
+    /* fields not in the document */
+    for(i = 0; i < res->count; i++) {
+        if(!seen[i]) {
+            slots[i + skip] = res->defaults ?
+                enif_make_copy(env, res->defaults[i]) : st->atom_undefined;
+        }
+    }
+    if(res->has_record) {
+        slots[0] = enif_make_copy(env, res->record);
+    }
+    out = enif_make_tuple_from_array(env, slots, res->count + skip);
+
+    if(collect) {
+        if(!make_document(env, &unknown, &extra, ds.return_maps)) {
+            out = make_error(st, env, "internal_error");
+            goto done;
+        }
+        out = enif_make_tuple2(env, out, extra);
+    }
+
+done:
+    vec_deinit(&unknown);
+    enif_free(slots);
+    return out;
 }
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include "cabala.h"
+
+#define MAX_DEPTHS 100
+
+typedef struct {
+    bson_t     set;
+    bson_t     unset;
+    vec_char_t path;        // dotted path of the current document
+    int        depth;
+    bool       nomem;       // the path could not grow
+} diff_state;
+
+static int diff_doc(diff_state *ds, bson_iter_t *old_root,
+                    bson_iter_t *new_root);
+
+/* the path stays NUL terminated, the NUL is not counted in its length */
+static inline int
+path_push(diff_state *ds, const char *key)
+{
+    int len = (int)strlen(key);
+    int want;
+
+    if(ds->path.length > 0 && vec_push(&ds->path, '.') != 0) {
+        goto nomem;
+    }
+    want = ds->path.length + len;
+    vec_pusharr(&ds->path, key, len);
+    if(ds->path.length != want || vec_push(&ds->path, '\0') != 0) {
+        goto nomem;
+    }
+    ds->path.length--;
+    return 1;
+
+nomem:
+    ds->nomem = true;
+    return 0;
+}
+
+static inline void
+path_pop(diff_state *ds, int length)
+{
+    vec_truncate(&ds->path, length);
+}
+
+/* whole element bytes: type, key and value */
+static inline bool
+same_bytes(const bson_iter_t *a, const bson_iter_t *b)
+{
+    uint32_t alen = a->next_off - a->off;
+    uint32_t blen = b->next_off - b->off;
+
+    return alen == blen && memcmp(a->raw + a->off, b->raw + b->off, alen) == 0;
+}
+
+/*
+ * Find `key` in the document of `root`, trying the element right after
+ * `cursor` first so that documents with the same field order are
+ * walked in lockstep.
+ */
+static bool
+find_key(const bson_iter_t *root, bson_iter_t *cursor, const char *key,
+         bson_iter_t *out)
+{
+    bson_iter_t next = *cursor;
+
+    if(bson_iter_next(&next) && strcmp(bson_iter_key(&next), key) == 0) {
+        *cursor = next;
+        *out = next;
+        return true;
+    }
+
+    *out = *root;
+    if(bson_iter_find(out, key)) {
+        *cursor = *out;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * update paths cannot address keys containing dots or starting with $,
+ * iter is positioned before the first element of the document
+ */
+static bool
+plain_root(bson_iter_t iter)
+{
+    const char *key;
+
+    while(bson_iter_next(&iter)) {
+        key = bson_iter_key(&iter);
+        if(key[0] == '$' || strchr(key, '.')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+plain_keys(const bson_iter_t *doc)
+{
+    bson_iter_t iter;
+
+    return bson_iter_recurse(doc, &iter) && plain_root(iter);
+}
+
+static int
+append_set(diff_state *ds, const bson_iter_t *val)
+{
+    int length = ds->path.length;
+    int ret;
+
+    if(!path_push(ds, bson_iter_key(val))) {
+        return 0;
+    }
+    ret = bson_append_iter(&ds->set, ds->path.data, ds->path.length, val);
+    path_pop(ds, length);
+    return ret;
+}
+
+static int
+append_unset(diff_state *ds, const char *key)
+{
+    int length = ds->path.length;
+    int ret;
+
+    if(!path_push(ds, key)) {
+        return 0;
+    }
+    ret = bson_append_utf8(&ds->unset, ds->path.data, ds->path.length, "", 0);
+    path_pop(ds, length);
+    return ret;
+}
+
+static int
+diff_value(diff_state *ds, const bson_iter_t *old_val,
+           const bson_iter_t *new_val)
+{
+    bson_iter_t old_child, new_child;
+    int length = ds->path.length;
+    int ret;
+
+    if(same_bytes(old_val, new_val)) {
+        return 1;
+    }
+    if(!BSON_ITER_HOLDS_DOCUMENT(old_val) || !BSON_ITER_HOLDS_DOCUMENT(new_val) ||
+            ds->depth >= MAX_DEPTHS ||
+            !plain_keys(old_val) || !plain_keys(new_val)) {
+        return append_set(ds, new_val);
+    }
+
+    if(!bson_iter_recurse(old_val, &old_child) ||
+            !bson_iter_recurse(new_val, &new_child)) {
+        return 0;
+    }
+    if(!path_push(ds, bson_iter_key(new_val))) {
+        return 0;
+    }
+    ds->depth++;
+    ret = diff_doc(ds, &old_child, &new_child);
+    ds->depth--;
+    path_pop(ds, length);
+    return ret;
+}
+
+/*
+ * Walk both documents: changed or added fields go to $set, nested
+ * documents are diffed recursively unless their bytes are identical,
+ * fields only present in the old document go to $unset. Both iterators
+ * must be positioned before the first element.
+ */
+static int
+diff_doc(diff_state *ds, bson_iter_t *old_root, bson_iter_t *new_root)
+{
+    bson_iter_t old_cursor, new_cursor;
+    bson_iter_t iter, found;
+
+    old_cursor = *old_root;
+    iter = *new_root;
+    while(bson_iter_next(&iter)) {
+        if(find_key(old_root, &old_cursor, bson_iter_key(&iter), &found)) {
+            if(!diff_value(ds, &found, &iter)) {
+                return 0;
+            }
+        } else if(!append_set(ds, &iter)) {
+            return 0;
+        }
+    }
+    if(iter.err_off) {
+        return 0;
+    }
+
+    new_cursor = *new_root;
+    iter = *old_root;
+    while(bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+
+        if(!find_key(new_root, &new_cursor, key, &found) &&
+                !append_unset(ds, key)) {
+            return 0;
+        }
+    }
+    return iter.err_off == 0;
+}
+
+static int
+make_update(diff_state *ds, bson_t *out)
+{
+    if(!bson_empty(&ds->set) &&
+            !bson_append_document(out, "$set", 4, &ds->set)) {
+        return 0;
+    }
+    if(!bson_empty(&ds->unset) &&
+            !bson_append_document(out, "$unset", 6, &ds->unset)) {
+        return 0;
+    }
+    return 1;
+}
+
+ERL_NIF_TERM
+diff(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ErlNifBinary old_bin, new_bin;
+    bson_t       old_bson, new_bson, update;
+    bson_iter_t  old_doc, new_doc;
+    diff_state   ds;
+    decode_state dec;
+    const bson_t *result = &update;
+    ERL_NIF_TERM opts, item, out;
+    bool         terms = false;
+
+    if(argc != 3) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_inspect_binary(env, argv[0], &old_bin) ||
+            !enif_inspect_binary(env, argv[1], &new_bin)) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&dec, env, st);
+    opts = argv[2];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_terms) == 0) {
+            terms = true;
+        } else if(enif_compare(item, st->atom_return_maps) == 0) {
+            terms = true;
+            dec.return_maps = 1;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    if(!bson_init_static(&old_bson, old_bin.data, old_bin.size) ||
+            !bson_init_static(&new_bson, new_bin.data, new_bin.size) ||
+            !bson_iter_init(&old_doc, &old_bson) ||
+            !bson_iter_init(&new_doc, &new_bson)) {
+        return make_error(st, env, "badbson");
+    }
+
+    bson_init(&ds.set);
+    bson_init(&ds.unset);
+    bson_init(&update);
+    vec_init(&ds.path);
+    ds.depth = 0;
+    ds.nomem = false;
+
+    /* a top-level key no update path can name: replace the whole document */
+    if(!plain_root(old_doc) || !plain_root(new_doc)) {
+        result = &new_bson;
+    } else if(!diff_doc(&ds, &old_doc, &new_doc) ||
+            !make_update(&ds, &update)) {
+        result = NULL;
+    }
+
+    if(!result) {
+        out = make_error(st, env, ds.nomem ? "internal_error" : "badbson");
+    } else if(terms) {
+        if(!iter_bson(result, &out, &dec)) {
+            out = make_error(st, env, "internal_error");
+        }
+    } else if(!make_binary(env, &out, bson_get_data(result), result->len)) {
+        out = make_error(st, env, "internal_error");
+    }
+
+    bson_destroy(&ds.set);
+    bson_destroy(&ds.unset);
+    bson_destroy(&update);
+    vec_deinit(&ds.path);
+    return out;
+}
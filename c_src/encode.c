@@ -1,13 +1,6 @@
 
 #include "cabala.h"
 
-typedef struct {
-	ErlNifEnv 	 *env;
-	cabala_st 	 *st;
-
-	bson_t 		  bson;
-} encode_state;
-
 typedef struct {
 	void   *data;
 	size_t  size;
@@ -35,7 +28,6 @@ typedef struct {
 #define TERMSTR_INIT {NULL, 0, false}
 
 int encode_doc_impl(enc_doc_t *ed, encode_state *es);
-int encode_doc(ERL_NIF_TERM term, encode_state *es);
 
 static inline int
 termstr_cpy_make(ErlNifEnv *env, termstr *str, ERL_NIF_TERM term, bool bin_cpy)
@@ -105,7 +97,7 @@ termstr_destroy(termstr *str)
 	}
 }
 
-static encode_state *
+encode_state *
 es_new(ErlNifEnv *env, cabala_st *st) 
 {
 	encode_state *es = enif_alloc(sizeof(encode_state));
@@ -115,12 +107,15 @@ es_new(ErlNifEnv *env, cabala_st *st)
 
 	es->env = env;
 	es->st  = st;
+	es->id  = NULL;
+	es->validate_utf8 = false;
+	es->utf8_error = false;
 	bson_init(&es->bson);
 
 	return es;
 }
 
-static void
+void
 es_destroy(encode_state *es) 
 {
 	if(!es) return;
@@ -156,6 +151,12 @@ append_utf8(ERL_NIF_TERM key, ERL_NIF_TERM term, encode_state *es)
 	if(!termstr_make(es->env, &valstr, term)) {
 		return 0;
 	}
+	if(es->validate_utf8 &&
+			!utf8_copy(NULL, (const uint8_t *)valstr.data, valstr.size)) {
+		es->utf8_error = true;
+		termstr_destroy(&valstr);
+		return 0;
+	}
 
 	val.value_type = BSON_TYPE_UTF8;
 	val.value.v_utf8.str = valstr.data;
@@ -185,6 +186,13 @@ append_oid(ERL_NIF_TERM key, ERL_NIF_TERM oid, encode_state *es)
 		val.value_type = BSON_TYPE_OID;
 		val.value.v_oid = oid;
 		ret = append_keyval(es->env, &es->bson, key, &val);
+	} else if(oidstr.size == 24) {
+		/* the hex form of decode's {oid_format, hex} */
+		bson_value_t val;
+
+		val.value_type = BSON_TYPE_OID;
+		ret = oid_from_hex(oidstr.data, val.value.v_oid.bytes) &&
+			append_keyval(es->env, &es->bson, key, &val);
 	} else {
 		ret = 0;
 	}
@@ -241,6 +249,21 @@ append_binary(ERL_NIF_TERM  key,
 	val.value.v_binary.data = datastr.data;
 	val.value.v_binary.data_len = datastr.size;
 	val.value.v_binary.subtype = v_subtype;
+
+	/* the text form of decode's {uuid_format, string} */
+	if(v_subtype == BSON_SUBTYPE_UUID && datastr.size == 36) {
+		uint8_t uuid[16];
+
+		if(!uuid_from_string(datastr.data, uuid)) {
+			termstr_destroy(&datastr);
+			return 0;
+		}
+		val.value.v_binary.data = uuid;
+		val.value.v_binary.data_len = 16;
+		ret = append_keyval(es->env, &es->bson, key, &val);
+		termstr_destroy(&datastr);
+		return ret;
+	}
 	ret = append_keyval(es->env, &es->bson, key, &val);
 
 	termstr_destroy(&datastr);
@@ -323,7 +346,9 @@ append_codescope(ERL_NIF_TERM key,
 		ret = 0;
 		goto done;
 	}
+	scope_es->validate_utf8 = es->validate_utf8;
 	if(!encode_doc(scope, scope_es)) {
+		es->utf8_error = scope_es->utf8_error;
 		ret = 0;
 		goto done;
 	}
@@ -428,8 +453,10 @@ append_doc(ERL_NIF_TERM key, enc_doc_t *ed, encode_state *es)
 		goto done;
 	}
 
+	cs->validate_utf8 = es->validate_utf8;
 	ret = encode_doc_impl(ed, cs);
 	if(!ret) {
+		es->utf8_error = cs->utf8_error;
 		goto done;
 	}
 	switch(ed->type) {
@@ -485,6 +512,84 @@ encode_digit(ERL_NIF_TERM key, ERL_NIF_TERM term, encode_state *es)
 	return 0;
 }
 
+/*
+ * {'$f64$' | '$i32$' | '$i64$', Bin}: write the array straight from the
+ * packed values, each element being the type byte, the index key kept
+ * as a running decimal string and the little endian value.
+ */
+static int
+append_packed(ERL_NIF_TERM key, bson_type_t type, size_t width,
+			  ERL_NIF_TERM term, encode_state *es)
+{
+	ErlNifBinary bin;
+	bson_value_t val;
+	uint8_t *buf, *p;
+	char idx[12] = "0";
+	size_t count, size, lo, hi, i;
+	int digits, idx_len = 1, ret;
+
+	if(!enif_inspect_binary(es->env, term, &bin) || bin.size % width != 0) {
+		return 0;
+	}
+	count = bin.size / width;
+
+	/* keys of d digits, plus their NUL, for the indexes in [lo, hi) */
+	size = 4 + count * (1 + width) + 1;
+	for(digits = 1, lo = 0, hi = 10; lo < count; digits++, lo = hi, hi *= 10) {
+		size += ((count < hi ? count : hi) - lo) * (digits + 1);
+	}
+	if(size > INT32_MAX) {
+		return 0;
+	}
+
+	buf = bson_malloc(size);
+	if(!buf) {
+		return 0;
+	}
+	p = buf + 4;
+	for(i = 0; i < count; i++) {
+		*p++ = (uint8_t)type;
+		memcpy(p, idx, idx_len + 1);
+		p += idx_len + 1;
+		if(width == 8) {
+			uint64_t v;
+			memcpy(&v, bin.data + i * 8, 8);
+			v = BSON_UINT64_TO_LE(v);
+			memcpy(p, &v, 8);
+		} else {
+			uint32_t v;
+			memcpy(&v, bin.data + i * 4, 4);
+			v = BSON_UINT32_TO_LE(v);
+			memcpy(p, &v, 4);
+		}
+		p += width;
+
+		/* next index key, carrying into a new leading digit */
+		for(digits = idx_len - 1; digits >= 0 && idx[digits] == '9'; digits--) {
+			idx[digits] = '0';
+		}
+		if(digits >= 0) {
+			idx[digits]++;
+		} else {
+			memmove(idx + 1, idx, idx_len + 1);
+			idx[0] = '1';
+			idx_len++;
+		}
+	}
+	*p = 0;
+	{
+		uint32_t len = BSON_UINT32_TO_LE((uint32_t)size);
+		memcpy(buf, &len, 4);
+	}
+
+	val.value_type = BSON_TYPE_ARRAY;
+	val.value.v_doc.data = buf;
+	val.value.v_doc.data_len = size;
+	ret = append_keyval(es->env, &es->bson, key, &val);
+	bson_free(buf);
+	return ret;
+}
+
 static inline int
 append_tuple(ERL_NIF_TERM key, ERL_NIF_TERM term, encode_state *es)
 {
@@ -511,6 +616,15 @@ append_tuple(ERL_NIF_TERM key, ERL_NIF_TERM term, encode_state *es)
 		    LOG("append_js, key: %d, val: %d \r\n", (int32_t)key, (int32_t)term);
 			return append_code(key, array[1], es);
 		}
+		if(enif_is_identical(array[0], es->st->atom_s_f64)) {
+			return append_packed(key, BSON_TYPE_DOUBLE, 8, array[1], es);
+		}
+		if(enif_is_identical(array[0], es->st->atom_s_i32)) {
+			return append_packed(key, BSON_TYPE_INT32, 4, array[1], es);
+		}
+		if(enif_is_identical(array[0], es->st->atom_s_i64)) {
+			return append_packed(key, BSON_TYPE_INT64, 8, array[1], es);
+		}
 		break;
 	case 4:
 		if(enif_is_identical(array[0], es->st->atom_s_type) && 
@@ -680,10 +794,7 @@ encode_doc(ERL_NIF_TERM term, encode_state *es)
 	if(enif_is_map(es->env, term)) {
 		ed.type = DOC_TYPE_MAP;
 		ed.value.map = term;
-		return encode_doc_impl(&ed, es);
-	}
-
-	if(enif_is_tuple(es->env, term)) {
+	} else if(enif_is_tuple(es->env, term)) {
 		ERL_NIF_TERM *array;
 		int arity;
 
@@ -696,10 +807,51 @@ encode_doc(ERL_NIF_TERM term, encode_state *es)
 		ed.type = DOC_TYPE_TUPLE;
 		ed.value.v_tuple.array = array;
 		ed.value.v_tuple.arity = arity;
+	} else {
+		return 0;
+	}
 
-		return encode_doc_impl(&ed, es);
+	if(es->id && !bson_append_oid(&es->bson, "_id", 3, es->id)) {
+		return 0;
 	}
+	return encode_doc_impl(&ed, es);
+}
+
+static inline int
+is_id_key(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM key)
+{
+	ErlNifBinary bin;
+
+	if(enif_is_identical(key, st->atom_id)) {
+		return 1;
+	}
+	return enif_inspect_binary(env, key, &bin) && bin.size == 3 &&
+		memcmp(bin.data, "_id", 3) == 0;
+}
+
+/* the _id of a map or tuple document, keyed by <<"_id">> or '_id' */
+int
+doc_id(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM doc, ERL_NIF_TERM *id)
+{
+	const ERL_NIF_TERM *array;
+	ERL_NIF_TERM key;
+	int idx, arity;
 
+	if(enif_is_map(env, doc)) {
+		if(enif_get_map_value(env, doc, st->atom_id, id)) {
+			return 1;
+		}
+		return make_binary(env, &key, "_id", 3) &&
+			enif_get_map_value(env, doc, key, id);
+	}
+	if(enif_get_tuple(env, doc, &arity, &array)) {
+		for(idx = 0; idx + 1 < arity; idx += 2) {
+			if(is_id_key(env, st, array[idx])) {
+				*id = array[idx + 1];
+				return 1;
+			}
+		}
+	}
 	return 0;
 }
 
@@ -715,7 +867,11 @@ encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
 	cabala_st 	 *st = (cabala_st*)enif_priv_data(env);
 	encode_state *es;
-	ERL_NIF_TERM  out;
+	ERL_NIF_TERM  out, opts, item, id;
+	const ERL_NIF_TERM *tuple;
+	bson_oid_t	  oid;
+	bool		  ensure_id = false, validate_utf8 = false;
+	int			  arity;
 
 	if(argc != 2) {
 		return enif_make_badarg(env);
@@ -724,21 +880,159 @@ encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 		return enif_make_badarg(env);
 	}
 
+	/* unknown options have always been ignored here */
+	opts = argv[1];
+	while(enif_get_list_cell(env, opts, &item, &opts)) {
+		if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+			continue;
+		}
+		if(enif_is_identical(tuple[0], st->atom_ensure_id)) {
+			ensure_id = enif_is_identical(tuple[1], st->atom_true);
+		} else if(enif_is_identical(tuple[0], st->atom_validate_utf8)) {
+			validate_utf8 = enif_is_identical(tuple[1], st->atom_true);
+		}
+	}
+
 	es = es_new(env, st);
 	if(!es) {
 		goto failure;
 	}
+	es->validate_utf8 = validate_utf8;
+	if(ensure_id && !doc_id(env, st, argv[0], &id)) {
+		oid_new(&oid);
+		es->id = &oid;
+		id = make_oid(env, st, &oid);
+	}
 	if(!encode_doc(argv[0], es)) {
 		goto failure;
 	}
 	if(!encode_result(&out, es)) {
 		goto failure;
 	}
+	if(ensure_id) {
+		out = enif_make_tuple2(env, out, id);
+	}
 
 	es_destroy(es);
 	return out;
 
 failure:
+	out = make_error(st, env, es && es->utf8_error ?
+					 "invalid_utf8" : "internal_error");
 	es_destroy(es);
-	return make_error(st, env, "internal_error");
+	return out;
+}
+
+/* typed fields take the fast path, anything else goes through encode_elem */
+static int
+encode_field(const schema_field *f, ERL_NIF_TERM term, encode_state *es)
+{
+	ErlNifBinary bin;
+	ErlNifSInt64 i64;
+	ERL_NIF_TERM key;
+	double d;
+	int i;
+
+	switch(f->type) {
+	case FIELD_INT32:
+		if(enif_get_int(es->env, term, &i)) {
+			return bson_append_int32(&es->bson, f->key, f->key_len, i);
+		}
+		break;
+	case FIELD_INT64:
+		if(enif_get_int64(es->env, term, &i64)) {
+			return bson_append_int64(&es->bson, f->key, f->key_len, i64);
+		}
+		break;
+	case FIELD_DOUBLE:
+		if(enif_get_double(es->env, term, &d)) {
+			return bson_append_double(&es->bson, f->key, f->key_len, d);
+		}
+		if(enif_get_int64(es->env, term, &i64)) {
+			return bson_append_double(&es->bson, f->key, f->key_len, (double)i64);
+		}
+		break;
+	case FIELD_STRING:
+		if(enif_inspect_binary(es->env, term, &bin)) {
+			return bson_append_utf8(&es->bson, f->key, f->key_len,
+									(const char *)bin.data, bin.size);
+		}
+		break;
+	case FIELD_BINARY:
+		if(enif_inspect_binary(es->env, term, &bin)) {
+			return bson_append_binary(&es->bson, f->key, f->key_len,
+									  BSON_SUBTYPE_BINARY, bin.data, bin.size);
+		}
+		break;
+	case FIELD_BOOL:
+		if(enif_is_identical(term, es->st->atom_true)) {
+			return bson_append_bool(&es->bson, f->key, f->key_len, true);
+		}
+		if(enif_is_identical(term, es->st->atom_false)) {
+			return bson_append_bool(&es->bson, f->key, f->key_len, false);
+		}
+		break;
+	case FIELD_DATE:
+		if(enif_get_int64(es->env, term, &i64)) {
+			return bson_append_date_time(&es->bson, f->key, f->key_len, i64);
+		}
+		break;
+	default:
+		break;
+	}
+
+	if(!make_binary(es->env, &key, f->key, f->key_len)) {
+		return 0;
+	}
+	return encode_elem(key, term, es);
+}
+
+/*
+ * Encode the elements of a tuple, or of a record when the tuple has one
+ * more element (the record name, which must be the schema's when it has
+ * one), in the order of the schema fields.
+ */
+ERL_NIF_TERM
+encode_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	cabala_st 	 *st = (cabala_st*)enif_priv_data(env);
+	schema_res	 *res;
+	encode_state *es;
+	const ERL_NIF_TERM *array;
+	ERL_NIF_TERM  out, key;
+	size_t		  i, skip;
+	int 		  arity;
+
+	if(argc != 2 ||
+			!enif_get_resource(env, argv[0], st->res_schema, (void **)&res) ||
+			!enif_get_tuple(env, argv[1], &arity, &array)) {
+		return enif_make_badarg(env);
+	}
+	if((size_t)arity == res->count + 1) {
+		if(res->has_record && enif_compare(array[0], res->record) != 0) {
+			return enif_make_badarg(env);
+		}
+		skip = 1;
+	} else if((size_t)arity == res->count) {
+		skip = 0;
+	} else {
+		return enif_make_badarg(env);
+	}
+
+	es = es_new(env, st);
+	if(!es) {
+		return make_error(st, env, "internal_error");
+	}
+	for(i = 0; i < res->count; i++) {
+		if(!encode_field(&res->fields[i], array[i + skip], es)) {
+			make_binary(env, &key, res->fields[i].key, res->fields[i].key_len);
+			es_destroy(es);
+			return make_obj_error(st, env, "badfield", key);
+		}
+	}
+	if(!encode_result(&out, es)) {
+		out = make_error(st, env, "internal_error");
+	}
+	es_destroy(es);
+	return out;
 }
\ No newline at end of file
@@ -0,0 +1,568 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cabala.h"
+
+#define WRITE_ALIGN         4096
+#define WRITE_BUFFER_SIZE   (1 << 20)
+#define MAX_BUFFER_SIZE     (1 << 30)
+
+typedef enum {
+    FSYNC_NEVER,
+    FSYNC_ON_CLOSE,
+    FSYNC_ALWAYS
+} fsync_policy;
+
+typedef struct {
+    ErlNifMutex *lock;
+    uint8_t     *map;       // NULL once closed or for an empty file
+    size_t       size;
+    size_t       pos;       // offset of the next document
+    size_t       dropped;   // pages before this offset were released
+    bool         closed;
+} reader_res;
+
+typedef struct {
+    ErlNifMutex *lock;
+    int          fd;        // -1 once closed
+    uint8_t     *buf;       // WRITE_ALIGN aligned
+    size_t       cap;
+    size_t       len;
+    fsync_policy fsync;
+} writer_res;
+
+static long page_size = 0;
+
+static void
+unmap_reader(reader_res *res)
+{
+    if(res->map) {
+        munmap(res->map, res->size);
+        res->map = NULL;
+    }
+    res->closed = true;
+}
+
+void
+reader_dtor(ErlNifEnv *env, void *obj)
+{
+    reader_res *res = obj;
+
+    unmap_reader(res);
+    if(res->lock) {
+        enif_mutex_destroy(res->lock);
+    }
+}
+
+/* a path given as a binary, without the trailing NUL */
+int
+get_path(ErlNifEnv *env, ERL_NIF_TERM term, char *path, size_t size)
+{
+    ErlNifBinary bin;
+
+    if(!enif_inspect_binary(env, term, &bin) || bin.size == 0 ||
+            bin.size >= size || memchr(bin.data, '\0', bin.size)) {
+        return 0;
+    }
+    memcpy(path, bin.data, bin.size);
+    path[bin.size] = '\0';
+    return 1;
+}
+
+/*
+ * Map a regular file read-only. An empty file gives a NULL mapping.
+ * Returns 0 or the errno.
+ */
+int
+map_file(const char *path, uint8_t **map, size_t *size)
+{
+    struct stat sb;
+    void *ptr = NULL;
+    int fd, err;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return errno;
+    }
+    if(fstat(fd, &sb) != 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if(!S_ISREG(sb.st_mode)) {
+        close(fd);
+        return EINVAL;
+    }
+    if(sb.st_size > 0) {
+        ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED) {
+            err = errno;
+            close(fd);
+            return err;
+        }
+    }
+    close(fd);
+
+    *map = ptr;
+    *size = sb.st_size;
+    return 0;
+}
+
+ERL_NIF_TERM
+file_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    reader_res  *res;
+    char         path[MAX_PATH_LEN];
+    uint8_t     *map;
+    size_t       size;
+    int          err;
+    ERL_NIF_TERM out;
+
+    if(argc != 1 || !get_path(env, argv[0], path, sizeof path)) {
+        return enif_make_badarg(env);
+    }
+
+    if((err = map_file(path, &map, &size)) != 0) {
+        return make_errno_error(st, env, err);
+    }
+    if(map) {
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    res = enif_alloc_resource(st->res_reader, sizeof(reader_res));
+    if(!res) {
+        if(map) {
+            munmap(map, size);
+        }
+        return make_error(st, env, "internal_error");
+    }
+    memset(res, 0, sizeof(reader_res));
+    res->map = map;
+    res->size = size;
+    res->lock = enif_mutex_create("cabala_reader");
+    if(!res->lock) {
+        enif_release_resource(res);
+        return make_error(st, env, "internal_error");
+    }
+
+    out = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return out;
+}
+
+/*
+ * Give the pages already decoded back to the kernel, so the resident
+ * part of the mapping stays around one batch in size.
+ */
+static void
+drop_consumed(reader_res *res)
+{
+    size_t end;
+
+    if(page_size <= 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    end = res->pos - res->pos % page_size;
+    if(end > res->dropped) {
+        madvise(res->map + res->dropped, end - res->dropped, MADV_DONTNEED);
+        res->dropped = end;
+    }
+}
+
+/* decode up to n documents from the current position */
+static ERL_NIF_TERM
+read_batch(decode_state *ds, reader_res *res, unsigned n)
+{
+    vec_term_t   vec;
+    bson_t       bson;
+    ERL_NIF_TERM item, out;
+    size_t       pos = res->pos;
+    int32_t      len;
+
+    vec_init(&vec);
+    while(n-- > 0 && pos < res->size) {
+        if(res->size - pos < 5) {
+            goto badbson;
+        }
+        memcpy(&len, res->map + pos, sizeof len);
+        len = (int32_t)BSON_UINT32_FROM_LE((uint32_t)len);
+        if(len < 5 || (size_t)len > res->size - pos) {
+            goto badbson;
+        }
+        if(!bson_init_static(&bson, res->map + pos, len) ||
+                !iter_bson(&bson, &item, ds)) {
+            goto badbson;
+        }
+        if(vec_push(&vec, item) != 0) {
+            vec_deinit(&vec);
+            return make_error(ds->st, ds->env, "internal_error");
+        }
+        pos += len;
+    }
+
+    out = enif_make_list_from_array(ds->env, vec.data, vec.length);
+    vec_deinit(&vec);
+    res->pos = pos;
+    drop_consumed(res);
+    return out;
+
+badbson:
+    vec_deinit(&vec);
+    return make_obj_error(ds->st, ds->env,
+                          ds->utf8_error ? "invalid_utf8" : "badbson",
+                          enif_make_uint64(ds->env, pos));
+}
+
+ERL_NIF_TERM
+file_next_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    reader_res  *res;
+    decode_state ds;
+    ERL_NIF_TERM opts, item, out;
+    unsigned     n;
+
+    if(argc != 3) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_reader, (void **)&res) ||
+            !enif_get_uint(env, argv[1], &n) || n == 0) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&ds, env, st);
+    opts = argv[2];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!decode_option(&ds, item)) {
+            return enif_make_badarg(env);
+        }
+    }
+
+    enif_mutex_lock(res->lock);
+    if(res->closed) {
+        out = make_error(st, env, "closed");
+    } else if(res->pos >= res->size) {
+        out = st->atom_eof;
+    } else {
+        out = read_batch(&ds, res, n);
+    }
+    enif_mutex_unlock(res->lock);
+    return out;
+}
+
+/* write every iovec, retrying short writes and EINTR */
+static int
+write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while(iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* write out the buffer followed by `extra`, which may be NULL */
+static int
+flush_writer(writer_res *res, const uint8_t *extra, size_t extra_len)
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+    int err;
+
+    if(res->len > 0) {
+        iov[iovcnt].iov_base = res->buf;
+        iov[iovcnt].iov_len = res->len;
+        iovcnt++;
+    }
+    if(extra_len > 0) {
+        iov[iovcnt].iov_base = (void*)extra;
+        iov[iovcnt].iov_len = extra_len;
+        iovcnt++;
+    }
+    err = write_all(res->fd, iov, iovcnt);
+    if(err == 0) {
+        res->len = 0;
+    }
+    return err;
+}
+
+static int
+close_writer(writer_res *res)
+{
+    int err = flush_writer(res, NULL, 0);
+
+    if(err == 0 && res->fsync != FSYNC_NEVER && fsync(res->fd) != 0) {
+        err = errno;
+    }
+    if(close(res->fd) != 0 && err == 0) {
+        err = errno;
+    }
+    res->fd = -1;
+    return err;
+}
+
+/*
+ * A writer dropped without close/1 loses its buffered documents: the
+ * destructor may run on a normal scheduler, so it neither writes nor
+ * syncs, it only closes the fd.
+ */
+void
+writer_dtor(ErlNifEnv *env, void *obj)
+{
+    writer_res *res = obj;
+
+    if(res->fd >= 0) {
+        close(res->fd);
+    }
+    if(res->buf) {
+        free(res->buf);
+    }
+    if(res->lock) {
+        enif_mutex_destroy(res->lock);
+    }
+}
+
+static int
+get_fsync_policy(cabala_st *st, ERL_NIF_TERM term, fsync_policy *out)
+{
+    if(enif_compare(term, st->atom_never) == 0) {
+        *out = FSYNC_NEVER;
+    } else if(enif_compare(term, st->atom_on_close) == 0) {
+        *out = FSYNC_ON_CLOSE;
+    } else if(enif_compare(term, st->atom_always) == 0) {
+        *out = FSYNC_ALWAYS;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+ERL_NIF_TERM
+writer_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    writer_res  *res;
+    char         path[MAX_PATH_LEN];
+    ERL_NIF_TERM opts, item, out;
+    const ERL_NIF_TERM *tuple;
+    fsync_policy policy = FSYNC_NEVER;
+    unsigned     size = WRITE_BUFFER_SIZE;
+    int          flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int          arity, fd;
+    void        *buf;
+
+    if(argc != 2 || !get_path(env, argv[0], path, sizeof path)) {
+        return enif_make_badarg(env);
+    }
+
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_append) == 0) {
+            flags = (flags & ~O_TRUNC) | O_APPEND;
+        } else if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            return enif_make_badarg(env);
+        } else if(enif_compare(tuple[0], st->atom_fsync) == 0) {
+            if(!get_fsync_policy(st, tuple[1], &policy)) {
+                return enif_make_badarg(env);
+            }
+        } else if(enif_compare(tuple[0], st->atom_buffer_size) == 0) {
+            if(!enif_get_uint(env, tuple[1], &size) || size == 0 ||
+                    size > MAX_BUFFER_SIZE) {
+                return enif_make_badarg(env);
+            }
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+    size = (size + WRITE_ALIGN - 1) & ~(WRITE_ALIGN - 1);
+
+    if(posix_memalign(&buf, WRITE_ALIGN, size) != 0) {
+        return make_error(st, env, "internal_error");
+    }
+    fd = open(path, flags, 0644);
+    if(fd < 0) {
+        int err = errno;
+        free(buf);
+        return make_errno_error(st, env, err);
+    }
+
+    res = enif_alloc_resource(st->res_writer, sizeof(writer_res));
+    if(!res) {
+        close(fd);
+        free(buf);
+        return make_error(st, env, "internal_error");
+    }
+    memset(res, 0, sizeof(writer_res));
+    res->fd = fd;
+    res->buf = buf;
+    res->cap = size;
+    res->fsync = policy;
+    res->lock = enif_mutex_create("cabala_writer");
+    if(!res->lock) {
+        enif_release_resource(res);
+        return make_error(st, env, "internal_error");
+    }
+
+    out = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return out;
+}
+
+/*
+ * Documents are encoded one after another with the same encoder and
+ * copied into the write buffer; a document that does not fit is
+ * written out together with the buffer in one writev.
+ */
+static ERL_NIF_TERM
+write_docs(encode_state *es, writer_res *res, ERL_NIF_TERM docs)
+{
+    cabala_st    *st = es->st;
+    ErlNifEnv    *env = es->env;
+    ERL_NIF_TERM  doc;
+    const uint8_t *data;
+    size_t        len;
+    int           err;
+
+    while(enif_get_list_cell(env, docs, &doc, &docs)) {
+        bson_reinit(&es->bson);
+        if(!encode_doc(doc, es)) {
+            return make_obj_error(st, env, "baddoc", doc);
+        }
+        data = bson_get_data(&es->bson);
+        len = es->bson.len;
+
+        if(len <= res->cap - res->len) {
+            memcpy(res->buf + res->len, data, len);
+            res->len += len;
+        } else if(len <= res->cap) {
+            if((err = flush_writer(res, NULL, 0)) != 0) {
+                return make_errno_error(st, env, err);
+            }
+            memcpy(res->buf, data, len);
+            res->len = len;
+        } else if((err = flush_writer(res, data, len)) != 0) {
+            return make_errno_error(st, env, err);
+        }
+    }
+
+    if(res->fsync == FSYNC_ALWAYS) {
+        if((err = flush_writer(res, NULL, 0)) != 0) {
+            return make_errno_error(st, env, err);
+        }
+        if(fsync(res->fd) != 0) {
+            return make_errno_error(st, env, errno);
+        }
+    }
+    return st->atom_ok;
+}
+
+ERL_NIF_TERM
+writer_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    writer_res   *res;
+    encode_state *es;
+    ERL_NIF_TERM  out;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_writer, (void **)&res) ||
+            !enif_is_list(env, argv[1])) {
+        return enif_make_badarg(env);
+    }
+
+    es = es_new(env, st);
+    if(!es) {
+        return make_error(st, env, "internal_error");
+    }
+
+    enif_mutex_lock(res->lock);
+    if(res->fd < 0) {
+        out = make_error(st, env, "closed");
+    } else {
+        out = write_docs(es, res, argv[1]);
+    }
+    enif_mutex_unlock(res->lock);
+
+    es_destroy(es);
+    return out;
+}
+
+ERL_NIF_TERM
+writer_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    writer_res  *res;
+    ERL_NIF_TERM out = st->atom_ok;
+    int          err;
+
+    if(argc != 1) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_writer, (void **)&res)) {
+        return enif_make_badarg(env);
+    }
+
+    enif_mutex_lock(res->lock);
+    if(res->fd < 0) {
+        out = make_error(st, env, "closed");
+    } else if((err = flush_writer(res, NULL, 0)) != 0) {
+        out = make_errno_error(st, env, err);
+    }
+    enif_mutex_unlock(res->lock);
+    return out;
+}
+
+/* closes readers and writers alike */
+ERL_NIF_TERM
+file_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    reader_res  *reader;
+    writer_res  *writer;
+    ERL_NIF_TERM out = st->atom_ok;
+    int          err;
+
+    if(argc != 1) {
+        return enif_make_badarg(env);
+    }
+
+    if(enif_get_resource(env, argv[0], st->res_reader, (void **)&reader)) {
+        enif_mutex_lock(reader->lock);
+        unmap_reader(reader);
+        enif_mutex_unlock(reader->lock);
+        return out;
+    }
+    if(!enif_get_resource(env, argv[0], st->res_writer, (void **)&writer)) {
+        return enif_make_badarg(env);
+    }
+
+    enif_mutex_lock(writer->lock);
+    if(writer->fd >= 0 && (err = close_writer(writer)) != 0) {
+        out = make_errno_error(st, env, err);
+    }
+    enif_mutex_unlock(writer->lock);
+    return out;
+}
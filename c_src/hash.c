@@ -0,0 +1,818 @@
+#include "cabala.h"
+
+#define MAX_DEPTHS 100
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/* canonical mode value tags */
+#define TAG_NULL    'n'
+#define TAG_INT     'i'
+#define TAG_DOUBLE  'd'
+#define TAG_STRING  's'
+#define TAG_DOC     'o'
+#define TAG_ARRAY   'a'
+#define TAG_KEY     'k'
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} hash128_t;
+
+typedef struct {
+    ErlNifEnv *env;
+    cabala_st *st;
+    uint64_t   seed;
+    int        depth;
+} hash_ctx;
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return BSON_UINT64_FROM_LE(v);
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return BSON_UINT32_FROM_LE(v);
+}
+
+static inline uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc  = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64_t
+xxh_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t
+xxh_finalize(uint64_t h, const uint8_t *p, size_t len)
+{
+    while(len >= 8) {
+        h ^= xxh_round(0, read64(p));
+        h  = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if(len >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h  = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while(len > 0) {
+        h ^= (*p) * PRIME64_5;
+        h  = rotl64(h, 11) * PRIME64_1;
+        p++;
+        len--;
+    }
+    return xxh_avalanche(h);
+}
+
+/*
+ * XXH64 over four independent accumulator lanes, 32 bytes per round,
+ * so the compiler can keep the lanes in flight in parallel. The low
+ * half is plain XXH64; the high half merges the same lanes in reverse
+ * order with a different offset, so both halves cover all of the
+ * input in a single pass.
+ */
+static hash128_t
+xxh128(const void *input, size_t len, uint64_t seed)
+{
+    const uint8_t *p = input;
+    const uint8_t *end = p + len;
+    uint64_t lo, hi;
+    hash128_t ret;
+
+    if(len >= 32) {
+        const uint8_t *limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while(p <= limit);
+
+        lo = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        lo = xxh_merge(lo, v1);
+        lo = xxh_merge(lo, v2);
+        lo = xxh_merge(lo, v3);
+        lo = xxh_merge(lo, v4);
+
+        hi = rotl64(v4, 1) + rotl64(v3, 7) + rotl64(v2, 12) + rotl64(v1, 18);
+        hi = xxh_merge(hi, v4);
+        hi = xxh_merge(hi, v3);
+        hi = xxh_merge(hi, v2);
+        hi = xxh_merge(hi, v1);
+        hi += PRIME64_3;
+    } else {
+        lo = seed + PRIME64_5;
+        hi = seed + PRIME64_5 + PRIME64_3;
+    }
+
+    lo += (uint64_t)len;
+    hi += (uint64_t)len;
+    ret.lo = xxh_finalize(lo, p, end - p);
+    ret.hi = xxh_finalize(hi, p, end - p);
+    return ret;
+}
+
+static inline hash128_t
+hash_combine(hash128_t acc, hash128_t val)
+{
+    acc.lo = xxh_merge(acc.lo, val.lo);
+    acc.hi = xxh_merge(acc.hi, val.hi);
+    return acc;
+}
+
+static inline hash128_t
+hash_leaf(hash_ctx *ctx, uint8_t tag, const void *data, size_t len)
+{
+    return xxh128(data, len, ctx->seed ^ ((uint64_t)tag * PRIME64_5));
+}
+
+static inline hash128_t
+hash_int(hash_ctx *ctx, int64_t v)
+{
+    uint64_t le = BSON_UINT64_TO_LE((uint64_t)v);
+    return hash_leaf(ctx, TAG_INT, &le, sizeof le);
+}
+
+/* integral doubles hash like the equal integer */
+static hash128_t
+hash_double(hash_ctx *ctx, double d)
+{
+    uint64_t bits;
+
+    if(d >= -9223372036854775808.0 && d < 9223372036854775808.0 &&
+            d == (double)(int64_t)d) {
+        return hash_int(ctx, (int64_t)d);
+    }
+    if(d != d) {
+        bits = 0x7FF8000000000000ULL;
+    } else {
+        memcpy(&bits, &d, sizeof bits);
+    }
+    bits = BSON_UINT64_TO_LE(bits);
+    return hash_leaf(ctx, TAG_DOUBLE, &bits, sizeof bits);
+}
+
+static hash128_t
+hash_field(hash_ctx *ctx, const char *key, size_t len, hash128_t val)
+{
+    return hash_combine(hash_leaf(ctx, TAG_KEY, key, len), val);
+}
+
+/* fields are summed, which makes a document hash independent of order */
+static hash128_t
+hash_doc_finish(hash_ctx *ctx, hash128_t sum, uint32_t count)
+{
+    uint32_t le = BSON_UINT32_TO_LE(count);
+    hash128_t ret = hash_leaf(ctx, TAG_DOC, &le, sizeof le);
+    ret = hash_combine(ret, sum);
+    ret.lo = xxh_avalanche(ret.lo);
+    ret.hi = xxh_avalanche(ret.hi);
+    return ret;
+}
+
+static int hash_iter_doc(hash_ctx *ctx, bson_iter_t *iter, bool array,
+                         hash128_t *out);
+
+static int
+hash_iter_value(hash_ctx *ctx, bson_iter_t *iter, hash128_t *out)
+{
+    uint8_t tag = (uint8_t)bson_iter_type(iter);
+    uint32_t len;
+
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_DOUBLE:
+        *out = hash_double(ctx, bson_iter_double(iter));
+        return 1;
+    case BSON_TYPE_INT32:
+        *out = hash_int(ctx, bson_iter_int32(iter));
+        return 1;
+    case BSON_TYPE_INT64:
+        *out = hash_int(ctx, bson_iter_int64(iter));
+        return 1;
+    case BSON_TYPE_UTF8: {
+        const char *str = bson_iter_utf8(iter, &len);
+        *out = hash_leaf(ctx, TAG_STRING, str, len);
+        return 1;
+    }
+    case BSON_TYPE_SYMBOL: {
+        const char *str = bson_iter_symbol(iter, &len);
+        *out = hash_leaf(ctx, TAG_STRING, str, len);
+        return 1;
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY: {
+        bson_iter_t child;
+        if(!bson_iter_recurse(iter, &child)) {
+            return 0;
+        }
+        return hash_iter_doc(ctx, &child, BSON_ITER_HOLDS_ARRAY(iter), out);
+    }
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+        *out = hash_leaf(ctx, TAG_NULL, NULL, 0);
+        return 1;
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY:
+        *out = hash_leaf(ctx, tag, NULL, 0);
+        return 1;
+    case BSON_TYPE_OID:
+        *out = hash_leaf(ctx, tag, bson_iter_oid(iter)->bytes, 12);
+        return 1;
+    case BSON_TYPE_BOOL: {
+        uint8_t v = bson_iter_bool(iter) ? 1 : 0;
+        *out = hash_leaf(ctx, tag, &v, 1);
+        return 1;
+    }
+    case BSON_TYPE_DATE_TIME: {
+        uint64_t v = BSON_UINT64_TO_LE((uint64_t)bson_iter_date_time(iter));
+        *out = hash_leaf(ctx, tag, &v, sizeof v);
+        return 1;
+    }
+    case BSON_TYPE_TIMESTAMP: {
+        uint32_t t, i;
+        uint64_t v;
+        bson_iter_timestamp(iter, &t, &i);
+        v = BSON_UINT64_TO_LE(((uint64_t)t << 32) | i);
+        *out = hash_leaf(ctx, tag, &v, sizeof v);
+        return 1;
+    }
+    case BSON_TYPE_BINARY: {
+        bson_subtype_t subtype;
+        const uint8_t *data;
+        bson_iter_binary(iter, &subtype, &len, &data);
+        *out = hash_leaf(ctx, (uint8_t)subtype, &tag, 1);
+        *out = hash_combine(*out, hash_leaf(ctx, tag, data, len));
+        return 1;
+    }
+    case BSON_TYPE_REGEX: {
+        const char *options;
+        const char *regex = bson_iter_regex(iter, &options);
+        *out = hash_combine(hash_leaf(ctx, tag, regex, strlen(regex)),
+                            hash_leaf(ctx, tag, options, strlen(options)));
+        return 1;
+    }
+    case BSON_TYPE_CODE: {
+        const char *code = bson_iter_code(iter, &len);
+        *out = hash_leaf(ctx, tag, code, len);
+        return 1;
+    }
+    case BSON_TYPE_CODEWSCOPE: {
+        uint32_t scope_len;
+        const uint8_t *scope_data;
+        const char *code = bson_iter_codewscope(iter, &len, &scope_len, &scope_data);
+        bson_t scope;
+        bson_iter_t child;
+        hash128_t scope_hash;
+
+        if(!bson_init_static(&scope, scope_data, scope_len) ||
+                !bson_iter_init(&child, &scope) ||
+                !hash_iter_doc(ctx, &child, false, &scope_hash)) {
+            return 0;
+        }
+        *out = hash_combine(hash_leaf(ctx, tag, code, len), scope_hash);
+        return 1;
+    }
+    case BSON_TYPE_DBPOINTER: {
+        const char *col;
+        const bson_oid_t *oid;
+        bson_iter_dbpointer(iter, &len, &col, &oid);
+        *out = hash_combine(hash_leaf(ctx, tag, col, len),
+                            hash_leaf(ctx, tag, oid->bytes, 12));
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static int
+hash_iter_doc(hash_ctx *ctx, bson_iter_t *iter, bool array, hash128_t *out)
+{
+    hash128_t acc, val;
+    uint32_t count = 0;
+
+    if(ctx->depth >= MAX_DEPTHS) {
+        return 0;
+    }
+    ctx->depth++;
+
+    acc.lo = acc.hi = 0;
+    if(array) {
+        acc = hash_leaf(ctx, TAG_ARRAY, NULL, 0);
+    }
+    while(bson_iter_next(iter)) {
+        if(!hash_iter_value(ctx, iter, &val)) {
+            return 0;
+        }
+        if(array) {
+            acc = hash_combine(acc, val);
+        } else {
+            const char *key = bson_iter_key(iter);
+            val = hash_field(ctx, key, strlen(key), val);
+            acc.lo += val.lo;
+            acc.hi += val.hi;
+        }
+        count++;
+    }
+    if(iter->err_off) {
+        return 0;
+    }
+
+    ctx->depth--;
+    *out = array ? acc : hash_doc_finish(ctx, acc, count);
+    return 1;
+}
+
+/*
+ * Term traversal, mirroring the term to bson mapping of encode_elem so
+ * that hash_term(Doc) == hash(encode(Doc), [canonical]).
+ */
+static int hash_term_value(hash_ctx *ctx, ERL_NIF_TERM term, hash128_t *out);
+
+static int
+term_bytes(hash_ctx *ctx, ERL_NIF_TERM term, char *buf, size_t size,
+           const void **data, size_t *len)
+{
+    ErlNifBinary bin;
+    unsigned alen;
+
+    if(enif_inspect_binary(ctx->env, term, &bin)) {
+        *data = bin.data;
+        *len = bin.size;
+        return 1;
+    }
+    if(enif_is_atom(ctx->env, term) &&
+            enif_get_atom_length(ctx->env, term, &alen, ERL_NIF_LATIN1) &&
+            alen < size &&
+            enif_get_atom(ctx->env, term, buf, size, ERL_NIF_LATIN1)) {
+        *data = buf;
+        *len = alen;
+        return 1;
+    }
+    return 0;
+}
+
+static int
+hash_term_field(hash_ctx *ctx, ERL_NIF_TERM key, ERL_NIF_TERM val,
+                hash128_t *acc)
+{
+    char buf[256];
+    const void *data;
+    size_t len;
+    hash128_t vh;
+
+    if(!term_bytes(ctx, key, buf, sizeof buf, &data, &len)) {
+        return 0;
+    }
+    if(!hash_term_value(ctx, val, &vh)) {
+        return 0;
+    }
+    vh = hash_field(ctx, data, len, vh);
+    acc->lo += vh.lo;
+    acc->hi += vh.hi;
+    return 1;
+}
+
+static int
+hash_term_doc(hash_ctx *ctx, ERL_NIF_TERM term, hash128_t *out)
+{
+    hash128_t acc = {0, 0};
+    uint32_t count = 0;
+    int ret = 0;
+
+    if(ctx->depth >= MAX_DEPTHS) {
+        return 0;
+    }
+    ctx->depth++;
+
+    if(enif_is_map(ctx->env, term)) {
+        ErlNifMapIterator iter;
+        ERL_NIF_TERM key, val;
+
+        if(!enif_map_iterator_create(ctx->env, term, &iter,
+                ERL_NIF_MAP_ITERATOR_HEAD)) {
+            return 0;
+        }
+        while(enif_map_iterator_get_pair(ctx->env, &iter, &key, &val)) {
+            if(!hash_term_field(ctx, key, val, &acc)) {
+                goto done;
+            }
+            count++;
+            enif_map_iterator_next(ctx->env, &iter);
+        }
+        ret = 1;
+done:
+        enif_map_iterator_destroy(ctx->env, &iter);
+    } else {
+        const ERL_NIF_TERM *array;
+        int arity, idx;
+
+        if(!enif_get_tuple(ctx->env, term, &arity, &array) || arity % 2 != 0) {
+            return 0;
+        }
+        for(idx = 0; idx < arity; idx += 2) {
+            if(!hash_term_field(ctx, array[idx], array[idx+1], &acc)) {
+                return 0;
+            }
+            count++;
+        }
+        ret = 1;
+    }
+    if(!ret) {
+        return 0;
+    }
+
+    ctx->depth--;
+    *out = hash_doc_finish(ctx, acc, count);
+    return 1;
+}
+
+/* {'$f64$' | '$i32$' | '$i64$', Bin}, hashed as the array encode writes */
+static int
+hash_term_packed(hash_ctx *ctx, bson_type_t type, size_t width,
+                 ERL_NIF_TERM term, hash128_t *out)
+{
+    ErlNifBinary bin;
+    hash128_t acc;
+    size_t i;
+
+    if(!enif_inspect_binary(ctx->env, term, &bin) || bin.size % width != 0) {
+        return 0;
+    }
+    if(ctx->depth >= MAX_DEPTHS) {
+        return 0;
+    }
+    acc = hash_leaf(ctx, TAG_ARRAY, NULL, 0);
+    for(i = 0; i < bin.size; i += width) {
+        if(type == BSON_TYPE_DOUBLE) {
+            double d;
+            memcpy(&d, bin.data + i, 8);
+            acc = hash_combine(acc, hash_double(ctx, d));
+        } else if(type == BSON_TYPE_INT64) {
+            int64_t v;
+            memcpy(&v, bin.data + i, 8);
+            acc = hash_combine(acc, hash_int(ctx, v));
+        } else {
+            int32_t v;
+            memcpy(&v, bin.data + i, 4);
+            acc = hash_combine(acc, hash_int(ctx, v));
+        }
+    }
+    *out = acc;
+    return 1;
+}
+
+static int
+hash_term_tuple(hash_ctx *ctx, ERL_NIF_TERM term, hash128_t *out)
+{
+    cabala_st *st = ctx->st;
+    const ERL_NIF_TERM *array;
+    ErlNifBinary bin;
+    ErlNifSInt64 i64;
+    int arity, i, j;
+
+    if(!enif_get_tuple(ctx->env, term, &arity, &array)) {
+        return 0;
+    }
+
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_oid)) {
+        uint8_t oid[12];
+        if(!enif_inspect_binary(ctx->env, array[1], &bin)) {
+            return 0;
+        }
+        if(bin.size == 24) {
+            if(!oid_from_hex((const char *)bin.data, oid)) {
+                return 0;
+            }
+            *out = hash_leaf(ctx, BSON_TYPE_OID, oid, 12);
+            return 1;
+        }
+        if(bin.size != 12) {
+            return 0;
+        }
+        *out = hash_leaf(ctx, BSON_TYPE_OID, bin.data, 12);
+        return 1;
+    }
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_f64)) {
+        return hash_term_packed(ctx, BSON_TYPE_DOUBLE, 8, array[1], out);
+    }
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_i32)) {
+        return hash_term_packed(ctx, BSON_TYPE_INT32, 4, array[1], out);
+    }
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_i64)) {
+        return hash_term_packed(ctx, BSON_TYPE_INT64, 8, array[1], out);
+    }
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_date)) {
+        uint64_t v;
+        if(!enif_get_int64(ctx->env, array[1], &i64)) {
+            return 0;
+        }
+        v = BSON_UINT64_TO_LE((uint64_t)i64);
+        *out = hash_leaf(ctx, BSON_TYPE_DATE_TIME, &v, sizeof v);
+        return 1;
+    }
+    if(arity == 2 && enif_is_identical(array[0], st->atom_s_javascript)) {
+        if(!enif_inspect_binary(ctx->env, array[1], &bin)) {
+            return 0;
+        }
+        *out = hash_leaf(ctx, BSON_TYPE_CODE, bin.data, bin.size);
+        return 1;
+    }
+    if(arity == 4 && enif_is_identical(array[0], st->atom_s_type) &&
+            enif_is_identical(array[2], st->atom_s_binary)) {
+        uint8_t tag = BSON_TYPE_BINARY, uuid[16];
+        if(!enif_get_int(ctx->env, array[1], &i) ||
+                !enif_inspect_binary(ctx->env, array[3], &bin)) {
+            return 0;
+        }
+        /* the text form of decode's {uuid_format, string} */
+        if(i == BSON_SUBTYPE_UUID && bin.size == 36) {
+            if(!uuid_from_string((const char *)bin.data, uuid)) {
+                return 0;
+            }
+            bin.data = uuid;
+            bin.size = 16;
+        }
+        *out = hash_leaf(ctx, (uint8_t)i, &tag, 1);
+        *out = hash_combine(*out, hash_leaf(ctx, tag, bin.data, bin.size));
+        return 1;
+    }
+    if(arity == 4 && enif_is_identical(array[0], st->atom_s_regex) &&
+            enif_is_identical(array[2], st->atom_s_options)) {
+        ErlNifBinary options;
+        if(!enif_inspect_binary(ctx->env, array[1], &bin) ||
+                !enif_inspect_binary(ctx->env, array[3], &options)) {
+            return 0;
+        }
+        *out = hash_combine(hash_leaf(ctx, BSON_TYPE_REGEX, bin.data, bin.size),
+                            hash_leaf(ctx, BSON_TYPE_REGEX, options.data, options.size));
+        return 1;
+    }
+    if(arity == 4 && enif_is_identical(array[0], st->atom_s_javascript) &&
+            enif_is_identical(array[2], st->atom_s_scope)) {
+        hash128_t scope_hash;
+        if(!enif_inspect_binary(ctx->env, array[1], &bin) ||
+                !hash_term_doc(ctx, array[3], &scope_hash)) {
+            return 0;
+        }
+        *out = hash_combine(hash_leaf(ctx, BSON_TYPE_CODEWSCOPE, bin.data, bin.size),
+                            scope_hash);
+        return 1;
+    }
+    if(arity == 4 && enif_is_identical(array[0], st->atom_s_timestamp) &&
+            enif_is_identical(array[2], st->atom_s_increment)) {
+        uint64_t v;
+        if(!enif_get_int(ctx->env, array[1], &i) ||
+                !enif_get_int(ctx->env, array[3], &j)) {
+            return 0;
+        }
+        v = BSON_UINT64_TO_LE(((uint64_t)(uint32_t)i << 32) | (uint32_t)j);
+        *out = hash_leaf(ctx, BSON_TYPE_TIMESTAMP, &v, sizeof v);
+        return 1;
+    }
+
+    return hash_term_doc(ctx, term, out);
+}
+
+static int
+hash_term_value(hash_ctx *ctx, ERL_NIF_TERM term, hash128_t *out)
+{
+    cabala_st *st = ctx->st;
+    ErlNifBinary bin;
+    ErlNifSInt64 i64;
+    double d;
+
+    if(enif_inspect_binary(ctx->env, term, &bin)) {
+        *out = hash_leaf(ctx, TAG_STRING, bin.data, bin.size);
+        return 1;
+    }
+    if(enif_is_map(ctx->env, term)) {
+        return hash_term_doc(ctx, term, out);
+    }
+    if(enif_is_tuple(ctx->env, term)) {
+        return hash_term_tuple(ctx, term, out);
+    }
+    if(enif_is_atom(ctx->env, term)) {
+        uint8_t v;
+        char buf[256];
+        const void *data;
+        size_t len;
+
+        if(enif_is_identical(term, st->atom_null) ||
+                enif_is_identical(term, st->atom_undefined)) {
+            *out = hash_leaf(ctx, TAG_NULL, NULL, 0);
+        } else if(enif_is_identical(term, st->atom_true) ||
+                enif_is_identical(term, st->atom_false)) {
+            v = enif_is_identical(term, st->atom_true) ? 1 : 0;
+            *out = hash_leaf(ctx, BSON_TYPE_BOOL, &v, 1);
+        } else if(enif_is_identical(term, st->atom_minkey)) {
+            *out = hash_leaf(ctx, BSON_TYPE_MINKEY, NULL, 0);
+        } else if(enif_is_identical(term, st->atom_maxkey)) {
+            *out = hash_leaf(ctx, BSON_TYPE_MAXKEY, NULL, 0);
+        } else if(term_bytes(ctx, term, buf, sizeof buf, &data, &len)) {
+            *out = hash_leaf(ctx, TAG_STRING, data, len);
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    if(enif_is_list(ctx->env, term)) {
+        ERL_NIF_TERM item;
+        hash128_t acc = hash_leaf(ctx, TAG_ARRAY, NULL, 0), val;
+
+        if(ctx->depth >= MAX_DEPTHS) {
+            return 0;
+        }
+        ctx->depth++;
+        while(enif_get_list_cell(ctx->env, term, &item, &term)) {
+            if(!hash_term_value(ctx, item, &val)) {
+                return 0;
+            }
+            acc = hash_combine(acc, val);
+        }
+        ctx->depth--;
+        *out = acc;
+        return 1;
+    }
+    if(enif_get_int64(ctx->env, term, &i64)) {
+        *out = hash_int(ctx, i64);
+        return 1;
+    }
+    if(enif_get_double(ctx->env, term, &d)) {
+        *out = hash_double(ctx, d);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Hash options: canonical, {bits, 64 | 128}, {seed, Int}. 64 bit hashes
+ * are returned as integers, 128 bit ones as 16 byte binaries.
+ */
+static int
+parse_hash_opts(ErlNifEnv *env, ERL_NIF_TERM opts, hash_ctx *ctx,
+                bool *canonical, int *bits)
+{
+    cabala_st *st = ctx->st;
+    ERL_NIF_TERM item;
+    const ERL_NIF_TERM *tuple;
+    ErlNifUInt64 seed;
+    int arity;
+
+    ctx->seed = 0;
+    *canonical = false;
+    *bits = 64;
+
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_canonical) == 0) {
+            *canonical = true;
+            continue;
+        }
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            return 0;
+        }
+        if(enif_compare(tuple[0], st->atom_bits) == 0) {
+            if(!enif_get_int(env, tuple[1], bits) || (*bits != 64 && *bits != 128)) {
+                return 0;
+            }
+        } else if(enif_compare(tuple[0], st->atom_seed) == 0) {
+            if(!enif_get_uint64(env, tuple[1], &seed)) {
+                return 0;
+            }
+            ctx->seed = seed;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static ERL_NIF_TERM
+make_hash(ErlNifEnv *env, hash128_t h, int bits)
+{
+    ERL_NIF_TERM out;
+    uint64_t be[2];
+
+    if(bits == 64) {
+        return enif_make_uint64(env, h.lo);
+    }
+#if BSON_BYTE_ORDER == BSON_BIG_ENDIAN
+    be[0] = h.hi;
+    be[1] = h.lo;
+#else
+    be[0] = __builtin_bswap64(h.hi);
+    be[1] = __builtin_bswap64(h.lo);
+#endif
+    if(!make_binary(env, &out, be, sizeof be)) {
+        return enif_make_badarg(env);
+    }
+    return out;
+}
+
+ERL_NIF_TERM
+hash(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ErlNifBinary bin;
+    hash_ctx     ctx;
+    hash128_t    h;
+    bool         canonical;
+    int          bits;
+    bson_t       bson;
+    bson_iter_t  iter;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+    ctx.env = env;
+    ctx.st = st;
+    ctx.depth = 0;
+    if(!parse_hash_opts(env, argv[1], &ctx, &canonical, &bits)) {
+        return enif_make_badarg(env);
+    }
+
+    if(!bson_init_static(&bson, bin.data, bin.size)) {
+        return make_error(st, env, "badbson");
+    }
+    if(!canonical) {
+        h = xxh128(bin.data, bin.size, ctx.seed);
+    } else if(!bson_iter_init(&iter, &bson) ||
+            !hash_iter_doc(&ctx, &iter, false, &h)) {
+        return make_error(st, env, "badbson");
+    }
+    return make_hash(env, h, bits);
+}
+
+ERL_NIF_TERM
+hash_term(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st *st = (cabala_st*)enif_priv_data(env);
+    hash_ctx   ctx;
+    hash128_t  h;
+    bool       canonical;
+    int        bits;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_is_tuple(env, argv[0]) && !enif_is_map(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+    ctx.env = env;
+    ctx.st = st;
+    ctx.depth = 0;
+    if(!parse_hash_opts(env, argv[1], &ctx, &canonical, &bits)) {
+        return enif_make_badarg(env);
+    }
+
+    if(!hash_term_doc(&ctx, argv[0], &h)) {
+        return make_error(st, env, "internal_error");
+    }
+    return make_hash(env, h, bits);
+}
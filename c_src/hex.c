@@ -0,0 +1,188 @@
+#include "cabala.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_SSE2 1
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* 0-15 for a hex digit of either case, 0xff otherwise */
+static inline uint8_t
+hex_value(uint8_t c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return 0xff;
+}
+
+#ifdef HEX_SSE2
+/* 16 bytes into 32 lower case digits */
+static inline void
+hex_encode16(const uint8_t *src, char *dst)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+    __m128i v, hi, lo;
+
+    v = _mm_loadu_si128((const __m128i *)src);
+    hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    lo = _mm_and_si128(v, mask);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+                      _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+                      _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/* 32 digits into 16 bytes, 0 if any of them is not a hex digit */
+static inline int
+hex_decode32(const char *src, uint8_t *dst)
+{
+    const __m128i digit_lo = _mm_set1_epi8('0' - 1);
+    const __m128i digit_hi = _mm_set1_epi8('9' + 1);
+    const __m128i alpha_lo = _mm_set1_epi8('a' - 1);
+    const __m128i alpha_hi = _mm_set1_epi8('f' + 1);
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8('a' - 10);
+    const __m128i low_byte = _mm_set1_epi16(0x00ff);
+    __m128i v[2], d, a, is_d, is_a;
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        d = _mm_loadu_si128((const __m128i *)(src + i * 16));
+        a = _mm_or_si128(d, lower);
+        /* bytes of 0x80 and up are negative, outside both ranges */
+        is_d = _mm_and_si128(_mm_cmpgt_epi8(d, digit_lo),
+                             _mm_cmpgt_epi8(digit_hi, d));
+        is_a = _mm_and_si128(_mm_cmpgt_epi8(a, alpha_lo),
+                             _mm_cmpgt_epi8(alpha_hi, a));
+        if(_mm_movemask_epi8(_mm_or_si128(is_d, is_a)) != 0xffff) {
+            return 0;
+        }
+        v[i] = _mm_or_si128(_mm_and_si128(is_d, _mm_sub_epi8(d, zero)),
+                            _mm_and_si128(is_a, _mm_sub_epi8(a, alpha)));
+        /* each 16 bit lane holds the high nibble then the low one */
+        v[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v[i], low_byte), 4),
+                            _mm_srli_epi16(v[i], 8));
+    }
+    _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(v[0], v[1]));
+    return 1;
+}
+#endif
+
+/* len bytes into 2 * len lower case hex digits */
+void
+hex_encode(const uint8_t *src, size_t len, char *dst)
+{
+    size_t i = 0;
+
+#ifdef HEX_SSE2
+    for(; i + 16 <= len; i += 16) {
+        hex_encode16(src + i, dst + 2 * i);
+    }
+#endif
+    for(; i < len; i++) {
+        dst[2 * i] = hex_digits[src[i] >> 4];
+        dst[2 * i + 1] = hex_digits[src[i] & 0x0f];
+    }
+}
+
+/* len digits (even) into len / 2 bytes, 0 when a digit is not hex */
+int
+hex_decode(const char *src, size_t len, uint8_t *dst)
+{
+    size_t  i = 0;
+    uint8_t hi, lo;
+
+    if(len % 2 != 0) {
+        return 0;
+    }
+#ifdef HEX_SSE2
+    for(; i + 32 <= len; i += 32) {
+        if(!hex_decode32(src + i, dst + i / 2)) {
+            return 0;
+        }
+    }
+#endif
+    for(; i < len; i += 2) {
+        hi = hex_value(src[i]);
+        lo = hex_value(src[i + 1]);
+        if((hi | lo) & 0xf0) {
+            return 0;
+        }
+        dst[i / 2] = (hi << 4) | lo;
+    }
+    return 1;
+}
+
+/* 12 bytes into 24 digits, through a padded block for the vector path */
+void
+oid_to_hex(const uint8_t *oid, char *dst)
+{
+    uint8_t src[16];
+    char    buf[32];
+
+    memcpy(src, oid, 12);
+    memset(src + 12, 0, 4);
+    hex_encode(src, 16, buf);
+    memcpy(dst, buf, 24);
+}
+
+int
+oid_from_hex(const char *src, uint8_t *oid)
+{
+    char    buf[32];
+    uint8_t out[16];
+
+    memcpy(buf, src, 24);
+    memset(buf + 24, '0', 8);
+    if(!hex_decode(buf, 32, out)) {
+        return 0;
+    }
+    memcpy(oid, out, 12);
+    return 1;
+}
+
+/* 16 bytes into the 36 character 8-4-4-4-12 form */
+void
+uuid_to_string(const uint8_t *uuid, char *dst)
+{
+    char buf[32];
+
+    hex_encode(uuid, 16, buf);
+    memcpy(dst, buf, 8);
+    dst[8] = '-';
+    memcpy(dst + 9, buf + 8, 4);
+    dst[13] = '-';
+    memcpy(dst + 14, buf + 12, 4);
+    dst[18] = '-';
+    memcpy(dst + 19, buf + 16, 4);
+    dst[23] = '-';
+    memcpy(dst + 24, buf + 20, 12);
+}
+
+int
+uuid_from_string(const char *src, uint8_t *uuid)
+{
+    char buf[32];
+
+    if(src[8] != '-' || src[13] != '-' || src[18] != '-' || src[23] != '-') {
+        return 0;
+    }
+    memcpy(buf, src, 8);
+    memcpy(buf + 8, src + 9, 4);
+    memcpy(buf + 12, src + 14, 4);
+    memcpy(buf + 16, src + 19, 4);
+    memcpy(buf + 20, src + 24, 12);
+    return hex_decode(buf, 32, uuid);
+}
@@ -0,0 +1,469 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cabala.h"
+
+/*
+ * sidecar layout: magic, source size, count, source inode and mtime in
+ * nanoseconds (both 0 for a binary source), then count offsets
+ */
+#define SIDECAR_MAGIC       "CBIX0002"
+#define SIDECAR_HEADER_LEN  40
+
+typedef struct {
+    ErlNifEnv     *env;     // holds the source binary
+    uint8_t       *map;     // or the mapping of the source file
+    const uint8_t *data;
+    size_t         size;
+    uint64_t      *offsets; // count + 1 entries, the last one is size
+    size_t         count;
+    uint64_t       ino;     // of the source file, 0 for a binary
+    uint64_t       mtime;
+} index_res;
+
+void
+index_dtor(ErlNifEnv *env, void *obj)
+{
+    index_res *res = obj;
+
+    if(res->env) {
+        enif_free_env(res->env);
+    }
+    if(res->map) {
+        munmap(res->map, res->size);
+    }
+    if(res->offsets) {
+        enif_free(res->offsets);
+    }
+}
+
+/*
+ * One pass over the length prefixes with the framing checks of
+ * bson_new_from_data: a length of at least 5 that fits in what is left,
+ * and a trailing NUL. Returns the offset of a bad document or -1.
+ */
+int64_t
+scan_offsets(const uint8_t *data, size_t size, vec_u64_t *offsets)
+{
+    size_t  pos = 0;
+    int32_t len;
+
+    while(pos < size) {
+        if(size - pos < 5) {
+            return pos;
+        }
+        memcpy(&len, data + pos, sizeof len);
+        len = (int32_t)BSON_UINT32_FROM_LE((uint32_t)len);
+        if(len < 5 || (size_t)len > size - pos || data[pos + len - 1] != 0) {
+            return pos;
+        }
+        if(vec_push(offsets, pos) != 0) {
+            return pos;
+        }
+        pos += len;
+    }
+    return -1;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        n = read(fd, buf, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return 0;
+        }
+        buf = (uint8_t*)buf + n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Only a sidecar written for the same source is used: a file of the same
+ * size, inode and mtime, or a binary whose length prefixes chain exactly
+ * from one stored offset to the next.
+ */
+static int
+load_sidecar(const char *path, index_res *res)
+{
+    uint8_t  header[SIDECAR_HEADER_LEN];
+    uint64_t size, count, ino, mtime, i;
+    int32_t  len;
+    int      fd, ret = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    if(!read_all(fd, header, sizeof header) ||
+            memcmp(header, SIDECAR_MAGIC, 8) != 0) {
+        goto done;
+    }
+    memcpy(&size, header + 8, 8);
+    memcpy(&count, header + 16, 8);
+    memcpy(&ino, header + 24, 8);
+    memcpy(&mtime, header + 32, 8);
+    size = BSON_UINT64_FROM_LE(size);
+    count = BSON_UINT64_FROM_LE(count);
+    ino = BSON_UINT64_FROM_LE(ino);
+    mtime = BSON_UINT64_FROM_LE(mtime);
+    if(size != res->size || count > size / 5 ||
+            ino != res->ino || mtime != res->mtime) {
+        goto done;
+    }
+
+    res->offsets = enif_alloc((count + 1) * sizeof(uint64_t));
+    if(!res->offsets) {
+        goto done;
+    }
+    if(!read_all(fd, res->offsets, count * sizeof(uint64_t))) {
+        goto done;
+    }
+    for(i = 0; i < count; i++) {
+        res->offsets[i] = BSON_UINT64_FROM_LE(res->offsets[i]);
+        if(res->offsets[i] >= size ||
+                (i > 0 && res->offsets[i] <= res->offsets[i - 1])) {
+            goto done;
+        }
+    }
+    res->offsets[count] = size;
+    if(!res->map) {
+        for(i = 0; i < count; i++) {
+            if(size - res->offsets[i] < 5) {
+                goto done;
+            }
+            memcpy(&len, res->data + res->offsets[i], sizeof len);
+            len = (int32_t)BSON_UINT32_FROM_LE((uint32_t)len);
+            if((i == 0 && res->offsets[0] != 0) || len < 5 ||
+                    res->offsets[i] + len != res->offsets[i + 1] ||
+                    res->data[res->offsets[i + 1] - 1] != 0) {
+                goto done;
+            }
+        }
+        if(count == 0 && size != 0) {
+            goto done;
+        }
+    }
+    res->count = count;
+    ret = 1;
+
+done:
+    if(!ret && res->offsets) {
+        enif_free(res->offsets);
+        res->offsets = NULL;
+    }
+    close(fd);
+    return ret;
+}
+
+/* written next to the final name and renamed, so readers never see half */
+static int
+save_sidecar(const char *path, index_res *res)
+{
+    char     tmp[MAX_PATH_LEN + 8];
+    uint8_t  header[SIDECAR_HEADER_LEN];
+    uint64_t v;
+    size_t   i;
+    FILE    *fp;
+    int      ok;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if(!fp) {
+        return errno;
+    }
+
+    memcpy(header, SIDECAR_MAGIC, 8);
+    v = BSON_UINT64_TO_LE((uint64_t)res->size);
+    memcpy(header + 8, &v, 8);
+    v = BSON_UINT64_TO_LE((uint64_t)res->count);
+    memcpy(header + 16, &v, 8);
+    v = BSON_UINT64_TO_LE(res->ino);
+    memcpy(header + 24, &v, 8);
+    v = BSON_UINT64_TO_LE(res->mtime);
+    memcpy(header + 32, &v, 8);
+
+    ok = fwrite(header, sizeof header, 1, fp) == 1;
+    for(i = 0; ok && i < res->count; i++) {
+        v = BSON_UINT64_TO_LE(res->offsets[i]);
+        ok = fwrite(&v, sizeof v, 1, fp) == 1;
+    }
+    if(fclose(fp) != 0) {
+        ok = 0;
+    }
+    if(!ok || rename(tmp, path) != 0) {
+        int err = errno ? errno : EIO;
+        unlink(tmp);
+        return err;
+    }
+    return 0;
+}
+
+static int
+get_source(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM term, index_res *res)
+{
+    const ERL_NIF_TERM *tuple;
+    ErlNifBinary bin;
+    ERL_NIF_TERM copy;
+    struct stat  sb;
+    char         path[MAX_PATH_LEN];
+    int          arity, err;
+
+    if(enif_is_binary(env, term)) {
+        res->env = enif_alloc_env();
+        if(!res->env) {
+            return ENOMEM;
+        }
+        copy = enif_make_copy(res->env, term);
+        if(!enif_inspect_binary(res->env, copy, &bin)) {
+            return ENOMEM;
+        }
+        res->data = bin.data;
+        res->size = bin.size;
+        return 0;
+    }
+
+    if(!enif_get_tuple(env, term, &arity, &tuple) || arity != 2 ||
+            enif_compare(tuple[0], st->atom_file) != 0 ||
+            !get_path(env, tuple[1], path, sizeof path)) {
+        return EINVAL;
+    }
+    /* stamped before mapping, a later change only makes the sidecar stale */
+    if(stat(path, &sb) != 0) {
+        return errno;
+    }
+    res->ino = (uint64_t)sb.st_ino;
+#ifdef __APPLE__
+    res->mtime = (uint64_t)sb.st_mtimespec.tv_sec * 1000000000 +
+                 sb.st_mtimespec.tv_nsec;
+#else
+    res->mtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 +
+                 sb.st_mtim.tv_nsec;
+#endif
+    if((err = map_file(path, &res->map, &res->size)) != 0) {
+        return err;
+    }
+    res->data = res->map;
+    return 0;
+}
+
+ERL_NIF_TERM
+index_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    index_res   *res;
+    vec_u64_t    offsets;
+    char         sidecar[MAX_PATH_LEN];
+    ERL_NIF_TERM opts, item, out;
+    const ERL_NIF_TERM *tuple;
+    bool         has_sidecar = false;
+    int64_t      bad;
+    int          arity, err;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_sidecar) == 0 &&
+                get_path(env, tuple[1], sidecar, sizeof sidecar)) {
+            has_sidecar = true;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    res = enif_alloc_resource(st->res_index, sizeof(index_res));
+    if(!res) {
+        return make_error(st, env, "internal_error");
+    }
+    memset(res, 0, sizeof(index_res));
+
+    if((err = get_source(env, st, argv[0], res)) != 0) {
+        enif_release_resource(res);
+        if(err == EINVAL) {
+            return enif_make_badarg(env);
+        }
+        return make_errno_error(st, env, err);
+    }
+
+    if(!has_sidecar || !load_sidecar(sidecar, res)) {
+        vec_init(&offsets);
+        if(res->map) {
+            madvise(res->map, res->size, MADV_SEQUENTIAL);
+        }
+        bad = scan_offsets(res->data, res->size, &offsets);
+        if(bad >= 0) {
+            vec_deinit(&offsets);
+            enif_release_resource(res);
+            return make_obj_error(st, env, "badbson", enif_make_int64(env, bad));
+        }
+        if(vec_push(&offsets, res->size) != 0) {
+            vec_deinit(&offsets);
+            enif_release_resource(res);
+            return make_error(st, env, "internal_error");
+        }
+
+        /* keep the offsets in a plain array owned by the resource */
+        res->count = offsets.length - 1;
+        res->offsets = enif_alloc(offsets.length * sizeof(uint64_t));
+        if(!res->offsets) {
+            vec_deinit(&offsets);
+            enif_release_resource(res);
+            return make_error(st, env, "internal_error");
+        }
+        memcpy(res->offsets, offsets.data, offsets.length * sizeof(uint64_t));
+        vec_deinit(&offsets);
+
+        if(has_sidecar && (err = save_sidecar(sidecar, res)) != 0) {
+            enif_release_resource(res);
+            return make_errno_error(st, env, err);
+        }
+    }
+    if(res->map) {
+        madvise(res->map, res->size, MADV_RANDOM);
+    }
+
+    out = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return out;
+}
+
+ERL_NIF_TERM
+index_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st *st = (cabala_st*)enif_priv_data(env);
+    index_res *res;
+
+    if(argc != 1) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_index, (void **)&res)) {
+        return enif_make_badarg(env);
+    }
+    return enif_make_uint64(env, res->count);
+}
+
+static inline ERL_NIF_TERM
+make_doc(ErlNifEnv *env, index_res *res, size_t n)
+{
+    uint64_t off = res->offsets[n];
+    return enif_make_resource_binary(env, res, res->data + off,
+                                     res->offsets[n + 1] - off);
+}
+
+/* the Nth document (1-based) */
+ERL_NIF_TERM
+index_nth(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    index_res   *res;
+    ErlNifUInt64 n;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_index, (void **)&res) ||
+            !enif_get_uint64(env, argv[1], &n) || n == 0 || n > res->count) {
+        return enif_make_badarg(env);
+    }
+    return make_doc(env, res, n - 1);
+}
+
+/*
+ * Documents From..From+Count-1 (1-based) as binaries pointing into the
+ * source, which the index keeps alive.
+ */
+ERL_NIF_TERM
+index_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    index_res    *res;
+    ERL_NIF_TERM *docs, out;
+    ErlNifUInt64  from, count, i;
+
+    if(argc != 3) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_index, (void **)&res) ||
+            !enif_get_uint64(env, argv[1], &from) ||
+            !enif_get_uint64(env, argv[2], &count) ||
+            from == 0) {
+        return enif_make_badarg(env);
+    }
+    if(from > res->count) {
+        return enif_make_list(env, 0);
+    }
+    if(count > res->count - from + 1) {
+        count = res->count - from + 1;
+    }
+
+    docs = enif_alloc((count + 1) * sizeof(ERL_NIF_TERM));
+    if(!docs) {
+        return make_error(st, env, "internal_error");
+    }
+    for(i = 0; i < count; i++) {
+        docs[i] = make_doc(env, res, from - 1 + i);
+    }
+    out = enif_make_list_from_array(env, docs, count);
+    enif_free(docs);
+    return out;
+}
+
+/*
+ * Split the index into at most Parts disjoint {From, Count} ranges of
+ * roughly equal byte size, for decoding in parallel.
+ */
+ERL_NIF_TERM
+index_ranges(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    index_res   *res;
+    ERL_NIF_TERM out;
+    unsigned     parts, p;
+    size_t       from, to, lo, hi, mid;
+    uint64_t     target;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_index, (void **)&res) ||
+            !enif_get_uint(env, argv[1], &parts) || parts == 0) {
+        return enif_make_badarg(env);
+    }
+
+    out = enif_make_list(env, 0);
+    to = res->count;
+    for(p = parts; p > 0 && to > 0; p--) {
+        /* the part starts at the last document at or below its share */
+        target = (uint64_t)((double)res->size * (p - 1) / parts);
+        lo = 0;
+        hi = to - 1;
+        while(lo < hi) {
+            mid = lo + (hi - lo + 1) / 2;
+            if(res->offsets[mid] <= target) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        from = p == 1 ? 0 : lo;
+        out = enif_make_list_cell(env,
+                enif_make_tuple2(env, enif_make_uint64(env, from + 1),
+                                 enif_make_uint64(env, to - from)),
+                out);
+        to = from;
+    }
+    return out;
+}
@@ -0,0 +1,503 @@
+#include <math.h>
+
+#include "cabala.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#endif
+
+/* the last millisecond of 9999-12-31, relaxed dates use ISO-8601 up to it */
+#define JSON_MAX_ISO_DATE   253402300799999LL
+
+#define PUT_LIT(buf, s)     buffer_append(buf, s, sizeof(s) - 1)
+#define PUT_WRAPPED(buf, s, v)  put_wrapped_int64(buf, s, sizeof(s) - 1, v)
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int put_document(buffer_t *buf, const bson_t *doc, int array,
+                        int canonical, int depth);
+
+/* decimal digits of v, two at a time, returns the length (at most 20) */
+static size_t
+format_uint64(uint64_t v, char *out)
+{
+    char   tmp[20];
+    size_t pos = sizeof tmp, idx;
+
+    while(v >= 100) {
+        idx = (v % 100) * 2;
+        v /= 100;
+        tmp[--pos] = digit_pairs[idx + 1];
+        tmp[--pos] = digit_pairs[idx];
+    }
+    if(v >= 10) {
+        tmp[--pos] = digit_pairs[v * 2 + 1];
+        tmp[--pos] = digit_pairs[v * 2];
+    } else {
+        tmp[--pos] = '0' + v;
+    }
+    memcpy(out, tmp + pos, sizeof tmp - pos);
+    return sizeof tmp - pos;
+}
+
+static size_t
+format_int64(int64_t v, char *out)
+{
+    if(v < 0) {
+        *out = '-';
+        return 1 + format_uint64((uint64_t)0 - (uint64_t)v, out + 1);
+    }
+    return format_uint64((uint64_t)v, out);
+}
+
+/*
+ * Shortest text that reads back as the same finite double. Integral
+ * values below 1e15 go through the integer formatter with ".0"
+ * appended, the rest through printf with increasing precision.
+ */
+static size_t
+format_double(double d, char *out)
+{
+    size_t len;
+    int    prec;
+
+    if(d == trunc(d) && fabs(d) < 1e15) {
+        if(d == 0 && signbit(d)) {
+            memcpy(out, "-0.0", 4);
+            return 4;
+        }
+        len = format_int64((int64_t)d, out);
+        memcpy(out + len, ".0", 2);
+        return len + 2;
+    }
+    for(prec = 15; prec < 17; prec++) {
+        len = snprintf(out, 32, "%.*g", prec, d);
+        if(strtod(out, NULL) == d) {
+            return len;
+        }
+    }
+    return snprintf(out, 32, "%.17g", d);
+}
+
+static int
+put_int64(buffer_t *buf, int64_t v)
+{
+    char tmp[24];
+    return buffer_append(buf, tmp, format_int64(v, tmp));
+}
+
+/* {"$numberInt": "1"} and the like */
+static int
+put_wrapped_int64(buffer_t *buf, const char *wrap, size_t wrap_len, int64_t v)
+{
+    return buffer_append(buf, wrap, wrap_len) &&
+           put_int64(buf, v) &&
+           PUT_LIT(buf, "\"}");
+}
+
+/* the number of leading bytes that need no escaping, in either direction */
+size_t
+json_safe_run(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        /* unsigned v <= 0x1f is min(v, 0x1f) == v */
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+        int mask = _mm_movemask_epi8(m);
+
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while(i < len && p[i] >= 0x20 && p[i] != '"' && p[i] != '\\') {
+        i++;
+    }
+    return i;
+}
+
+static int
+put_escape(buffer_t *buf, uint8_t c)
+{
+    char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+
+    switch(c) {
+    case '"':  return PUT_LIT(buf, "\\\"");
+    case '\\': return PUT_LIT(buf, "\\\\");
+    case '\b': return PUT_LIT(buf, "\\b");
+    case '\f': return PUT_LIT(buf, "\\f");
+    case '\n': return PUT_LIT(buf, "\\n");
+    case '\r': return PUT_LIT(buf, "\\r");
+    case '\t': return PUT_LIT(buf, "\\t");
+    default:
+        esc[4] = "0123456789abcdef"[c >> 4];
+        esc[5] = "0123456789abcdef"[c & 0x0f];
+        return buffer_append(buf, esc, 6);
+    }
+}
+
+/* a quoted string, runs without special characters are copied whole */
+static int
+put_string(buffer_t *buf, const char *str, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)str;
+    size_t run;
+
+    if(!buffer_reserve(buf, len + 2) || !PUT_LIT(buf, "\"")) {
+        return 0;
+    }
+    while(len > 0) {
+        run = json_safe_run(p, len);
+        if(run > 0 && !buffer_append(buf, p, run)) {
+            return 0;
+        }
+        if(run == len) {
+            break;
+        }
+        if(!put_escape(buf, p[run])) {
+            return 0;
+        }
+        p += run + 1;
+        len -= run + 1;
+    }
+    return PUT_LIT(buf, "\"");
+}
+
+static int
+put_base64(buffer_t *buf, const uint8_t *data, size_t len)
+{
+    size_t   i, out_len = (len + 2) / 3 * 4;
+    uint8_t *p;
+    uint32_t v;
+
+    if(!buffer_reserve(buf, out_len)) {
+        return 0;
+    }
+    p = buf->bin.data + buf->len;
+    for(i = 0; i + 3 <= len; i += 3) {
+        v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *p++ = base64_chars[v >> 18];
+        *p++ = base64_chars[(v >> 12) & 0x3f];
+        *p++ = base64_chars[(v >> 6) & 0x3f];
+        *p++ = base64_chars[v & 0x3f];
+    }
+    if(i < len) {
+        v = data[i] << 16;
+        if(i + 1 < len) {
+            v |= data[i + 1] << 8;
+        }
+        *p++ = base64_chars[v >> 18];
+        *p++ = base64_chars[(v >> 12) & 0x3f];
+        *p++ = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+        *p++ = '=';
+    }
+    buf->len += out_len;
+    return 1;
+}
+
+/* YYYY-MM-DDTHH:MM:SS.mmmZ for 0 <= ms <= JSON_MAX_ISO_DATE */
+static int
+put_iso_date(buffer_t *buf, int64_t ms)
+{
+    int64_t  days = ms / 86400000, rem = ms % 86400000;
+    int64_t  era, doe, yoe, doy, mp, y, m, d;
+    char     tmp[48];
+    int      n;
+
+    /* civil_from_days, Howard Hinnant's algorithm */
+    days += 719468;
+    era = days / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y += m <= 2;
+
+    /* 26 bytes in range, tmp fits the widest output the field types allow */
+    n = snprintf(tmp, sizeof tmp, "\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\"",
+                 (int)y, (int)m, (int)d, (int)(rem / 3600000),
+                 (int)(rem / 60000 % 60), (int)(rem / 1000 % 60),
+                 (int)(rem % 1000));
+    if(n < 0 || (size_t)n >= sizeof tmp) {
+        return 0;
+    }
+    return buffer_append(buf, tmp, (size_t)n);
+}
+
+static int
+put_double(buffer_t *buf, double d, int canonical)
+{
+    char   tmp[32];
+    size_t len;
+
+    if(isnan(d)) {
+        return PUT_LIT(buf, "{\"$numberDouble\":\"NaN\"}");
+    }
+    if(isinf(d)) {
+        return d > 0 ? PUT_LIT(buf, "{\"$numberDouble\":\"Infinity\"}")
+                     : PUT_LIT(buf, "{\"$numberDouble\":\"-Infinity\"}");
+    }
+    len = format_double(d, tmp);
+    if(!canonical) {
+        return buffer_append(buf, tmp, len);
+    }
+    return PUT_LIT(buf, "{\"$numberDouble\":\"") &&
+           buffer_append(buf, tmp, len) &&
+           PUT_LIT(buf, "\"}");
+}
+
+static int
+put_oid(buffer_t *buf, const bson_oid_t *oid)
+{
+    char hex[24];
+
+    oid_to_hex(oid->bytes, hex);
+    return PUT_LIT(buf, "{\"$oid\":\"") &&
+           buffer_append(buf, hex, 24) &&
+           PUT_LIT(buf, "\"}");
+}
+
+static int
+put_subdocument(buffer_t *buf, const uint8_t *data, uint32_t len, int array,
+                int canonical, int depth)
+{
+    bson_t doc;
+
+    if(!bson_init_static(&doc, data, len)) {
+        return 0;
+    }
+    return put_document(buf, &doc, array, canonical, depth + 1);
+}
+
+/* one value, in the Extended JSON v2 form of its type */
+static int
+put_value(buffer_t *buf, const bson_iter_t *iter, int canonical, int depth)
+{
+    const uint8_t    *data;
+    const char       *str, *opts;
+    const bson_oid_t *oid;
+    bson_subtype_t    subtype;
+    bson_decimal128_t dec;
+    uint32_t          len, scope_len, ts, inc;
+    int64_t           ms;
+    char              tmp[BSON_DECIMAL128_STRING];
+
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_DOUBLE:
+        return put_double(buf, bson_iter_double(iter), canonical);
+    case BSON_TYPE_UTF8:
+        str = bson_iter_utf8(iter, &len);
+        return put_string(buf, str, len);
+    case BSON_TYPE_DOCUMENT:
+        bson_iter_document(iter, &len, &data);
+        return put_subdocument(buf, data, len, 0, canonical, depth);
+    case BSON_TYPE_ARRAY:
+        bson_iter_array(iter, &len, &data);
+        return put_subdocument(buf, data, len, 1, canonical, depth);
+    case BSON_TYPE_BINARY:
+        bson_iter_binary(iter, &subtype, &len, &data);
+        tmp[0] = "0123456789abcdef"[(subtype >> 4) & 0x0f];
+        tmp[1] = "0123456789abcdef"[subtype & 0x0f];
+        return PUT_LIT(buf, "{\"$binary\":{\"base64\":\"") &&
+               put_base64(buf, data, len) &&
+               PUT_LIT(buf, "\",\"subType\":\"") &&
+               buffer_append(buf, tmp, 2) &&
+               PUT_LIT(buf, "\"}}");
+    case BSON_TYPE_UNDEFINED:
+        return PUT_LIT(buf, "{\"$undefined\":true}");
+    case BSON_TYPE_OID:
+        return put_oid(buf, bson_iter_oid(iter));
+    case BSON_TYPE_BOOL:
+        return bson_iter_bool(iter) ? PUT_LIT(buf, "true")
+                                    : PUT_LIT(buf, "false");
+    case BSON_TYPE_DATE_TIME:
+        ms = bson_iter_date_time(iter);
+        if(!canonical && ms >= 0 && ms <= JSON_MAX_ISO_DATE) {
+            return PUT_LIT(buf, "{\"$date\":") &&
+                   put_iso_date(buf, ms) &&
+                   PUT_LIT(buf, "}");
+        }
+        return PUT_WRAPPED(buf, "{\"$date\":{\"$numberLong\":\"", ms) &&
+               PUT_LIT(buf, "}");
+    case BSON_TYPE_NULL:
+        return PUT_LIT(buf, "null");
+    case BSON_TYPE_REGEX:
+        str = bson_iter_regex(iter, &opts);
+        return PUT_LIT(buf, "{\"$regularExpression\":{\"pattern\":") &&
+               put_string(buf, str, strlen(str)) &&
+               PUT_LIT(buf, ",\"options\":") &&
+               put_string(buf, opts, strlen(opts)) &&
+               PUT_LIT(buf, "}}");
+    case BSON_TYPE_DBPOINTER:
+        bson_iter_dbpointer(iter, &len, &str, &oid);
+        return PUT_LIT(buf, "{\"$dbPointer\":{\"$ref\":") &&
+               put_string(buf, str, len) &&
+               PUT_LIT(buf, ",\"$id\":") &&
+               put_oid(buf, oid) &&
+               PUT_LIT(buf, "}}");
+    case BSON_TYPE_CODE:
+        str = bson_iter_code(iter, &len);
+        return PUT_LIT(buf, "{\"$code\":") &&
+               put_string(buf, str, len) &&
+               PUT_LIT(buf, "}");
+    case BSON_TYPE_SYMBOL:
+        str = bson_iter_symbol(iter, &len);
+        return PUT_LIT(buf, "{\"$symbol\":") &&
+               put_string(buf, str, len) &&
+               PUT_LIT(buf, "}");
+    case BSON_TYPE_CODEWSCOPE:
+        str = bson_iter_codewscope(iter, &len, &scope_len, &data);
+        return PUT_LIT(buf, "{\"$code\":") &&
+               put_string(buf, str, len) &&
+               PUT_LIT(buf, ",\"$scope\":") &&
+               put_subdocument(buf, data, scope_len, 0, canonical, depth) &&
+               PUT_LIT(buf, "}");
+    case BSON_TYPE_INT32:
+        if(canonical) {
+            return PUT_WRAPPED(buf, "{\"$numberInt\":\"",
+                               bson_iter_int32(iter));
+        }
+        return put_int64(buf, bson_iter_int32(iter));
+    case BSON_TYPE_TIMESTAMP:
+        bson_iter_timestamp(iter, &ts, &inc);
+        return PUT_LIT(buf, "{\"$timestamp\":{\"t\":") &&
+               put_int64(buf, ts) &&
+               PUT_LIT(buf, ",\"i\":") &&
+               put_int64(buf, inc) &&
+               PUT_LIT(buf, "}}");
+    case BSON_TYPE_INT64:
+        if(canonical) {
+            return PUT_WRAPPED(buf, "{\"$numberLong\":\"",
+                               bson_iter_int64(iter));
+        }
+        return put_int64(buf, bson_iter_int64(iter));
+    case BSON_TYPE_DECIMAL128:
+        if(!bson_iter_decimal128(iter, &dec)) {
+            return 0;
+        }
+        bson_decimal128_to_string(&dec, tmp);
+        return PUT_LIT(buf, "{\"$numberDecimal\":\"") &&
+               buffer_append(buf, tmp, strlen(tmp)) &&
+               PUT_LIT(buf, "\"}");
+    case BSON_TYPE_MAXKEY:
+        return PUT_LIT(buf, "{\"$maxKey\":1}");
+    case BSON_TYPE_MINKEY:
+        return PUT_LIT(buf, "{\"$minKey\":1}");
+    default:
+        return 0;
+    }
+}
+
+static int
+put_document(buffer_t *buf, const bson_t *doc, int array, int canonical,
+             int depth)
+{
+    bson_iter_t iter;
+    const char *key;
+    int         first = 1;
+
+    if(depth >= JSON_MAX_DEPTH || !bson_iter_init(&iter, doc)) {
+        return 0;
+    }
+    if(!buffer_append(buf, array ? "[" : "{", 1)) {
+        return 0;
+    }
+    while(bson_iter_next(&iter)) {
+        if(!first && !PUT_LIT(buf, ",")) {
+            return 0;
+        }
+        first = 0;
+        if(!array) {
+            key = bson_iter_key(&iter);
+            if(!put_string(buf, key, strlen(key)) || !PUT_LIT(buf, ":")) {
+                return 0;
+            }
+        }
+        if(!put_value(buf, &iter, canonical, depth)) {
+            return 0;
+        }
+    }
+    if(iter.err_off) {
+        return 0;
+    }
+    return buffer_append(buf, array ? "]" : "}", 1);
+}
+
+static ERL_NIF_TERM
+to_json_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ErlNifBinary bin;
+    ERL_NIF_TERM opts, item, out;
+    buffer_t     buf;
+    bson_t       doc;
+    int          canonical = 0;
+
+    if(argc != 2 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_canonical) == 0) {
+            canonical = 1;
+        } else if(enif_compare(item, st->atom_relaxed) == 0) {
+            canonical = 0;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    if(!bson_init_static(&doc, bin.data, bin.size)) {
+        return make_error(st, env, "badbson");
+    }
+    if(!buffer_init(&buf, bin.size + bin.size / 2)) {
+        return make_error(st, env, "internal_error");
+    }
+    if(!put_document(&buf, &doc, 0, canonical, 0)) {
+        buffer_destroy(&buf);
+        return make_error(st, env, "badbson");
+    }
+    if(!buffer_make_binary(env, &buf, &out)) {
+        buffer_destroy(&buf);
+        return make_error(st, env, "internal_error");
+    }
+    return out;
+}
+
+/*
+ * Extended JSON v2 straight from the bson bytes. Small documents are
+ * written on the calling scheduler, large ones move to a dirty one.
+ */
+ERL_NIF_TERM
+to_json(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin;
+
+    if(argc != 2 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+    if(bin.size > JSON_DIRTY_BYTES) {
+        return enif_schedule_nif(env, "to_json", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 to_json_run, argc, argv);
+    }
+    return to_json_run(env, argc, argv);
+}
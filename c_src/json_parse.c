@@ -0,0 +1,1390 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "cabala.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#endif
+
+/*
+ * A string read from the input. Strings without escapes stay where they
+ * are in the input (raw), the others are unescaped into a buffer and
+ * found at off, so that the buffer may grow in the meantime.
+ */
+typedef struct {
+    const char *raw;
+    size_t      off;
+    size_t      len;
+} json_str;
+
+typedef struct {
+    const uint8_t *start;
+    const uint8_t *p;
+    const uint8_t *end;
+    buffer_t       keys;    // unescaped keys of the open levels, a stack
+    buffer_t       str;     // the string value at hand
+    buffer_t       aux;     // the second string of a wrapper, number text
+    int            depth;
+} json_parser;
+
+/* Extended JSON v2 type wrappers, {"$oid": ...} and the like */
+typedef enum {
+    EJ_NONE = 0,
+    EJ_OID,
+    EJ_DATE,
+    EJ_LONG,
+    EJ_INT,
+    EJ_DOUBLE,
+    EJ_DECIMAL,
+    EJ_BINARY,
+    EJ_UUID,
+    EJ_TIMESTAMP,
+    EJ_REGEX,
+    EJ_CODE,
+    EJ_SYMBOL,
+    EJ_DBPOINTER,
+    EJ_MINKEY,
+    EJ_MAXKEY,
+    EJ_UNDEFINED
+} ej_kind;
+
+#define EJ_NAME(s, k)   {s, sizeof(s) - 1, k}
+
+static const struct {
+    const char *name;
+    size_t      len;
+    ej_kind     kind;
+} ej_names[] = {
+    EJ_NAME("$oid", EJ_OID),
+    EJ_NAME("$date", EJ_DATE),
+    EJ_NAME("$numberLong", EJ_LONG),
+    EJ_NAME("$numberInt", EJ_INT),
+    EJ_NAME("$numberDouble", EJ_DOUBLE),
+    EJ_NAME("$numberDecimal", EJ_DECIMAL),
+    EJ_NAME("$binary", EJ_BINARY),
+    EJ_NAME("$uuid", EJ_UUID),
+    EJ_NAME("$timestamp", EJ_TIMESTAMP),
+    EJ_NAME("$regularExpression", EJ_REGEX),
+    EJ_NAME("$code", EJ_CODE),
+    EJ_NAME("$symbol", EJ_SYMBOL),
+    EJ_NAME("$dbPointer", EJ_DBPOINTER),
+    EJ_NAME("$minKey", EJ_MINKEY),
+    EJ_NAME("$maxKey", EJ_MAXKEY),
+    EJ_NAME("$undefined", EJ_UNDEFINED)
+};
+
+/* the powers of ten a double holds exactly */
+static const double pow10_exact[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int parse_value(json_parser *jp, bson_t *b, const json_str *key);
+static int parse_members(json_parser *jp, bson_t *doc, const json_str *first);
+
+static inline const char *
+str_ptr(const buffer_t *buf, const json_str *s)
+{
+    return s->raw ? s->raw : (const char *)buf->bin.data + s->off;
+}
+
+#define KEY_ARGS(jp, k)     str_ptr(&(jp)->keys, k), (int)(k)->len
+
+static inline int
+is_digit(uint8_t c)
+{
+    return (unsigned)(c - '0') < 10;
+}
+
+static inline int
+is_ws(uint8_t c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/* whitespace, long indentation runs 16 bytes at a time */
+static inline void
+skip_ws(json_parser *jp)
+{
+    if(jp->p >= jp->end || !is_ws(*jp->p)) {
+        return;
+    }
+#ifdef JSON_SSE2
+    while(jp->end - jp->p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)jp->p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+        int mask = _mm_movemask_epi8(m);
+
+        if(mask != 0xffff) {
+            jp->p += __builtin_ctz(~mask);
+            return;
+        }
+        jp->p += 16;
+    }
+#endif
+    while(jp->p < jp->end && is_ws(*jp->p)) {
+        jp->p++;
+    }
+}
+
+static inline int
+expect(json_parser *jp, uint8_t c)
+{
+    skip_ws(jp);
+    if(jp->p < jp->end && *jp->p == c) {
+        jp->p++;
+        return 1;
+    }
+    return 0;
+}
+
+static int
+literal(json_parser *jp, const char *word, size_t len)
+{
+    if((size_t)(jp->end - jp->p) < len || memcmp(jp->p, word, len) != 0) {
+        return 0;
+    }
+    jp->p += len;
+    return 1;
+}
+
+static int
+hex4(const uint8_t *p, uint32_t *out)
+{
+    uint32_t v = 0;
+    int      i;
+    uint8_t  c;
+
+    for(i = 0; i < 4; i++) {
+        c = p[i];
+        if(is_digit(c)) {
+            c -= '0';
+        } else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            c = (c | 0x20) - 'a' + 10;
+        } else {
+            return 0;
+        }
+        v = (v << 4) | c;
+    }
+    *out = v;
+    return 1;
+}
+
+static int
+put_utf8(buffer_t *buf, uint32_t cp)
+{
+    uint8_t out[4];
+    size_t  len;
+
+    if(cp < 0x80) {
+        out[0] = cp;
+        len = 1;
+    } else if(cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        len = 2;
+    } else if(cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        len = 3;
+    } else {
+        out[0] = 0xf0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3f);
+        out[2] = 0x80 | ((cp >> 6) & 0x3f);
+        out[3] = 0x80 | (cp & 0x3f);
+        len = 4;
+    }
+    return buffer_append(buf, out, len);
+}
+
+/* \uXXXX at p, a surrogate pair taking a second one */
+static int
+parse_unicode(json_parser *jp, const uint8_t **pp, buffer_t *buf)
+{
+    const uint8_t *p = *pp;
+    uint32_t cp, lo;
+
+    if(jp->end - p < 4 || !hex4(p, &cp)) {
+        return 0;
+    }
+    p += 4;
+    if(cp >= 0xdc00 && cp <= 0xdfff) {
+        return 0;
+    }
+    if(cp >= 0xd800 && cp <= 0xdbff) {
+        if(jp->end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                !hex4(p + 2, &lo) || lo < 0xdc00 || lo > 0xdfff) {
+            return 0;
+        }
+        p += 6;
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+    }
+    *pp = p;
+    return put_utf8(buf, cp);
+}
+
+/*
+ * The string starting at the quote under p. The runs between escapes
+ * are found with json_safe_run, which stops at the closing quote, a
+ * backslash or a control character.
+ */
+static int
+parse_string(json_parser *jp, buffer_t *buf, json_str *s)
+{
+    const uint8_t *p = jp->p + 1;
+    size_t run;
+    char   c;
+
+    run = json_safe_run(p, jp->end - p);
+    p += run;
+    if(p < jp->end && *p == '"') {
+        s->raw = (const char *)jp->p + 1;
+        s->len = run;
+        jp->p = p + 1;
+        return 1;
+    }
+
+    s->raw = NULL;
+    s->off = buf->len;
+    if(!buffer_append(buf, jp->p + 1, run)) {
+        return 0;
+    }
+    while(p < jp->end) {
+        if(*p == '"') {
+            s->len = buf->len - s->off;
+            jp->p = p + 1;
+            return 1;
+        }
+        if(*p != '\\' || ++p >= jp->end) {
+            return 0;
+        }
+        switch(*p++) {
+        case '"':  c = '"';  break;
+        case '\\': c = '\\'; break;
+        case '/':  c = '/';  break;
+        case 'b':  c = '\b'; break;
+        case 'f':  c = '\f'; break;
+        case 'n':  c = '\n'; break;
+        case 'r':  c = '\r'; break;
+        case 't':  c = '\t'; break;
+        case 'u':
+            if(!parse_unicode(jp, &p, buf)) {
+                return 0;
+            }
+            c = 0;
+            break;
+        default:
+            return 0;
+        }
+        if(c != 0 && !buffer_append(buf, &c, 1)) {
+            return 0;
+        }
+        run = json_safe_run(p, jp->end - p);
+        if(run > 0 && !buffer_append(buf, p, run)) {
+            return 0;
+        }
+        p += run;
+    }
+    return 0;
+}
+
+/* a string value, from a clean str buffer */
+static int
+parse_str_value(json_parser *jp, json_str *s)
+{
+    skip_ws(jp);
+    if(jp->p >= jp->end || *jp->p != '"') {
+        return 0;
+    }
+    jp->str.len = 0;
+    return parse_string(jp, &jp->str, s);
+}
+
+/* a NUL terminated copy of s at the end of buf, for the cstring appenders */
+static const char *
+str_cstring(json_parser *jp, buffer_t *buf, const json_str *s)
+{
+    size_t off = buf->len;
+
+    if(s->raw) {
+        if(!buffer_append(buf, s->raw, s->len)) {
+            return NULL;
+        }
+    } else {
+        off = s->off;
+    }
+    if(!buffer_append(buf, "", 1)) {
+        return NULL;
+    }
+    if(memchr(buf->bin.data + off, '\0', buf->len - off - 1)) {
+        return NULL;
+    }
+    return (const char *)buf->bin.data + off;
+}
+
+/* a key, pushed on the keys stack when it had escapes; bson keys hold no NUL */
+static int
+parse_key(json_parser *jp, json_str *key)
+{
+    skip_ws(jp);
+    if(jp->p >= jp->end || *jp->p != '"' ||
+            !parse_string(jp, &jp->keys, key)) {
+        return 0;
+    }
+    return key->raw || !memchr(jp->keys.bin.data + key->off, '\0', key->len);
+}
+
+static inline int
+key_is(json_parser *jp, const json_str *key, const char *name)
+{
+    size_t len = strlen(name);
+    return key->len == len && memcmp(str_ptr(&jp->keys, key), name, len) == 0;
+}
+
+/*
+ * A JSON number. Integers become int32 or int64 when they fit, the rest
+ * doubles: exactly from at most 19 digits below 2^53 and a power of ten
+ * up to 22, through strtod otherwise.
+ */
+static int
+parse_number(json_parser *jp, bson_value_t *v)
+{
+    const uint8_t *p = jp->p, *start = jp->p;
+    uint64_t mant = 0;
+    int      neg = 0, digits = 0, frac = 0, integral = 1, exact = 1;
+    int      exp = 0, exp_neg = 0;
+    char    *end;
+    double   d;
+
+    if(p < jp->end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if(p >= jp->end || !is_digit(*p)) {
+        return 0;
+    }
+    if(*p == '0') {
+        p++;
+    } else {
+        for(; p < jp->end && is_digit(*p); p++) {
+            if(digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                digits++;
+            } else {
+                exact = 0;
+            }
+        }
+    }
+    if(p < jp->end && *p == '.') {
+        integral = 0;
+        if(++p >= jp->end || !is_digit(*p)) {
+            return 0;
+        }
+        for(; p < jp->end && is_digit(*p); p++) {
+            if(digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                digits++;
+                frac++;
+            } else if(*p != '0') {
+                exact = 0;
+            }
+        }
+    }
+    if(p < jp->end && (*p == 'e' || *p == 'E')) {
+        integral = 0;
+        if(++p < jp->end && (*p == '+' || *p == '-')) {
+            exp_neg = *p++ == '-';
+        }
+        if(p >= jp->end || !is_digit(*p)) {
+            return 0;
+        }
+        for(; p < jp->end && is_digit(*p); p++) {
+            if(exp < 100000) {
+                exp = exp * 10 + (*p - '0');
+            }
+        }
+    }
+    jp->p = p;
+
+    if(integral && exact) {
+        if(!neg && mant <= INT64_MAX) {
+            v->value_type = BSON_TYPE_INT64;
+            v->value.v_int64 = (int64_t)mant;
+        } else if(neg && mant <= (uint64_t)INT64_MAX + 1) {
+            v->value_type = BSON_TYPE_INT64;
+            v->value.v_int64 = (int64_t)(0 - mant);
+        } else {
+            goto slow;
+        }
+        if(v->value.v_int64 >= INT32_MIN && v->value.v_int64 <= INT32_MAX) {
+            v->value_type = BSON_TYPE_INT32;
+            v->value.v_int32 = (int32_t)v->value.v_int64;
+        }
+        return 1;
+    }
+
+    exp = (exp_neg ? -exp : exp) - frac;
+    if(exact && mant < (1ull << 53) && exp >= -22 && exp <= 22) {
+        d = (double)mant;
+        d = exp < 0 ? d / pow10_exact[-exp] : d * pow10_exact[exp];
+        v->value_type = BSON_TYPE_DOUBLE;
+        v->value.v_double = neg ? -d : d;
+        return 1;
+    }
+
+slow:
+    jp->aux.len = 0;
+    if(!buffer_append(&jp->aux, start, p - start) ||
+            !buffer_append(&jp->aux, "", 1)) {
+        return 0;
+    }
+    v->value_type = BSON_TYPE_DOUBLE;
+    v->value.v_double = strtod((const char *)jp->aux.bin.data, &end);
+    return 1;
+}
+
+/* the whole of s as a decimal integer */
+static int
+str_int64(const char *s, size_t len, int64_t *out)
+{
+    uint64_t v = 0;
+    size_t   i = 0;
+    int      neg = 0;
+
+    if(len > 0 && s[0] == '-') {
+        neg = 1;
+        i = 1;
+    }
+    if(i == len || len - i > 19) {
+        return 0;
+    }
+    for(; i < len; i++) {
+        if(!is_digit(s[i])) {
+            return 0;
+        }
+        v = v * 10 + (s[i] - '0');
+    }
+    if(v > (uint64_t)INT64_MAX + neg) {
+        return 0;
+    }
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return 1;
+}
+
+static int
+fixed_digits(const char *s, int n, int *out)
+{
+    int v = 0, i;
+
+    for(i = 0; i < n; i++) {
+        if(!is_digit(s[i])) {
+            return 0;
+        }
+        v = v * 10 + (s[i] - '0');
+    }
+    *out = v;
+    return 1;
+}
+
+/* days since 1970-01-01 of a proleptic Gregorian date (H. Hinnant) */
+static int64_t
+days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    int64_t  era;
+    unsigned yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+/* YYYY-MM-DDTHH:MM:SS, an optional fraction, then Z or +HH:MM / -HHMM */
+static int
+parse_iso_date(const char *s, size_t len, int64_t *ms)
+{
+    static const int mdays[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int    year, mon, day, hour, min, sec, millis = 0, off = 0, oh, om;
+    size_t i = 19, n;
+
+    if(len < 20 || s[4] != '-' || s[7] != '-' || s[10] != 'T' ||
+            s[13] != ':' || s[16] != ':' ||
+            !fixed_digits(s, 4, &year) || !fixed_digits(s + 5, 2, &mon) ||
+            !fixed_digits(s + 8, 2, &day) || !fixed_digits(s + 11, 2, &hour) ||
+            !fixed_digits(s + 14, 2, &min) || !fixed_digits(s + 17, 2, &sec)) {
+        return 0;
+    }
+    if(mon < 1 || mon > 12 || day < 1 || day > mdays[mon - 1] ||
+            (mon == 2 && day == 29 &&
+             (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0))) ||
+            hour > 23 || min > 59 || sec > 59) {
+        return 0;
+    }
+    if(s[i] == '.') {
+        /* milliseconds, further digits are dropped */
+        for(i++, n = 0; i < len && is_digit(s[i]); i++, n++) {
+            if(n < 3) {
+                millis = millis * 10 + (s[i] - '0');
+            }
+        }
+        if(n == 0) {
+            return 0;
+        }
+        for(; n < 3; n++) {
+            millis *= 10;
+        }
+    }
+    if(i < len && s[i] == 'Z') {
+        i++;
+    } else if(i < len && (s[i] == '+' || s[i] == '-')) {
+        if(len - i == 6 && s[i + 3] == ':' && fixed_digits(s + i + 1, 2, &oh) &&
+                fixed_digits(s + i + 4, 2, &om)) {
+            off = oh * 60 + om;
+        } else if(len - i == 5 && fixed_digits(s + i + 1, 2, &oh) &&
+                fixed_digits(s + i + 3, 2, &om)) {
+            off = oh * 60 + om;
+        } else {
+            return 0;
+        }
+        if(s[i] == '-') {
+            off = -off;
+        }
+        i = len;
+    } else {
+        return 0;
+    }
+    if(i != len) {
+        return 0;
+    }
+    *ms = ((days_from_civil(year, mon, day) * 86400 +
+            hour * 3600 + (min - off) * 60 + sec) * 1000) + millis;
+    return 1;
+}
+
+static inline int
+base64_value(uint8_t c)
+{
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(is_digit(c)) return c - '0' + 52;
+    if(c == '+') return 62;
+    if(c == '/') return 63;
+    return -1;
+}
+
+/* padded base64 into the end of buf */
+static int
+base64_decode(const char *s, size_t len, buffer_t *buf)
+{
+    uint8_t out[3];
+    int     v[4], i;
+    size_t  n, pad = 0;
+
+    if(len % 4 != 0) {
+        return 0;
+    }
+    if(len > 0 && s[len - 1] == '=') {
+        pad = len > 1 && s[len - 2] == '=' ? 2 : 1;
+    }
+    if(!buffer_reserve(buf, len / 4 * 3)) {
+        return 0;
+    }
+    for(n = 0; n < len; n += 4) {
+        for(i = 0; i < 4; i++) {
+            v[i] = n + i >= len - pad ? 0 : base64_value(s[n + i]);
+            if(v[i] < 0) {
+                return 0;
+            }
+        }
+        out[0] = (v[0] << 2) | (v[1] >> 4);
+        out[1] = (v[1] << 4) | (v[2] >> 2);
+        out[2] = (v[2] << 6) | v[3];
+        if(!buffer_append(buf, out, n + 4 < len ? 3 : 3 - pad)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* a member key and its colon, inside a wrapper */
+static int
+wrapper_key(json_parser *jp, json_str *key, int first)
+{
+    if(!first && !expect(jp, ',')) {
+        return 0;
+    }
+    return parse_key(jp, key) && expect(jp, ':');
+}
+
+/* {"t": T, "i": I} with two unsigned 32 bit integers */
+static int
+parse_timestamp(json_parser *jp, uint32_t *t, uint32_t *inc)
+{
+    json_str     key;
+    bson_value_t v;
+    int          i, seen = 0;
+
+    if(!expect(jp, '{')) {
+        return 0;
+    }
+    for(i = 0; i < 2; i++) {
+        if(!wrapper_key(jp, &key, i == 0)) {
+            return 0;
+        }
+        skip_ws(jp);
+        if(!parse_number(jp, &v) || v.value_type == BSON_TYPE_DOUBLE) {
+            return 0;
+        }
+        if(v.value_type == BSON_TYPE_INT32) {
+            v.value.v_int64 = v.value.v_int32;
+        }
+        if(v.value.v_int64 < 0 || v.value.v_int64 > UINT32_MAX) {
+            return 0;
+        }
+        if(key_is(jp, &key, "t") && !(seen & 1)) {
+            *t = (uint32_t)v.value.v_int64;
+            seen |= 1;
+        } else if(key_is(jp, &key, "i") && !(seen & 2)) {
+            *inc = (uint32_t)v.value.v_int64;
+            seen |= 2;
+        } else {
+            return 0;
+        }
+    }
+    return expect(jp, '}');
+}
+
+/* {"base64": B, "subType": "hh"} in either order */
+static int
+parse_binary(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str name, s;
+    int      i, subtype = -1, seen = 0;
+    uint32_t v;
+
+    jp->aux.len = 0;
+    if(!expect(jp, '{')) {
+        return 0;
+    }
+    for(i = 0; i < 2; i++) {
+        if(!wrapper_key(jp, &name, i == 0) || !parse_str_value(jp, &s)) {
+            return 0;
+        }
+        if(key_is(jp, &name, "base64") && !seen) {
+            if(!base64_decode(str_ptr(&jp->str, &s), s.len, &jp->aux)) {
+                return 0;
+            }
+            seen = 1;
+        } else if(key_is(jp, &name, "subType") && subtype < 0) {
+            char hex[4] = {'0', '0', '0', '0'};
+
+            if(s.len < 1 || s.len > 2) {
+                return 0;
+            }
+            memcpy(hex + 4 - s.len, str_ptr(&jp->str, &s), s.len);
+            if(!hex4((const uint8_t *)hex, &v)) {
+                return 0;
+            }
+            subtype = (int)v;
+        } else {
+            return 0;
+        }
+    }
+    return expect(jp, '}') &&
+           bson_append_binary(b, KEY_ARGS(jp, key), (bson_subtype_t)subtype,
+                              jp->aux.bin.data, jp->aux.len);
+}
+
+/* {"pattern": P, "options": O} in either order */
+static int
+parse_regex(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str name, s;
+    size_t   pattern = 0, options = 0;
+    int      i, seen = 0;
+
+    jp->aux.len = 0;
+    if(!expect(jp, '{')) {
+        return 0;
+    }
+    for(i = 0; i < 2; i++) {
+        if(!wrapper_key(jp, &name, i == 0) || !parse_str_value(jp, &s)) {
+            return 0;
+        }
+        /* both are kept in aux, as offsets since it may move */
+        if(key_is(jp, &name, "pattern") && !(seen & 1)) {
+            pattern = jp->aux.len;
+            seen |= 1;
+        } else if(key_is(jp, &name, "options") && !(seen & 2)) {
+            options = jp->aux.len;
+            seen |= 2;
+        } else {
+            return 0;
+        }
+        if(s.raw == NULL) {
+            s.raw = str_ptr(&jp->str, &s);
+        }
+        if(str_cstring(jp, &jp->aux, &s) == NULL) {
+            return 0;
+        }
+    }
+    return expect(jp, '}') &&
+           bson_append_regex(b, KEY_ARGS(jp, key),
+                             (const char *)jp->aux.bin.data + pattern,
+                             (const char *)jp->aux.bin.data + options);
+}
+
+/* {"$ref": Collection, "$id": {"$oid": Hex}} in either order */
+static int
+parse_dbpointer(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str   name, s, oid_key;
+    bson_oid_t oid;
+    int        i, seen = 0;
+
+    jp->aux.len = 0;
+    if(!expect(jp, '{')) {
+        return 0;
+    }
+    for(i = 0; i < 2; i++) {
+        if(!wrapper_key(jp, &name, i == 0)) {
+            return 0;
+        }
+        if(key_is(jp, &name, "$ref") && !(seen & 1)) {
+            if(!parse_str_value(jp, &s)) {
+                return 0;
+            }
+            if(s.raw == NULL) {
+                s.raw = str_ptr(&jp->str, &s);
+            }
+            if(str_cstring(jp, &jp->aux, &s) == NULL) {
+                return 0;
+            }
+            seen |= 1;
+        } else if(key_is(jp, &name, "$id") && !(seen & 2)) {
+            if(!expect(jp, '{') || !wrapper_key(jp, &oid_key, 1) ||
+                    !key_is(jp, &oid_key, "$oid") || !parse_str_value(jp, &s) ||
+                    s.len != 24 || !oid_from_hex(str_ptr(&jp->str, &s), oid.bytes) ||
+                    !expect(jp, '}')) {
+                return 0;
+            }
+            seen |= 2;
+        } else {
+            return 0;
+        }
+    }
+    return expect(jp, '}') &&
+           bson_append_dbpointer(b, KEY_ARGS(jp, key),
+                                 (const char *)jp->aux.bin.data, &oid);
+}
+
+/* {"$code": C} or {"$code": C, "$scope": Document} */
+static int
+parse_code(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str    s, name;
+    bson_t      scope;
+    char       *code;
+    const char *c;
+    int         ret;
+
+    if(!parse_str_value(jp, &s) ||
+            (c = str_cstring(jp, &jp->str, &s)) == NULL) {
+        return 0;
+    }
+    skip_ws(jp);
+    if(jp->p < jp->end && *jp->p == '}') {
+        jp->p++;
+        return bson_append_code(b, KEY_ARGS(jp, key), c);
+    }
+    if(!wrapper_key(jp, &name, 0) || !key_is(jp, &name, "$scope") ||
+            !expect(jp, '{')) {
+        return 0;
+    }
+
+    /* the scope reuses the string buffers, so the code goes aside */
+    code = enif_alloc(strlen(c) + 1);
+    if(code == NULL) {
+        return 0;
+    }
+    strcpy(code, c);
+    bson_init(&scope);
+    jp->depth++;
+    ret = jp->depth <= JSON_MAX_DEPTH &&
+          parse_members(jp, &scope, NULL) &&
+          expect(jp, '}') &&
+          bson_append_code_with_scope(b, KEY_ARGS(jp, key), code, &scope);
+    jp->depth--;
+    bson_destroy(&scope);
+    enif_free(code);
+    return ret;
+}
+
+/* {"$numberLong": "N"} inside a canonical $date */
+static int
+parse_date_long(json_parser *jp, int64_t *ms)
+{
+    json_str key, s;
+
+    return wrapper_key(jp, &key, 1) && key_is(jp, &key, "$numberLong") &&
+           parse_str_value(jp, &s) &&
+           str_int64(str_ptr(&jp->str, &s), s.len, ms) &&
+           expect(jp, '}');
+}
+
+static int
+parse_date(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str     s;
+    bson_value_t v;
+    int64_t      ms;
+
+    skip_ws(jp);
+    if(jp->p >= jp->end) {
+        return 0;
+    }
+    if(*jp->p == '"') {
+        if(!parse_str_value(jp, &s) ||
+                !parse_iso_date(str_ptr(&jp->str, &s), s.len, &ms)) {
+            return 0;
+        }
+    } else if(*jp->p == '{') {
+        jp->p++;
+        if(!parse_date_long(jp, &ms)) {
+            return 0;
+        }
+    } else {
+        if(!parse_number(jp, &v)) {
+            return 0;
+        }
+        if(v.value_type == BSON_TYPE_INT32) {
+            ms = v.value.v_int32;
+        } else if(v.value_type == BSON_TYPE_INT64) {
+            ms = v.value.v_int64;
+        } else {
+            return 0;
+        }
+    }
+    return expect(jp, '}') &&
+           bson_append_date_time(b, KEY_ARGS(jp, key), ms);
+}
+
+static int
+parse_number_double(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str    s;
+    const char *c;
+    char       *end;
+    double      d;
+
+    if(!parse_str_value(jp, &s) ||
+            (c = str_cstring(jp, &jp->str, &s)) == NULL) {
+        return 0;
+    }
+    if(strcmp(c, "Infinity") == 0) {
+        d = INFINITY;
+    } else if(strcmp(c, "-Infinity") == 0) {
+        d = -INFINITY;
+    } else if(strcmp(c, "NaN") == 0) {
+        d = NAN;
+    } else {
+        d = strtod(c, &end);
+        if(end == c || *end != '\0') {
+            return 0;
+        }
+    }
+    return expect(jp, '}') && bson_append_double(b, KEY_ARGS(jp, key), d);
+}
+
+/* the value of a wrapper, p is past its key; consumes the closing brace */
+static int
+parse_wrapper(json_parser *jp, bson_t *b, const json_str *key, ej_kind kind)
+{
+    json_str          s;
+    bson_oid_t        oid;
+    bson_decimal128_t dec;
+    bson_value_t      v;
+    uint8_t           uuid[16];
+    uint32_t          t = 0, inc = 0;
+    int64_t           i64;
+    const char       *c;
+
+    if(!expect(jp, ':')) {
+        return 0;
+    }
+    switch(kind) {
+    case EJ_OID:
+        return parse_str_value(jp, &s) && s.len == 24 &&
+               oid_from_hex(str_ptr(&jp->str, &s), oid.bytes) &&
+               expect(jp, '}') &&
+               bson_append_oid(b, KEY_ARGS(jp, key), &oid);
+    case EJ_DATE:
+        return parse_date(jp, b, key);
+    case EJ_LONG:
+        return parse_str_value(jp, &s) &&
+               str_int64(str_ptr(&jp->str, &s), s.len, &i64) &&
+               expect(jp, '}') &&
+               bson_append_int64(b, KEY_ARGS(jp, key), i64);
+    case EJ_INT:
+        return parse_str_value(jp, &s) &&
+               str_int64(str_ptr(&jp->str, &s), s.len, &i64) &&
+               i64 >= INT32_MIN && i64 <= INT32_MAX &&
+               expect(jp, '}') &&
+               bson_append_int32(b, KEY_ARGS(jp, key), (int32_t)i64);
+    case EJ_DOUBLE:
+        return parse_number_double(jp, b, key);
+    case EJ_DECIMAL:
+        return parse_str_value(jp, &s) &&
+               (c = str_cstring(jp, &jp->str, &s)) != NULL &&
+               bson_decimal128_from_string(c, &dec) &&
+               expect(jp, '}') &&
+               bson_append_decimal128(b, KEY_ARGS(jp, key), &dec);
+    case EJ_BINARY:
+        return parse_binary(jp, b, key) && expect(jp, '}');
+    case EJ_UUID:
+        return parse_str_value(jp, &s) && s.len == 36 &&
+               uuid_from_string(str_ptr(&jp->str, &s), uuid) &&
+               expect(jp, '}') &&
+               bson_append_binary(b, KEY_ARGS(jp, key), BSON_SUBTYPE_UUID,
+                                  uuid, 16);
+    case EJ_TIMESTAMP:
+        return parse_timestamp(jp, &t, &inc) && expect(jp, '}') &&
+               bson_append_timestamp(b, KEY_ARGS(jp, key), t, inc);
+    case EJ_REGEX:
+        return parse_regex(jp, b, key) && expect(jp, '}');
+    case EJ_CODE:
+        return parse_code(jp, b, key);
+    case EJ_SYMBOL:
+        return parse_str_value(jp, &s) && expect(jp, '}') &&
+               bson_append_symbol(b, KEY_ARGS(jp, key),
+                                  str_ptr(&jp->str, &s), (int)s.len);
+    case EJ_DBPOINTER:
+        return parse_dbpointer(jp, b, key) && expect(jp, '}');
+    case EJ_MINKEY:
+    case EJ_MAXKEY:
+        skip_ws(jp);
+        if(!parse_number(jp, &v) || v.value_type != BSON_TYPE_INT32 ||
+                v.value.v_int32 != 1 || !expect(jp, '}')) {
+            return 0;
+        }
+        return kind == EJ_MINKEY ?
+               bson_append_minkey(b, KEY_ARGS(jp, key)) :
+               bson_append_maxkey(b, KEY_ARGS(jp, key));
+    case EJ_UNDEFINED:
+        skip_ws(jp);
+        return literal(jp, "true", 4) && expect(jp, '}') &&
+               bson_append_undefined(b, KEY_ARGS(jp, key));
+    default:
+        return 0;
+    }
+}
+
+static ej_kind
+wrapper_kind(json_parser *jp, const json_str *key)
+{
+    const char *name = str_ptr(&jp->keys, key);
+    size_t      i;
+
+    if(key->len < 2 || name[0] != '$') {
+        return EJ_NONE;
+    }
+    for(i = 0; i < sizeof ej_names / sizeof ej_names[0]; i++) {
+        if(ej_names[i].len == key->len &&
+                memcmp(ej_names[i].name, name, key->len) == 0) {
+            return ej_names[i].kind;
+        }
+    }
+    return EJ_NONE;
+}
+
+/* members after the '{' up to and including the '}', first already read */
+static int
+parse_members(json_parser *jp, bson_t *doc, const json_str *first)
+{
+    size_t   mark = jp->keys.len;
+    json_str key;
+
+    if(first == NULL) {
+        skip_ws(jp);
+        if(jp->p < jp->end && *jp->p == '}') {
+            jp->p++;
+            return 1;
+        }
+    }
+    for(;;) {
+        if(first) {
+            key = *first;
+            first = NULL;
+        } else if(!parse_key(jp, &key)) {
+            return 0;
+        }
+        if(!expect(jp, ':') || !parse_value(jp, doc, &key)) {
+            return 0;
+        }
+        jp->keys.len = mark;
+        skip_ws(jp);
+        if(jp->p >= jp->end) {
+            return 0;
+        }
+        if(*jp->p == '}') {
+            jp->p++;
+            return 1;
+        }
+        if(*jp->p++ != ',') {
+            return 0;
+        }
+    }
+}
+
+/* '{' under p, a type wrapper when its first key names one */
+static int
+parse_object(json_parser *jp, bson_t *b, const json_str *key)
+{
+    size_t   mark = jp->keys.len;
+    json_str first;
+    bson_t   child;
+    ej_kind  kind;
+    int      has_first = 0, ret;
+
+    if(++jp->depth > JSON_MAX_DEPTH) {
+        return 0;
+    }
+    jp->p++;
+    skip_ws(jp);
+    if(jp->p < jp->end && *jp->p == '"') {
+        if(!parse_key(jp, &first)) {
+            return 0;
+        }
+        kind = wrapper_kind(jp, &first);
+        if(kind != EJ_NONE) {
+            ret = parse_wrapper(jp, b, key, kind);
+            jp->keys.len = mark;
+            jp->depth--;
+            return ret;
+        }
+        has_first = 1;
+    }
+    ret = bson_append_document_begin(b, KEY_ARGS(jp, key), &child) &&
+          parse_members(jp, &child, has_first ? &first : NULL) &&
+          bson_append_document_end(b, &child);
+    jp->keys.len = mark;
+    jp->depth--;
+    return ret;
+}
+
+/* elements after the '[' up to and including the ']' */
+static int
+parse_elements(json_parser *jp, bson_t *array)
+{
+    json_str key = {NULL, 0, 0};
+    char     idx[16];
+    uint32_t n = 0;
+
+    skip_ws(jp);
+    if(jp->p < jp->end && *jp->p == ']') {
+        jp->p++;
+        return 1;
+    }
+    for(;;) {
+        key.len = bson_uint32_to_string(n++, &key.raw, idx, sizeof idx);
+        if(!parse_value(jp, array, &key)) {
+            return 0;
+        }
+        skip_ws(jp);
+        if(jp->p >= jp->end) {
+            return 0;
+        }
+        if(*jp->p == ']') {
+            jp->p++;
+            return 1;
+        }
+        if(*jp->p++ != ',') {
+            return 0;
+        }
+    }
+}
+
+static int
+parse_array(json_parser *jp, bson_t *b, const json_str *key)
+{
+    bson_t child;
+    int    ret;
+
+    if(++jp->depth > JSON_MAX_DEPTH) {
+        return 0;
+    }
+    jp->p++;
+    ret = bson_append_array_begin(b, KEY_ARGS(jp, key), &child) &&
+          parse_elements(jp, &child) &&
+          bson_append_array_end(b, &child);
+    jp->depth--;
+    return ret;
+}
+
+static int
+parse_value(json_parser *jp, bson_t *b, const json_str *key)
+{
+    json_str     s;
+    bson_value_t v;
+
+    skip_ws(jp);
+    if(jp->p >= jp->end) {
+        return 0;
+    }
+    switch(*jp->p) {
+    case '{':
+        return parse_object(jp, b, key);
+    case '[':
+        return parse_array(jp, b, key);
+    case '"':
+        return parse_str_value(jp, &s) &&
+               bson_append_utf8(b, KEY_ARGS(jp, key),
+                                str_ptr(&jp->str, &s), (int)s.len);
+    case 't':
+        return literal(jp, "true", 4) &&
+               bson_append_bool(b, KEY_ARGS(jp, key), true);
+    case 'f':
+        return literal(jp, "false", 5) &&
+               bson_append_bool(b, KEY_ARGS(jp, key), false);
+    case 'n':
+        return literal(jp, "null", 4) &&
+               bson_append_null(b, KEY_ARGS(jp, key));
+    default:
+        if(!parse_number(jp, &v)) {
+            return 0;
+        }
+        switch(v.value_type) {
+        case BSON_TYPE_INT32:
+            return bson_append_int32(b, KEY_ARGS(jp, key), v.value.v_int32);
+        case BSON_TYPE_INT64:
+            return bson_append_int64(b, KEY_ARGS(jp, key), v.value.v_int64);
+        default:
+            return bson_append_double(b, KEY_ARGS(jp, key), v.value.v_double);
+        }
+    }
+}
+
+/* a top level object into doc, its keys are never taken as wrappers */
+static int
+parse_document(json_parser *jp, bson_t *doc)
+{
+    int ret;
+
+    if(!expect(jp, '{')) {
+        return 0;
+    }
+    jp->depth = 1;
+    ret = parse_members(jp, doc, NULL);
+    jp->depth = 0;
+    return ret;
+}
+
+/*
+ * doc onto out, and with ensure_id its _id, a new ObjectId written in
+ * front of the other fields when it has none.
+ */
+static int
+put_doc(ErlNifEnv *env, cabala_st *st, const bson_t *doc, int ensure_id,
+        buffer_t *out, ERL_NIF_TERM *id)
+{
+    const uint8_t *data = bson_get_data(doc);
+    decode_state   ds;
+    bson_iter_t    iter;
+    bson_oid_t     oid;
+
+    if(!ensure_id) {
+        return buffer_append(out, data, doc->len);
+    }
+    if(bson_iter_init_find(&iter, doc, "_id")) {
+        init_state(&ds, env, st);
+        return decode_value(&ds, &iter, id) &&
+               buffer_append(out, data, doc->len);
+    }
+    oid_new(&oid);
+    *id = make_oid(env, st, &oid);
+    /* type byte, "_id" and its NUL, the 12 bytes, then the old fields */
+    return buffer_append_int32(out, (int32_t)doc->len + 17) &&
+           buffer_append(out, "\x07_id", 5) &&
+           buffer_append(out, oid.bytes, 12) &&
+           buffer_append(out, data + 4, doc->len - 4);
+}
+
+static int
+parse_json_opts(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM opts,
+                int *ensure_id)
+{
+    ERL_NIF_TERM item;
+    const ERL_NIF_TERM *tuple;
+    int arity;
+
+    *ensure_id = 0;
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2 ||
+                enif_compare(tuple[0], st->atom_ensure_id) != 0) {
+            return 0;
+        }
+        *ensure_id = enif_compare(tuple[1], st->atom_true) == 0;
+    }
+    return enif_is_empty_list(env, opts);
+}
+
+static int
+parser_init(json_parser *jp, const ErlNifBinary *bin)
+{
+    memset(jp, 0, sizeof(json_parser));
+    jp->start = jp->p = bin->data;
+    jp->end = bin->data + bin->size;
+    if(!buffer_init(&jp->keys, 256)) {
+        return 0;
+    }
+    if(!buffer_init(&jp->str, 256)) {
+        buffer_destroy(&jp->keys);
+        return 0;
+    }
+    if(!buffer_init(&jp->aux, 256)) {
+        buffer_destroy(&jp->keys);
+        buffer_destroy(&jp->str);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+parser_destroy(json_parser *jp)
+{
+    buffer_destroy(&jp->keys);
+    buffer_destroy(&jp->str);
+    buffer_destroy(&jp->aux);
+}
+
+/*
+ * One JSON object into a document, or with sequence set any number of
+ * them separated by whitespace, as in NDJSON, into concatenated ones.
+ */
+static ERL_NIF_TERM
+from_json_run(ErlNifEnv *env, const ERL_NIF_TERM argv[], int sequence)
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    json_parser  jp;
+    ErlNifBinary bin;
+    ERL_NIF_TERM out, id, ids;
+    buffer_t     buf;
+    bson_t       doc;
+    int          ensure_id, count = 0;
+
+    if(!enif_inspect_binary(env, argv[0], &bin) ||
+            !parse_json_opts(env, st, argv[1], &ensure_id)) {
+        return enif_make_badarg(env);
+    }
+    if(!parser_init(&jp, &bin)) {
+        return make_error(st, env, "enomem");
+    }
+    if(!buffer_init(&buf, bin.size > 256 ? bin.size : 256)) {
+        parser_destroy(&jp);
+        return make_error(st, env, "enomem");
+    }
+
+    ids = enif_make_list(env, 0);
+    bson_init(&doc);
+    for(;;) {
+        skip_ws(&jp);
+        if(jp.p == jp.end && (sequence || count > 0)) {
+            break;
+        }
+        if(count > 0 && !sequence) {
+            goto badjson;
+        }
+        if(!parse_document(&jp, &doc)) {
+            goto badjson;
+        }
+        if(!put_doc(env, st, &doc, ensure_id, &buf, &id)) {
+            goto failure;
+        }
+        if(ensure_id) {
+            ids = enif_make_list_cell(env, id, ids);
+        }
+        bson_reinit(&doc);
+        count++;
+    }
+
+    if(!buffer_make_binary(env, &buf, &out)) {
+        goto failure;
+    }
+    if(ensure_id && sequence) {
+        enif_make_reverse_list(env, ids, &ids);
+        out = enif_make_tuple2(env, out, ids);
+    } else if(ensure_id) {
+        out = enif_make_tuple2(env, out, id);
+    }
+    bson_destroy(&doc);
+    parser_destroy(&jp);
+    return out;
+
+badjson:
+    out = make_obj_error(st, env, "badjson",
+                         enif_make_uint64(env, jp.p - jp.start));
+    goto done;
+failure:
+    out = make_error(st, env, "internal_error");
+done:
+    buffer_destroy(&buf);
+    bson_destroy(&doc);
+    parser_destroy(&jp);
+    return out;
+}
+
+static ERL_NIF_TERM
+from_json_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    return from_json_run(env, argv, 0);
+}
+
+static ERL_NIF_TERM
+from_ndjson_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    return from_json_run(env, argv, 1);
+}
+
+/*
+ * JSON, with Extended JSON v2 wrappers in relaxed or canonical form,
+ * written into a document with the bson appenders as it is read,
+ * without building terms. Large inputs move to a dirty scheduler.
+ */
+ERL_NIF_TERM
+from_json(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin;
+
+    if(argc != 2 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+    if(bin.size > JSON_DIRTY_BYTES) {
+        return enif_schedule_nif(env, "from_json", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 from_json_dirty, argc, argv);
+    }
+    return from_json_run(env, argv, 0);
+}
+
+ERL_NIF_TERM
+from_ndjson(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin;
+
+    if(argc != 2 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+    if(bin.size > JSON_DIRTY_BYTES) {
+        return enif_schedule_nif(env, "from_ndjson", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                                 from_ndjson_dirty, argc, argv);
+    }
+    return from_json_run(env, argv, 1);
+}
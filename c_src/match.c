@@ -0,0 +1,491 @@
+#include "cabala.h"
+
+#define MAX_FILTER_DEPTHS 100
+
+typedef enum {
+    MATCH_AND,
+    MATCH_OR,
+    MATCH_NOR,
+    MATCH_EQ,
+    MATCH_NE,
+    MATCH_GT,
+    MATCH_GTE,
+    MATCH_LT,
+    MATCH_LTE,
+    MATCH_IN,
+    MATCH_NIN,
+    MATCH_EXISTS,
+} match_op;
+
+/*
+ * A compiled filter is a flat program in prefix order. Logical nodes
+ * are followed by their children, `size` counts the nodes of the whole
+ * subtree so an evaluator can skip it on early exit.
+ */
+typedef struct {
+    match_op     op;
+    int          size;
+    const char  *path;      // dotted path, points into the filter bson
+    bson_iter_t  value;     // literal operand
+} match_node;
+
+typedef vec_t(match_node) vec_node_t;
+
+typedef struct {
+    bson_t     *bson;
+    vec_node_t  prog;
+} filter_res;
+
+typedef struct {
+    const match_node *node;
+    match_op          op;
+} leaf_ctx;
+
+static int compile_doc(vec_node_t *prog, bson_iter_t *iter, int depth);
+
+void
+filter_dtor(ErlNifEnv *env, void *obj)
+{
+    filter_res *res = obj;
+
+    if(res->bson) {
+        bson_destroy(res->bson);
+    }
+    vec_deinit(&res->prog);
+}
+
+static int
+push_node(vec_node_t *prog, match_op op, const char *path,
+          const bson_iter_t *value)
+{
+    match_node node;
+
+    memset(&node, 0, sizeof node);
+    node.op = op;
+    node.size = 1;
+    node.path = path;
+    if(value) {
+        node.value = *value;
+    }
+    return vec_push(prog, node) == 0;
+}
+
+static int
+parse_operator(const char *name, match_op *op)
+{
+    static const struct {
+        const char *name;
+        match_op    op;
+    } ops[] = {
+        {"$eq",     MATCH_EQ},
+        {"$ne",     MATCH_NE},
+        {"$gt",     MATCH_GT},
+        {"$gte",    MATCH_GTE},
+        {"$lt",     MATCH_LT},
+        {"$lte",    MATCH_LTE},
+        {"$in",     MATCH_IN},
+        {"$nin",    MATCH_NIN},
+        {"$exists", MATCH_EXISTS},
+    };
+    size_t idx;
+
+    for(idx = 0; idx < sizeof(ops)/sizeof(ops[0]); idx++) {
+        if(strcmp(name, ops[idx].name) == 0) {
+            *op = ops[idx].op;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+is_operator_doc(const bson_iter_t *iter)
+{
+    bson_iter_t child;
+
+    if(!BSON_ITER_HOLDS_DOCUMENT(iter) || !bson_iter_recurse(iter, &child)) {
+        return 0;
+    }
+    return bson_iter_next(&child) && bson_iter_key(&child)[0] == '$';
+}
+
+/* {$and: [Filter, ...]}, {$or: [...]}, {$nor: [...]} */
+static int
+compile_logical(vec_node_t *prog, match_op op, bson_iter_t *iter, int depth)
+{
+    bson_iter_t child, sub;
+    int idx = prog->length;
+    int count = 0;
+
+    if(!BSON_ITER_HOLDS_ARRAY(iter) || !bson_iter_recurse(iter, &child)) {
+        return 0;
+    }
+    if(!push_node(prog, op, NULL, NULL)) {
+        return 0;
+    }
+    while(bson_iter_next(&child)) {
+        if(!BSON_ITER_HOLDS_DOCUMENT(&child) ||
+                !bson_iter_recurse(&child, &sub)) {
+            return 0;
+        }
+        if(!compile_doc(prog, &sub, depth + 1)) {
+            return 0;
+        }
+        count++;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    prog->data[idx].size = prog->length - idx;
+    return 1;
+}
+
+/* {Path: {$op: Value, ...}} */
+static int
+compile_operators(vec_node_t *prog, const char *path, bson_iter_t *iter)
+{
+    bson_iter_t child;
+    match_op op;
+    int idx = prog->length;
+
+    if(!bson_iter_recurse(iter, &child)) {
+        return 0;
+    }
+    if(!push_node(prog, MATCH_AND, NULL, NULL)) {
+        return 0;
+    }
+    while(bson_iter_next(&child)) {
+        if(!parse_operator(bson_iter_key(&child), &op)) {
+            return 0;
+        }
+        if((op == MATCH_IN || op == MATCH_NIN) &&
+                !BSON_ITER_HOLDS_ARRAY(&child)) {
+            return 0;
+        }
+        if(!push_node(prog, op, path, &child)) {
+            return 0;
+        }
+    }
+    prog->data[idx].size = prog->length - idx;
+    return 1;
+}
+
+/*
+ * Compile every element of a filter document, the elements are joined
+ * by an implicit $and.
+ */
+static int
+compile_doc(vec_node_t *prog, bson_iter_t *iter, int depth)
+{
+    int idx = prog->length;
+
+    if(depth >= MAX_FILTER_DEPTHS) {
+        return 0;
+    }
+    if(!push_node(prog, MATCH_AND, NULL, NULL)) {
+        return 0;
+    }
+
+    while(bson_iter_next(iter)) {
+        const char *key = bson_iter_key(iter);
+
+        if(key[0] == '$') {
+            int ret;
+            if(strcmp(key, "$and") == 0) {
+                ret = compile_logical(prog, MATCH_AND, iter, depth);
+            } else if(strcmp(key, "$or") == 0) {
+                ret = compile_logical(prog, MATCH_OR, iter, depth);
+            } else if(strcmp(key, "$nor") == 0) {
+                ret = compile_logical(prog, MATCH_NOR, iter, depth);
+            } else {
+                ret = 0;
+            }
+            if(!ret) {
+                return 0;
+            }
+        } else if(is_operator_doc(iter)) {
+            if(!compile_operators(prog, key, iter)) {
+                return 0;
+            }
+        } else if(!push_node(prog, MATCH_EQ, key, iter)) {
+            return 0;
+        }
+    }
+    if(iter->err_off) {
+        return 0;
+    }
+
+    prog->data[idx].size = prog->length - idx;
+    return 1;
+}
+
+static inline bool
+is_nullish(bson_type_t type)
+{
+    return type == BSON_TYPE_NULL || type == BSON_TYPE_UNDEFINED;
+}
+
+static bool
+match_value(match_op op, const bson_iter_t *literal, const bson_iter_t *value)
+{
+    bson_type_t lt = bson_iter_type(literal);
+    bson_type_t vt = bson_iter_type(value);
+    int cmp;
+
+    if(lt == BSON_TYPE_NULL && is_nullish(vt)) {
+        return op == MATCH_EQ || op == MATCH_GTE || op == MATCH_LTE;
+    }
+    if(canonical_type(lt) != canonical_type(vt)) {
+        return false;
+    }
+
+    cmp = compare_iter(value, literal);
+    switch(op) {
+    case MATCH_EQ:
+        return cmp == 0;
+    case MATCH_GT:
+        return cmp > 0;
+    case MATCH_GTE:
+        return cmp >= 0;
+    case MATCH_LT:
+        return cmp < 0;
+    case MATCH_LTE:
+        return cmp <= 0;
+    default:
+        return false;
+    }
+}
+
+static bool
+leaf_visit(const bson_iter_t *value, void *data)
+{
+    leaf_ctx *ctx = data;
+    bson_iter_t elem;
+
+    switch(ctx->op) {
+    case MATCH_IN:
+        if(!bson_iter_recurse(&ctx->node->value, &elem)) {
+            return false;
+        }
+        while(bson_iter_next(&elem)) {
+            if(match_value(MATCH_EQ, &elem, value)) {
+                return true;
+            }
+        }
+        return false;
+    case MATCH_EXISTS:
+        return true;
+    default:
+        return match_value(ctx->op, &ctx->node->value, value);
+    }
+}
+
+/* does a missing field satisfy the operator? */
+static bool
+match_missing(match_op op, const bson_iter_t *literal)
+{
+    bson_iter_t elem;
+
+    switch(op) {
+    case MATCH_EQ:
+    case MATCH_GTE:
+    case MATCH_LTE:
+        return bson_iter_type(literal) == BSON_TYPE_NULL;
+    case MATCH_IN:
+        if(!bson_iter_recurse(literal, &elem)) {
+            return false;
+        }
+        while(bson_iter_next(&elem)) {
+            if(bson_iter_type(&elem) == BSON_TYPE_NULL) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+static bool
+eval_leaf(const match_node *node, const bson_iter_t *root, bool *error)
+{
+    leaf_ctx ctx;
+    bool found = false;
+    bool negate = false;
+    bool ret;
+
+    ctx.node = node;
+    ctx.op = node->op;
+    if(node->op == MATCH_NE) {
+        ctx.op = MATCH_EQ;
+        negate = true;
+    } else if(node->op == MATCH_NIN) {
+        ctx.op = MATCH_IN;
+        negate = true;
+    } else if(node->op == MATCH_EXISTS) {
+        walk_path(*root, node->path, leaf_visit, &ctx, &found, error);
+        return found == bson_iter_as_bool(&node->value);
+    }
+
+    ret = walk_path(*root, node->path, leaf_visit, &ctx, &found, error);
+    if(!ret && !found) {
+        ret = match_missing(ctx.op, &node->value);
+    }
+    return negate ? !ret : ret;
+}
+
+static bool
+eval_node(const vec_node_t *prog, int idx, const bson_iter_t *root,
+          bool *error)
+{
+    const match_node *node = &prog->data[idx];
+    int child, end;
+
+    switch(node->op) {
+    case MATCH_AND:
+    case MATCH_OR:
+    case MATCH_NOR:
+        end = idx + node->size;
+        for(child = idx + 1; child < end; child += prog->data[child].size) {
+            bool ret = eval_node(prog, child, root, error);
+            if(node->op == MATCH_AND && !ret) {
+                return false;
+            }
+            if(node->op == MATCH_OR && ret) {
+                return true;
+            }
+            if(node->op == MATCH_NOR && ret) {
+                return false;
+            }
+        }
+        return node->op != MATCH_OR;
+    default:
+        return eval_leaf(node, root, error);
+    }
+}
+
+static int
+match_binary(filter_res *res, ErlNifBinary *bin, bool *out)
+{
+    bson_t bson;
+    bson_iter_t root;
+    bool error = false;
+
+    if(!bson_init_static(&bson, bin->data, bin->size)) {
+        return 0;
+    }
+    if(!bson_iter_init(&root, &bson)) {
+        return 0;
+    }
+    /* only the parts of the document the filter walks are checked */
+    *out = eval_node(&res->prog, 0, &root, &error);
+    return !error;
+}
+
+ERL_NIF_TERM
+compile_filter(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    encode_state *es;
+    filter_res   *res;
+    bson_iter_t   iter;
+    ERL_NIF_TERM  out;
+
+    if(argc != 1) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_is_tuple(env, argv[0]) && !enif_is_map(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+
+    /* literals are mapped to bson exactly as encode/1 does */
+    es = es_new(env, st);
+    if(!es) {
+        return make_error(st, env, "internal_error");
+    }
+    if(!encode_doc(argv[0], es)) {
+        es_destroy(es);
+        return make_error(st, env, "internal_error");
+    }
+
+    res = enif_alloc_resource(st->res_filter, sizeof(filter_res));
+    if(!res) {
+        es_destroy(es);
+        return make_error(st, env, "internal_error");
+    }
+    vec_init(&res->prog);
+    res->bson = bson_copy(&es->bson);
+    es_destroy(es);
+
+    if(!res->bson || !bson_iter_init(&iter, res->bson) ||
+            !compile_doc(&res->prog, &iter, 0)) {
+        enif_release_resource(res);
+        return make_obj_error(st, env, "badfilter", argv[0]);
+    }
+
+    out = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return out;
+}
+
+ERL_NIF_TERM
+match(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    filter_res  *res;
+    ErlNifBinary bin;
+    bool         ret;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_filter, (void **)&res)) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_inspect_binary(env, argv[1], &bin)) {
+        return enif_make_badarg(env);
+    }
+    if(!match_binary(res, &bin, &ret)) {
+        return make_error(st, env, "badbson");
+    }
+    return ret ? st->atom_true : st->atom_false;
+}
+
+ERL_NIF_TERM
+filter(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    filter_res  *res;
+    ErlNifBinary bin;
+    ERL_NIF_TERM list, item, out;
+    vec_term_t   vec;
+    bool         ret;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_resource(env, argv[0], st->res_filter, (void **)&res)) {
+        return enif_make_badarg(env);
+    }
+
+    vec_init(&vec);
+    list = argv[1];
+    while(enif_get_list_cell(env, list, &item, &list)) {
+        if(!enif_inspect_binary(env, item, &bin)) {
+            vec_deinit(&vec);
+            return enif_make_badarg(env);
+        }
+        if(!match_binary(res, &bin, &ret)) {
+            vec_deinit(&vec);
+            return make_obj_error(st, env, "badbson", item);
+        }
+        if(ret && vec_push(&vec, item) != 0) {
+            vec_deinit(&vec);
+            return make_error(st, env, "internal_error");
+        }
+    }
+
+    out = enif_make_list_from_array(env, vec.data, vec.length);
+    vec_deinit(&vec);
+    return out;
+}
@@ -0,0 +1,88 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "cabala.h"
+
+/*
+ * ObjectId generator state, one per thread so scheduler threads never
+ * share a counter or take a lock. Each thread has its own random
+ * 5 byte value, which keeps the ids of different threads apart.
+ */
+typedef struct {
+    int      ready;
+    uint8_t  unique[5];
+    uint32_t counter;
+} oid_ctx;
+
+static __thread oid_ctx ctx;
+static uint64_t         oid_seeds;
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void
+oid_seed(void)
+{
+    struct timespec ts;
+    uint64_t x, r;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    x = ((uint64_t)ts.tv_sec << 30) ^ (uint64_t)ts.tv_nsec ^
+        ((uint64_t)getpid() << 40) ^ (uint64_t)(uintptr_t)&ctx ^
+        (__atomic_fetch_add(&oid_seeds, 1, __ATOMIC_RELAXED) << 20);
+    r = splitmix64(&x);
+    memcpy(ctx.unique, &r, sizeof ctx.unique);
+    ctx.counter = (uint32_t)splitmix64(&x);
+    ctx.ready = 1;
+}
+
+/* 4 byte big endian seconds, 5 unique bytes, 3 byte big endian counter */
+void
+oid_new(bson_oid_t *oid)
+{
+    uint32_t t, c;
+
+    if(!ctx.ready) {
+        oid_seed();
+    }
+    t = (uint32_t)time(NULL);
+    c = ctx.counter++;
+
+    oid->bytes[0] = t >> 24;
+    oid->bytes[1] = t >> 16;
+    oid->bytes[2] = t >> 8;
+    oid->bytes[3] = t;
+    memcpy(oid->bytes + 4, ctx.unique, 5);
+    oid->bytes[9] = c >> 16;
+    oid->bytes[10] = c >> 8;
+    oid->bytes[11] = c;
+}
+
+/* {'$oid$', <<Bytes:12/binary>>}, as decode returns them */
+ERL_NIF_TERM
+make_oid(ErlNifEnv *env, cabala_st *st, const bson_oid_t *oid)
+{
+    ERL_NIF_TERM bin;
+
+    if(!make_binary(env, &bin, oid->bytes, 12)) {
+        return enif_make_badarg(env);
+    }
+    return enif_make_tuple2(env, st->atom_s_oid, bin);
+}
+
+ERL_NIF_TERM
+new_oid(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st *st = (cabala_st*)enif_priv_data(env);
+    bson_oid_t oid;
+
+    oid_new(&oid);
+    return make_oid(env, st, &oid);
+}
@@ -0,0 +1,511 @@
+#include "cabala.h"
+
+/* below these, splitting costs more than it saves */
+#define PARALLEL_MIN_BYTES      (256 * 1024)
+#define PARALLEL_MIN_DOCS       64
+
+/* default document count below which encode_batch stays on one thread */
+#define ENCODE_THRESHOLD        1000
+
+/* encode_task.failed of a task that never ran */
+#define NOT_RUN                 ((size_t)-1)
+
+typedef struct {
+    pool_job_t      job;
+    cabala_st      *st;
+    latch_t        *latch;
+    ErlNifEnv      *env;        // process independent, owns the results
+    const uint8_t  *data;
+    const uint64_t *offsets;
+    size_t          from;
+    size_t          to;
+    const decode_state *opts;   // the caller's options
+    vec_term_t      docs;
+    int             ok;
+    int             utf8_error;
+} decode_task;
+
+typedef struct {
+    pool_job_t    job;
+    cabala_st    *st;
+    latch_t      *latch;
+    ErlNifEnv    *env;      // copies of the documents
+    ERL_NIF_TERM *docs;
+    const bson_oid_t **ids;     // _id to prepend per document, or NULL
+    size_t        count;
+    buffer_t      out;
+    size_t        failed;   // index of the failed document, count if none
+    bool          validate_utf8;
+} encode_task;
+
+/* decode documents [from, to) into docs, all terms live in ds->env */
+static int
+decode_range(decode_state *ds, const uint8_t *data, const uint64_t *offsets,
+             size_t from, size_t to, vec_term_t *docs)
+{
+    bson_t       bson;
+    ERL_NIF_TERM doc;
+    size_t       i;
+
+    for(i = from; i < to; i++) {
+        if(!bson_init_static(&bson, data + offsets[i],
+                             offsets[i + 1] - offsets[i]) ||
+                !iter_bson(&bson, &doc, ds)) {
+            return 0;
+        }
+        if(vec_push(docs, doc) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+run_decode_task(pool_job_t *job)
+{
+    decode_task *task = (decode_task*)job;
+    decode_state ds = *task->opts;
+
+    ds.env = task->env;
+    task->ok = decode_range(&ds, task->data, task->offsets,
+                            task->from, task->to, &task->docs);
+    task->utf8_error = ds.utf8_error;
+    latch_count_down(task->latch);
+}
+
+/*
+ * Split [0, count) into at most parts ranges of about the same byte
+ * size, bounds gets parts + 1 entries. Returns the number of ranges.
+ */
+static int
+partition(const uint64_t *offsets, size_t count, int parts, size_t *bounds)
+{
+    uint64_t total = offsets[count];
+    size_t   i = 0;
+    int      n = 0, p;
+
+    bounds[0] = 0;
+    for(p = 1; p < parts; p++) {
+        uint64_t target = (uint64_t)((double)total * p / parts);
+        while(i < count && offsets[i] < target) {
+            i++;
+        }
+        if(i > bounds[n] && i < count) {
+            bounds[++n] = i;
+        }
+    }
+    bounds[++n] = count;
+    return n;
+}
+
+static ERL_NIF_TERM
+decode_serial(decode_state *ds, const uint8_t *data, vec_u64_t *offsets)
+{
+    vec_term_t   docs;
+    ERL_NIF_TERM out;
+
+    vec_init(&docs);
+    if(!decode_range(ds, data, offsets->data, 0, offsets->length - 1, &docs)) {
+        out = make_error(ds->st, ds->env, ds->utf8_error ?
+                         "invalid_utf8" : "badbson");
+    } else {
+        out = enif_make_list_from_array(ds->env, docs.data, docs.length);
+    }
+    vec_deinit(&docs);
+    return out;
+}
+
+static ERL_NIF_TERM
+decode_tasks(ErlNifEnv *env, cabala_st *st, const uint8_t *data,
+             vec_u64_t *offsets, const decode_state *opts, int parts)
+{
+    decode_task *tasks;
+    latch_t      latch;
+    size_t       bounds[POOL_MAX_THREADS + 1];
+    ERL_NIF_TERM out;
+    int          n, i, j, ok = 1, utf8_error = 0;
+
+    n = partition(offsets->data, offsets->length - 1, parts, bounds);
+    tasks = enif_alloc(n * sizeof(decode_task));
+    if(!tasks) {
+        return make_error(st, env, "internal_error");
+    }
+    memset(tasks, 0, n * sizeof(decode_task));
+    if(!latch_init(&latch, n)) {
+        enif_free(tasks);
+        return make_error(st, env, "internal_error");
+    }
+
+    for(i = 0; i < n; i++) {
+        decode_task *task = &tasks[i];
+
+        task->job.run = run_decode_task;
+        task->st = st;
+        task->latch = &latch;
+        task->env = enif_alloc_env();
+        task->data = data;
+        task->offsets = offsets->data;
+        task->from = bounds[i];
+        task->to = bounds[i + 1];
+        task->opts = opts;
+        vec_init(&task->docs);
+        if(!task->env || !pool_submit(st->pool, &task->job, false)) {
+            latch_count_down(&latch);
+        }
+    }
+    latch_wait(&latch);
+
+    for(i = 0; i < n; i++) {
+        ok = ok && tasks[i].ok;
+        utf8_error = utf8_error || tasks[i].utf8_error;
+    }
+
+    /* copy the documents out back to front to build the list in order */
+    out = enif_make_list(env, 0);
+    for(i = n - 1; ok && i >= 0; i--) {
+        for(j = tasks[i].docs.length - 1; j >= 0; j--) {
+            out = enif_make_list_cell(env,
+                    enif_make_copy(env, tasks[i].docs.data[j]), out);
+        }
+    }
+    if(!ok) {
+        out = make_error(st, env, utf8_error ? "invalid_utf8" : "badbson");
+    }
+
+    for(i = 0; i < n; i++) {
+        vec_deinit(&tasks[i].docs);
+        if(tasks[i].env) {
+            enif_free_env(tasks[i].env);
+        }
+    }
+    latch_destroy(&latch);
+    enif_free(tasks);
+    return out;
+}
+
+/*
+ * Decode a sequence of documents on the native pool. The input is
+ * framed by its length prefixes, cut into byte-balanced ranges and
+ * every range is decoded into its own environment; the results are
+ * copied into the caller's environment in order.
+ */
+ERL_NIF_TERM
+decode_all_parallel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ErlNifBinary bin;
+    decode_state ds;
+    vec_u64_t    offsets;
+    ERL_NIF_TERM opts, item, out;
+    const ERL_NIF_TERM *tuple;
+    size_t       count;
+    int          arity, threads = pool_size(st->pool), parts;
+
+    if(argc != 2 || !enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&ds, env, st);
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_threads) == 0) {
+            if(!enif_get_int(env, tuple[1], &threads) || threads <= 0) {
+                return enif_make_badarg(env);
+            }
+        } else if(!decode_option(&ds, item)) {
+            return enif_make_badarg(env);
+        }
+    }
+
+    vec_init(&offsets);
+    if(scan_offsets(bin.data, bin.size, &offsets) >= 0 ||
+            vec_push(&offsets, bin.size) != 0) {
+        vec_deinit(&offsets);
+        return make_error(st, env, "badbson");
+    }
+    count = offsets.length - 1;
+
+    parts = threads < pool_size(st->pool) ? threads : pool_size(st->pool);
+    if((size_t)parts > count / PARALLEL_MIN_DOCS) {
+        parts = count / PARALLEL_MIN_DOCS;
+    }
+    if(parts < 2 || bin.size < PARALLEL_MIN_BYTES) {
+        out = decode_serial(&ds, bin.data, &offsets);
+    } else {
+        out = decode_tasks(env, st, bin.data, &offsets, &ds, parts);
+    }
+
+    vec_deinit(&offsets);
+    return out;
+}
+
+/* encode docs one after another into out, returns the index that failed */
+static size_t
+encode_range(encode_state *es, const ERL_NIF_TERM *docs,
+             const bson_oid_t **ids, size_t count, buffer_t *out)
+{
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        bson_reinit(&es->bson);
+        es->id = ids ? ids[i] : NULL;
+        if(!encode_doc(docs[i], es) ||
+                !buffer_append(out, bson_get_data(&es->bson), es->bson.len)) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static void
+run_encode_task(pool_job_t *job)
+{
+    encode_task  *task = (encode_task*)job;
+    encode_state *es;
+
+    es = es_new(task->env, task->st);
+    if(es) {
+        es->validate_utf8 = task->validate_utf8;
+        task->failed = encode_range(es, task->docs, task->ids, task->count,
+                                    &task->out);
+        es_destroy(es);
+    }
+    latch_count_down(task->latch);
+}
+
+static ERL_NIF_TERM
+encode_serial(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM *docs,
+              const bson_oid_t **ids, size_t count, bool validate_utf8)
+{
+    encode_state *es;
+    buffer_t      buf;
+    ERL_NIF_TERM  out;
+    size_t        failed;
+
+    if(!buffer_init(&buf, 64 * count)) {
+        return make_error(st, env, "internal_error");
+    }
+    es = es_new(env, st);
+    if(!es) {
+        buffer_destroy(&buf);
+        return make_error(st, env, "internal_error");
+    }
+    es->validate_utf8 = validate_utf8;
+
+    failed = encode_range(es, docs, ids, count, &buf);
+    es_destroy(es);
+    if(failed < count) {
+        buffer_destroy(&buf);
+        return make_obj_error(st, env, "baddoc", docs[failed]);
+    }
+    if(!buffer_make_binary(env, &buf, &out)) {
+        buffer_destroy(&buf);
+        return make_error(st, env, "internal_error");
+    }
+    return out;
+}
+
+/*
+ * Every partition is copied into a worker environment and encoded into
+ * its own buffer, the buffers are then joined in order.
+ */
+static ERL_NIF_TERM
+encode_tasks(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM *docs,
+             const bson_oid_t **ids, size_t count, int parts,
+             bool validate_utf8)
+{
+    encode_task *tasks;
+    latch_t      latch;
+    ErlNifBinary bin;
+    ERL_NIF_TERM out;
+    size_t       i, j, from, total = 0, offset = 0;
+    bool         failed = false;
+    int          n = 0;
+
+    tasks = enif_alloc(parts * sizeof(encode_task));
+    if(!tasks) {
+        return make_error(st, env, "internal_error");
+    }
+    memset(tasks, 0, parts * sizeof(encode_task));
+    if(!latch_init(&latch, parts)) {
+        enif_free(tasks);
+        return make_error(st, env, "internal_error");
+    }
+
+    for(n = 0; n < parts; n++) {
+        encode_task *task = &tasks[n];
+
+        from = count * n / parts;
+        task->job.run = run_encode_task;
+        task->st = st;
+        task->latch = &latch;
+        task->count = count * (n + 1) / parts - from;
+        task->ids = ids ? ids + from : NULL;
+        task->failed = NOT_RUN;
+        task->validate_utf8 = validate_utf8;
+        task->env = enif_alloc_env();
+        task->docs = enif_alloc(task->count * sizeof(ERL_NIF_TERM));
+        if(!task->env || !task->docs ||
+                !buffer_init(&task->out, 64 * task->count)) {
+            latch_count_down(&latch);
+            continue;
+        }
+        for(j = 0; j < task->count; j++) {
+            task->docs[j] = enif_make_copy(task->env, docs[from + j]);
+        }
+        if(!pool_submit(st->pool, &task->job, false)) {
+            latch_count_down(&latch);
+        }
+    }
+    latch_wait(&latch);
+
+    for(n = 0, from = 0; n < parts; from += tasks[n].count, n++) {
+        if(tasks[n].failed == NOT_RUN) {
+            out = make_error(st, env, "internal_error");
+            failed = true;
+            break;
+        }
+        if(tasks[n].failed < tasks[n].count) {
+            out = make_obj_error(st, env, "baddoc",
+                                 docs[from + tasks[n].failed]);
+            failed = true;
+            break;
+        }
+        total += tasks[n].out.len;
+    }
+
+    if(!failed) {
+        if(enif_alloc_binary(total, &bin)) {
+            for(n = 0; n < parts; n++) {
+                memcpy(bin.data + offset, tasks[n].out.bin.data,
+                       tasks[n].out.len);
+                offset += tasks[n].out.len;
+            }
+            out = enif_make_binary(env, &bin);
+        } else {
+            out = make_error(st, env, "internal_error");
+        }
+    }
+
+    for(i = 0; i < (size_t)parts; i++) {
+        if(tasks[i].out.bin.data) {
+            buffer_destroy(&tasks[i].out);
+        }
+        if(tasks[i].docs) {
+            enif_free(tasks[i].docs);
+        }
+        if(tasks[i].env) {
+            enif_free_env(tasks[i].env);
+        }
+    }
+    latch_destroy(&latch);
+    enif_free(tasks);
+    return out;
+}
+
+/*
+ * Encode a list of documents into one binary of concatenated documents,
+ * ready to be used as an OP_MSG document sequence.
+ */
+ERL_NIF_TERM
+encode_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    ERL_NIF_TERM *docs, list, opts, item, out, id;
+    const ERL_NIF_TERM *tuple;
+    const bson_oid_t **ids = NULL;
+    bson_oid_t   *oids = NULL;
+    unsigned      count, i, threshold = ENCODE_THRESHOLD;
+    int           arity, threads = pool_size(st->pool), parts;
+    bool          ensure_id = false, validate_utf8 = false;
+
+    if(argc != 2 || !enif_get_list_length(env, argv[0], &count)) {
+        return enif_make_badarg(env);
+    }
+
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            return enif_make_badarg(env);
+        } else if(enif_compare(tuple[0], st->atom_threads) == 0) {
+            if(!enif_get_int(env, tuple[1], &threads) || threads <= 0) {
+                return enif_make_badarg(env);
+            }
+        } else if(enif_compare(tuple[0], st->atom_threshold) == 0) {
+            if(!enif_get_uint(env, tuple[1], &threshold)) {
+                return enif_make_badarg(env);
+            }
+        } else if(enif_compare(tuple[0], st->atom_ensure_id) == 0) {
+            ensure_id = enif_compare(tuple[1], st->atom_true) == 0;
+        } else if(enif_compare(tuple[0], st->atom_validate_utf8) == 0) {
+            validate_utf8 = enif_compare(tuple[1], st->atom_true) == 0;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    docs = enif_alloc((count + 1) * sizeof(ERL_NIF_TERM));
+    if(!docs) {
+        return make_error(st, env, "internal_error");
+    }
+    list = argv[0];
+    for(i = 0; enif_get_list_cell(env, list, &docs[i], &list); i++) {
+        if(!enif_is_tuple(env, docs[i]) && !enif_is_map(env, docs[i])) {
+            enif_free(docs);
+            return enif_make_badarg(env);
+        }
+    }
+
+    /* ids are made here, on the scheduler thread, workers only copy them */
+    if(ensure_id) {
+        ids = enif_alloc((count + 1) * sizeof(bson_oid_t*));
+        oids = enif_alloc((count + 1) * sizeof(bson_oid_t));
+        if(!ids || !oids) {
+            out = make_error(st, env, "internal_error");
+            goto done;
+        }
+        for(i = 0; i < count; i++) {
+            if(doc_id(env, st, docs[i], &id)) {
+                ids[i] = NULL;
+            } else {
+                oid_new(&oids[i]);
+                ids[i] = &oids[i];
+            }
+        }
+    }
+
+    parts = threads < pool_size(st->pool) ? threads : pool_size(st->pool);
+    if((unsigned)parts > count / PARALLEL_MIN_DOCS) {
+        parts = count / PARALLEL_MIN_DOCS;
+    }
+    if(count < threshold || parts < 2) {
+        out = encode_serial(env, st, docs, ids, count, validate_utf8);
+    } else {
+        out = encode_tasks(env, st, docs, ids, count, parts, validate_utf8);
+    }
+
+    /* {Bin, Ids} with the _id of every document, new or not */
+    if(ensure_id && enif_is_binary(env, out)) {
+        list = enif_make_list(env, 0);
+        for(i = count; i > 0; i--) {
+            if(ids[i - 1]) {
+                id = make_oid(env, st, ids[i - 1]);
+            } else {
+                doc_id(env, st, docs[i - 1], &id);
+            }
+            list = enif_make_list_cell(env, id, list);
+        }
+        out = enif_make_tuple2(env, out, list);
+    }
+
+done:
+    if(ids) {
+        enif_free(ids);
+    }
+    if(oids) {
+        enif_free(oids);
+    }
+    enif_free(docs);
+    return out;
+}
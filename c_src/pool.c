@@ -0,0 +1,240 @@
+#include <unistd.h>
+
+#include "cabala.h"
+
+struct pool_s {
+    ErlNifMutex *lock;
+    ErlNifCond  *cond;
+    ErlNifTid   *tids;
+    int          nthreads;
+    pool_job_t  *head;
+    pool_job_t  *tail;
+    int          queued;
+    int          max_queued;
+    bool         stop;
+};
+
+static void*
+worker(void *arg)
+{
+    pool_t     *pool = arg;
+    pool_job_t *job;
+
+    for(;;) {
+        enif_mutex_lock(pool->lock);
+        while(!pool->head && !pool->stop) {
+            enif_cond_wait(pool->cond, pool->lock);
+        }
+        if(!pool->head) {
+            enif_mutex_unlock(pool->lock);
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if(!pool->head) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        enif_mutex_unlock(pool->lock);
+
+        job->run(job);
+    }
+    return NULL;
+}
+
+/* one worker per online cpu unless nthreads is given */
+pool_t*
+pool_new(int nthreads, int max_queued)
+{
+    pool_t *pool;
+    int     i;
+
+    if(nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(nthreads <= 0) {
+        nthreads = 1;
+    } else if(nthreads > POOL_MAX_THREADS) {
+        nthreads = POOL_MAX_THREADS;
+    }
+
+    pool = enif_alloc(sizeof(pool_t));
+    if(!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(pool_t));
+    pool->max_queued = max_queued;
+    pool->lock = enif_mutex_create("cabala_pool");
+    pool->cond = enif_cond_create("cabala_pool");
+    pool->tids = enif_alloc(nthreads * sizeof(ErlNifTid));
+    if(!pool->lock || !pool->cond || !pool->tids) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    for(i = 0; i < nthreads; i++) {
+        if(enif_thread_create("cabala_worker", &pool->tids[i], worker,
+                              pool, NULL) != 0) {
+            break;
+        }
+        pool->nthreads++;
+    }
+    if(pool->nthreads == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* queued jobs are still run before the workers exit */
+void
+pool_destroy(pool_t *pool)
+{
+    int i;
+
+    if(!pool) {
+        return;
+    }
+    if(pool->lock) {
+        enif_mutex_lock(pool->lock);
+        pool->stop = true;
+        if(pool->cond) {
+            enif_cond_broadcast(pool->cond);
+        }
+        enif_mutex_unlock(pool->lock);
+    }
+    for(i = 0; i < pool->nthreads; i++) {
+        enif_thread_join(pool->tids[i], NULL);
+    }
+
+    if(pool->tids) {
+        enif_free(pool->tids);
+    }
+    if(pool->cond) {
+        enif_cond_destroy(pool->cond);
+    }
+    if(pool->lock) {
+        enif_mutex_destroy(pool->lock);
+    }
+    enif_free(pool);
+}
+
+int
+pool_size(pool_t *pool)
+{
+    return pool->nthreads;
+}
+
+/*
+ * Queue a job. Bounded submissions fail once max_queued jobs are
+ * waiting, jobs belonging to a call that waits for them are never
+ * refused.
+ */
+int
+pool_submit(pool_t *pool, pool_job_t *job, bool bounded)
+{
+    int ret = 1;
+
+    job->next = NULL;
+    enif_mutex_lock(pool->lock);
+    if(pool->stop || (bounded && pool->queued >= pool->max_queued)) {
+        ret = 0;
+    } else {
+        if(pool->tail) {
+            pool->tail->next = job;
+        } else {
+            pool->head = job;
+        }
+        pool->tail = job;
+        pool->queued++;
+        enif_cond_signal(pool->cond);
+    }
+    enif_mutex_unlock(pool->lock);
+    return ret;
+}
+
+/* unlink a job that has not been picked up by a worker yet */
+int
+pool_cancel(pool_t *pool, pool_job_t *job)
+{
+    pool_job_t *prev = NULL, *cur;
+    int ret = 0;
+
+    enif_mutex_lock(pool->lock);
+    for(cur = pool->head; cur; prev = cur, cur = cur->next) {
+        if(cur != job) {
+            continue;
+        }
+        if(prev) {
+            prev->next = cur->next;
+        } else {
+            pool->head = cur->next;
+        }
+        if(pool->tail == cur) {
+            pool->tail = prev;
+        }
+        pool->queued--;
+        ret = 1;
+        break;
+    }
+    enif_mutex_unlock(pool->lock);
+    return ret;
+}
+
+int
+pool_queued(pool_t *pool)
+{
+    int queued;
+
+    enif_mutex_lock(pool->lock);
+    queued = pool->queued;
+    enif_mutex_unlock(pool->lock);
+    return queued;
+}
+
+/* countdown for a caller waiting on a set of jobs */
+int
+latch_init(latch_t *latch, int count)
+{
+    latch->count = count;
+    latch->lock = enif_mutex_create("cabala_latch");
+    latch->cond = enif_cond_create("cabala_latch");
+    if(!latch->lock || !latch->cond) {
+        latch_destroy(latch);
+        return 0;
+    }
+    return 1;
+}
+
+void
+latch_count_down(latch_t *latch)
+{
+    enif_mutex_lock(latch->lock);
+    if(--latch->count == 0) {
+        enif_cond_broadcast(latch->cond);
+    }
+    enif_mutex_unlock(latch->lock);
+}
+
+void
+latch_wait(latch_t *latch)
+{
+    enif_mutex_lock(latch->lock);
+    while(latch->count > 0) {
+        enif_cond_wait(latch->cond, latch->lock);
+    }
+    enif_mutex_unlock(latch->lock);
+}
+
+void
+latch_destroy(latch_t *latch)
+{
+    if(latch->cond) {
+        enif_cond_destroy(latch->cond);
+        latch->cond = NULL;
+    }
+    if(latch->lock) {
+        enif_mutex_destroy(latch->lock);
+        latch->lock = NULL;
+    }
+}
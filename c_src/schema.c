@@ -0,0 +1,266 @@
+#include "cabala.h"
+
+void
+schema_dtor(ErlNifEnv *env, void *obj)
+{
+    schema_res *res = obj;
+
+    if(res->fields) {
+        enif_free(res->fields);
+    }
+    if(res->keys) {
+        enif_free(res->keys);
+    }
+    if(res->table) {
+        enif_free(res->table);
+    }
+    if(res->defaults) {
+        enif_free(res->defaults);
+    }
+    if(res->env) {
+        enif_free_env(res->env);
+    }
+}
+
+/* FNV-1a, field names are short */
+static inline uint32_t
+key_hash(const char *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t   i;
+
+    for(i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* index of the field named key, or -1 */
+int
+schema_lookup(const schema_res *res, const char *key, size_t len)
+{
+    uint32_t i = key_hash(key, len) & res->mask;
+    uint32_t slot;
+
+    while((slot = res->table[i]) != 0) {
+        const schema_field *f = &res->fields[slot - 1];
+
+        if((size_t)f->key_len == len && memcmp(f->key, key, len) == 0) {
+            return slot - 1;
+        }
+        i = (i + 1) & res->mask;
+    }
+    return -1;
+}
+
+/* open addressing at most half full, the first of duplicate names wins */
+static int
+build_table(schema_res *res)
+{
+    uint32_t size = 8, i;
+    size_t   n;
+
+    while(size < res->count * 2) {
+        size <<= 1;
+    }
+    res->table = enif_alloc(sizeof(uint32_t) * size);
+    if(res->table == NULL) {
+        return 0;
+    }
+    memset(res->table, 0, sizeof(uint32_t) * size);
+    res->mask = size - 1;
+
+    for(n = 0; n < res->count; n++) {
+        const schema_field *f = &res->fields[n];
+
+        if(schema_lookup(res, f->key, f->key_len) >= 0) {
+            continue;
+        }
+        i = key_hash(f->key, f->key_len) & res->mask;
+        while(res->table[i] != 0) {
+            i = (i + 1) & res->mask;
+        }
+        res->table[i] = n + 1;
+    }
+    return 1;
+}
+
+/* {defaults, [Value]} with one value per field and {record, Name} */
+static int
+parse_schema_opts(ErlNifEnv *env, cabala_st *st, schema_res *res,
+                  ERL_NIF_TERM opts)
+{
+    ERL_NIF_TERM item, list, value;
+    const ERL_NIF_TERM *tuple;
+    unsigned     len;
+    int          arity;
+    size_t       i;
+
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(!enif_get_tuple(env, item, &arity, &tuple) || arity != 2) {
+            return 0;
+        }
+        if(enif_compare(tuple[0], st->atom_defaults) == 0) {
+            if(!enif_get_list_length(env, tuple[1], &len) ||
+                    len != res->count || res->defaults) {
+                return 0;
+            }
+            res->defaults = enif_alloc(sizeof(ERL_NIF_TERM) *
+                                       (len > 0 ? len : 1));
+            if(res->defaults == NULL) {
+                return 0;
+            }
+            list = tuple[1];
+            for(i = 0; i < len; i++) {
+                enif_get_list_cell(env, list, &value, &list);
+                res->defaults[i] = enif_make_copy(res->env, value);
+            }
+        } else if(enif_compare(tuple[0], st->atom_record) == 0 &&
+                enif_is_atom(env, tuple[1])) {
+            res->record = enif_make_copy(res->env, tuple[1]);
+            res->has_record = 1;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+get_field_type(cabala_st *st, ERL_NIF_TERM term, field_type *type)
+{
+    if(enif_compare(term, st->atom_any) == 0) {
+        *type = FIELD_ANY;
+    } else if(enif_compare(term, st->atom_int32) == 0) {
+        *type = FIELD_INT32;
+    } else if(enif_compare(term, st->atom_int64) == 0) {
+        *type = FIELD_INT64;
+    } else if(enif_compare(term, st->atom_double) == 0) {
+        *type = FIELD_DOUBLE;
+    } else if(enif_compare(term, st->atom_string) == 0) {
+        *type = FIELD_STRING;
+    } else if(enif_compare(term, st->atom_binary) == 0) {
+        *type = FIELD_BINARY;
+    } else if(enif_compare(term, st->atom_bool) == 0) {
+        *type = FIELD_BOOL;
+    } else if(enif_compare(term, st->atom_date) == 0) {
+        *type = FIELD_DATE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* the key bytes of a binary or atom field name, without a NUL inside */
+static int
+key_length(ErlNifEnv *env, ERL_NIF_TERM term, size_t *len)
+{
+    ErlNifBinary bin;
+    unsigned     alen;
+
+    if(enif_get_atom_length(env, term, &alen, ERL_NIF_LATIN1)) {
+        *len = alen;
+        return 1;
+    }
+    if(!enif_inspect_binary(env, term, &bin) ||
+            memchr(bin.data, '\0', bin.size)) {
+        return 0;
+    }
+    *len = bin.size;
+    return 1;
+}
+
+static void
+key_copy(ErlNifEnv *env, ERL_NIF_TERM term, char *dst, size_t len)
+{
+    ErlNifBinary bin;
+
+    if(enif_is_atom(env, term)) {
+        enif_get_atom(env, term, dst, len + 1, ERL_NIF_LATIN1);
+        return;
+    }
+    enif_inspect_binary(env, term, &bin);
+    memcpy(dst, bin.data, len);
+    dst[len] = '\0';
+}
+
+/*
+ * Fields (binaries or atoms, as from record_info(fields, R)) with one
+ * type per field. The key bytes are laid out once so encode_record can
+ * hand them to the bson appenders as they are, and hashed so that
+ * decode_record finds the slot of each key without building it.
+ */
+ERL_NIF_TERM
+compile_schema(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    schema_res  *res;
+    ERL_NIF_TERM fields, types, name, type, out;
+    unsigned     count, ntypes;
+    size_t       i, len, total = 0;
+    char        *p;
+
+    if(argc != 3 ||
+            !enif_get_list_length(env, argv[0], &count) ||
+            !enif_get_list_length(env, argv[1], &ntypes) ||
+            count != ntypes) {
+        return enif_make_badarg(env);
+    }
+
+    fields = argv[0];
+    while(enif_get_list_cell(env, fields, &name, &fields)) {
+        if(!key_length(env, name, &len)) {
+            return enif_make_badarg(env);
+        }
+        total += len + 1;
+    }
+
+    res = enif_alloc_resource(st->res_schema, sizeof(schema_res));
+    if(res == NULL) {
+        return make_error(st, env, "enomem");
+    }
+    memset(res, 0, sizeof(schema_res));
+    res->count = count;
+    res->fields = enif_alloc(sizeof(schema_field) * (count > 0 ? count : 1));
+    res->keys = enif_alloc(total > 0 ? total : 1);
+    res->env = enif_alloc_env();
+    if(res->fields == NULL || res->keys == NULL || res->env == NULL) {
+        enif_release_resource(res);
+        return make_error(st, env, "enomem");
+    }
+
+    fields = argv[0];
+    types = argv[1];
+    p = res->keys;
+    for(i = 0; i < count; i++) {
+        schema_field *f = &res->fields[i];
+
+        enif_get_list_cell(env, fields, &name, &fields);
+        enif_get_list_cell(env, types, &type, &types);
+        if(!get_field_type(st, type, &f->type)) {
+            enif_release_resource(res);
+            return enif_make_badarg(env);
+        }
+        if(!key_length(env, name, &len)) {
+            enif_release_resource(res);
+            return enif_make_badarg(env);
+        }
+        key_copy(env, name, p, len);
+        f->key = p;
+        f->key_len = (int)len;
+        p += len + 1;
+    }
+
+    if(!parse_schema_opts(env, st, res, argv[2])) {
+        enif_release_resource(res);
+        return enif_make_badarg(env);
+    }
+    if(!build_table(res)) {
+        enif_release_resource(res);
+        return make_error(st, env, "enomem");
+    }
+
+    out = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return out;
+}
@@ -0,0 +1,310 @@
+#include "cabala.h"
+
+typedef struct {
+    const char *path;
+    int         direction;      // 1 ascending, -1 descending
+} sort_key;
+
+typedef vec_t(sort_key) vec_sort_key_t;
+
+typedef struct {
+    encode_state   *es;         // owns the encoded sort spec
+    vec_sort_key_t  keys;
+    bson_iter_t     null_iter;  // stands in for missing fields
+    bson_iter_t     empty_iter; // stands in for empty arrays
+} sort_spec;
+
+typedef struct {
+    ERL_NIF_TERM  term;
+    bson_t        bson;
+    bson_iter_t  *values;       // one per sort key
+} sort_item;
+
+typedef struct {
+    const sort_spec *spec;
+    int              direction;
+    bool             found;
+    bson_iter_t      best;
+} extract_ctx;
+
+/* {"": null} and {"": undefined} */
+static const uint8_t null_doc[] = {7, 0, 0, 0, BSON_TYPE_NULL, 0, 0};
+static const uint8_t undefined_doc[] = {7, 0, 0, 0, BSON_TYPE_UNDEFINED, 0, 0};
+
+static int
+single_iter(const uint8_t *data, size_t len, bson_iter_t *iter)
+{
+    bson_t bson;
+
+    return bson_init_static(&bson, data, len) &&
+           bson_iter_init(iter, &bson) &&
+           bson_iter_next(iter);
+}
+
+static void
+spec_destroy(sort_spec *spec)
+{
+    es_destroy(spec->es);
+    vec_deinit(&spec->keys);
+}
+
+/*
+ * Sort specs are documents of {Path, 1 | -1}, given as a tuple (or a
+ * map when the key order does not matter).
+ */
+static int
+spec_init(ErlNifEnv *env, cabala_st *st, ERL_NIF_TERM term, sort_spec *spec)
+{
+    bson_iter_t iter;
+    sort_key key;
+    int64_t direction;
+
+    vec_init(&spec->keys);
+    spec->es = NULL;
+
+    if(!enif_is_tuple(env, term) && !enif_is_map(env, term)) {
+        return 0;
+    }
+    if(!single_iter(null_doc, sizeof null_doc, &spec->null_iter) ||
+            !single_iter(undefined_doc, sizeof undefined_doc,
+                         &spec->empty_iter)) {
+        return 0;
+    }
+
+    spec->es = es_new(env, st);
+    if(!spec->es) {
+        return 0;
+    }
+    if(!encode_doc(term, spec->es)) {
+        return 0;
+    }
+    if(!bson_iter_init(&iter, &spec->es->bson)) {
+        return 0;
+    }
+    while(bson_iter_next(&iter)) {
+        switch(bson_iter_type(&iter)) {
+        case BSON_TYPE_INT32:
+        case BSON_TYPE_INT64:
+        case BSON_TYPE_DOUBLE:
+            direction = bson_iter_as_int64(&iter);
+            break;
+        default:
+            return 0;
+        }
+        if(direction != 1 && direction != -1) {
+            return 0;
+        }
+        key.path = bson_iter_key(&iter);
+        key.direction = (int)direction;
+        if(vec_push(&spec->keys, key) != 0) {
+            return 0;
+        }
+    }
+    return spec->keys.length > 0;
+}
+
+/*
+ * An array sorts by its smallest element when ascending and by its
+ * largest when descending, like MongoDB does. An empty array has no
+ * element and sorts as undefined, before null and missing fields.
+ */
+static bool
+extract_visit(const bson_iter_t *value, void *data)
+{
+    extract_ctx *ctx = data;
+
+    if(BSON_ITER_HOLDS_ARRAY(value)) {
+        return false;
+    }
+    if(!ctx->found ||
+            compare_iter(value, &ctx->best) * ctx->direction < 0) {
+        ctx->best = *value;
+        ctx->found = true;
+    }
+    return false;
+}
+
+static void
+extract_keys(const sort_spec *spec, const bson_t *bson, bson_iter_t *values)
+{
+    extract_ctx ctx;
+    bson_iter_t root;
+    bool found;
+    int idx;
+
+    for(idx = 0; idx < spec->keys.length; idx++) {
+        ctx.spec = spec;
+        ctx.direction = spec->keys.data[idx].direction;
+        ctx.found = false;
+        found = false;
+
+        if(bson_iter_init(&root, bson)) {
+            walk_path(root, spec->keys.data[idx].path, extract_visit, &ctx,
+                      &found, NULL);
+        }
+        if(ctx.found) {
+            values[idx] = ctx.best;
+        } else {
+            values[idx] = found ? spec->empty_iter : spec->null_iter;
+        }
+    }
+}
+
+static int
+compare_keys(const sort_spec *spec, const bson_iter_t *a, const bson_iter_t *b)
+{
+    int idx, ret;
+
+    for(idx = 0; idx < spec->keys.length; idx++) {
+        ret = compare_iter(&a[idx], &b[idx]);
+        if(ret != 0) {
+            return ret * spec->keys.data[idx].direction;
+        }
+    }
+    return 0;
+}
+
+/* stable merge sort, keys are extracted once per document beforehand */
+static void
+merge_sort(const sort_spec *spec, sort_item **items, sort_item **tmp, int n)
+{
+    int mid = n / 2;
+    int i = 0, j = mid, k = 0;
+
+    if(n < 2) {
+        return;
+    }
+    merge_sort(spec, items, tmp, mid);
+    merge_sort(spec, items + mid, tmp, n - mid);
+
+    if(compare_keys(spec, items[mid-1]->values, items[mid]->values) <= 0) {
+        return;
+    }
+    while(i < mid && j < n) {
+        if(compare_keys(spec, items[j]->values, items[i]->values) < 0) {
+            tmp[k++] = items[j++];
+        } else {
+            tmp[k++] = items[i++];
+        }
+    }
+    while(i < mid) {
+        tmp[k++] = items[i++];
+    }
+    while(j < n) {
+        tmp[k++] = items[j++];
+    }
+    memcpy(items, tmp, n * sizeof(sort_item *));
+}
+
+static int
+item_init(ErlNifEnv *env, ERL_NIF_TERM term, sort_item *item)
+{
+    ErlNifBinary bin;
+
+    if(!enif_inspect_binary(env, term, &bin)) {
+        return 0;
+    }
+    item->term = term;
+    return bson_init_static(&item->bson, bin.data, bin.size);
+}
+
+ERL_NIF_TERM
+compare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    sort_spec    spec;
+    sort_item    a, b;
+    bson_iter_t *values;
+    ERL_NIF_TERM out;
+    int n;
+
+    if(argc != 3) {
+        return enif_make_badarg(env);
+    }
+    if(!spec_init(env, st, argv[2], &spec)) {
+        spec_destroy(&spec);
+        return enif_make_badarg(env);
+    }
+    if(!item_init(env, argv[0], &a) || !item_init(env, argv[1], &b)) {
+        spec_destroy(&spec);
+        return make_error(st, env, "badbson");
+    }
+
+    n = spec.keys.length;
+    values = enif_alloc(2 * n * sizeof(bson_iter_t));
+    if(!values) {
+        spec_destroy(&spec);
+        return make_error(st, env, "internal_error");
+    }
+    extract_keys(&spec, &a.bson, values);
+    extract_keys(&spec, &b.bson, values + n);
+    out = enif_make_int(env, compare_keys(&spec, values, values + n));
+
+    enif_free(values);
+    spec_destroy(&spec);
+    return out;
+}
+
+ERL_NIF_TERM
+sort(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    sort_spec     spec;
+    sort_item    *items = NULL, **order = NULL, **tmp = NULL;
+    bson_iter_t  *values = NULL;
+    ERL_NIF_TERM *terms = NULL;
+    ERL_NIF_TERM  list, item, out;
+    unsigned      count, idx;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_list_length(env, argv[0], &count)) {
+        return enif_make_badarg(env);
+    }
+    if(!spec_init(env, st, argv[1], &spec)) {
+        spec_destroy(&spec);
+        return enif_make_badarg(env);
+    }
+    if(count == 0) {
+        spec_destroy(&spec);
+        return argv[0];
+    }
+
+    items  = enif_alloc(count * sizeof(sort_item));
+    order  = enif_alloc(count * sizeof(sort_item *));
+    tmp    = enif_alloc(count * sizeof(sort_item *));
+    values = enif_alloc(count * spec.keys.length * sizeof(bson_iter_t));
+    terms  = enif_alloc(count * sizeof(ERL_NIF_TERM));
+    if(!items || !order || !tmp || !values || !terms) {
+        out = make_error(st, env, "internal_error");
+        goto done;
+    }
+
+    list = argv[0];
+    for(idx = 0; enif_get_list_cell(env, list, &item, &list); idx++) {
+        if(!item_init(env, item, &items[idx])) {
+            out = make_obj_error(st, env, "badbson", item);
+            goto done;
+        }
+        items[idx].values = values + idx * spec.keys.length;
+        extract_keys(&spec, &items[idx].bson, items[idx].values);
+        order[idx] = &items[idx];
+    }
+
+    merge_sort(&spec, order, tmp, count);
+
+    for(idx = 0; idx < count; idx++) {
+        terms[idx] = order[idx]->term;
+    }
+    out = enif_make_list_from_array(env, terms, count);
+
+done:
+    if(items) enif_free(items);
+    if(order) enif_free(order);
+    if(tmp) enif_free(tmp);
+    if(values) enif_free(values);
+    if(terms) enif_free(terms);
+    spec_destroy(&spec);
+    return out;
+}
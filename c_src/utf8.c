@@ -0,0 +1,289 @@
+#include "cabala.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define UTF8_AVX2 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_SSE2 1
+#endif
+
+#ifdef UTF8_AVX2
+static int utf8_avx2 = 0;
+#endif
+
+void
+utf8_init(void)
+{
+#ifdef UTF8_AVX2
+    utf8_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/* the length of the well formed sequence at s (RFC 3629), 0 if there is none */
+static inline size_t
+utf8_seq(const uint8_t *s, size_t len)
+{
+    uint8_t c = s[0], lo = 0x80, hi = 0xbf;
+
+    if(c < 0x80) {
+        return 1;
+    }
+    if(c >= 0xc2 && c <= 0xdf) {
+        return len >= 2 && (s[1] & 0xc0) == 0x80 ? 2 : 0;
+    }
+    if(c >= 0xe0 && c <= 0xef) {
+        if(c == 0xe0) {
+            lo = 0xa0;          /* overlong */
+        } else if(c == 0xed) {
+            hi = 0x9f;          /* surrogates */
+        }
+        return len >= 3 && s[1] >= lo && s[1] <= hi &&
+               (s[2] & 0xc0) == 0x80 ? 3 : 0;
+    }
+    if(c >= 0xf0 && c <= 0xf4) {
+        if(c == 0xf0) {
+            lo = 0x90;          /* overlong */
+        } else if(c == 0xf4) {
+            hi = 0x8f;          /* above U+10FFFF */
+        }
+        return len >= 4 && s[1] >= lo && s[1] <= hi &&
+               (s[2] & 0xc0) == 0x80 && (s[3] & 0xc0) == 0x80 ? 4 : 0;
+    }
+    return 0;
+}
+
+/* whole sequences from *pos until at least stop, copied as they pass */
+static inline int
+utf8_scalar(uint8_t *dst, const uint8_t *src, size_t len, size_t *pos,
+            size_t stop)
+{
+    size_t i = *pos, n, k;
+
+    while(i < stop) {
+        n = utf8_seq(src + i, len - i);
+        if(n == 0) {
+            return 0;
+        }
+        if(dst) {
+            for(k = 0; k < n; k++) {
+                dst[i + k] = src[i + k];
+            }
+        }
+        i += n;
+    }
+    *pos = i;
+    return 1;
+}
+
+/*
+ * ASCII runs go 16 bytes (or a word) at a time, a block holding other
+ * bytes is checked sequence by sequence from its first such byte.
+ */
+static int
+utf8_copy_basic(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0, block;
+
+#ifdef UTF8_SSE2
+    while(i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        int mask = _mm_movemask_epi8(v);
+
+        if(dst) {
+            _mm_storeu_si128((__m128i *)(dst + i), v);
+        }
+        block = i + 16;
+        if(mask == 0) {
+            i = block;
+            continue;
+        }
+        i += __builtin_ctz(mask);
+        if(!utf8_scalar(dst, src, len, &i, block)) {
+            return 0;
+        }
+    }
+#else
+    uint64_t w;
+
+    while(i + 8 <= len) {
+        memcpy(&w, src + i, 8);
+        if(dst) {
+            memcpy(dst + i, &w, 8);
+        }
+        block = i + 8;
+        if((w & 0x8080808080808080ull) == 0) {
+            i = block;
+            continue;
+        }
+        if(!utf8_scalar(dst, src, len, &i, block)) {
+            return 0;
+        }
+    }
+#endif
+    return utf8_scalar(dst, src, len, &i, len);
+}
+
+#ifdef UTF8_AVX2
+/*
+ * The lookup validator of Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte". Each byte is classified by the high
+ * nibble of the byte before it, the low nibble of the byte before it and
+ * its own high nibble; a bit set in all three tables is an error, and
+ * the third and fourth bytes of a sequence must be continuations.
+ */
+#define TOO_SHORT       (1 << 0)
+#define TOO_LONG        (1 << 1)
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define LOOKUP16(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+    _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+                     a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+/* the 32 bytes ending n bytes before the end of input */
+#define PREV(input, prev, n) \
+    _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), \
+                       16 - (n))
+
+__attribute__((target("avx2")))
+static int
+utf8_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const __m256i byte_1_high = LOOKUP16(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low = LOOKUP16(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high = LOOKUP16(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+            OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    /* lead bytes in the last three positions that want more bytes */
+    const __m256i incomplete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i third = _mm256_set1_epi8(0xe0 - 0x80);
+    const __m256i fourth = _mm256_set1_epi8(0xf0 - 0x80);
+    const __m256i high = _mm256_set1_epi8((char)0x80);
+    __m256i prev = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i pending = _mm256_setzero_si256();
+    __m256i input, prev1, special, must23;
+    uint8_t tail[32];
+    size_t  i = 0, rest;
+    int     last = 0;
+
+    for(;;) {
+        /* two ASCII blocks in a row after a complete sequence are skipped */
+        while(i + 64 <= len && _mm256_testz_si256(pending, pending)) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+
+            if(_mm256_movemask_epi8(_mm256_or_si256(a, b)) != 0) {
+                break;
+            }
+            if(dst) {
+                _mm256_storeu_si256((__m256i *)(dst + i), a);
+                _mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+            }
+            prev = b;
+            i += 64;
+        }
+        if(i + 32 <= len) {
+            input = _mm256_loadu_si256((const __m256i *)(src + i));
+            if(dst) {
+                _mm256_storeu_si256((__m256i *)(dst + i), input);
+            }
+            i += 32;
+        } else {
+            /* the rest padded with NULs, which also ends a cut sequence */
+            rest = len - i;
+            memset(tail, 0, sizeof tail);
+            memcpy(tail, src + i, rest);
+            if(dst) {
+                memcpy(dst + i, src + i, rest);
+            }
+            input = _mm256_loadu_si256((const __m256i *)tail);
+            last = 1;
+        }
+
+        if(_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, pending);
+            pending = _mm256_setzero_si256();
+        } else {
+            prev1 = PREV(input, prev, 1);
+            special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte_1_high,
+                        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte_1_low,
+                        _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(byte_2_high,
+                    _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+            must23 = _mm256_or_si256(
+                _mm256_subs_epu8(PREV(input, prev, 2), third),
+                _mm256_subs_epu8(PREV(input, prev, 3), fourth));
+            error = _mm256_or_si256(error,
+                _mm256_xor_si256(_mm256_and_si256(must23, high), special));
+            pending = _mm256_subs_epu8(input, incomplete);
+        }
+        prev = input;
+        if(last) {
+            break;
+        }
+    }
+    error = _mm256_or_si256(error, pending);
+    return _mm256_testz_si256(error, error);
+}
+#endif
+
+/*
+ * Copy len bytes from src to dst, unless dst is NULL, and check them for
+ * well formed UTF-8 on the way. NULs are allowed, as in bson strings.
+ */
+int
+utf8_copy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef UTF8_AVX2
+    if(utf8_avx2 && len >= 32) {
+        return utf8_copy_avx2(dst, src, len);
+    }
+#endif
+    return utf8_copy_basic(dst, src, len);
+}
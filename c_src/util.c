@@ -1,4 +1,6 @@
 
+#include <errno.h>
+
 #include "cabala.h"
 
 ERL_NIF_TERM
@@ -33,6 +35,29 @@ make_obj_error(cabala_st    *st,
     return enif_make_tuple2(env, st->atom_error, reason);
 }
 
+/* {error, Posix} with the atom file:open/2 would use */
+ERL_NIF_TERM
+make_errno_error(cabala_st *st, ErlNifEnv *env, int err)
+{
+    switch(err) {
+        case ENOENT:    return make_error(st, env, "enoent");
+        case EACCES:    return make_error(st, env, "eacces");
+        case EPERM:     return make_error(st, env, "eperm");
+        case EISDIR:    return make_error(st, env, "eisdir");
+        case ENOTDIR:   return make_error(st, env, "enotdir");
+        case EEXIST:    return make_error(st, env, "eexist");
+        case EMFILE:    return make_error(st, env, "emfile");
+        case ENFILE:    return make_error(st, env, "enfile");
+        case ENOMEM:    return make_error(st, env, "enomem");
+        case ENOSPC:    return make_error(st, env, "enospc");
+        case EDQUOT:    return make_error(st, env, "edquot");
+        case EROFS:     return make_error(st, env, "erofs");
+        case EFBIG:     return make_error(st, env, "efbig");
+        case EINVAL:    return make_error(st, env, "einval");
+        default:        return make_error(st, env, "eio");
+    }
+}
+
 int
 make_binary(ErlNifEnv *env, ERL_NIF_TERM *out, const void* str, size_t len)
 {
@@ -0,0 +1,482 @@
+#include "cabala.h"
+
+#define MSG_HEADER_LEN  16
+#define OP_MSG          2013
+#define OP_COMPRESSED   2012
+
+/* OP_MSG flag bits */
+#define OP_MSG_CHECKSUM_PRESENT 0x01
+#define OP_MSG_MORE_TO_COME     0x02
+#define OP_MSG_REQUIRED_BITS    0xFFFF
+
+#define SECTION_BODY        0
+#define SECTION_SEQUENCE    1
+
+static int
+append_byte(buffer_t *buf, uint8_t v)
+{
+    return buffer_append(buf, &v, 1);
+}
+
+/* a sequence identifier given as a binary or an atom */
+static int
+append_cstring(ErlNifEnv *env, buffer_t *buf, ERL_NIF_TERM term)
+{
+    ErlNifBinary bin;
+    char atom[256];
+    int len;
+
+    if(enif_inspect_binary(env, term, &bin)) {
+        if(memchr(bin.data, '\0', bin.size)) {
+            return 0;
+        }
+        return buffer_append(buf, bin.data, bin.size) && append_byte(buf, 0);
+    }
+    len = enif_get_atom(env, term, atom, sizeof atom, ERL_NIF_LATIN1);
+    if(len <= 0) {
+        return 0;
+    }
+    return buffer_append(buf, atom, len);
+}
+
+static int
+write_doc(encode_state *es, buffer_t *buf, ERL_NIF_TERM doc)
+{
+    bson_reinit(&es->bson);
+    if(!encode_doc(doc, es)) {
+        return 0;
+    }
+    return buffer_append(buf, bson_get_data(&es->bson), es->bson.len);
+}
+
+/* kind 1 section: int32 size, cstring identifier, documents */
+static int
+write_sequence(encode_state *es, buffer_t *buf, ERL_NIF_TERM seq)
+{
+    const ERL_NIF_TERM *tuple;
+    ERL_NIF_TERM docs, doc;
+    size_t offset;
+    int arity;
+
+    if(!enif_get_tuple(es->env, seq, &arity, &tuple) || arity != 2) {
+        return 0;
+    }
+    if(!append_byte(buf, SECTION_SEQUENCE)) {
+        return 0;
+    }
+    offset = buf->len;
+    if(!buffer_append_int32(buf, 0) ||
+            !append_cstring(es->env, buf, tuple[0])) {
+        return 0;
+    }
+
+    docs = tuple[1];
+    while(enif_get_list_cell(es->env, docs, &doc, &docs)) {
+        if(!write_doc(es, buf, doc)) {
+            return 0;
+        }
+    }
+    buffer_set_int32(buf, offset, (int32_t)(buf->len - offset));
+    return 1;
+}
+
+ERL_NIF_TERM
+encode_op_msg(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st    *st = (cabala_st*)enif_priv_data(env);
+    encode_state *es = NULL;
+    buffer_t      buf;
+    ERL_NIF_TERM  seqs, seq, opts, item, out;
+    const ERL_NIF_TERM *tuple;
+    int           request_id, response_to = 0, arity;
+    int           compressor = COMPRESSOR_NOOP, level = -1;
+    unsigned      flags;
+
+    if(argc != 5) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_get_int(env, argv[0], &request_id) ||
+            !enif_get_uint(env, argv[1], &flags) ||
+            !enif_is_list(env, argv[3])) {
+        return enif_make_badarg(env);
+    }
+
+    opts = argv[4];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_checksum) == 0) {
+            flags |= OP_MSG_CHECKSUM_PRESENT;
+        } else if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_response_to) == 0 &&
+                enif_get_int(env, tuple[1], &response_to)) {
+            continue;
+        } else if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_compressor) == 0) {
+            if(enif_compare(tuple[1], st->atom_zlib) == 0) {
+                compressor = COMPRESSOR_ZLIB;
+            } else if(enif_compare(tuple[1], st->atom_zstd) == 0) {
+                compressor = COMPRESSOR_ZSTD;
+            } else {
+                return enif_make_badarg(env);
+            }
+        } else if(enif_get_tuple(env, item, &arity, &tuple) && arity == 2 &&
+                enif_compare(tuple[0], st->atom_compression_level) == 0 &&
+                enif_get_int(env, tuple[1], &level) && level >= 0) {
+            continue;
+        } else {
+            return enif_make_badarg(env);
+        }
+    }
+
+    if(!buffer_init(&buf, 1024)) {
+        return make_error(st, env, "internal_error");
+    }
+    es = es_new(env, st);
+    if(!es) {
+        goto failure;
+    }
+
+    /* header, messageLength is patched once the frame is complete */
+    if(!buffer_append_int32(&buf, 0) ||
+            !buffer_append_int32(&buf, request_id) ||
+            !buffer_append_int32(&buf, response_to) ||
+            !buffer_append_int32(&buf, OP_MSG) ||
+            !buffer_append_int32(&buf, (int32_t)flags)) {
+        goto failure;
+    }
+
+    if(!append_byte(&buf, SECTION_BODY) || !write_doc(es, &buf, argv[2])) {
+        goto failure;
+    }
+    seqs = argv[3];
+    while(enif_get_list_cell(env, seqs, &seq, &seqs)) {
+        if(!write_sequence(es, &buf, seq)) {
+            goto failure;
+        }
+    }
+
+    if(flags & OP_MSG_CHECKSUM_PRESENT) {
+        buffer_set_int32(&buf, 0, (int32_t)(buf.len + 4));
+        if(!buffer_append_int32(&buf, (int32_t)crc32c(buf.bin.data, buf.len))) {
+            goto failure;
+        }
+    } else {
+        buffer_set_int32(&buf, 0, (int32_t)buf.len);
+    }
+
+    es_destroy(es);
+    es = NULL;
+    if(compressor != COMPRESSOR_NOOP) {
+        buffer_t zbuf;
+
+        if(!buffer_init(&zbuf, buf.len / 2 + 64)) {
+            goto failure;
+        }
+        if(!compress_frame(buf.bin.data, buf.len, compressor, level, &zbuf)) {
+            buffer_destroy(&zbuf);
+            goto failure;
+        }
+        buffer_destroy(&buf);
+        buf = zbuf;
+    }
+    if(!buffer_make_binary(env, &buf, &out)) {
+        buffer_destroy(&buf);
+        return make_error(st, env, "internal_error");
+    }
+    return out;
+
+failure:
+    es_destroy(es);
+    buffer_destroy(&buf);
+    return make_error(st, env, "internal_error");
+}
+
+static inline int32_t
+read_int32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return (int32_t)BSON_UINT32_FROM_LE(v);
+}
+
+/*
+ * Copy the reply body without the cursor batch, leaving `batch` on the
+ * firstBatch/nextBatch array when there is one.
+ */
+static int
+split_body(const bson_t *body, bson_t *envelope, bson_iter_t *batch,
+           bool *has_batch)
+{
+    bson_iter_t iter, child;
+    bson_t cursor;
+
+    *has_batch = false;
+    if(!bson_iter_init(&iter, body)) {
+        return 0;
+    }
+    while(bson_iter_next(&iter)) {
+        if(!BSON_ITER_HOLDS_DOCUMENT(&iter) ||
+                strcmp(bson_iter_key(&iter), "cursor") != 0) {
+            if(!bson_append_iter(envelope, NULL, 0, &iter)) {
+                return 0;
+            }
+            continue;
+        }
+
+        if(!bson_iter_recurse(&iter, &child) ||
+                !bson_append_document_begin(envelope, "cursor", 6, &cursor)) {
+            return 0;
+        }
+        while(bson_iter_next(&child)) {
+            const char *key = bson_iter_key(&child);
+            if(BSON_ITER_HOLDS_ARRAY(&child) && !*has_batch &&
+                    (strcmp(key, "firstBatch") == 0 ||
+                     strcmp(key, "nextBatch") == 0)) {
+                *batch = child;
+                *has_batch = true;
+            } else if(!bson_append_iter(&cursor, NULL, 0, &child)) {
+                return 0;
+            }
+        }
+        if(!bson_append_document_end(envelope, &cursor)) {
+            return 0;
+        }
+    }
+    return iter.err_off == 0;
+}
+
+/*
+ * Batch documents are decoded one by one, or returned as sub-binaries
+ * of the frame with the raw option.
+ */
+static int
+decode_batch(decode_state *ds, ERL_NIF_TERM frame, const uint8_t *base,
+             bson_iter_t *batch, bool raw, ERL_NIF_TERM *out)
+{
+    bson_iter_t   iter;
+    vec_term_t    vec;
+    bson_t        doc;
+    ERL_NIF_TERM  item;
+    const uint8_t *data;
+    uint32_t      len;
+    int           ret = 0;
+
+    vec_init(&vec);
+    if(!bson_iter_recurse(batch, &iter)) {
+        goto done;
+    }
+    while(bson_iter_next(&iter)) {
+        if(!BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+            goto done;
+        }
+        bson_iter_document(&iter, &len, &data);
+        if(raw) {
+            item = enif_make_sub_binary(ds->env, frame, data - base, len);
+        } else if(!bson_init_static(&doc, data, len) ||
+                !iter_bson(&doc, &item, ds)) {
+            goto done;
+        }
+        if(vec_push(&vec, item) != 0) {
+            goto done;
+        }
+    }
+    if(iter.err_off) {
+        goto done;
+    }
+
+    *out = enif_make_list_from_array(ds->env, vec.data, vec.length);
+    ret = 1;
+
+done:
+    vec_deinit(&vec);
+    return ret;
+}
+
+/*
+ * A kind 1 section, `size` bytes at p holding the int32 size, a cstring
+ * identifier and the documents, goes into the envelope as an array under
+ * its identifier, the way the server reads it. An identifier that is
+ * already a field of the envelope is a bad frame.
+ */
+static int
+append_sequence(bson_t *envelope, const uint8_t *p, int32_t size)
+{
+    const uint8_t *end = p + size, *ident = p + 4, *nul;
+    bson_iter_t   iter;
+    bson_t        array, doc;
+    char          buf[16];
+    const char   *key;
+    size_t        key_len;
+    uint32_t      idx = 0;
+    int32_t       len;
+
+    nul = memchr(ident, '\0', end - ident);
+    if(!nul || nul == ident ||
+            bson_iter_init_find(&iter, envelope, (const char *)ident)) {
+        return 0;
+    }
+    if(!bson_append_array_begin(envelope, (const char *)ident,
+                                (int)(nul - ident), &array)) {
+        return 0;
+    }
+    for(p = nul + 1; p < end; p += len) {
+        if(end - p < 5) {
+            return 0;
+        }
+        len = read_int32(p);
+        if(len < 5 || len > end - p || !bson_init_static(&doc, p, len)) {
+            return 0;
+        }
+        key_len = bson_uint32_to_string(idx++, &key, buf, sizeof buf);
+        if(!bson_append_document(&array, key, (int)key_len, &doc)) {
+            return 0;
+        }
+    }
+    return bson_append_array_end(envelope, &array);
+}
+
+/*
+ * Parse an OP_MSG frame held in `frame` (data/len may point into it)
+ * into {ResponseTo, Flags, Envelope, Batch}. Document sequences are
+ * fields of the envelope, Identifier => [Doc].
+ */
+static ERL_NIF_TERM
+parse_op_msg(decode_state *ds, ERL_NIF_TERM frame, const uint8_t *data,
+             size_t len, bool raw)
+{
+    cabala_st    *st = ds->st;
+    ErlNifEnv    *env = ds->env;
+    const uint8_t *p, *end;
+    bson_t        body, envelope;
+    bson_iter_t   batch;
+    bool          has_body = false, has_batch = false, has_seqs = false;
+    uint32_t      flags;
+    int32_t       size;
+    ERL_NIF_TERM  env_term, batch_term, out;
+
+    if(len < MSG_HEADER_LEN + 5 || (size_t)read_int32(data) != len) {
+        return make_error(st, env, "badframe");
+    }
+    if(read_int32(data + 12) != OP_MSG) {
+        return make_error(st, env, "badopcode");
+    }
+    flags = (uint32_t)read_int32(data + MSG_HEADER_LEN);
+    if(flags & OP_MSG_REQUIRED_BITS & ~(OP_MSG_CHECKSUM_PRESENT|OP_MSG_MORE_TO_COME)) {
+        return make_error(st, env, "badflags");
+    }
+
+    end = data + len;
+    if(flags & OP_MSG_CHECKSUM_PRESENT) {
+        if(len < MSG_HEADER_LEN + 9) {
+            return make_error(st, env, "badframe");
+        }
+        end -= 4;
+        if((uint32_t)read_int32(end) != crc32c(data, end - data)) {
+            return make_error(st, env, "badchecksum");
+        }
+    }
+
+    for(p = data + MSG_HEADER_LEN + 4; p < end; p += size) {
+        uint8_t kind = *p++;
+
+        if(end - p < 5) {
+            return make_error(st, env, "badframe");
+        }
+        size = read_int32(p);
+        if(size < 5 || size > end - p) {
+            return make_error(st, env, "badframe");
+        }
+        if(kind == SECTION_SEQUENCE) {
+            has_seqs = true;
+            continue;
+        }
+        if(kind != SECTION_BODY) {
+            return make_error(st, env, "unsupported_section");
+        }
+        if(has_body || !bson_init_static(&body, p, size)) {
+            return make_error(st, env, "badframe");
+        }
+        has_body = true;
+    }
+    if(!has_body) {
+        return make_error(st, env, "badframe");
+    }
+
+    bson_init(&envelope);
+    if(!split_body(&body, &envelope, &batch, &has_batch)) {
+        bson_destroy(&envelope);
+        return make_error(st, env, "badbson");
+    }
+    for(p = data + MSG_HEADER_LEN + 4; has_seqs && p < end; p += size) {
+        uint8_t kind = *p++;
+
+        size = read_int32(p);
+        if(kind == SECTION_SEQUENCE && !append_sequence(&envelope, p, size)) {
+            bson_destroy(&envelope);
+            return make_error(st, env, "badframe");
+        }
+    }
+    if(!iter_bson(&envelope, &env_term, ds)) {
+        bson_destroy(&envelope);
+        return make_error(st, env, ds->utf8_error ?
+                          "invalid_utf8" : "badbson");
+    }
+    bson_destroy(&envelope);
+
+    if(!has_batch) {
+        batch_term = enif_make_list(env, 0);
+    } else if(!decode_batch(ds, frame, data, &batch, raw, &batch_term)) {
+        return make_error(st, env, ds->utf8_error ?
+                          "invalid_utf8" : "badbson");
+    }
+
+    out = enif_make_tuple4(env,
+                           enif_make_int(env, read_int32(data + 8)),
+                           enif_make_uint(env, flags),
+                           env_term,
+                           batch_term);
+    return out;
+}
+
+ERL_NIF_TERM
+decode_op_msg(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    cabala_st   *st = (cabala_st*)enif_priv_data(env);
+    ErlNifBinary bin;
+    decode_state ds;
+    ERL_NIF_TERM frame, opts, item;
+    const char  *error;
+    bool         raw = false;
+
+    if(argc != 2) {
+        return enif_make_badarg(env);
+    }
+    if(!enif_inspect_binary(env, argv[0], &bin)) {
+        return enif_make_badarg(env);
+    }
+
+    init_state(&ds, env, st);
+    opts = argv[1];
+    while(enif_get_list_cell(env, opts, &item, &opts)) {
+        if(enif_compare(item, st->atom_raw) == 0) {
+            raw = true;
+        } else if(!decode_option(&ds, item)) {
+            return enif_make_badarg(env);
+        }
+    }
+
+    /* inflate into a new binary, raw batch documents then point into it */
+    frame = argv[0];
+    if(bin.size >= MSG_HEADER_LEN &&
+            read_int32(bin.data + 12) == OP_COMPRESSED) {
+        error = decompress_frame(bin.data, bin.size, &bin);
+        if(error) {
+            return make_error(st, env, error);
+        }
+        frame = enif_make_binary(env, &bin);
+        if(!enif_inspect_binary(env, frame, &bin)) {
+            return make_error(st, env, "internal_error");
+        }
+    }
+
+    return parse_op_msg(&ds, frame, bin.data, bin.size, raw);
+}
@@ -1,11 +1,73 @@
 -module(cabala).
 
 -export([encode/1, 
+         encode/2,
          decode/1,
-		 decode/2]).
+		 decode/2,
+         compile_filter/1,
+         match/2,
+         filter/2,
+         compare/3,
+         sort/2,
+         hash/1,
+         hash/2,
+         hash_term/1,
+         hash_term/2,
+         diff/2,
+         diff/3,
+         encode_op_msg/4,
+         encode_op_msg/5,
+         decode_op_msg/1,
+         decode_op_msg/2,
+         decode_all_parallel/1,
+         decode_all_parallel/2,
+         encode_batch/1,
+         encode_batch/2,
+         encode_async/1,
+         encode_async/2,
+         decode_async/1,
+         decode_async/2,
+         cancel/1,
+         async_info/0,
+         index/1,
+         index/2,
+         count/1,
+         nth/2,
+         slice/3,
+         ranges/2,
+         decode_columns/2,
+         decode_columns/3,
+         encode_buckets/2,
+         compile_schema/1,
+         compile_schema/2,
+         compile_schema/3,
+         encode_record/2,
+         decode_record/2,
+         decode_record/3,
+         new_oid/0,
+         to_json/1,
+         to_json/2,
+         from_json/1,
+         from_json/2,
+         from_ndjson/1,
+         from_ndjson/2]).
+
+%% file access, wrapped by cabala_file
+-export([file_open/1,
+         file_next_batch/3,
+         file_close/1,
+         writer_open/2,
+         writer_write/2,
+         writer_flush/1]).
 
 -on_load(init/0).
 
+%% Values {'$f64$' | '$i32$' | '$i64$', Bin} holding native endian
+%% numbers are written as arrays of doubles, int32s or int64s.
+%% With {ensure_id, true} a document without _id gets a new ObjectId
+%% as its first field and {Bin, Id} is returned. With
+%% {validate_utf8, true} strings that are not well formed UTF-8 fail
+%% with {error, invalid_utf8}.
 encode(Data) ->
     encode(Data, []).
 
@@ -15,9 +77,271 @@ encode(Data, Opts) when is_tuple(Data); is_map(Data) ->
 decode(Data) ->
     decode(Data, []).
 
+%% Options: return_maps, and {packed_arrays, true} to return arrays of
+%% only doubles, int32s or int64s as {'$f64$' | '$i32$' | '$i64$', Bin}
+%% with the values in native byte order. {oid_format, hex} returns
+%% ObjectIds as {'$oid$', <<24 hex digits>>} and {uuid_format, string}
+%% subtype 4 binaries as 8-4-4-4-12 text; encode accepts both forms.
+%% {validate_utf8, true} checks strings as they are copied out and
+%% returns {error, invalid_utf8} for any that is not well formed.
 decode(Data, Opts) when is_binary(Data) ->
 	nif_decode(Data, Opts).
 
+%% Compile a MongoDB-style query document ($eq, $ne, $gt, $gte, $lt,
+%% $lte, $in, $nin, $exists, $and, $or, $nor and dotted paths) into a
+%% filter that is evaluated directly over bson binaries.
+compile_filter(Filter) when is_tuple(Filter); is_map(Filter) ->
+	nif_compile_filter(Filter).
+
+match(Filter, Data) when is_binary(Data) ->
+	nif_match(Filter, Data).
+
+filter(Filter, List) when is_list(List) ->
+	nif_filter(Filter, List).
+
+%% Compare or sort bson binaries by a sort spec such as {<<"a.b">>, 1, c, -1},
+%% following MongoDB's cross-type ordering. Returns -1, 0 or 1. Decimal128
+%% values rank with the other numbers and compare through their nearest
+%% double. An empty array sorts before null and missing fields.
+compare(A, B, SortSpec) when is_binary(A), is_binary(B) ->
+	nif_compare(A, B, SortSpec).
+
+sort(List, SortSpec) when is_list(List) ->
+	nif_sort(List, SortSpec).
+
+%% Non-cryptographic xxHash-style hash of a bson binary.
+%% Options: canonical (field order and numeric type do not matter),
+%% {bits, 64 | 128} and {seed, Seed}. 64 bit hashes are integers,
+%% 128 bit hashes are 16 byte binaries.
+hash(Data) ->
+	hash(Data, []).
+
+hash(Data, Opts) when is_binary(Data), is_list(Opts) ->
+	nif_hash(Data, Opts).
+
+%% Same as hash(encode(Doc), [canonical | Opts]) without encoding Doc.
+hash_term(Doc) ->
+	hash_term(Doc, []).
+
+hash_term(Doc, Opts) when is_tuple(Doc); is_map(Doc) ->
+	nif_hash_term(Doc, Opts).
+
+%% Build a minimal {$set, $unset} update document turning Old into New.
+%% Returned as bson, or decoded with the terms / return_maps options.
+%% When a top-level key holds a dot or starts with $, no update path can
+%% name it and New itself is returned as a replacement document.
+diff(Old, New) ->
+	diff(Old, New, []).
+
+diff(Old, New, Opts) when is_binary(Old), is_binary(New), is_list(Opts) ->
+	nif_diff(Old, New, Opts).
+
+%% Encode a complete OP_MSG frame: header, flag bits, the kind 0 body
+%% and one kind 1 document sequence per {Identifier, Docs}.
+%% Options: checksum (append a CRC-32C), {response_to, Id} and
+%% {compressor, zlib | zstd} with {compression_level, N} to wrap the
+%% frame in OP_COMPRESSED.
+encode_op_msg(RequestId, Flags, Body, Sequences) ->
+	encode_op_msg(RequestId, Flags, Body, Sequences, []).
+
+encode_op_msg(RequestId, Flags, Body, Sequences, Opts)
+		when is_integer(RequestId), is_integer(Flags),
+			 is_tuple(Body) orelse is_map(Body),
+			 is_list(Sequences), is_list(Opts) ->
+	nif_encode_op_msg(RequestId, Flags, Body, Sequences, Opts).
+
+%% Parse an OP_MSG reply into {ResponseTo, Flags, Envelope, Batch}. The
+%% envelope is the body without cursor.firstBatch/nextBatch, the batch
+%% is a list of decoded documents, or sub-binaries with the raw option.
+%% Document sequences are added to the envelope as Identifier => [Doc].
+%% Other options are those of decode/2. OP_COMPRESSED replies are
+%% inflated first.
+decode_op_msg(Frame) ->
+	decode_op_msg(Frame, []).
+
+decode_op_msg(Frame, Opts) when is_binary(Frame), is_list(Opts) ->
+	nif_decode_op_msg(Frame, Opts).
+
+%% Decode a sequence of concatenated documents into a list, splitting
+%% large inputs across the native worker threads. Options: those of
+%% decode/2 and {threads, N} to cap the number of workers used.
+decode_all_parallel(Data) ->
+	decode_all_parallel(Data, []).
+
+decode_all_parallel(Data, Opts) when is_binary(Data), is_list(Opts) ->
+	nif_decode_all_parallel(Data, Opts).
+
+%% Encode a list of documents into one binary of concatenated documents,
+%% in order. Lists of at least {threshold, N} documents (1000) are split
+%% across up to {threads, N} native worker threads.
+%% With {ensure_id, true}, {Bin, Ids} is returned, see encode/2, and
+%% with {validate_utf8, true} a document holding a string that is not
+%% well formed UTF-8 fails as {error, {baddoc, Doc}}.
+encode_batch(Docs) ->
+	encode_batch(Docs, []).
+
+encode_batch(Docs, Opts) when is_list(Docs), is_list(Opts) ->
+	nif_encode_batch(Docs, Opts).
+
+%% Encode or decode on the native worker threads without blocking the
+%% caller. The returned Ref tags the reply, {cabala, Ref, Result}, where
+%% Result is what encode/decode would have returned. {error, busy} is
+%% returned when the queue is full.
+encode_async(Data) ->
+	encode_async(Data, []).
+
+encode_async(Data, Opts) when is_tuple(Data); is_map(Data) ->
+	nif_encode_async(Data, Opts).
+
+decode_async(Data) ->
+	decode_async(Data, []).
+
+decode_async(Data, Opts) when is_binary(Data), is_list(Opts) ->
+	nif_decode_async(Data, Opts).
+
+%% true if the job had not started, no reply will be sent then.
+cancel(Ref) ->
+	nif_async_cancel(Ref).
+
+%% [{threads, N}, {queued, N}, {max_queued, N}]
+async_info() ->
+	nif_async_info().
+
+%% Offset index over concatenated bson documents, held in a binary or
+%% read from {file, Path}. Only the length prefixes are read; with
+%% {sidecar, Path} the offsets are loaded from, or saved to, that file;
+%% a sidecar for another version of the source is rebuilt.
+index(Source) ->
+	index(Source, []).
+
+index(Bin, Opts) when is_binary(Bin), is_list(Opts) ->
+	nif_index(Bin, Opts);
+index({file, Path}, Opts) when is_list(Opts) ->
+	nif_index({file, unicode:characters_to_binary(Path)}, Opts).
+
+count(Index) ->
+	nif_index_count(Index).
+
+%% The Nth document (1-based) as a binary referencing the source.
+nth(Index, N) when is_integer(N), N > 0 ->
+	nif_index_nth(Index, N).
+
+slice(Index, From, Count) when is_integer(From), From > 0,
+							   is_integer(Count), Count >= 0 ->
+	nif_index_slice(Index, From, Count).
+
+%% Up to Parts disjoint {From, Count} ranges of about the same byte size,
+%% to be handed to slice/3 in different processes.
+ranges(Index, Parts) when is_integer(Parts), Parts > 0 ->
+	nif_index_ranges(Index, Parts).
+
+%% Decode the given dotted field paths of every document in a sequence of
+%% concatenated documents into a map of Field => Column, without building
+%% the documents. Columns of only int32s, int64s or doubles (and nulls or
+%% missing fields) are {'$i32$' | '$i64$' | '$f64$', Values, Valid} with
+%% the values in native byte order and bit N of Valid, LSB first, set
+%% when row N has a value. Other columns are lists holding undefined for
+%% missing fields. Options as in decode/2.
+decode_columns(Data, Fields) ->
+	decode_columns(Data, Fields, []).
+
+decode_columns(Data, Fields, Opts) when is_binary(Data), is_list(Fields),
+										is_list(Opts) ->
+	nif_decode_columns(Data, Fields, Opts).
+
+%% Encode rows (maps or tuples) into MongoDB time-series bucket documents,
+%% {control: {version: 1, min, max}, meta, data: {Field: {"0": V, ...}}}.
+%% Spec: {time_field, F} (required, a {'$date$', Ms} in every row),
+%% {meta_field, F}, {max_count, N} (1000) and {max_size, Bytes} (125KB).
+%% Rows are bucketed in order, a row with another meta value than the
+%% previous one starts a new bucket.
+encode_buckets(Rows, Spec) when is_list(Rows), is_list(Spec) ->
+	nif_encode_buckets(Rows, Spec).
+
+%% A new ObjectId, {'$oid$', <<_:12/binary>>}, made without locks from a
+%% per scheduler thread counter.
+new_oid() ->
+	nif_new_oid().
+
+%% Compile field names (binaries or atoms, e.g. record_info(fields, R))
+%% and their types, int32 | int64 | double | string | binary | bool |
+%% date | any, into a schema for encode_record/2. Values that do not
+%% match their type are encoded as encode/1 would.
+compile_schema(Fields) when is_list(Fields) ->
+	compile_schema(Fields, [any || _ <- Fields]).
+
+compile_schema(Fields, Types) ->
+	compile_schema(Fields, Types, []).
+
+%% Options: {defaults, [Value]} (one per field, undefined otherwise) for
+%% fields missing when decoding, and {record, Name} to decode records.
+compile_schema(Fields, Types, Opts) when is_list(Fields), is_list(Types),
+										 is_list(Opts) ->
+	nif_compile_schema(Fields, Types, Opts).
+
+%% Encode a tuple, or a record, positionally by the schema fields. A
+%% record of another name than the schema's {record, Name} is badarg.
+encode_record(Schema, Record) when is_tuple(Record) ->
+	nif_encode_record(Schema, Record).
+
+%% Decode a document into a tuple, or record, positionally by the schema
+%% fields. Options: those of decode/2 and {unknown, ignore | collect};
+%% with collect the result is {Record, Unknown} holding the fields not
+%% in the schema.
+decode_record(Schema, Data) ->
+	decode_record(Schema, Data, []).
+
+decode_record(Schema, Data, Opts) when is_binary(Data), is_list(Opts) ->
+	nif_decode_record(Schema, Data, Opts).
+
+%% MongoDB Extended JSON v2 of a document, as a binary. Opts: relaxed
+%% (default), with plain numbers and ISO dates where they fit, or
+%% canonical, which keeps every bson type.
+to_json(Data) ->
+	to_json(Data, []).
+
+to_json(Data, Opts) when is_binary(Data), is_list(Opts) ->
+	nif_to_json(Data, Opts).
+
+%% Parse a JSON object straight into a bson document, taking Extended
+%% JSON v2 wrappers ({"$oid": ...}, {"$date": ...}, {"$numberLong": ...}
+%% and so on) in relaxed or canonical form as the types they stand for.
+%% Integers go to int32 or int64 by size, other numbers to doubles.
+%% With {ensure_id, true}, {Bin, Id} is returned as by encode/2. Errors
+%% are {error, {badjson, Offset}}.
+from_json(Json) ->
+	from_json(Json, []).
+
+from_json(Json, Opts) when is_binary(Json), is_list(Opts) ->
+	nif_from_json(Json, Opts).
+
+%% Parse newline delimited JSON, or any whitespace separated objects,
+%% into one binary of concatenated documents. With {ensure_id, true},
+%% {Bin, Ids} is returned as by encode_batch/2.
+from_ndjson(Json) ->
+	from_ndjson(Json, []).
+
+from_ndjson(Json, Opts) when is_binary(Json), is_list(Opts) ->
+	nif_from_ndjson(Json, Opts).
+
+file_open(Path) when is_binary(Path) ->
+	nif_file_open(Path).
+
+file_next_batch(Reader, N, Opts) when is_integer(N), N > 0, is_list(Opts) ->
+	nif_file_next_batch(Reader, N, Opts).
+
+file_close(Reader) ->
+	nif_file_close(Reader).
+
+writer_open(Path, Opts) when is_binary(Path), is_list(Opts) ->
+	nif_writer_open(Path, Opts).
+
+writer_write(Writer, Docs) when is_list(Docs) ->
+	nif_writer_write(Writer, Docs).
+
+writer_flush(Writer) ->
+	nif_writer_flush(Writer).
+
 %%% -------------------------------------------------
 %%% Nif Functions
 %%% -------------------------------------------------
@@ -44,4 +368,112 @@ nif_decode(_Data, _Opts) ->
 	?NOT_LOADED.
 
 nif_encode(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_compile_filter(_Filter) ->
+	?NOT_LOADED.
+
+nif_match(_Filter, _Data) ->
+	?NOT_LOADED.
+
+nif_filter(_Filter, _List) ->
+	?NOT_LOADED.
+
+nif_compare(_A, _B, _SortSpec) ->
+	?NOT_LOADED.
+
+nif_sort(_List, _SortSpec) ->
+	?NOT_LOADED.
+
+nif_hash(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_hash_term(_Doc, _Opts) ->
+	?NOT_LOADED.
+
+nif_diff(_Old, _New, _Opts) ->
+	?NOT_LOADED.
+
+nif_encode_op_msg(_RequestId, _Flags, _Body, _Sequences, _Opts) ->
+	?NOT_LOADED.
+
+nif_decode_op_msg(_Frame, _Opts) ->
+	?NOT_LOADED.
+
+nif_file_open(_Path) ->
+	?NOT_LOADED.
+
+nif_file_next_batch(_Reader, _N, _Opts) ->
+	?NOT_LOADED.
+
+nif_file_close(_Reader) ->
+	?NOT_LOADED.
+
+nif_writer_open(_Path, _Opts) ->
+	?NOT_LOADED.
+
+nif_writer_write(_Writer, _Docs) ->
+	?NOT_LOADED.
+
+nif_writer_flush(_Writer) ->
+	?NOT_LOADED.
+
+nif_decode_all_parallel(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_encode_batch(_Docs, _Opts) ->
+	?NOT_LOADED.
+
+nif_encode_async(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_decode_async(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_async_cancel(_Ref) ->
+	?NOT_LOADED.
+
+nif_async_info() ->
+	?NOT_LOADED.
+
+nif_index(_Source, _Opts) ->
+	?NOT_LOADED.
+
+nif_index_count(_Index) ->
+	?NOT_LOADED.
+
+nif_index_nth(_Index, _N) ->
+	?NOT_LOADED.
+
+nif_index_slice(_Index, _From, _Count) ->
+	?NOT_LOADED.
+
+nif_index_ranges(_Index, _Parts) ->
+	?NOT_LOADED.
+
+nif_decode_columns(_Data, _Fields, _Opts) ->
+	?NOT_LOADED.
+
+nif_encode_buckets(_Rows, _Spec) ->
+	?NOT_LOADED.
+
+nif_compile_schema(_Fields, _Types, _Opts) ->
+	?NOT_LOADED.
+
+nif_encode_record(_Schema, _Record) ->
+	?NOT_LOADED.
+
+nif_decode_record(_Schema, _Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_new_oid() ->
+	?NOT_LOADED.
+
+nif_to_json(_Data, _Opts) ->
+	?NOT_LOADED.
+
+nif_from_json(_Json, _Opts) ->
+	?NOT_LOADED.
+
+nif_from_ndjson(_Json, _Opts) ->
 	?NOT_LOADED.
\ No newline at end of file
@@ -0,0 +1,74 @@
+-module(cabala_file).
+
+%% Reading and writing mongodump style .bson files: a sequence of bson
+%% documents. Readers go through a read-only mapping of the file,
+%% writers encode into a large buffer that is written out as it fills.
+
+-export([open/1,
+         next_batch/2,
+         next_batch/3,
+         fold/3,
+         fold/4,
+         open_writer/2,
+         write/2,
+         flush/1,
+         close/1]).
+
+-define(BATCH_SIZE, 1000).
+
+open(Path) ->
+	cabala:file_open(path(Path)).
+
+%% Decode up to N documents, returns eof once the file is consumed.
+next_batch(Reader, N) ->
+	next_batch(Reader, N, []).
+
+next_batch(Reader, N, Opts) ->
+	cabala:file_next_batch(Reader, N, Opts).
+
+%% Fold Fun(Doc, Acc) over the remaining documents, one batch per NIF
+%% call. Options: {batch_size, N} and those of decode/2.
+fold(Reader, Fun, Acc) ->
+	fold(Reader, Fun, Acc, []).
+
+fold(Reader, Fun, Acc, Opts) when is_function(Fun, 2), is_list(Opts) ->
+	N = proplists:get_value(batch_size, Opts, ?BATCH_SIZE),
+	DecodeOpts = proplists:delete(batch_size, Opts),
+	fold_batches(Reader, Fun, Acc, N, DecodeOpts).
+
+fold_batches(Reader, Fun, Acc, N, Opts) ->
+	case cabala:file_next_batch(Reader, N, Opts) of
+		eof ->
+			{ok, Acc};
+		{error, _} = Error ->
+			Error;
+		Docs ->
+			Acc1 = lists:foldl(Fun, Acc, Docs),
+			fold_batches(Reader, Fun, Acc1, N, Opts)
+	end.
+
+%% Options: {buffer_size, Bytes} (1MB), {fsync, never | on_close | always}
+%% and append to keep the existing contents. A writer must be closed with
+%% close/1, documents still buffered when it is garbage collected are lost.
+open_writer(Path, Opts) ->
+	cabala:writer_open(path(Path), Opts).
+
+write(Writer, Docs) when is_list(Docs) ->
+	cabala:writer_write(Writer, Docs);
+write(Writer, Doc) ->
+	cabala:writer_write(Writer, [Doc]).
+
+flush(Writer) ->
+	cabala:writer_flush(Writer).
+
+%% Unmaps a reader, or flushes and closes a writer.
+close(ReaderOrWriter) ->
+	cabala:file_close(ReaderOrWriter).
+
+path(Path) ->
+	case unicode:characters_to_binary(Path) of
+		Bin when is_binary(Bin) ->
+			Bin;
+		_ ->
+			erlang:error(badarg, [Path])
+	end.
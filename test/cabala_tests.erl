@@ -0,0 +1,1626 @@
+-module(cabala_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+-include_lib("kernel/include/file.hrl").
+
+-record(user, {name, age}).
+
+%%% -------------------------------------------------
+%%% match/2 and filter/2
+%%% -------------------------------------------------
+
+match_doc() ->
+	cabala:encode(#{<<"a">> => 5,
+					<<"b">> => #{<<"c">> => <<"x">>},
+					<<"tags">> => [<<"red">>, <<"blue">>],
+					<<"items">> => [#{<<"n">> => 1}, #{<<"n">> => 7}],
+					<<"nil">> => null}).
+
+match_test_() ->
+	Doc = match_doc(),
+	Cases = [{#{<<"a">> => 5}, true},
+			 {#{<<"a">> => 5.0}, true},
+			 {#{<<"a">> => <<"5">>}, false},
+			 {#{<<"a">> => #{<<"$gt">> => 4, <<"$lt">> => 6}}, true},
+			 {#{<<"a">> => #{<<"$gte">> => 6}}, false},
+			 %% comparisons only hold within one canonical type
+			 {#{<<"a">> => #{<<"$lt">> => <<"z">>}}, false},
+			 {#{<<"b.c">> => <<"x">>}, true},
+			 {#{<<"b">> => #{<<"c">> => <<"x">>}}, true},
+			 %% an array matches as a whole and through each element
+			 {#{<<"tags">> => <<"red">>}, true},
+			 {#{<<"tags">> => [<<"red">>, <<"blue">>]}, true},
+			 {#{<<"tags">> => [<<"blue">>, <<"red">>]}, false},
+			 {#{<<"tags.1">> => <<"blue">>}, true},
+			 {#{<<"tags.0">> => <<"blue">>}, false},
+			 {#{<<"items.n">> => 7}, true},
+			 {#{<<"items.1.n">> => 7}, true},
+			 %% without $elemMatch each operator may hold for another element
+			 {#{<<"items.n">> => #{<<"$gt">> => 5, <<"$lt">> => 2}}, true},
+			 {#{<<"items.n">> => #{<<"$gt">> => 7}}, false},
+			 {#{<<"tags">> => #{<<"$ne">> => <<"red">>}}, false},
+			 {#{<<"tags">> => #{<<"$nin">> => [<<"green">>]}}, true},
+			 {#{<<"a">> => #{<<"$in">> => [1, 5]}}, true},
+			 {#{<<"a">> => #{<<"$nin">> => [1, 5]}}, false},
+			 %% null matches null and missing fields
+			 {#{<<"nil">> => null}, true},
+			 {#{<<"missing">> => null}, true},
+			 {#{<<"missing">> => #{<<"$in">> => [1, null]}}, true},
+			 {#{<<"a">> => null}, false},
+			 {#{<<"nil">> => #{<<"$exists">> => true}}, true},
+			 {#{<<"missing">> => #{<<"$exists">> => false}}, true},
+			 {#{<<"b.missing">> => #{<<"$exists">> => true}}, false},
+			 {#{<<"$or">> => [#{<<"a">> => 1}, #{<<"b.c">> => <<"x">>}]}, true},
+			 {#{<<"$nor">> => [#{<<"a">> => 5}]}, false},
+			 {#{<<"$and">> => [#{<<"a">> => 5},
+							   #{<<"nil">> => #{<<"$ne">> => null}}]}, false}],
+	[?_assertEqual({Filter, Expected},
+				   {Filter, cabala:match(cabala:compile_filter(Filter), Doc)})
+	 || {Filter, Expected} <- Cases].
+
+filter_test() ->
+	Docs = [cabala:encode(#{<<"n">> => N}) || N <- lists:seq(1, 10)],
+	Filter = cabala:compile_filter(#{<<"n">> => #{<<"$gt">> => 3,
+												  <<"$lte">> => 6}}),
+	?assertEqual(lists:sublist(Docs, 4, 3), cabala:filter(Filter, Docs)).
+
+bad_filter_test() ->
+	[?assertMatch({error, {badfilter, F}}, cabala:compile_filter(F))
+	 || F <- [#{<<"a">> => #{<<"$regex">> => <<"x">>}},
+			  #{<<"a">> => #{<<"$in">> => 1}},
+			  #{<<"$or">> => []},
+			  #{<<"$where">> => <<"true">>}]].
+
+%% The string length of the only element runs past the document.
+match_corrupt_test() ->
+	Filter = cabala:compile_filter(#{<<"a">> => <<"x">>}),
+	Good = cabala:encode(#{<<"a">> => <<"x">>}),
+	Bad = <<14:32/little, 2, "a", 0, 100:32/little, "x", 0, 0>>,
+	?assert(cabala:match(Filter, Good)),
+	?assertEqual({error, badbson}, cabala:match(Filter, Bad)),
+	?assertEqual({error, {badbson, Bad}}, cabala:filter(Filter, [Good, Bad])).
+
+%%% -------------------------------------------------
+%%% compare/3 and sort/2
+%%% -------------------------------------------------
+
+%% One value of every canonical type, in MongoDB's order.
+type_order() ->
+	['MIN_KEY',
+	 null,
+	 -1,
+	 2.5,
+	 {decimal, <<"2.75">>},
+	 1 bsl 40,
+	 <<"abc">>,
+	 #{<<"x">> => 1},
+	 {'$type$', 0, '$binary$', <<1>>},
+	 {'$oid$', <<1:96>>},
+	 false,
+	 {'$date$', 0},
+	 'MAX_KEY'].
+
+a_doc({decimal, Dec}) ->
+	cabala:from_json(<<"{\"a\": {\"$numberDecimal\": \"", Dec/binary, "\"}}">>);
+a_doc(Value) ->
+	cabala:encode(#{<<"a">> => Value}).
+
+sort_types_test() ->
+	Sorted = [a_doc(V) || V <- type_order()],
+	Shuffled = [D || {_, D} <- lists:sort([{erlang:phash2(D), D}
+										   || D <- Sorted])],
+	?assertEqual(Sorted, cabala:sort(Shuffled, {<<"a">>, 1})),
+	?assertEqual(lists:reverse(Sorted), cabala:sort(Shuffled, {<<"a">>, -1})).
+
+compare_test() ->
+	One = a_doc(1),
+	?assertEqual(-1, cabala:compare(One, a_doc(2), {<<"a">>, 1})),
+	?assertEqual(1, cabala:compare(One, a_doc(2), {<<"a">>, -1})),
+	?assertEqual(0, cabala:compare(One, a_doc(1.0), {<<"a">>, 1})),
+	?assertEqual(0, cabala:compare(One, a_doc({decimal, <<"1.0">>}),
+								   {<<"a">>, 1})),
+	?assertEqual(-1, cabala:compare(a_doc({decimal, <<"-Infinity">>}),
+									a_doc(-1 bsl 62), {<<"a">>, 1})),
+	?assertEqual(0, cabala:compare(cabala:encode(#{<<"b">> => 1}),
+								   a_doc(null), {<<"a">>, 1})),
+	?assertEqual(1, cabala:compare(cabala:encode(#{<<"a">> => #{<<"b">> => 2}}),
+								   cabala:encode(#{<<"a">> => #{<<"b">> => 1}}),
+								   {<<"a.b">>, 1})).
+
+sort_stable_test() ->
+	Docs = [cabala:encode({<<"k">>, K, <<"i">>, I})
+			|| {K, I} <- [{1, 1}, {0, 2}, {1, 3}, {0, 4}, {1, 5}]],
+	Order = fun(Spec) ->
+					[maps:get(<<"i">>, cabala:decode(D, [return_maps]))
+					 || D <- cabala:sort(Docs, Spec)]
+			end,
+	?assertEqual([2, 4, 1, 3, 5], Order({<<"k">>, 1})),
+	?assertEqual([1, 3, 5, 2, 4], Order({<<"k">>, -1})),
+	?assertEqual([4, 2, 5, 3, 1], Order({<<"k">>, 1, <<"i">>, -1})).
+
+%% An array sorts by its smallest element ascending and its largest
+%% descending. An empty array sorts before null and missing fields.
+sort_arrays_test() ->
+	Array = a_doc([1, 10]),
+	Five = a_doc(5),
+	?assertEqual([Array, Five], cabala:sort([Five, Array], {<<"a">>, 1})),
+	?assertEqual([Array, Five], cabala:sort([Five, Array], {<<"a">>, -1})),
+	Empty = a_doc([]),
+	Null = a_doc(null),
+	Missing = cabala:encode(#{<<"b">> => 1}),
+	?assertEqual([Empty, Null, Missing, Five],
+				 cabala:sort([Null, Five, Missing, Empty], {<<"a">>, 1})),
+	Items = cabala:encode(#{<<"a">> => [#{<<"b">> => 3}, #{<<"b">> => 0}]}),
+	?assertEqual([Items, Five], cabala:sort([Five, Items], {<<"a.b">>, 1})).
+
+bad_sort_spec_test() ->
+	?assertError(badarg, cabala:sort([a_doc(1)], {<<"a">>, 2})),
+	?assertError(badarg, cabala:sort([a_doc(1)], {})),
+	?assertEqual({error, {badbson, <<1, 2, 3>>}},
+				 cabala:sort([a_doc(1), <<1, 2, 3>>], {<<"a">>, 1})).
+
+%%% -------------------------------------------------
+%%% hash/2 and hash_term/2
+%%% -------------------------------------------------
+
+hash_test() ->
+	Bin = cabala:encode({<<"a">>, 1, <<"b">>, <<"x">>}),
+	H = cabala:hash(Bin),
+	?assert(is_integer(H) andalso H >= 0 andalso H < 1 bsl 64),
+	?assertEqual(H, cabala:hash(Bin)),
+	?assertEqual(H, cabala:hash(Bin, [{bits, 64}, {seed, 0}])),
+	?assertNotEqual(H, cabala:hash(Bin, [{seed, 1}])),
+	?assertMatch(<<_:128>>, cabala:hash(Bin, [{bits, 128}])),
+	?assertNotEqual(H, cabala:hash(cabala:encode({<<"a">>, 2,
+												  <<"b">>, <<"x">>}))),
+	?assertError(badarg, cabala:hash(Bin, [{bits, 32}])),
+	?assertEqual({error, badbson}, cabala:hash(<<1, 2, 3>>)).
+
+%% Canonical hashes ignore field order and numeric type, not array order.
+hash_canonical_test() ->
+	H = fun(Doc) -> cabala:hash(cabala:encode(Doc), [canonical]) end,
+	A = {<<"a">>, 1, <<"b">>, #{<<"c">> => 2, <<"d">> => [1, 2]}},
+	B = {<<"b">>, {<<"d">>, [1.0, 2], <<"c">>, 2.0}, <<"a">>, 1},
+	?assertNotEqual(cabala:hash(cabala:encode(A)), cabala:hash(cabala:encode(B))),
+	?assertEqual(H(A), H(B)),
+	?assertNotEqual(H(A), H({<<"a">>, 1, <<"b">>,
+							 #{<<"c">> => 2, <<"d">> => [2, 1]}})),
+	?assertNotEqual(H({<<"a">>, 1}), H({<<"a">>, 1.5})),
+	?assertNotEqual(H({<<"a">>, 1}), H({<<"a">>, <<"1">>})),
+	?assertNotEqual(H({<<"a">>, 1}), H({<<"b">>, 1})).
+
+hash_term_test_() ->
+	Docs = [#{<<"a">> => 1, <<"b">> => [1.5, <<"x">>, null]},
+			{<<"z">>, true, <<"a">>, #{<<"n">> => #{<<"m">> => 1 bsl 40}}},
+			#{<<"id">> => {'$oid$', <<1:96>>}, <<"at">> => {'$date$', 7},
+			  <<"bin">> => {'$type$', 0, '$binary$', <<1, 2>>}}],
+	[?_assertEqual(cabala:hash(cabala:encode(D), [canonical | Opts]),
+				   cabala:hash_term(D, Opts))
+	 || D <- Docs, Opts <- [[], [{bits, 128}, {seed, 7}]]].
+
+%%% -------------------------------------------------
+%%% diff/3
+%%% -------------------------------------------------
+
+diff_old() ->
+	#{<<"a">> => 1, <<"b">> => 2, <<"x">> => true,
+	  <<"c">> => #{<<"d">> => 1, <<"e">> => 2, <<"h">> => 1},
+	  <<"l">> => [1, 2], <<"t">> => #{<<"u">> => 1}}.
+
+diff_new() ->
+	#{<<"a">> => 1, <<"b">> => 3, <<"g">> => 7,
+	  <<"c">> => #{<<"d">> => 1, <<"e">> => 5, <<"f">> => 6},
+	  <<"l">> => [1, 3], <<"t">> => 5}.
+
+diff_test() ->
+	Update = cabala:diff(cabala:encode(diff_old()), cabala:encode(diff_new()),
+						 [return_maps]),
+	?assertEqual(#{<<"$set">> => #{<<"b">> => 3, <<"g">> => 7,
+								   <<"c.e">> => 5, <<"c.f">> => 6,
+								   <<"l">> => [1, 3], <<"t">> => 5},
+				   <<"$unset">> => #{<<"x">> => <<>>, <<"c.h">> => <<>>}},
+				 Update),
+	?assertEqual(diff_new(), apply_update(diff_old(), Update)).
+
+diff_round_trip_test_() ->
+	Pairs = [{#{<<"a">> => 1}, #{<<"a">> => 1}},
+			 {#{}, #{<<"a">> => #{<<"b">> => [1]}}},
+			 {#{<<"a">> => #{<<"b">> => #{<<"c">> => 1}}},
+			  #{<<"a">> => #{<<"b">> => #{<<"c">> => 2, <<"d">> => null}}}},
+			 {#{<<"a">> => #{<<"b">> => 1}}, #{}},
+			 {#{<<"a">> => 1}, #{<<"a">> => <<"1">>}}],
+	[?_assertEqual(New, apply_update(Old,
+									 cabala:diff(cabala:encode(Old),
+												 cabala:encode(New),
+												 [return_maps])))
+	 || {Old, New} <- Pairs].
+
+diff_forms_test() ->
+	Old = cabala:encode(#{<<"a">> => 1}),
+	New = cabala:encode(#{<<"a">> => 2}),
+	Bin = cabala:diff(Old, New),
+	?assertEqual(cabala:encode({<<"$set">>, {<<"a">>, 2}}), Bin),
+	?assertEqual({<<"$set">>, {<<"a">>, 2}}, cabala:diff(Old, New, [terms])),
+	?assertEqual(<<5:32/little, 0>>, cabala:diff(Old, Old)),
+	?assertError(badarg, cabala:diff(Old, New, [bogus])),
+	?assertEqual({error, badbson}, cabala:diff(Old, <<1, 2, 3>>)).
+
+%% Keys holding a dot or starting with $ cannot be named by an update
+%% path: nested ones are set whole, top-level ones make New the result.
+diff_unaddressable_test() ->
+	Old = cabala:encode(#{<<"a">> => #{<<"b.c">> => 1}, <<"z">> => 1}),
+	New = cabala:encode(#{<<"a">> => #{<<"b.c">> => 2}, <<"z">> => 1}),
+	?assertEqual(#{<<"$set">> => #{<<"a">> => #{<<"b.c">> => 2}}},
+				 cabala:diff(Old, New, [return_maps])),
+	Top = cabala:encode(#{<<"$k">> => 1, <<"z">> => 2}),
+	?assertEqual(Top, cabala:diff(Old, Top)),
+	?assertEqual(Old, cabala:diff(Top, Old)).
+
+apply_update(Doc, Update) ->
+	Set = maps:fold(fun(K, V, D) -> put_path(split_path(K), V, D) end,
+					Doc, maps:get(<<"$set">>, Update, #{})),
+	maps:fold(fun(K, _, D) -> del_path(split_path(K), D) end,
+			  Set, maps:get(<<"$unset">>, Update, #{})).
+
+split_path(Path) ->
+	binary:split(Path, <<".">>, [global]).
+
+put_path([K], V, M) ->
+	M#{K => V};
+put_path([K | Rest], V, M) ->
+	M#{K => put_path(Rest, V, maps:get(K, M, #{}))}.
+
+del_path([K], M) ->
+	maps:remove(K, M);
+del_path([K | Rest], M) ->
+	M#{K => del_path(Rest, maps:get(K, M))}.
+
+%%% -------------------------------------------------
+%%% encode_op_msg/5
+%%% -------------------------------------------------
+
+-define(OP_MSG, 2013).
+
+numbered(N) ->
+	[#{<<"_id">> => I, <<"name">> => <<"doc", (integer_to_binary(I))/binary>>}
+	 || I <- lists:seq(1, N)].
+
+%% The frame written out by hand: header, flag bits, the kind 0 body, one
+%% kind 1 section per sequence and the CRC-32C of all that.
+op_msg_layout_test() ->
+	Body = #{<<"insert">> => <<"c">>, <<"$db">> => <<"test">>},
+	Docs = numbered(3),
+	BodyBin = cabala:encode(Body),
+	DocsBin = iolist_to_binary([cabala:encode(D) || D <- Docs]),
+	Seq = <<"documents", 0, DocsBin/binary>>,
+	Sections = <<0, BodyBin/binary,
+				 1, (byte_size(Seq) + 4):32/little, Seq/binary>>,
+	Len = 16 + 4 + byte_size(Sections) + 4,
+	Unsummed = <<Len:32/little, 9:32/little, 4:32/little, ?OP_MSG:32/little,
+				 1:32/little, Sections/binary>>,
+	Expected = <<Unsummed/binary, (crc32c(Unsummed)):32/little>>,
+	?assertEqual(Expected,
+				 cabala:encode_op_msg(9, 0, Body, [{<<"documents">>, Docs}],
+									  [checksum, {response_to, 4}])),
+	?assertEqual(Expected,
+				 cabala:encode_op_msg(9, 1, Body, [{documents, Docs}],
+									  [{response_to, 4}])).
+
+op_msg_sections_test() ->
+	Body = #{<<"update">> => <<"c">>},
+	Updates = numbered(2),
+	Deletes = numbered(1),
+	Frame = cabala:encode_op_msg(3, 0, Body, [{<<"updates">>, Updates},
+											  {<<"deletes">>, Deletes},
+											  {<<"none">>, []}]),
+	?assertEqual({3, 0, 0, none,
+				  [{body, cabala:encode(Body)},
+				   {<<"updates">>, [cabala:encode(D) || D <- Updates]},
+				   {<<"deletes">>, [cabala:encode(D) || D <- Deletes]},
+				   {<<"none">>, []}]},
+				 parse_frame(Frame)),
+	Plain = cabala:encode_op_msg(3, 0, Body, []),
+	?assertEqual({3, 0, 0, none, [{body, cabala:encode(Body)}]},
+				 parse_frame(Plain)),
+	?assertEqual(16 + 4 + 1 + byte_size(cabala:encode(Body)),
+				 byte_size(Plain)).
+
+op_msg_bad_input_test() ->
+	?assertError(badarg, cabala:encode_op_msg(1, 0, #{}, [], [bogus])),
+	?assertError(badarg, cabala:encode_op_msg(1, 0, #{}, [],
+											  [{compressor, lz4}])),
+	?assertMatch({error, _},
+				 cabala:encode_op_msg(1, 0, #{}, [{<<"a", 0, "b">>, []}])).
+
+crc32c_test() ->
+	?assertEqual(16#E3069283, crc32c(<<"123456789">>)).
+
+%% An insert with a document sequence sent over TCP to a mock mongod,
+%% which checks the frame byte by byte and answers with the count.
+op_msg_mock_server_test() ->
+	{ok, Listen} = gen_tcp:listen(0, [binary, {active, false},
+									  {ip, {127, 0, 0, 1}}]),
+	{ok, Port} = inet:port(Listen),
+	Self = self(),
+	Server = spawn_link(fun() -> Self ! {mongod, mock_mongod(Listen)} end),
+	{ok, Sock} = gen_tcp:connect({127, 0, 0, 1}, Port,
+								 [binary, {active, false}]),
+	Docs = numbered(50),
+	Insert = #{<<"insert">> => <<"c">>, <<"$db">> => <<"test">>},
+	ok = gen_tcp:send(Sock, cabala:encode_op_msg(
+							  42, 0, Insert, [{<<"documents">>, Docs}],
+							  [checksum])),
+	Reply = recv_frame(Sock),
+	?assertEqual({42, 0, #{<<"n">> => 50, <<"ok">> => 1}, []},
+				 cabala:decode_op_msg(Reply, [return_maps])),
+	receive
+		{mongod, Received} ->
+			?assertEqual({cabala:encode(Insert),
+						  [cabala:encode(D) || D <- Docs]}, Received)
+	after 5000 ->
+		erlang:error(timeout)
+	end,
+	gen_tcp:close(Sock),
+	gen_tcp:close(Listen),
+	unlink(Server).
+
+mock_mongod(Listen) ->
+	{ok, Sock} = gen_tcp:accept(Listen),
+	{RequestId, 0, 1, Crc, [{body, Body}, {<<"documents">>, Docs}]} =
+		parse_frame(recv_frame(Sock)),
+	true = is_integer(Crc),
+	ok = gen_tcp:send(Sock, cabala:encode_op_msg(
+							  1, 0, {<<"n">>, length(Docs), <<"ok">>, 1}, [],
+							  [{response_to, RequestId}])),
+	gen_tcp:close(Sock),
+	{Body, Docs}.
+
+recv_frame(Sock) ->
+	{ok, <<Len:32/little>> = Prefix} = gen_tcp:recv(Sock, 4),
+	{ok, Rest} = gen_tcp:recv(Sock, Len - 4),
+	<<Prefix/binary, Rest/binary>>.
+
+%% {RequestId, ResponseTo, Flags, Crc | none, Sections} of an OP_MSG frame,
+%% where sections are {body, Doc} or {Identifier, [Doc]}. A checksum
+%% that does not match fails the match.
+parse_frame(<<Len:32/little, RequestId:32/little-signed,
+			  ResponseTo:32/little-signed, ?OP_MSG:32/little,
+			  Flags:32/little, _/binary>> = Frame)
+  when Len =:= byte_size(Frame) ->
+	{Sections, Crc} =
+		case Flags band 1 of
+			1 ->
+				Summed = Len - 4,
+				<<Data:Summed/binary, Sum:32/little>> = Frame,
+				Sum = crc32c(Data),
+				{binary:part(Data, 20, Summed - 20), Sum};
+			0 ->
+				{binary:part(Frame, 20, Len - 20), none}
+		end,
+	{RequestId, ResponseTo, Flags, Crc, parse_sections(Sections)}.
+
+parse_sections(<<>>) ->
+	[];
+parse_sections(<<0, Rest/binary>>) ->
+	<<Len:32/little, _/binary>> = Rest,
+	<<Doc:Len/binary, Tail/binary>> = Rest,
+	[{body, Doc} | parse_sections(Tail)];
+parse_sections(<<1, Size:32/little, Rest/binary>>) ->
+	PayloadLen = Size - 4,
+	<<Payload:PayloadLen/binary, Tail/binary>> = Rest,
+	[Identifier, Docs] = binary:split(Payload, <<0>>),
+	[{Identifier, split_docs(Docs)} | parse_sections(Tail)].
+
+split_docs(<<>>) ->
+	[];
+split_docs(<<Len:32/little, _/binary>> = Bin) ->
+	<<Doc:Len/binary, Rest/binary>> = Bin,
+	[Doc | split_docs(Rest)].
+
+crc32c(Bin) ->
+	crc32c(Bin, 16#FFFFFFFF) bxor 16#FFFFFFFF.
+
+crc32c(<<B, Rest/binary>>, Crc) ->
+	crc32c(Rest, crc32c_bits(Crc bxor B, 8));
+crc32c(<<>>, Crc) ->
+	Crc.
+
+crc32c_bits(Crc, 0) ->
+	Crc;
+crc32c_bits(Crc, N) when Crc band 1 =:= 1 ->
+	crc32c_bits((Crc bsr 1) bxor 16#82F63B78, N - 1);
+crc32c_bits(Crc, N) ->
+	crc32c_bits(Crc bsr 1, N - 1).
+
+%%% -------------------------------------------------
+%%% decode_op_msg/2
+%%% -------------------------------------------------
+
+reply(Batch, Docs) ->
+	#{<<"cursor">> => #{Batch => Docs,
+						<<"id">> => 0,
+						<<"ns">> => <<"test.c">>},
+	  <<"ok">> => 1}.
+
+envelope() ->
+	#{<<"cursor">> => #{<<"id">> => 0, <<"ns">> => <<"test.c">>},
+	  <<"ok">> => 1}.
+
+op_msg_reply_test_() ->
+	Docs = numbered(50),
+	[?_assertEqual({3, Flags, envelope(), Docs},
+				   cabala:decode_op_msg(
+					 cabala:encode_op_msg(7, Flags, reply(Batch, Docs), [],
+										  [{response_to, 3}]),
+					 [return_maps]))
+	 || Batch <- [<<"firstBatch">>, <<"nextBatch">>],
+		Flags <- [0, 1, 2]].
+
+op_msg_raw_test() ->
+	Docs = numbered(5),
+	Frame = cabala:encode_op_msg(1, 0, reply(<<"firstBatch">>, Docs), []),
+	{0, 0, Envelope, Raw} = cabala:decode_op_msg(Frame, [raw]),
+	?assertEqual([cabala:encode(D) || D <- Docs], Raw),
+	?assertEqual(4, tuple_size(Envelope)),
+	{0, 0, _, []} = cabala:decode_op_msg(
+					  cabala:encode_op_msg(1, 0, #{<<"ok">> => 1}, [])).
+
+%% Document sequences come back as envelope fields, Identifier => [Doc].
+op_msg_sequence_test() ->
+	Docs = numbered(3),
+	Body = #{<<"insert">> => <<"c">>},
+	Frame = cabala:encode_op_msg(5, 0, Body, [{<<"documents">>, Docs},
+											  {<<"empty">>, []}],
+								 [checksum]),
+	?assertEqual({0, 1, Body#{<<"documents">> => Docs, <<"empty">> => []}, []},
+				 cabala:decode_op_msg(Frame, [return_maps])),
+	Clash = cabala:encode_op_msg(5, 0, #{<<"documents">> => 1},
+								 [{<<"documents">>, Docs}]),
+	?assertEqual({error, badframe}, cabala:decode_op_msg(Clash)),
+	Twice = cabala:encode_op_msg(5, 0, Body, [{<<"documents">>, Docs},
+											  {<<"documents">>, Docs}]),
+	?assertEqual({error, badframe}, cabala:decode_op_msg(Twice)).
+
+op_msg_bad_frame_test() ->
+	Frame = cabala:encode_op_msg(1, 0, reply(<<"firstBatch">>, numbered(5)),
+								 [], [checksum]),
+	Size = byte_size(Frame),
+	<<Len:32/little, Ids:8/binary, _:32, Flags:32/little, Sections/binary>> =
+		Frame,
+	<<Head:40/binary, B, Tail/binary>> = Frame,
+	?assertEqual({error, badchecksum},
+				 cabala:decode_op_msg(<<Head/binary, (B bxor 1), Tail/binary>>)),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(binary:part(Frame, 0, Size - 1))),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(<<Frame/binary, 0>>)),
+	?assertEqual({error, badopcode},
+				 cabala:decode_op_msg(<<Len:32/little, Ids/binary,
+										2004:32/little, Flags:32/little,
+										Sections/binary>>)),
+	Doc = cabala:encode(#{<<"ok">> => 1}),
+	?assertEqual({0, 0, {<<"ok">>, 1}, []},
+				 cabala:decode_op_msg(op_msg_frame(0, <<0, Doc/binary>>))),
+	?assertEqual({error, badflags},
+				 cabala:decode_op_msg(op_msg_frame(4, <<0, Doc/binary>>))),
+	?assertEqual({error, unsupported_section},
+				 cabala:decode_op_msg(op_msg_frame(0, <<2, Doc/binary>>))),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(op_msg_frame(0, <<0, Doc/binary,
+														0, Doc/binary>>))),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(op_msg_frame(0, <<1, 9:32/little,
+														"docs", 0>>))),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(op_msg_frame(0, <<0, Doc/binary,
+														1, 11:32/little,
+														"docs", 0, 5, 0>>))).
+
+op_msg_frame(Flags, Sections) ->
+	Len = 20 + byte_size(Sections),
+	<<Len:32/little, 1:32/little, 0:32, ?OP_MSG:32/little, Flags:32/little,
+	  Sections/binary>>.
+
+op_msg_options_test() ->
+	Doc = #{<<"_id">> => {'$oid$', <<16#65, 0:88>>}},
+	Frame = cabala:encode_op_msg(1, 0, reply(<<"firstBatch">>, [Doc]), []),
+	?assertMatch({0, 0, _, [#{<<"_id">> := {'$oid$', <<"65", _:22/binary>>}}]},
+				 cabala:decode_op_msg(Frame, [return_maps, {oid_format, hex}])),
+	?assertError(badarg, cabala:decode_op_msg(Frame, [bogus])).
+
+%%% -------------------------------------------------
+%%% OP_COMPRESSED
+%%% -------------------------------------------------
+
+-define(OP_COMPRESSED, 2012).
+
+op_msg_compressed_test_() ->
+	Docs = numbered(200),
+	Body = reply(<<"firstBatch">>, Docs),
+	[?_assertEqual({3, Flags, envelope(), Docs},
+				   cabala:decode_op_msg(
+					 cabala:encode_op_msg(7, 0, Body, [],
+										  [{response_to, 3} | Opts]),
+					 [return_maps]))
+	 || {Flags, Opts} <- [{0, [{compressor, zlib}]},
+						  {0, [{compressor, zstd}]},
+						  {0, [{compressor, zlib}, {compression_level, 9}]},
+						  {0, [{compressor, zstd}, {compression_level, 19}]},
+						  {1, [checksum, {compressor, zstd}]},
+						  {1, [checksum, {compressor, zlib}]}]].
+
+%% The OP_COMPRESSED header keeps the ids, names the original opcode and
+%% size and the zlib data inflates to the original frame after its header.
+op_compressed_layout_test() ->
+	Body = reply(<<"firstBatch">>, numbered(200)),
+	Plain = cabala:encode_op_msg(7, 0, Body, [{<<"s">>, numbered(2)}],
+								 [checksum, {response_to, 3}]),
+	<<_:16/binary, Original/binary>> = Plain,
+	Frame = cabala:encode_op_msg(7, 0, Body, [{<<"s">>, numbered(2)}],
+								 [checksum, {response_to, 3},
+								  {compressor, zlib}]),
+	<<Len:32/little, 7:32/little, 3:32/little, ?OP_COMPRESSED:32/little,
+	  ?OP_MSG:32/little, Size:32/little, 2, Data/binary>> = Frame,
+	?assertEqual(byte_size(Frame), Len),
+	?assertEqual(byte_size(Original), Size),
+	?assertEqual(Original, zlib:uncompress(Data)),
+	?assert(byte_size(Frame) < byte_size(Plain)),
+	<<_:24/binary, 3, _/binary>> =
+		cabala:encode_op_msg(7, 0, Body, [], [{compressor, zstd}]).
+
+%% Compressor 0 (noop) is read as well, bad data is reported.
+op_compressed_decode_test() ->
+	Plain = cabala:encode_op_msg(7, 0, #{<<"ok">> => 1}, []),
+	<<_:16/binary, Original/binary>> = Plain,
+	Noop = compressed_frame(0, byte_size(Original), Original),
+	?assertEqual(cabala:decode_op_msg(Plain), cabala:decode_op_msg(Noop)),
+	?assertEqual({error, baddata},
+				 cabala:decode_op_msg(compressed_frame(2, byte_size(Original),
+													   <<"not zlib">>))),
+	?assertEqual({error, baddata},
+				 cabala:decode_op_msg(compressed_frame(
+										2, byte_size(Original) + 1,
+										zlib:compress(Original)))),
+	?assertEqual({error, badcompressor},
+				 cabala:decode_op_msg(compressed_frame(1, byte_size(Original),
+													   Original))),
+	?assertEqual({error, badframe},
+				 cabala:decode_op_msg(compressed_frame(0, -1, Original))).
+
+compressed_frame(Compressor, Size, Data) ->
+	Len = 25 + byte_size(Data),
+	<<Len:32/little, 7:32/little, 0:32, ?OP_COMPRESSED:32/little,
+	  ?OP_MSG:32/little, Size:32/little-signed, Compressor, Data/binary>>.
+
+%% A find sent over TCP to a mock mongod, which answers with a cursor
+%% reply compressed with zstd.
+op_compressed_mock_server_test() ->
+	{ok, Listen} = gen_tcp:listen(0, [binary, {active, false},
+									  {ip, {127, 0, 0, 1}}]),
+	{ok, Port} = inet:port(Listen),
+	Docs = numbered(50),
+	Server = spawn_link(fun() -> compressing_mongod(Listen, Docs) end),
+	{ok, Sock} = gen_tcp:connect({127, 0, 0, 1}, Port,
+								 [binary, {active, false}]),
+	Find = #{<<"find">> => <<"c">>, <<"$db">> => <<"test">>},
+	ok = gen_tcp:send(Sock, cabala:encode_op_msg(42, 0, Find, [],
+												 [{compressor, zlib}])),
+	?assertEqual({42, 0, envelope(), Docs},
+				 cabala:decode_op_msg(recv_frame(Sock), [return_maps])),
+	gen_tcp:close(Sock),
+	gen_tcp:close(Listen),
+	unlink(Server).
+
+compressing_mongod(Listen, Docs) ->
+	{ok, Sock} = gen_tcp:accept(Listen),
+	Frame = recv_frame(Sock),
+	<<_:32, RequestId:32/little-signed, _:32, ?OP_COMPRESSED:32/little,
+	  _/binary>> = Frame,
+	{0, 0, #{<<"find">> := <<"c">>}, []} =
+		cabala:decode_op_msg(Frame, [return_maps]),
+	ok = gen_tcp:send(Sock, cabala:encode_op_msg(
+							  1, 0, reply(<<"firstBatch">>, Docs), [],
+							  [{response_to, RequestId},
+							   {compressor, zstd}])),
+	gen_tcp:close(Sock).
+
+%%% -------------------------------------------------
+%%% cabala_file readers
+%%% -------------------------------------------------
+
+tmp_file(Name) ->
+	Path = filename:join(os:getenv("TMPDIR", "/tmp"),
+						 "cabala_" ++ os:getpid() ++ "_" ++ Name),
+	_ = file:delete(Path),
+	Path.
+
+dump_file(Name, Docs) ->
+	Path = tmp_file(Name),
+	ok = file:write_file(Path, [cabala:encode(D) || D <- Docs]),
+	Path.
+
+reader_batches_test() ->
+	Docs = numbered(2500),
+	Path = dump_file("batches.bson", Docs),
+	R = cabala_file:open(Path),
+	B1 = cabala_file:next_batch(R, 1000, [return_maps]),
+	B2 = cabala_file:next_batch(R, 1000, [return_maps]),
+	B3 = cabala_file:next_batch(R, 1000, [return_maps]),
+	?assertEqual([1000, 1000, 500], [length(B) || B <- [B1, B2, B3]]),
+	?assertEqual(Docs, B1 ++ B2 ++ B3),
+	?assertEqual(eof, cabala_file:next_batch(R, 1000)),
+	?assertEqual(ok, cabala_file:close(R)),
+	?assertEqual({error, closed}, cabala_file:next_batch(R, 1)),
+	?assertEqual(ok, cabala_file:close(R)),
+	ok = file:delete(Path).
+
+reader_fold_test() ->
+	Docs = [D#{<<"oid">> => {'$oid$', <<I:96>>}}
+			|| #{<<"_id">> := I} = D <- numbered(100)],
+	Path = dump_file("fold.bson", Docs),
+	R = cabala_file:open(Path),
+	Fold = fun(Doc, Acc) -> [Doc | Acc] end,
+	{ok, Acc} = cabala_file:fold(R, Fold, [], [{batch_size, 7}, return_maps,
+											   {oid_format, hex}]),
+	?assertEqual([D#{<<"oid">> => {'$oid$', list_to_binary(
+											   io_lib:format("~24.16.0b", [I]))}}
+				  || #{<<"_id">> := I} = D <- Docs],
+				 lists:reverse(Acc)),
+	?assertEqual({ok, 0}, cabala_file:fold(R, fun(_, N) -> N + 1 end, 0)),
+	cabala_file:close(R),
+	?assertEqual({error, closed}, cabala_file:fold(R, Fold, [])),
+	ok = file:delete(Path).
+
+reader_errors_test() ->
+	Docs = numbered(3),
+	Good = iolist_to_binary([cabala:encode(D) || D <- Docs]),
+	Path = tmp_file("truncated.bson"),
+	ok = file:write_file(Path, [Good, binary:part(cabala:encode(hd(Docs)),
+												  0, 10)]),
+	R = cabala_file:open(Path),
+	Offset = byte_size(Good),
+	?assertEqual({error, {badbson, Offset}}, cabala_file:next_batch(R, 10)),
+	?assertEqual(3, length(cabala_file:next_batch(R, 3))),
+	?assertEqual({error, {badbson, Offset}}, cabala_file:next_batch(R, 1)),
+	cabala_file:close(R),
+	ok = file:write_file(Path, cabala:encode(#{<<"s">> => <<255>>})),
+	R2 = cabala_file:open(Path),
+	?assertEqual({error, {invalid_utf8, 0}},
+				 cabala_file:next_batch(R2, 1, [{validate_utf8, true}])),
+	?assertMatch([_], cabala_file:next_batch(R2, 1)),
+	cabala_file:close(R2),
+	ok = file:write_file(Path, <<>>),
+	R3 = cabala_file:open(Path),
+	?assertEqual(eof, cabala_file:next_batch(R3, 1)),
+	cabala_file:close(R3),
+	ok = file:delete(Path),
+	?assertEqual({error, enoent}, cabala_file:open(Path)).
+
+%%% -------------------------------------------------
+%%% cabala_file writers
+%%% -------------------------------------------------
+
+encoded(Docs) ->
+	iolist_to_binary([cabala:encode(D) || D <- Docs]).
+
+writer_test() ->
+	Path = tmp_file("writer.bson"),
+	Docs = numbered(10),
+	W = cabala_file:open_writer(Path, []),
+	?assertEqual(ok, cabala_file:write(W, Docs)),
+	?assertEqual(ok, cabala_file:write(W, #{<<"last">> => true})),
+	%% everything is still in the 1MB buffer
+	?assertEqual({ok, <<>>}, file:read_file(Path)),
+	?assertEqual(ok, cabala_file:flush(W)),
+	?assertEqual({ok, encoded(Docs ++ [#{<<"last">> => true}])},
+				 file:read_file(Path)),
+	?assertEqual(ok, cabala_file:close(W)),
+	R = cabala_file:open(Path),
+	?assertEqual(Docs ++ [#{<<"last">> => true}],
+				 cabala_file:next_batch(R, 100, [return_maps])),
+	cabala_file:close(R),
+	ok = file:delete(Path).
+
+writer_fsync_test_() ->
+	Docs = numbered(3),
+	[{atom_to_list(Policy),
+	  fun() ->
+			  Path = tmp_file("fsync.bson"),
+			  W = cabala_file:open_writer(Path, [{fsync, Policy}]),
+			  ok = cabala_file:write(W, Docs),
+			  ?assertEqual({ok, Written}, file:read_file(Path)),
+			  ?assertEqual(ok, cabala_file:close(W)),
+			  ?assertEqual({ok, encoded(Docs)}, file:read_file(Path)),
+			  ok = file:delete(Path)
+	  end}
+	 || {Policy, Written} <- [{never, <<>>},
+							  {on_close, <<>>},
+							  {always, encoded(Docs)}]].
+
+%% The buffer is rounded up to 4KB. A document that does not fit is
+%% written out with the buffer, one larger than the buffer goes straight
+%% to the file.
+writer_buffer_test() ->
+	Path = tmp_file("buffer.bson"),
+	W = cabala_file:open_writer(Path, [{buffer_size, 1}]),
+	Small = [#{<<"pad">> => binary:copy(<<"x">>, 1000), <<"n">> => N}
+			 || N <- lists:seq(1, 5)],
+	[Bin1, Bin2, Bin3, Bin4, Bin5] = [cabala:encode(D) || D <- Small],
+	ok = cabala_file:write(W, Small),
+	?assertEqual({ok, <<Bin1/binary, Bin2/binary, Bin3/binary, Bin4/binary>>},
+				 file:read_file(Path)),
+	Big = #{<<"pad">> => binary:copy(<<"y">>, 10000)},
+	ok = cabala_file:write(W, Big),
+	?assertEqual({ok, <<Bin1/binary, Bin2/binary, Bin3/binary, Bin4/binary,
+						Bin5/binary, (cabala:encode(Big))/binary>>},
+				 file:read_file(Path)),
+	ok = cabala_file:close(W),
+	ok = file:delete(Path).
+
+writer_append_test() ->
+	Path = tmp_file("append.bson"),
+	[A, B] = numbered(2),
+	W1 = cabala_file:open_writer(Path, []),
+	ok = cabala_file:write(W1, A),
+	ok = cabala_file:close(W1),
+	W2 = cabala_file:open_writer(Path, [append]),
+	ok = cabala_file:write(W2, B),
+	ok = cabala_file:close(W2),
+	?assertEqual({ok, encoded([A, B])}, file:read_file(Path)),
+	W3 = cabala_file:open_writer(Path, []),
+	ok = cabala_file:close(W3),
+	?assertEqual({ok, <<>>}, file:read_file(Path)),
+	ok = file:delete(Path).
+
+writer_errors_test() ->
+	Path = tmp_file("errors.bson"),
+	?assertError(badarg, cabala_file:open_writer(Path, [{fsync, sometimes}])),
+	?assertError(badarg, cabala_file:open_writer(Path, [{buffer_size, 0}])),
+	?assertEqual({error, enoent},
+				 cabala_file:open_writer(filename:join(Path, "x"), [])),
+	W = cabala_file:open_writer(Path, []),
+	?assertEqual({error, {baddoc, 5}},
+				 cabala_file:write(W, [#{<<"a">> => 1}, 5])),
+	ok = cabala_file:close(W),
+	?assertEqual({ok, encoded([#{<<"a">> => 1}])}, file:read_file(Path)),
+	?assertEqual({error, closed}, cabala_file:write(W, [#{}])),
+	?assertEqual({error, closed}, cabala_file:flush(W)),
+	?assertEqual(ok, cabala_file:close(W)),
+	ok = file:delete(Path).
+
+%%% -------------------------------------------------
+%%% index/2
+%%% -------------------------------------------------
+
+index_test() ->
+	Docs = [cabala:encode(#{<<"n">> => N}) || N <- lists:seq(1, 100)],
+	Index = cabala:index(iolist_to_binary(Docs)),
+	?assertEqual(100, cabala:count(Index)),
+	?assertEqual(lists:nth(37, Docs), cabala:nth(Index, 37)),
+	?assertEqual(lists:sublist(Docs, 10, 5), cabala:slice(Index, 10, 5)),
+	?assertEqual(lists:nthtail(95, Docs), cabala:slice(Index, 96, 50)),
+	?assertEqual([], cabala:slice(Index, 101, 1)),
+	?assertEqual([], cabala:slice(Index, 1, 0)),
+	?assertError(badarg, cabala:nth(Index, 101)),
+	?assertEqual([{1, 25}, {26, 25}, {51, 25}, {76, 25}],
+				 cabala:ranges(Index, 4)),
+	?assertEqual(0, cabala:count(cabala:index(<<>>))).
+
+index_ranges_test_() ->
+	Docs = [cabala:encode(D) || D <- numbered(50)],
+	Index = cabala:index(iolist_to_binary(Docs)),
+	[?_test(begin
+				Ranges = cabala:ranges(Index, Parts),
+				?assert(length(Ranges) =< Parts),
+				?assert(lists:all(fun({_, Count}) -> Count > 0 end, Ranges)),
+				?assertEqual(Docs, lists:append([cabala:slice(Index, F, C)
+												 || {F, C} <- Ranges]))
+			end)
+	 || Parts <- [1, 3, 7, 50, 64]].
+
+index_errors_test() ->
+	Good = iolist_to_binary([cabala:encode(D) || D <- numbered(3)]),
+	?assertEqual({error, {badbson, byte_size(Good)}},
+				 cabala:index(<<Good/binary, 10:32/little, 1, 2, 3>>)),
+	?assertEqual({error, {badbson, 0}}, cabala:index(<<1, 2, 3>>)),
+	?assertEqual({error, enoent},
+				 cabala:index({file, tmp_file("missing.bson")})),
+	?assertError(badarg, cabala:index(Good, [{bogus, 1}])).
+
+%% A sidecar for the same source is read, not rewritten. One for another
+%% version of the file, or for another binary of the same size, is
+%% rebuilt.
+index_sidecar_test() ->
+	Path = dump_file("indexed.bson", numbered(20)),
+	Sidecar = tmp_file("indexed.cbix"),
+	Opts = [{sidecar, Sidecar}],
+	?assertEqual(20, cabala:count(cabala:index({file, Path}, Opts))),
+	Inode = inode(Sidecar),
+	Index = cabala:index({file, Path}, Opts),
+	?assertEqual(20, cabala:count(Index)),
+	?assertEqual(Inode, inode(Sidecar)),
+	?assertEqual(cabala:encode(lists:last(numbered(20))), cabala:nth(Index, 20)),
+	ok = file:write_file(Path, [cabala:encode(D) || D <- numbered(30)]),
+	?assertEqual(30, cabala:count(cabala:index({file, Path}, Opts))),
+	?assertNotEqual(Inode, inode(Sidecar)),
+	Two = iolist_to_binary([cabala:encode(#{<<"a">> => <<"xx">>}),
+							cabala:encode(#{<<"a">> => <<"xx">>})]),
+	One = cabala:encode(#{<<"a">> => binary:copy(<<"x">>, 17)}),
+	?assertEqual(byte_size(Two), byte_size(One)),
+	?assertEqual(2, cabala:count(cabala:index(Two, Opts))),
+	?assertEqual(1, cabala:count(cabala:index(One, Opts))),
+	?assertEqual([One], cabala:slice(cabala:index(One, Opts), 1, 5)),
+	ok = file:delete(Path),
+	ok = file:delete(Sidecar).
+
+inode(Path) ->
+	{ok, Info} = file:read_file_info(Path),
+	element(#file_info.inode, Info).
+
+%%% -------------------------------------------------
+%%% decode_all_parallel/2
+%%% -------------------------------------------------
+
+decode_all_parallel_test_() ->
+	Docs = numbered(5000),
+	Bin = iolist_to_binary([cabala:encode(D) || D <- Docs]),
+	[?_assertEqual(Docs, cabala:decode_all_parallel(Bin, [return_maps])),
+	 ?_assertEqual(Docs, cabala:decode_all_parallel(Bin, [return_maps,
+														  {threads, 1}])),
+	 ?_assertEqual(Docs, cabala:decode_all_parallel(Bin, [return_maps,
+														  {threads, 3}])),
+	 %% too few documents to be worth splitting
+	 ?_assertEqual([#{<<"a">> => 1}],
+				   cabala:decode_all_parallel(cabala:encode(#{<<"a">> => 1}),
+											  [return_maps])),
+	 ?_assertEqual([], cabala:decode_all_parallel(<<>>))].
+
+decode_all_parallel_errors_test() ->
+	Good = iolist_to_binary([cabala:encode(D) || D <- numbered(1000)]),
+	?assertEqual({error, badbson},
+				 cabala:decode_all_parallel(<<Good/binary, 1, 2, 3>>)),
+	Bad = cabala:encode(#{<<"s">> => <<"ok", 255>>}),
+	Mixed = <<Good/binary, Bad/binary, Good/binary>>,
+	?assertMatch([_ | _], cabala:decode_all_parallel(Mixed)),
+	?assertEqual({error, invalid_utf8},
+				 cabala:decode_all_parallel(Mixed, [{validate_utf8, true}])),
+	?assertError(badarg, cabala:decode_all_parallel(Good, [{threads, 0}])),
+	?assertError(badarg, cabala:decode_all_parallel(Good, [bogus])).
+
+%%% -------------------------------------------------
+%%% encode_async/2, decode_async/2 and cancel/1
+%%% -------------------------------------------------
+
+-define(OID, <<16#65, 16#1f, 16#00, 16#aa, 16#01, 16#02,
+			   16#03, 16#04, 16#05, 16#06, 16#07, 16#08>>).
+-define(OID_HEX, <<"651f00aa0102030405060708">>).
+
+async_result(Ref) ->
+	receive
+		{cabala, Ref, Result} -> Result
+	after 5000 ->
+		erlang:error(timeout)
+	end.
+
+no_async_result(Ref) ->
+	receive
+		{cabala, Ref, _} -> erlang:error(unexpected_reply)
+	after 100 ->
+		ok
+	end.
+
+async_test() ->
+	Doc = #{<<"a">> => 1, <<"b">> => [<<"x">>, 2.5]},
+	Bin = cabala:encode(Doc),
+	Ref1 = cabala:encode_async(Doc),
+	?assert(is_reference(Ref1)),
+	?assertEqual(Bin, async_result(Ref1)),
+	Ref2 = cabala:decode_async(Bin, [return_maps]),
+	?assertEqual(Doc, async_result(Ref2)),
+	?assertEqual({error, badbson}, async_result(cabala:decode_async(<<1, 2>>))),
+	%% done already, nothing left to cancel
+	?assertNot(cabala:cancel(Ref1)),
+	?assertError(badarg, cabala:cancel(make_ref())),
+	?assertError(badarg, cabala:decode_async(Bin, [bogus])),
+	Info = cabala:async_info(),
+	?assert(proplists:get_value(threads, Info) > 0),
+	?assert(is_integer(proplists:get_value(queued, Info))),
+	?assert(proplists:get_value(max_queued, Info) > 0).
+
+async_options_test() ->
+	Bad = #{<<"s">> => <<255>>},
+	Ref1 = cabala:encode_async(Bad, [{validate_utf8, true}]),
+	?assertEqual({error, invalid_utf8}, async_result(Ref1)),
+	Ref2 = cabala:encode_async(#{<<"a">> => 1}, [{ensure_id, true}]),
+	?assertMatch({Enc, {'$oid$', _}} when is_binary(Enc), async_result(Ref2)),
+	Bin = cabala:encode(#{<<"_id">> => {'$oid$', ?OID}}),
+	Ref3 = cabala:decode_async(Bin, [return_maps, {oid_format, hex}]),
+	?assertEqual(#{<<"_id">> => {'$oid$', ?OID_HEX}}, async_result(Ref3)).
+
+%% More jobs than the workers can take plus the queue holds: the
+%% overflow is refused as busy, every accepted job replies once unless
+%% it was cancelled while still queued.
+async_busy_cancel_test_() ->
+	{timeout, 60,
+	 fun() ->
+			 Big = cabala:encode(#{<<"a">> => lists:seq(1, 20000)}),
+			 Info = cabala:async_info(),
+			 N = proplists:get_value(max_queued, Info) +
+				 2 * proplists:get_value(threads, Info) + 16,
+			 Results = [cabala:decode_async(Big) || _ <- lists:seq(1, N)],
+			 ?assert(lists:member({error, busy}, Results)),
+			 Refs = [R || R <- Results, is_reference(R)],
+			 ?assertEqual(N, length(Refs) + length(Results -- Refs)),
+			 ?assert(lists:all(fun(R) -> R =:= {error, busy} end,
+							   Results -- Refs)),
+			 %% the newest jobs are the ones still queued
+			 {Kept, Tail} = lists:split(length(Refs) - 8, Refs),
+			 Cancelled = [{R, cabala:cancel(R)} || R <- Tail],
+			 ?assert(lists:any(fun({_, C}) -> C end, Cancelled)),
+			 [?assertMatch({_, _}, async_result(R)) || R <- Kept],
+			 [case C of
+				  true -> no_async_result(R);
+				  false -> ?assertMatch({_, _}, async_result(R))
+			  end || {R, C} <- Cancelled],
+			 %% a cancelled job stays cancelled
+			 [?assertNot(cabala:cancel(R)) || {R, true} <- Cancelled]
+	 end}.
+
+%%% -------------------------------------------------
+%%% encode_batch/2
+%%% -------------------------------------------------
+
+encode_batch_test_() ->
+	Docs = numbered(5000),
+	Bin = iolist_to_binary([cabala:encode(D) || D <- Docs]),
+	[?_assertEqual(Bin, cabala:encode_batch(Docs)),
+	 ?_assertEqual(Bin, cabala:encode_batch(Docs, [{threshold, 0}])),
+	 ?_assertEqual(Bin, cabala:encode_batch(Docs, [{threshold, 100000}])),
+	 ?_assertEqual(Bin, cabala:encode_batch(Docs, [{threads, 1}])),
+	 ?_assertEqual(Bin, cabala:encode_batch(Docs, [{threads, 3},
+												   {threshold, 10}])),
+	 ?_assertEqual(<<>>, cabala:encode_batch([]))].
+
+encode_batch_errors_test() ->
+	Bad = #{<<"p">> => self()},
+	Docs = numbered(3000),
+	{Front, Back} = lists:split(2000, Docs),
+	?assertEqual({error, {baddoc, Bad}},
+				 cabala:encode_batch(Front ++ [Bad | Back])),
+	?assertEqual({error, {baddoc, Bad}},
+				 cabala:encode_batch(Front ++ [Bad | Back], [{threshold, 0}])),
+	?assertError(badarg, cabala:encode_batch([#{}, not_a_doc])),
+	?assertError(badarg, cabala:encode_batch(Docs, [{threads, 0}])),
+	?assertError(badarg, cabala:encode_batch(Docs, [bogus])).
+
+%%% -------------------------------------------------
+%%% packed_arrays on decode
+%%% -------------------------------------------------
+
+packed_doc() ->
+	cabala:encode(#{<<"f">> => [1.5, 2.5],
+					<<"i">> => [1, 2, 3],
+					<<"l">> => [{'$i64$', <<1:64/signed-native>>}],
+					<<"big">> => [1 bsl 40, 1 bsl 41],
+					<<"mixed">> => [1, 1 bsl 40, 2.5],
+					<<"strs">> => [<<"a">>],
+					<<"none">> => [],
+					<<"sub">> => #{<<"n">> => lists:seq(1, 12)}}).
+
+packed_arrays_decode_test() ->
+	Packed = #{<<"f">> => {'$f64$', <<1.5:64/float-native, 2.5:64/float-native>>},
+			   <<"i">> => {'$i32$', <<1:32/signed-native, 2:32/signed-native,
+									  3:32/signed-native>>},
+			   <<"l">> => [{'$i64$', <<1:64/signed-native>>}],
+			   <<"big">> => {'$i64$', <<(1 bsl 40):64/signed-native,
+										(1 bsl 41):64/signed-native>>},
+			   <<"mixed">> => [1, 1 bsl 40, 2.5],
+			   <<"strs">> => [<<"a">>],
+			   <<"none">> => [],
+			   <<"sub">> => #{<<"n">> => {'$i32$',
+										  << <<N:32/signed-native>>
+											 || N <- lists:seq(1, 12) >>}}},
+	Bin = packed_doc(),
+	?assertEqual(Packed, cabala:decode(Bin, [return_maps, packed_arrays])),
+	?assertEqual(Packed, cabala:decode(Bin, [return_maps,
+											 {packed_arrays, true}])),
+	?assertEqual(cabala:decode(Bin, [return_maps]),
+				 cabala:decode(Bin, [return_maps, {packed_arrays, false}])),
+	?assertEqual([1.5, 2.5],
+				 maps:get(<<"f">>, cabala:decode(Bin, [return_maps]))).
+
+%% every decoder takes the decode/2 options
+packed_arrays_decoders_test() ->
+	Bin = packed_doc(),
+	Opts = [return_maps, packed_arrays],
+	Packed = cabala:decode(Bin, Opts),
+	?assertEqual([Packed, Packed],
+				 cabala:decode_all_parallel(<<Bin/binary, Bin/binary>>, Opts)),
+	?assertEqual(Packed, async_result(cabala:decode_async(Bin, Opts))),
+	Reply = reply(<<"firstBatch">>, [cabala:decode(Bin, [return_maps])]),
+	{_, _, _, [Batch]} = cabala:decode_op_msg(
+						   cabala:encode_op_msg(1, 0, Reply, []), Opts),
+	?assertEqual(Packed, Batch).
+
+%%% -------------------------------------------------
+%%% packed arrays on encode
+%%% -------------------------------------------------
+
+packed_arrays_encode_test() ->
+	Doubles = [float(N) / 4 || N <- lists:seq(1, 25)],
+	Ints = lists:seq(-5, 120),
+	Longs = [N bsl 40 || N <- lists:seq(1, 11)],
+	Plain = cabala:encode(#{<<"f">> => Doubles, <<"i">> => Ints,
+							<<"l">> => Longs}),
+	F64 = << <<D:64/float-native>> || D <- Doubles >>,
+	I32 = << <<I:32/signed-native>> || I <- Ints >>,
+	I64 = << <<L:64/signed-native>> || L <- Longs >>,
+	?assertEqual(Plain, cabala:encode(#{<<"f">> => {'$f64$', F64},
+										<<"i">> => {'$i32$', I32},
+										<<"l">> => {'$i64$', I64}})),
+	?assertEqual(Plain, cabala:encode(
+						  cabala:decode(Plain, [return_maps, packed_arrays]))),
+	%% ints that fit 32 bits still make an int64 array when asked for
+	?assertEqual(#{<<"a">> => [{'$i64$', <<1:64/signed-native>>}]},
+				 cabala:decode(cabala:encode(
+								 #{<<"a">> => [{'$i64$', <<1:64/signed-native>>}]}),
+							   [return_maps, packed_arrays])),
+	?assertEqual(cabala:encode(#{<<"e">> => []}),
+				 cabala:encode(#{<<"e">> => {'$f64$', <<>>}})),
+	?assertMatch({error, _}, cabala:encode(#{<<"b">> => {'$i32$', <<1, 2, 3>>}})).
+
+packed_arrays_encode_batch_test() ->
+	Docs = [#{<<"v">> => {'$f64$', <<(float(N)):64/float-native>>}}
+			|| N <- lists:seq(1, 2000)],
+	?assertEqual(iolist_to_binary([cabala:encode(D) || D <- Docs]),
+				 cabala:encode_batch(Docs, [{threshold, 0}])).
+
+hash_term_packed_test_() ->
+	Docs = [#{<<"p">> => {'$f64$', <<1.5:64/float-native>>},
+			  <<"q">> => {'$i64$', <<(1 bsl 40):64/signed-native>>}},
+			#{<<"r">> => {'$i32$', << <<N:32/signed-native>>
+									  || N <- lists:seq(1, 15) >>}},
+			#{<<"e">> => {'$i32$', <<>>}}],
+	[?_assertEqual(cabala:hash(cabala:encode(D), [canonical]),
+				   cabala:hash_term(D))
+	 || D <- Docs].
+
+%%% -------------------------------------------------
+%%% decode_columns/3
+%%% -------------------------------------------------
+
+decode_columns_test() ->
+	Rows = [#{<<"a">> => 1, <<"b">> => #{<<"c">> => 1.5}, <<"s">> => <<"x">>,
+			  <<"n">> => null},
+			#{<<"a">> => 2, <<"b">> => #{<<"c">> => 2}, <<"s">> => 3},
+			#{<<"b">> => #{}, <<"n">> => null},
+			#{<<"a">> => null, <<"s">> => <<"y">>}],
+	Bin = iolist_to_binary([cabala:encode(R) || R <- Rows]),
+	Fields = [<<"a">>, <<"b.c">>, <<"s">>, <<"n">>, <<"zz">>],
+	?assertEqual(#{<<"a">> => {'$i32$', <<1:32/signed-native, 2:32/signed-native,
+										   0:32, 0:32>>, <<2#0011>>},
+				   %% an int after a double is widened to one
+				   <<"b.c">> => {'$f64$', <<1.5:64/float-native,
+											2.0:64/float-native,
+											0:64, 0:64>>, <<2#0011>>},
+				   <<"s">> => [<<"x">>, 3, undefined, <<"y">>],
+				   <<"n">> => [null, undefined, null, undefined],
+				   <<"zz">> => [undefined, undefined, undefined, undefined]},
+				 cabala:decode_columns(Bin, Fields)).
+
+decode_columns_numeric_test() ->
+	Bin = iolist_to_binary([cabala:encode(#{<<"i">> => I, <<"l">> => I bsl 33})
+							|| I <- lists:seq(1, 10)]),
+	Mixed = iolist_to_binary([cabala:encode(#{<<"m">> => 1}),
+							  cabala:encode(#{<<"m">> => 1 bsl 40})]),
+	?assertEqual(#{<<"i">> => {'$i32$', << <<I:32/signed-native>>
+											 || I <- lists:seq(1, 10) >>,
+							   <<16#ff, 16#03>>},
+				   <<"l">> => {'$i64$', << <<(I bsl 33):64/signed-native>>
+											 || I <- lists:seq(1, 10) >>,
+							   <<16#ff, 16#03>>}},
+				 cabala:decode_columns(Bin, [<<"i">>, <<"l">>])),
+	?assertEqual(#{<<"m">> => {'$i64$', <<1:64/signed-native,
+										   (1 bsl 40):64/signed-native>>, <<3>>}},
+				 cabala:decode_columns(Mixed, [<<"m">>])),
+	?assertEqual(#{<<"a">> => []}, cabala:decode_columns(<<>>, [<<"a">>])),
+	?assertEqual(#{}, cabala:decode_columns(Bin, [])).
+
+decode_columns_options_test() ->
+	Bin = iolist_to_binary([cabala:encode(#{<<"_id">> => {'$oid$', ?OID},
+											<<"s">> => <<"ok", 255>>})]),
+	?assertEqual(#{<<"_id">> => [{'$oid$', ?OID_HEX}]},
+				 cabala:decode_columns(Bin, [<<"_id">>], [{oid_format, hex}])),
+	?assertEqual(#{<<"s">> => [<<"ok", 255>>]},
+				 cabala:decode_columns(Bin, [<<"s">>])),
+	?assertEqual({error, invalid_utf8},
+				 cabala:decode_columns(Bin, [<<"s">>], [{validate_utf8, true}])),
+	?assertEqual({error, badbson},
+				 cabala:decode_columns(<<Bin/binary, 1>>, [<<"s">>])),
+	?assertError(badarg, cabala:decode_columns(Bin, [s])),
+	?assertError(badarg, cabala:decode_columns(Bin, [<<>>])),
+	?assertError(badarg, cabala:decode_columns(Bin, [<<"s">>], [bogus])).
+
+%%% -------------------------------------------------
+%%% encode_buckets/2
+%%% -------------------------------------------------
+
+row(T, Tag, V) ->
+	{<<"t">>, {'$date$', T}, <<"tag">>, Tag, <<"v">>, V}.
+
+buckets(Rows, Spec) ->
+	[cabala:decode(B, [return_maps]) || B <- cabala:encode_buckets(Rows, Spec)].
+
+encode_buckets_test() ->
+	Rows = [row(1000, <<"a">>, 3), row(2000, <<"a">>, 1),
+			{<<"t">>, {'$date$', 3000}, <<"tag">>, <<"a">>},
+			row(4000, <<"a">>, 2)],
+	?assertEqual([#{<<"control">> =>
+						#{<<"version">> => 1,
+						  <<"min">> => #{<<"t">> => {'$date$', 1000}, <<"v">> => 1},
+						  <<"max">> => #{<<"t">> => {'$date$', 4000}, <<"v">> => 3}},
+					<<"meta">> => <<"a">>,
+					<<"data">> =>
+						#{<<"t">> => #{<<"0">> => {'$date$', 1000},
+									   <<"1">> => {'$date$', 2000},
+									   <<"2">> => {'$date$', 3000},
+									   <<"3">> => {'$date$', 4000}},
+						  %% the row without v is left out
+						  <<"v">> => #{<<"0">> => 3, <<"1">> => 1, <<"3">> => 2}}}],
+				 buckets(Rows, [{time_field, <<"t">>}, {meta_field, <<"tag">>}])),
+	%% without a meta field it is just another column
+	[#{<<"data">> := #{<<"tag">> := #{<<"0">> := <<"a">>}}} = NoMeta] =
+		buckets(Rows, [{time_field, t}]),
+	?assertNot(maps:is_key(<<"meta">>, NoMeta)),
+	?assertEqual([], cabala:encode_buckets([], [{time_field, t}])).
+
+encode_buckets_split_test() ->
+	Rows = [row(T, Tag, T) || {T, Tag} <- [{1, <<"a">>}, {2, <<"a">>},
+										   {3, <<"b">>}, {4, <<"a">>},
+										   {5, <<"a">>}]],
+	Counts = fun(Bs) ->
+					 [maps:size(maps:get(<<"t">>, maps:get(<<"data">>, B)))
+					  || B <- Bs]
+			 end,
+	Meta = [{time_field, <<"t">>}, {meta_field, <<"tag">>}],
+	?assertEqual([2, 1, 2], Counts(buckets(Rows, Meta))),
+	?assertEqual([<<"a">>, <<"b">>, <<"a">>],
+				 [maps:get(<<"meta">>, B) || B <- buckets(Rows, Meta)]),
+	?assertEqual([2, 2, 1], Counts(buckets(Rows, [{time_field, t},
+												  {max_count, 2}]))),
+	?assertEqual([1, 1, 1, 1, 1], Counts(buckets(Rows, [{time_field, t},
+														{max_size, 1}]))),
+	?assertEqual([5], Counts(buckets(Rows, [{time_field, t}]))).
+
+encode_buckets_errors_test() ->
+	NoTime = {<<"v">>, 1},
+	NotDate = {<<"t">>, 5},
+	Spec = [{time_field, t}],
+	?assertEqual({error, {baddoc, NoTime}},
+				 cabala:encode_buckets([row(1, null, 1), NoTime], Spec)),
+	?assertEqual({error, {baddoc, NotDate}},
+				 cabala:encode_buckets([NotDate], Spec)),
+	?assertError(badarg, cabala:encode_buckets([], [])),
+	?assertError(badarg, cabala:encode_buckets([], [{meta_field, m}])),
+	?assertError(badarg, cabala:encode_buckets([], [{time_field, <<>>}])),
+	?assertError(badarg, cabala:encode_buckets([], [{time_field, t},
+													{max_count, 0}])),
+	?assertError(badarg, cabala:encode_buckets([], [{time_field, t}, bogus])).
+
+%%% -------------------------------------------------
+%%% compile_schema/3 and encode_record/2
+%%% -------------------------------------------------
+
+user_schema() ->
+	cabala:compile_schema(record_info(fields, user), [string, int32],
+						  [{record, user}]).
+
+encode_record_test() ->
+	Schema = user_schema(),
+	Bin = cabala:encode({<<"name">>, <<"ann">>, <<"age">>, 30}),
+	?assertEqual(Bin, cabala:encode_record(Schema, #user{name = <<"ann">>,
+														 age = 30})),
+	?assertEqual(Bin, cabala:encode_record(Schema, {<<"ann">>, 30})),
+	?assertEqual(Bin, cabala:encode_record(
+						cabala:compile_schema([<<"name">>, <<"age">>]),
+						{<<"ann">>, 30})),
+	?assertError(badarg, cabala:encode_record(Schema, {other, <<"ann">>, 30})),
+	?assertError(badarg, cabala:encode_record(Schema, {user, <<"ann">>})),
+	?assertError(badarg, cabala:encode_record(make_ref(), {<<"ann">>, 30})).
+
+%% typed fields are written as their type, anything else as encode/1 would
+encode_record_types_test() ->
+	Typed = cabala:compile_schema([a, b], [int64, double]),
+	?assertEqual(<<27:32/little, 16#12, "a", 0, 1:64/little,
+				   16#01, "b", 0, 2.0:64/float-little, 0>>,
+				 cabala:encode_record(Typed, {1, 2})),
+	Schema = cabala:compile_schema([d, b, t, s, x],
+								   [date, binary, bool, int32, any]),
+	?assertEqual(cabala:encode({<<"d">>, {'$date$', 1000},
+								<<"b">>, {'$type$', 0, '$binary$', <<"x">>},
+								<<"t">>, true,
+								<<"s">>, <<"str">>,
+								<<"x">>, [1, #{<<"y">> => null}]}),
+				 cabala:encode_record(Schema, {1000, <<"x">>, true, <<"str">>,
+											   [1, #{<<"y">> => null}]})),
+	?assertEqual(cabala:encode({<<"name">>, null, <<"age">>, null}),
+				 cabala:encode_record(user_schema(), #user{})),
+	?assertEqual({error, {badfield, <<"age">>}},
+				 cabala:encode_record(user_schema(),
+									  #user{name = <<"ann">>, age = self()})).
+
+compile_schema_errors_test() ->
+	?assertError(badarg, cabala:compile_schema([a, b], [int32])),
+	?assertError(badarg, cabala:compile_schema([a], [float])),
+	?assertError(badarg, cabala:compile_schema([<<"a", 0, "b">>], [any])),
+	?assertError(badarg, cabala:compile_schema([1], [any])),
+	?assertError(badarg, cabala:compile_schema([a], [any], [{record, "r"}])),
+	?assertError(badarg, cabala:compile_schema([a], [any], [{defaults, []}])),
+	?assertError(badarg, cabala:compile_schema([a], [any], [bogus])).
+
+%%% -------------------------------------------------
+%%% decode_record/3
+%%% -------------------------------------------------
+
+decode_record_test() ->
+	Schema = user_schema(),
+	Ann = #user{name = <<"ann">>, age = 30},
+	?assertEqual(Ann, cabala:decode_record(Schema,
+										   cabala:encode_record(Schema, Ann))),
+	%% found by name whatever the order, other fields dropped
+	?assertEqual(Ann, cabala:decode_record(
+						Schema, cabala:encode({<<"x">>, 1, <<"age">>, 30,
+											   <<"name">>, <<"ann">>}))),
+	?assertEqual(#user{name = <<"bob">>},
+				 cabala:decode_record(Schema,
+									  cabala:encode(#{<<"name">> => <<"bob">>}))),
+	?assertEqual({<<"ann">>, 30},
+				 cabala:decode_record(cabala:compile_schema([name, age]),
+									  cabala:encode_record(Schema, Ann))),
+	?assertEqual({error, badbson}, cabala:decode_record(Schema, <<1, 2, 3>>)),
+	?assertError(badarg, cabala:decode_record(Schema, <<5:32/little, 0>>,
+											  [{unknown, keep}])).
+
+decode_record_defaults_test() ->
+	Schema = cabala:compile_schema(record_info(fields, user), [any, any],
+								   [{record, user}, {defaults, [<<"?">>, 0]}]),
+	?assertEqual(#user{name = <<"?">>, age = 0},
+				 cabala:decode_record(Schema, cabala:encode(#{}))),
+	?assertEqual(#user{name = <<"cy">>, age = 0},
+				 cabala:decode_record(Schema,
+									  cabala:encode(#{<<"name">> => <<"cy">>}))),
+	%% a null in the document is a value, not a missing field
+	?assertEqual(#user{name = null, age = 0},
+				 cabala:decode_record(Schema,
+									  cabala:encode(#{<<"name">> => null}))).
+
+decode_record_unknown_test() ->
+	Schema = user_schema(),
+	Bin = cabala:encode({<<"name">>, <<"ann">>, <<"x">>, 1,
+						 <<"sub">>, #{<<"_id">> => {'$oid$', ?OID}},
+						 <<"age">>, 30}),
+	Ann = #user{name = <<"ann">>, age = 30},
+	?assertEqual(Ann, cabala:decode_record(Schema, Bin, [{unknown, ignore}])),
+	?assertEqual({Ann, {<<"x">>, 1, <<"sub">>, {<<"_id">>, {'$oid$', ?OID}}}},
+				 cabala:decode_record(Schema, Bin, [{unknown, collect}])),
+	?assertEqual({Ann, #{<<"x">> => 1,
+						 <<"sub">> => #{<<"_id">> => {'$oid$', ?OID_HEX}}}},
+				 cabala:decode_record(Schema, Bin, [{unknown, collect},
+													return_maps,
+													{oid_format, hex}])).
+
+%%% -------------------------------------------------
+%%% ensure_id and new_oid/0
+%%% -------------------------------------------------
+
+ensure_id_test() ->
+	{Bin, {'$oid$', Id} = Oid} = cabala:encode(#{<<"a">> => 1},
+											   [{ensure_id, true}]),
+	?assertEqual(12, byte_size(Id)),
+	?assertEqual(#{<<"_id">> => Oid, <<"a">> => 1},
+				 cabala:decode(Bin, [return_maps])),
+	%% the new _id is the first field
+	?assertMatch(<<_:32, 7, "_id", 0, Id:12/binary, _/binary>>, Bin),
+	Doc = #{<<"_id">> => 5, <<"a">> => 1},
+	?assertEqual({cabala:encode(Doc), 5},
+				 cabala:encode(Doc, [{ensure_id, true}])),
+	Tuple = {<<"a">>, 1, '_id', <<"k">>},
+	?assertEqual({cabala:encode(Tuple), <<"k">>},
+				 cabala:encode(Tuple, [{ensure_id, true}])),
+	?assertEqual(cabala:encode(Doc), cabala:encode(Doc, [{ensure_id, false}])).
+
+ensure_id_batch_test() ->
+	Docs = [#{<<"a">> => I} || I <- lists:seq(1, 3)] ++ [#{<<"_id">> => 7}],
+	{Bin, Ids} = cabala:encode_batch(Docs, [{ensure_id, true}]),
+	?assertEqual(Ids, [maps:get(<<"_id">>, D)
+					   || D <- cabala:decode_all_parallel(Bin, [return_maps])]),
+	?assertEqual(7, lists:last(Ids)),
+	?assertEqual(4, length(lists:usort(Ids))),
+	Many = numbered(3000) ++ [#{<<"n">> => I} || I <- lists:seq(1, 3000)],
+	{ManyBin, ManyIds} = cabala:encode_batch(Many, [{ensure_id, true},
+													{threshold, 0}]),
+	?assertEqual(ManyIds, [maps:get(<<"_id">>, D)
+						   || D <- cabala:decode_all_parallel(ManyBin,
+															  [return_maps])]),
+	?assertEqual(lists:seq(1, 3000), lists:sublist(ManyIds, 3000)),
+	?assertEqual(3000, length(lists:usort(lists:nthtail(3000, ManyIds)))).
+
+new_oid_test() ->
+	{'$oid$', <<Time:32/big, _:8/binary>>} = cabala:new_oid(),
+	?assert(abs(Time - erlang:system_time(second)) < 60),
+	Self = self(),
+	Pids = [spawn(fun() ->
+						  Self ! {self(), [cabala:new_oid()
+										   || _ <- lists:seq(1, 1000)]}
+				  end) || _ <- lists:seq(1, 4)],
+	Oids = lists:append([receive {P, L} -> L end || P <- Pids]),
+	?assertEqual(4000, length(lists:usort(Oids))),
+	?assert(lists:all(fun({'$oid$', <<_:12/binary>>}) -> true;
+						 (_) -> false
+					  end, Oids)).
+
+%%% -------------------------------------------------
+%%% oid_format and uuid_format
+%%% -------------------------------------------------
+
+-define(UUID, <<16#12, 16#34, 16#56, 16#78, 16#9a, 16#bc, 16#de, 16#f0,
+				16#12, 16#34, 16#56, 16#78, 16#9a, 16#bc, 16#de, 16#f0>>).
+-define(UUID_STR, <<"12345678-9abc-def0-1234-56789abcdef0">>).
+
+oid_and_uuid_format_test() ->
+	Doc = #{<<"_id">> => {'$oid$', ?OID},
+			<<"u">> => {'$type$', 4, '$binary$', ?UUID}},
+	Text = #{<<"_id">> => {'$oid$', ?OID_HEX},
+			 <<"u">> => {'$type$', 4, '$binary$', ?UUID_STR}},
+	Opts = [return_maps, {oid_format, hex}, {uuid_format, string}],
+	Bin = cabala:encode(Doc),
+	?assertEqual(Text, cabala:decode(Bin, Opts)),
+	?assertEqual(Doc, cabala:decode(Bin, [return_maps, {oid_format, binary},
+										  {uuid_format, binary}])),
+	?assertEqual(Bin, cabala:encode(Text)),
+	?assertEqual([Text], cabala:decode_all_parallel(Bin, Opts)),
+	{0, 0, _, [Batch]} = cabala:decode_op_msg(
+						   cabala:encode_op_msg(1, 0, reply(<<"firstBatch">>, [Doc]),
+												[]), Opts),
+	?assertEqual(Text, Batch),
+	?assertError(badarg, cabala:decode(Bin, [{oid_format, base64}])).
+
+oid_and_uuid_text_test() ->
+	Upper = cabala:encode(#{<<"_id">> => {'$oid$', string:uppercase(?OID_HEX)},
+							<<"u">> => {'$type$', 4, '$binary$',
+										string:uppercase(?UUID_STR)}}),
+	?assertEqual(cabala:encode(#{<<"_id">> => {'$oid$', ?OID},
+								 <<"u">> => {'$type$', 4, '$binary$', ?UUID}}),
+				 Upper),
+	%% only subtype 4 holds UUIDs, 36 bytes of another subtype are data
+	?assertEqual(#{<<"b">> => {'$type$', 0, '$binary$', ?UUID_STR}},
+				 cabala:decode(cabala:encode(#{<<"b">> => {'$type$', 0, '$binary$',
+														  ?UUID_STR}}),
+							   [return_maps, {uuid_format, string}])),
+	?assertMatch({error, _},
+				 cabala:encode(#{<<"_id">> => {'$oid$',
+											   <<"zz1f00aa0102030405060708">>}})),
+	?assertMatch({error, _},
+				 cabala:encode(#{<<"_id">> => {'$oid$', <<"651f00aa">>}})),
+	?assertMatch({error, _},
+				 cabala:encode(#{<<"u">> => {'$type$', 4, '$binary$',
+											 <<"12345678_9abc-def0-1234-56789abcdef0">>}})).
+
+hash_term_formats_test_() ->
+	Docs = [#{<<"a">> => 1, <<"b">> => [1.5, <<"x">>]},
+			#{<<"_id">> => {'$oid$', ?OID_HEX},
+			  <<"u">> => {'$type$', 4, '$binary$', ?UUID_STR}},
+			#{<<"_id">> => {'$oid$', ?OID},
+			  <<"u">> => {'$type$', 4, '$binary$', ?UUID}}],
+	[?_assertEqual(cabala:hash(cabala:encode(D), [canonical]),
+				   cabala:hash_term(D))
+	 || D <- Docs].
+
+%%% -------------------------------------------------
+%%% to_json/2
+%%% -------------------------------------------------
+
+json_values() ->
+	cabala:encode({<<"i">>, 7, <<"l">>, 1 bsl 40, <<"d">>, 2.5, <<"w">>, 3.0,
+				   <<"s">>, <<"a\"b\\c\n", 1, 16#c3, 16#a9>>,
+				   <<"t">>, true, <<"n">>, null,
+				   <<"o">>, {'$oid$', ?OID},
+				   <<"dt">>, {'$date$', 1700000000123},
+				   <<"b">>, {'$type$', 0, '$binary$', <<0, 1, 2, 255>>},
+				   <<"a">>, [1, <<"x">>], <<"m">>, 'MAX_KEY'}).
+
+to_json_relaxed_test() ->
+	?assertEqual(<<"{\"i\":7,\"l\":1099511627776,\"d\":2.5,\"w\":3.0,"
+				   "\"s\":\"a\\\"b\\\\c\\n\\u0001", 16#c3, 16#a9, "\","
+				   "\"t\":true,\"n\":null,"
+				   "\"o\":{\"$oid\":\"", ?OID_HEX/binary, "\"},"
+				   "\"dt\":{\"$date\":\"2023-11-14T22:13:20.123Z\"},"
+				   "\"b\":{\"$binary\":{\"base64\":\"AAEC/w==\",\"subType\":\"00\"}},"
+				   "\"a\":[1,\"x\"],\"m\":{\"$maxKey\":1}}">>,
+				 cabala:to_json(json_values())),
+	?assertEqual(cabala:to_json(json_values()),
+				 cabala:to_json(json_values(), [relaxed])).
+
+to_json_canonical_test() ->
+	?assertEqual(<<"{\"i\":{\"$numberInt\":\"7\"},"
+				   "\"l\":{\"$numberLong\":\"1099511627776\"},"
+				   "\"d\":{\"$numberDouble\":\"2.5\"},"
+				   "\"w\":{\"$numberDouble\":\"3.0\"},"
+				   "\"s\":\"a\\\"b\\\\c\\n\\u0001", 16#c3, 16#a9, "\","
+				   "\"t\":true,\"n\":null,"
+				   "\"o\":{\"$oid\":\"", ?OID_HEX/binary, "\"},"
+				   "\"dt\":{\"$date\":{\"$numberLong\":\"1700000000123\"}},"
+				   "\"b\":{\"$binary\":{\"base64\":\"AAEC/w==\",\"subType\":\"00\"}},"
+				   "\"a\":[{\"$numberInt\":\"1\"},\"x\"],\"m\":{\"$maxKey\":1}}">>,
+				 cabala:to_json(json_values(), [canonical])).
+
+%% ISO dates only for years 1970 to 9999, $numberLong otherwise
+to_json_dates_test_() ->
+	Date = fun(Ms) -> cabala:to_json(cabala:encode({<<"d">>, {'$date$', Ms}})) end,
+	[?_assertEqual(<<"{\"d\":{\"$date\":\"1970-01-01T00:00:00.000Z\"}}">>, Date(0)),
+	 ?_assertEqual(<<"{\"d\":{\"$date\":\"2000-02-29T12:00:00.001Z\"}}">>,
+				   Date(951825600001)),
+	 ?_assertEqual(<<"{\"d\":{\"$date\":\"9999-12-31T23:59:59.999Z\"}}">>,
+				   Date(253402300799999)),
+	 ?_assertEqual(<<"{\"d\":{\"$date\":{\"$numberLong\":\"253402300800000\"}}}">>,
+				   Date(253402300800000)),
+	 ?_assertEqual(<<"{\"d\":{\"$date\":{\"$numberLong\":\"-1\"}}}">>, Date(-1))].
+
+to_json_test() ->
+	Big = cabala:encode(#{<<"s">> => binary:copy(<<"\"x\"">>, 40000)}),
+	?assertEqual(<<"{\"s\":\"", (binary:copy(<<"\\\"x\\\"">>, 40000))/binary,
+				   "\"}">>,
+				 cabala:to_json(Big)),
+	?assertEqual(<<"{}">>, cabala:to_json(cabala:encode(#{}))),
+	?assertEqual(<<"{\"e\":[],\"f\":{}}">>,
+				 cabala:to_json(cabala:encode({<<"e">>, [], <<"f">>, #{}}))),
+	?assertEqual({error, badbson}, cabala:to_json(<<1, 2, 3>>)),
+	?assertError(badarg, cabala:to_json(cabala:encode(#{}), [pretty])).
+
+%%% -------------------------------------------------
+%%% from_json/2 and from_ndjson/2
+%%% -------------------------------------------------
+
+json_doc() ->
+	#{<<"_id">> => {'$oid$', ?OID},
+	  <<"i32">> => 7,
+	  <<"i64">> => 1 bsl 40,
+	  <<"dbl">> => 2.5,
+	  <<"str">> => <<"line\n\"quoted\" caf", 16#c3, 16#a9>>,
+	  <<"bool">> => false,
+	  <<"nil">> => null,
+	  <<"date">> => {'$date$', 1700000000123},
+	  <<"bin">> => {'$type$', 0, '$binary$', <<0, 1, 2, 255>>},
+	  <<"uuid">> => {'$type$', 4, '$binary$', ?UUID},
+	  <<"arr">> => [1, <<"two">>, #{<<"three">> => 3}],
+	  <<"doc">> => #{<<"nested">> => #{<<"deep">> => true}}}.
+
+json_canonical_round_trip_test() ->
+	Bin = cabala:encode(json_doc()),
+	?assertEqual(Bin, cabala:from_json(cabala:to_json(Bin, [canonical]))).
+
+json_relaxed_round_trip_test() ->
+	Bin = cabala:encode(json_doc()),
+	?assertEqual(json_doc(),
+				 cabala:decode(cabala:from_json(cabala:to_json(Bin)),
+							   [return_maps])).
+
+from_json_test() ->
+	Json = <<"{\"a\": 1, \"b\": [true, null, -2.5e3], \"c\": {\"d\": \"x\"},"
+			 " \"big\": 9007199254740993, \"id\": {\"$oid\": \"",
+			 ?OID_HEX/binary, "\"}}">>,
+	?assertEqual(#{<<"a">> => 1, <<"b">> => [true, null, -2500.0],
+				   <<"c">> => #{<<"d">> => <<"x">>},
+				   <<"big">> => 9007199254740993,
+				   <<"id">> => {'$oid$', ?OID}},
+				 cabala:decode(cabala:from_json(Json), [return_maps])),
+	{Bin, {'$oid$', _} = Id} = cabala:from_json(<<"{\"a\": 1}">>,
+												[{ensure_id, true}]),
+	?assertEqual(#{<<"_id">> => Id, <<"a">> => 1},
+				 cabala:decode(Bin, [return_maps])),
+	?assertEqual({cabala:encode(#{<<"_id">> => 3}), 3},
+				 cabala:from_json(<<"{\"_id\": 3}">>, [{ensure_id, true}])).
+
+%% the Extended JSON wrappers become the types they stand for
+from_json_wrappers_test() ->
+	Json = <<"{\"i\": {\"$numberInt\": \"7\"},"
+			 " \"l\": {\"$numberLong\": \"7\"},"
+			 " \"d\": {\"$numberDouble\": \"7\"},"
+			 " \"t\": {\"$date\": \"2023-11-14T23:13:20.123+01:00\"},"
+			 " \"u\": {\"$uuid\": \"", ?UUID_STR/binary, "\"},"
+			 " \"b\": {\"$binary\": {\"base64\": \"AAEC/w==\", \"subType\": \"80\"}},"
+			 " \"m\": {\"$minKey\": 1},"
+			 " \"s\": \"\\u00e9\\ud83d\\ude00\\t\"}">>,
+	Doc = cabala:from_json(Json),
+	?assertMatch(<<_:32, 16#10, "i", 0, 7:32/little,
+				   16#12, "l", 0, 7:64/little,
+				   16#01, "d", 0, _/binary>>, Doc),
+	?assertEqual(#{<<"i">> => 7, <<"l">> => 7, <<"d">> => 7.0,
+				   <<"t">> => {'$date$', 1700000000123},
+				   <<"u">> => {'$type$', 4, '$binary$', ?UUID},
+				   <<"b">> => {'$type$', 128, '$binary$', <<0, 1, 2, 255>>},
+				   <<"m">> => 'MIN_KEY',
+				   <<"s">> => <<16#c3, 16#a9, 16#f0, 16#9f, 16#98, 16#80, "\t">>},
+				 cabala:decode(Doc, [return_maps])).
+
+from_json_errors_test_() ->
+	Deep = <<(binary:copy(<<"{\"a\":">>, 200))/binary, "1",
+			 (binary:copy(<<"}">>, 200))/binary>>,
+	[?_assertMatch({error, {badjson, _}}, cabala:from_json(<<"{\"a\": }">>)),
+	 ?_assertMatch({error, {badjson, _}}, cabala:from_json(<<"[1, 2]">>)),
+	 ?_assertMatch({error, {badjson, _}}, cabala:from_json(<<"{} {}">>)),
+	 ?_assertMatch({error, {badjson, _}}, cabala:from_json(<<"{\"a\": 1">>)),
+	 ?_assertMatch({error, {badjson, _}}, cabala:from_json(<<>>)),
+	 ?_assertMatch({error, {badjson, _}},
+				   cabala:from_json(<<"{\"t\": {\"$date\": \"2023-02-29T00:00:00Z\"}}">>)),
+	 ?_assertMatch({error, {badjson, _}},
+				   cabala:from_json(<<"{\"o\": {\"$oid\": \"xyz\"}}">>)),
+	 ?_assertMatch({error, {badjson, _}}, cabala:from_json(Deep)),
+	 ?_assertError(badarg, cabala:from_json(<<"{}">>, [bogus]))].
+
+from_ndjson_test() ->
+	Json = <<"{\"n\": 1}\n{\"n\": 2}\n\n{\"n\": 3}\n">>,
+	?assertEqual([#{<<"n">> => N} || N <- [1, 2, 3]],
+				 cabala:decode_all_parallel(cabala:from_ndjson(Json),
+											[return_maps])),
+	?assertEqual(<<>>, cabala:from_ndjson(<<"\n \n">>)),
+	{Bin, [{'$oid$', _}, 5]} = cabala:from_ndjson(<<"{} {\"_id\": 5}">>,
+												  [{ensure_id, true}]),
+	?assertMatch([#{<<"_id">> := {'$oid$', _}}, #{<<"_id">> := 5}],
+				 cabala:decode_all_parallel(Bin, [return_maps])),
+	?assertMatch({error, {badjson, _}}, cabala:from_ndjson(<<"{\"n\": 1} x">>)).
+
+%%% -------------------------------------------------
+%%% validate_utf8
+%%% -------------------------------------------------
+
+validate_utf8_test() ->
+	Bad = #{<<"s">> => <<"ok", 16#c3, 16#28>>},
+	Good = #{<<"s">> => <<"caf", 16#c3, 16#a9>>},
+	?assertEqual({error, invalid_utf8},
+				 cabala:encode(Bad, [{validate_utf8, true}])),
+	?assert(is_binary(cabala:encode(Good, [{validate_utf8, true}]))),
+	?assertEqual({error, invalid_utf8},
+				 cabala:encode(#{<<"d">> => #{<<"a">> => [1, maps:get(<<"s">>, Bad)]}},
+							   [{validate_utf8, true}])),
+	Bin = cabala:encode(Bad),
+	?assertEqual(Bad, cabala:decode(Bin, [return_maps])),
+	?assertEqual(Bad, cabala:decode(Bin, [return_maps, {validate_utf8, false}])),
+	?assertEqual({error, invalid_utf8},
+				 cabala:decode(Bin, [{validate_utf8, true}])),
+	?assertEqual({error, invalid_utf8},
+				 cabala:decode_all_parallel(Bin, [{validate_utf8, true}])),
+	?assertMatch({error, {baddoc, Bad}},
+				 cabala:encode_batch([Good, Bad], [{validate_utf8, true}])).
+
+%% RFC 3629: no overlong forms, surrogates or code points past U+10FFFF
+validate_utf8_sequences_test_() ->
+	Valid = [<<"plain">>, <<>>, <<16#7f>>, <<16#c2, 16#80>>, <<16#df, 16#bf>>,
+			 <<16#e0, 16#a0, 16#80>>, <<16#ed, 16#9f, 16#bf>>,
+			 <<16#ef, 16#bf, 16#bf>>, <<16#f0, 16#90, 16#80, 16#80>>,
+			 <<16#f4, 16#8f, 16#bf, 16#bf>>],
+	Invalid = [<<16#80>>, <<16#c0, 16#af>>, <<16#c1, 16#bf>>, <<16#c3>>,
+			   <<16#e0, 16#9f, 16#bf>>, <<16#ed, 16#a0, 16#80>>,
+			   <<16#e2, 16#82>>, <<16#f0, 16#8f, 16#bf, 16#bf>>,
+			   <<16#f4, 16#90, 16#80, 16#80>>, <<16#f5, 16#80, 16#80, 16#80>>,
+			   <<16#ff>>],
+	Check = fun(S) ->
+					Doc = #{<<"s">> => S},
+					{is_binary(cabala:encode(Doc, [{validate_utf8, true}])),
+					 is_map(cabala:decode(cabala:encode(Doc),
+										  [return_maps, {validate_utf8, true}]))}
+			end,
+	[?_assertEqual({true, true}, Check(S)) || S <- Valid] ++
+	[?_assertEqual({false, false}, Check(S)) || S <- Invalid].
+
+%% long strings take the vector path, a bad byte anywhere must be seen
+validate_utf8_long_test_() ->
+	Text = binary:copy(<<"abc", 16#c3, 16#a9, "xyz ">>, 20),
+	[?_assertEqual({error, invalid_utf8},
+				   cabala:encode(#{<<"s">> => <<(binary:part(Text, 0, P))/binary,
+											   16#ff,
+											   (binary:part(Text, P, 100 - P))/binary>>},
+								 [{validate_utf8, true}]))
+	 || P <- [0, 15, 16, 31, 32, 33, 63, 64, 99, 100]] ++
+	[?_assert(is_binary(cabala:encode(#{<<"s">> => Text},
+									  [{validate_utf8, true}])))].
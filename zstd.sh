@@ -0,0 +1,13 @@
+#! /bin/sh
+
+[ -f ./deps/zstd/lib/libzstd.a ] && exit 0
+
+if [ ! -d deps ]; then
+    mkdir deps
+fi
+cd deps
+
+git clone https://github.com/facebook/zstd
+cd zstd/lib
+
+make libzstd.a CFLAGS="-O3 -fPIC"